@@ -0,0 +1,34 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _BLOOM_FILTER_H_
+#define _BLOOM_FILTER_H_
+
+#include "shared.h"
+
+/*
+ * Bloom filter over strings. bloom_filter_check() returning 0 means the
+ * key was never added; 1 means it probably was. With bits_per_entry = 10
+ * and the expected number of entries, about 1% of absent keys pass.
+ * Keys cannot be removed, clear and re-add to shed them.
+ *
+ * Not locked, the caller serializes access.
+ */
+typedef struct bloom_filter bloom_filter_t;
+
+bloom_filter_t *bloom_filter_new(unsigned int entries, unsigned int bits_per_entry);
+void bloom_filter_destroy(bloom_filter_t *filter);
+void bloom_filter_add(bloom_filter_t *filter, const char *key);
+int bloom_filter_check(const bloom_filter_t *filter, const char *key);
+void bloom_filter_clear(bloom_filter_t *filter);
+unsigned int bloom_filter_count(const bloom_filter_t *filter);	/* adds since the last clear */
+
+#endif /* _BLOOM_FILTER_H_ */
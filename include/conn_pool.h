@@ -0,0 +1,64 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _CONN_POOL_H_
+#define _CONN_POOL_H_
+
+#include "shared.h"
+
+/*
+ * Pool of blocking connections, one per request in flight.
+ *
+ * conn_pool_acquire() hands out an idle connection, opens a new one while
+ * fewer than max are open, and otherwise waits up to wait_ms for one to be
+ * released. A connection released as broken is closed instead of going
+ * back to the idle list, so the next acquire reconnects. The connection
+ * itself is opaque; create/destroy are supplied by the caller and run
+ * without the pool lock held.
+ */
+typedef void *(*conn_pool_create_cb_t) (void *data);
+typedef void (*conn_pool_destroy_cb_t) (void *conn, void *data);
+
+typedef struct conn_pool_stats {
+	unsigned int max;
+	unsigned int open;
+	unsigned int idle;
+	unsigned long acquired;
+	unsigned long waited;				/* had to wait for a release */
+	unsigned long timeouts;
+	unsigned long failed;				/* create callback returned NULL */
+} conn_pool_stats_t;
+
+typedef struct conn_pool conn_pool_t;
+
+conn_pool_t *conn_pool_new(unsigned int max, unsigned int wait_ms, conn_pool_create_cb_t create, conn_pool_destroy_cb_t destroy, void *data);
+void conn_pool_destroy(conn_pool_t *pool);
+
+/* returns NULL when no connection could be opened or the wait timed out */
+void *conn_pool_acquire(conn_pool_t *pool);
+void conn_pool_release(conn_pool_t *pool, void *conn, int broken);
+
+/* closes idle connections */
+void conn_pool_flush(conn_pool_t *pool);
+
+/* closes idle connections, and those in use once released; e.g. after the settings changed */
+void conn_pool_invalidate(conn_pool_t *pool);
+
+/*
+ * before destroying a pool that other threads use: refuse new acquires and
+ * wait up to wait_ms for the connections in use to be released. Returns 0
+ * once none is in use; on timeout the pool hands out connections again and
+ * -1 is returned.
+ */
+int conn_pool_drain(conn_pool_t *pool, unsigned int wait_ms);
+void conn_pool_stats(conn_pool_t *pool, conn_pool_stats_t *stats);
+
+#endif /* _CONN_POOL_H_ */
@@ -0,0 +1,49 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _DEVICE_LRU_H_
+#define _DEVICE_LRU_H_
+
+#include <stddef.h>
+#include "shared.h"
+
+/*
+ * Bounded cache of the devices a node pulled on demand. Each entry keeps the
+ * state every origin reported for the device and the aggregate of those,
+ * computed by the callback passed to device_lru_new() (called with no states
+ * for a device nobody reported yet). Adding to a full cache evicts the least
+ * recently used entry, whose name is handed back so the caller can drop its
+ * subscription. An entry that is asked for again while cached (a hint
+ * re-reading it after a change) is pinned and never evicted: nothing would
+ * query it again to bring it back. When every entry is pinned the cache grows
+ * past its capacity instead.
+ */
+#define DEVICE_LRU_MAX_NAME 80
+#define DEVICE_LRU_MAX_ORIGINS 16
+
+typedef struct device_lru device_lru_t;
+typedef int (*device_lru_aggregate_t) (const int *states, unsigned int count);
+
+device_lru_t *device_lru_new(unsigned int capacity, device_lru_aggregate_t aggregate);
+void device_lru_destroy(device_lru_t *lru);
+unsigned int device_lru_count(device_lru_t *lru);
+
+int device_lru_get(device_lru_t *lru, const char *device, int *state);
+exception_t device_lru_add(device_lru_t *lru, const char *device, char *evicted, size_t evicted_len);
+boolean_t device_lru_update(device_lru_t *lru, const char *device, const char *origin, int state, int *aggregate);
+void device_lru_remove(device_lru_t *lru, const char *device);
+
+/* callbacks run with the cache locked and must not call back into it */
+unsigned int device_lru_list(device_lru_t *lru, void (*cb)(const char *device, void *data), void *data);
+void device_lru_clear(device_lru_t *lru, void (*cb)(const char *device, void *data), void *data);
+unsigned int device_lru_forget_origin(device_lru_t *lru, const char *origin, void (*cb)(const char *device, int state, void *data), void *data);
+
+#endif /* _DEVICE_LRU_H_ */
@@ -0,0 +1,38 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _DEVSTATE_AGGREGATE_H_
+#define _DEVSTATE_AGGREGATE_H_
+
+/*
+ * Device state aggregation, the way ast_devstate_aggregate_add() combines the
+ * states of one device on several servers. States are the values of enum
+ * ast_device_state (0 unknown, 1 not in use, 2 in use, 3 busy, 4 invalid,
+ * 5 unavailable, 6 ringing, 7 ringing + in use, 8 on hold); the higher the
+ * rank the more it wins, ringing together with in use / busy / on hold
+ * becomes ringing + in use. No states aggregate to invalid.
+ *
+ * devstate_aggregate_script is the same rule as a redis lua script, built
+ * from the same rank table:
+ *   KEYS[1] hash of the per node states, KEYS[2] the aggregate,
+ *   KEYS[3] set of the devices a node contributed to
+ *   ARGV[1] eid, ARGV[2] state ("" removes the node's state), ARGV[3] channel,
+ *   ARGV[4] / ARGV[5] message before / after the aggregate, ARGV[6] device
+ * It publishes and returns 1 only when the aggregate changed.
+ */
+#define DEVSTATE_AGGREGATE_RANKS 1, 3, 6, 7, 0, 2, 5, 8, 4
+#define DEVSTATE_AGGREGATE_MAX_STATE 8
+
+extern const char devstate_aggregate_script[];
+
+int devstate_aggregate(const int *states, unsigned int count);
+
+#endif /* _DEVSTATE_AGGREGATE_H_ */
@@ -0,0 +1,53 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _DUMP_QUEUE_H_
+#define _DUMP_QUEUE_H_
+
+#include <stddef.h>
+#include "shared.h"
+
+/*
+ * FIFO of encoded events waiting for the bulk lane: the entries of a paced
+ * cache dump and, with priority lanes, the live events of the bulk types.
+ * Each entry keeps its identity field (device, mailbox@context, "" for none),
+ * so a newer event can supersede the queued one. A new dump only replaces the
+ * dump entries still queued; live events stay where they are.
+ */
+typedef struct dump_entry dump_entry_t;
+struct dump_entry {
+	unsigned int type;				/* event type */
+	boolean_t dump;					/* part of a cache dump, not a live event */
+	const char *field;
+	size_t len;
+	dump_entry_t *next;
+	char msg[];
+};
+
+typedef struct dump_queue dump_queue_t;
+
+dump_queue_t *dump_queue_new(void);
+void dump_queue_destroy(dump_queue_t *queue);
+unsigned int dump_queue_len(dump_queue_t *queue);
+
+exception_t dump_queue_push(dump_queue_t *queue, unsigned int type, boolean_t dump, const char *field, const char *msg, size_t len);
+/* drop the queued entry of type and field, returns TRUE when there was one */
+boolean_t dump_queue_supersede(dump_queue_t *queue, unsigned int type, const char *field);
+/* drop the dump entries (all entries unless dump_only), returns how many */
+unsigned int dump_queue_clear(dump_queue_t *queue, boolean_t dump_only);
+/* oldest entry or NULL, release it with dump_queue_entry_free() */
+dump_entry_t *dump_queue_pop(dump_queue_t *queue);
+void dump_queue_entry_free(dump_entry_t *entry);
+
+/* bytes the bulk lane may send in a tick: bulk_share percent of the total, idle_burst while the realtime lane is idle */
+size_t dump_queue_lane_budget(size_t realtime_bytes, unsigned int bulk_share, size_t idle_burst);
+
+#endif /* _DUMP_QUEUE_H_ */
@@ -0,0 +1,46 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _EVENT_BATCH_H_
+#define _EVENT_BATCH_H_
+
+#include <stddef.h>
+#include "shared.h"
+
+/*
+ * Multi-event envelope: packs several encoded events, possibly of different
+ * types, into one PUBLISH payload so redis does its fan-out once per batch
+ * instead of once per event.
+ *
+ *   [["device_state",{...}],["mwi",{...}],...]
+ *
+ * A single event still starts with '{', so both can share a channel.
+ */
+#define EVENT_BATCH_MAX_TYPE_NAME 32
+
+typedef struct event_batch {
+	char *buf;
+	size_t len;
+	size_t size;
+	unsigned int count;
+} event_batch_t;
+
+exception_t event_batch_init(event_batch_t *batch, size_t size);
+void event_batch_free(event_batch_t *batch);
+void event_batch_reset(event_batch_t *batch);
+exception_t event_batch_append(event_batch_t *batch, const char *type_name, const char *msg, size_t msg_len);
+const char *event_batch_finish(event_batch_t *batch, size_t *len);
+
+/* splitter, works in place: NUL-terminates each type name and event */
+char *event_batch_open(char *payload);
+exception_t event_batch_next(char **cursor, char **type_name, char **msg);
+
+#endif /* _EVENT_BATCH_H_ */
@@ -0,0 +1,55 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _INTERN_TABLE_H_
+#define _INTERN_TABLE_H_
+
+#include <stddef.h>
+#include "shared.h"
+
+/*
+ * Device name interning for the wire format.
+ *
+ * The sending node assigns compact numeric ids to device / mailbox strings
+ * (local table, string -> id), announces each new mapping once and from then
+ * on sends only the id. Receivers keep one table per origin EID (id -> string)
+ * and copy the interned string straight into the event being decoded.
+ *
+ * Ids carry the epoch of their table in the upper 16 bits. The sender moves
+ * to a new epoch whenever it restarts its id space, so a receiver that missed
+ * the reset sees ids of an unknown epoch and refetches, instead of resolving
+ * a reused id to the string it had before. A table starts at epoch 0.
+ */
+#define INTERN_MAX_ENTRIES 65535
+#define INTERN_MAX_STRLEN 256
+#define INTERN_EPOCH(id) ((id) >> 16)
+#define INTERN_INDEX(id) ((id) & 0xffff)
+
+typedef struct intern_table intern_table_t;
+
+intern_table_t *intern_table_new(unsigned int max_entries, boolean_t reverse_lookup);
+void intern_table_destroy(intern_table_t *table);
+void intern_table_clear(intern_table_t *table);
+void intern_table_reset(intern_table_t *table, unsigned int epoch);	/* clear and move to epoch */
+unsigned int intern_table_epoch(intern_table_t *table);
+unsigned int intern_table_count(intern_table_t *table);
+
+/* ids include the epoch; set and copy fail with EXISTS_EXCEPTION for an id of another epoch */
+exception_t intern_table_get_id(intern_table_t *table, const char *str, unsigned int *id, boolean_t *added);
+exception_t intern_table_set(intern_table_t *table, unsigned int id, const char *str);
+exception_t intern_table_copy(intern_table_t *table, unsigned int id, char *buf, size_t buf_len);
+
+/* remote tables, one per origin eid */
+intern_table_t *intern_registry_get(const char *eid_str, boolean_t create);
+void intern_registry_list(void (*cb)(const char *eid_str, unsigned int count, void *data), void *data);
+void intern_registry_destroy_all(void);
+
+#endif /* _INTERN_TABLE_H_ */
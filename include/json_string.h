@@ -0,0 +1,45 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _JSON_STRING_H_
+#define _JSON_STRING_H_
+
+#include <stddef.h>
+#include "shared.h"
+
+/*
+ * JSON string escaping / unescaping for the wire format.
+ *
+ * The hot part is finding the next byte that needs attention ('"', '\\' or a
+ * control character below 0x20). On x86-64 this is done 16 bytes at a time
+ * with SSE2 by default, or 32 with AVX2 when selected explicitly, with a
+ * scalar fallback everywhere else. Clean runs in between are copied with
+ * memcpy.
+ */
+typedef enum {
+	JSON_KERNEL_AUTO	= 0,
+	JSON_KERNEL_SCALAR	= 1,
+	JSON_KERNEL_SSE2	= 2,
+	JSON_KERNEL_AVX2	= 3,
+} json_kernel_t;
+
+json_kernel_t json_string_set_kernel(json_kernel_t kernel);
+const char *json_kernel2str(json_kernel_t kernel);
+
+size_t json_string_find_special(const char *str, size_t len);
+
+exception_t json_escape(char *dst, size_t dst_len, const char *src, size_t src_len, size_t *out_len);
+exception_t json_unescape(char *dst, size_t dst_len, const char *src, size_t src_len, size_t *out_len);
+boolean_t json_validate_string(const char *src, size_t len);
+
+exception_t json_next_member(char **cursor, char **key, char **value, boolean_t *is_string);
+
+#endif /* _JSON_STRING_H_ */
@@ -0,0 +1,47 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _MEMBER_TABLE_H_
+#define _MEMBER_TABLE_H_
+
+#include <stdint.h>
+#include "shared.h"
+
+/*
+ * Cluster membership, fed by the heartbeats every node publishes on the ping
+ * channel. A member that has not been heard of for the timeout passed to
+ * member_table_expire() is removed, so the caller can purge the state it
+ * contributed. Times are in milliseconds.
+ */
+typedef struct member_info {
+	char eid_str[32];
+	uint32_t seq;					/* last heartbeat sequence */
+	unsigned int missed;				/* heartbeats lost in between */
+	int64_t first_seen;
+	int64_t last_seen;
+	unsigned int rtt;				/* the member's own round trip through redis */
+	unsigned int load;				/* 1 minute load average * 100 */
+	unsigned long events;				/* events published by the member */
+} member_info_t;
+
+typedef struct member_table member_table_t;
+typedef void (*member_table_cb_t) (const member_info_t *member, void *data);
+
+member_table_t *member_table_new(void);
+void member_table_destroy(member_table_t *table);
+boolean_t member_table_heartbeat(member_table_t *table, const member_info_t *beat, int64_t now);
+int member_table_get(member_table_t *table, const char *eid_str, member_info_t *member);
+
+/* callbacks run with the table locked and must not call back into it */
+unsigned int member_table_expire(member_table_t *table, int64_t now, int64_t timeout, member_table_cb_t cb, void *data);
+unsigned int member_table_list(member_table_t *table, member_table_cb_t cb, void *data);
+
+#endif /* _MEMBER_TABLE_H_ */
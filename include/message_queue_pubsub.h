@@ -14,6 +14,7 @@
 
 //#include <stdlib.h>
 #include "../include/shared.h"
+#include "../include/rate_limiter.h"
 
 /* 
  * declarations
@@ -41,6 +42,8 @@ exception_t msq_stop();
 event_type_t msq_find_channel(const char *channelname);
 exception_t msq_set_channel(event_type_t channel, msq_type_t type, boolean_t onoff);
 exception_t msq_publish(event_type_t channel, const char *publishmsg);
+exception_t msq_set_rate_limit(event_type_t channel, unsigned int rate, unsigned int burst);
+exception_t msq_get_rate_limit_stats(event_type_t channel, rate_limiter_stats_t *stats);
 exception_t msq_add_subscription(event_type_t channel, const char *channelstr, const char *patternstr, msq_subscription_callback_t callback);
 void msq_list_subscriptions();
 exception_t msq_drop_all_subscriptions();
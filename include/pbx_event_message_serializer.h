@@ -13,15 +13,99 @@
 #define _AST_EVENT_MESSAGE_SERIALIZER_H_
 
 #include "shared.h"
+#include "intern_table.h"
 
 #define MAX_JSON_BUFFERLEN 1024
 
 typedef void (*pbx_subscription_callback_t) (event_type_t event_type, char *data);
+typedef void (*pbx_intern_announce_cb_t) (unsigned int id, const char *str);
+typedef void (*pbx_intern_miss_cb_t) (const char *eid_str);
 typedef struct pbx_event_map pbx_event_map_t;
 
+/*
+ * Lazy decode view on a received message: members are only indexed as far as
+ * needed by the pbx_event_view_get_* calls, so filters can run before the
+ * ast_event is built by pbx_event_view_materialize().
+ * Valid until the caller resets its scratch arena.
+ */
+#define PBX_EVENT_VIEW_MAX_MEMBERS 32
+
+typedef struct pbx_event_view_member {
+	enum ast_event_ie_type ie_type;			/* AST_EVENT_IE_END for non-IE members */
+	char *value;
+	boolean_t is_string;
+	boolean_t interned;
+} pbx_event_view_member_t;
+
+typedef struct pbx_event_view {
+	enum ast_event_type event_type;
+	const char *msg;
+	char *cursor;
+	boolean_t complete;
+	unsigned int num_members;
+	pbx_event_view_member_t members[PBX_EVENT_VIEW_MAX_MEMBERS];
+} pbx_event_view_t;
+
 exception_t pbx_subscribe(event_type_t event_type, pbx_subscription_callback_t callback);
 exception_t pbx_unsubscribe(event_type_t event_type);
 exception_t pbx_publish(event_type_t event_type, char *jsonmsgbuffer, size_t buf_len);
+void pbx_set_interning(intern_table_t *local_table, pbx_intern_announce_cb_t announce, pbx_intern_miss_cb_t miss);
+
+exception_t pbx_event_view_init(pbx_event_view_t *view, enum ast_event_type event_type, const char *msg);
+exception_t pbx_event_view_get_eid(pbx_event_view_t *view, struct ast_eid *eid, char *eid_str, size_t eid_str_len);
+exception_t pbx_event_view_get_str(pbx_event_view_t *view, enum ast_event_ie_type ie_type, const char **value);
+exception_t pbx_event_view_get_uint(pbx_event_view_t *view, enum ast_event_ie_type ie_type, uint32_t *value);
+exception_t pbx_event_view_materialize(pbx_event_view_t *view, struct ast_event **eventref, boolean_t *cacheable);
+/* like materialize, but the event stays in the pooled buffer it was built in; release it with scratch_pool_put() */
+exception_t pbx_event_view_build(pbx_event_view_t *view, struct ast_event **eventref, boolean_t *cacheable);
+
+/*
+ * Cache digests: the cached state one origin contributed, split into buckets
+ * by the hash of each entry's identity (device, mailbox@context). A bucket's
+ * digest is the sum of its entry hashes (identity + state), so it does not
+ * depend on the order the cache is walked in and is equal on every node that
+ * holds the same states from that origin. With a prefix only the entries whose
+ * device / mailbox starts with it are counted, what a peer filtering on that
+ * prefix holds.
+ */
+#define PBX_DIGEST_MAX_BUCKETS 64
+
+typedef struct pbx_digest {
+	unsigned int count;
+	uint32_t hash;
+} pbx_digest_t;
+
+typedef void (*pbx_snapshot_cb_t) (enum ast_event_type event_type, const char *msg, size_t msg_len, void *data);
+
+exception_t pbx_cache_digest(enum ast_event_type event_type, const struct ast_eid *eid, const char *prefix, unsigned int num_buckets, pbx_digest_t *digests);
+unsigned int pbx_cache_republish(enum ast_event_type event_type, unsigned int num_buckets, uint64_t bucket_mask, pbx_snapshot_cb_t callback, void *data);
+
+/* drop the cached state a (dead) origin contributed, returns the number of entries purged */
+unsigned int pbx_cache_purge(enum ast_event_type event_type, const struct ast_eid *eid);
+
+/*
+ * Anti-entropy removals: the origin lists the identities (device, or
+ * mailbox@context) it holds in the repaired buckets, peers purge what they
+ * hold from it in those buckets that is not on the list.
+ */
+typedef boolean_t (*pbx_identity_cb_t) (enum ast_event_type event_type, const char *identity, void *data);
+unsigned int pbx_cache_identities(enum ast_event_type event_type, unsigned int num_buckets, uint64_t bucket_mask, pbx_identity_cb_t callback, void *data);
+/* like pbx_cache_purge(), limited to the buckets of bucket_mask and sparing the entries keep returns TRUE for */
+unsigned int pbx_cache_purge_missing(enum ast_event_type event_type, const struct ast_eid *eid, unsigned int num_buckets, uint64_t bucket_mask, pbx_identity_cb_t keep, void *data);
+
+/* everything cached from other servers, encoded with literal names */
+unsigned int pbx_cache_dump_remote(enum ast_event_type event_type, pbx_snapshot_cb_t callback, void *data);
+
+#ifdef HAVE_PBX_STASIS_H
+/*
+ * Stasis (asterisk 12+) device state and mwi messages, encoded straight from
+ * the message payload into the same wire format as the ast_event path.
+ */
+struct stasis_subscription *pbx_stasis_subscribe(enum ast_event_type event_type, stasis_subscription_cb callback, void *data);
+exception_t stasis2json(char *msg, const size_t msg_len, struct stasis_message *smsg, enum ast_event_type *event_type);
+exception_t json2stasis(enum ast_event_type event_type, const char *msg, const char *prefix);
+unsigned int pbx_stream_cache_snapshot(enum ast_event_type event_type, pbx_snapshot_cb_t callback, void *data);
+#endif
 
 /* should become private instead / to be removed*/
 exception_t message2json(char *jsonmsgbuffer, const size_t msg_len, const struct ast_event *event);
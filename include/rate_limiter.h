@@ -0,0 +1,56 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _RATE_LIMITER_H_
+#define _RATE_LIMITER_H_
+
+#include <stdint.h>
+#include "shared.h"
+
+/*
+ * Token bucket with coalesce-on-overflow.
+ *
+ * A message passes while tokens are left (rate per second, up to burst).
+ * Beyond that it is kept pending in arrival order; a newer message with the
+ * same key (device, mailbox) replaces the pending one in place, so a storm of
+ * updates for one device costs one message once tokens are back. Only when
+ * max_pending different keys wait is a message dropped. rate_limiter_drain()
+ * hands out the pending messages as tokens refill.
+ */
+typedef enum {
+	RATE_PASS = 0,					/* send it now */
+	RATE_DEFERRED,					/* queued, comes out of rate_limiter_drain() */
+	RATE_COALESCED,					/* replaced a queued message with the same key */
+	RATE_DROPPED,					/* queue full */
+} rate_status_t;
+
+typedef struct rate_limiter_stats {
+	unsigned long passed;
+	unsigned long deferred;
+	unsigned long coalesced;
+	unsigned long dropped;
+	unsigned int pending;
+} rate_limiter_stats_t;
+
+typedef struct rate_limiter rate_limiter_t;
+typedef void (*rate_limiter_cb_t) (const char *key, const char *msg, void *data);
+
+rate_limiter_t *rate_limiter_new(unsigned int rate, unsigned int burst, unsigned int max_pending);
+void rate_limiter_destroy(rate_limiter_t *limiter);
+
+/* now in ms; a NULL or empty key is never coalesced */
+rate_status_t rate_limiter_submit(rate_limiter_t *limiter, const char *key, const char *msg, uint64_t now);
+
+/* the callback runs with the limiter locked and must not call back into it */
+unsigned int rate_limiter_drain(rate_limiter_t *limiter, uint64_t now, rate_limiter_cb_t callback, void *data);
+void rate_limiter_stats(rate_limiter_t *limiter, rate_limiter_stats_t *stats);
+
+#endif /* _RATE_LIMITER_H_ */
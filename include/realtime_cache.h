@@ -0,0 +1,65 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _REALTIME_CACHE_H_
+#define _REALTIME_CACHE_H_
+
+#include <stdint.h>
+#include "shared.h"
+
+/*
+ * Sharded LRU of realtime lookup results.
+ *
+ * An entry maps a lookup key (table plus lookup fields) to the list of
+ * name/value pairs that came back, and carries one tag: the redis key of
+ * the row it was read from, or the table key when the lookup could have
+ * matched any row. realtime_cache_invalidate(tag) drops every entry with
+ * that tag, across all shards.
+ *
+ * A lookup that misses should take realtime_cache_epoch() before asking
+ * redis and hand it to realtime_cache_put(): when an invalidation ran in
+ * between, the put is discarded instead of caching a value that may
+ * already be outdated.
+ */
+typedef struct realtime_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long inserts;
+	unsigned long evictions;
+	unsigned long invalidations;			/* entries dropped by tag or flush */
+	unsigned long discarded;			/* puts that lost against an invalidation */
+	unsigned int entries;
+} realtime_cache_stats_t;
+
+typedef struct realtime_cache realtime_cache_t;
+typedef void (*realtime_cache_cb_t) (const char *name, const char *value, void *data);
+
+/* capacity is the total over all shards; ttl in ms, 0 never expires */
+realtime_cache_t *realtime_cache_new(unsigned int shards, unsigned int capacity, unsigned int ttl);
+void realtime_cache_destroy(realtime_cache_t *cache);
+
+/* calls callback for every pair with the shard locked, returns 1 on a hit */
+int realtime_cache_get(realtime_cache_t *cache, const char *key, uint64_t now, realtime_cache_cb_t callback, void *data);
+unsigned long realtime_cache_epoch(realtime_cache_t *cache);
+exception_t realtime_cache_put(realtime_cache_t *cache, const char *key, const char *tag, const char *const *names, const char *const *values, unsigned int num_pairs, unsigned long epoch, uint64_t now);
+
+unsigned int realtime_cache_invalidate(realtime_cache_t *cache, const char *tag);
+
+/*
+ * a redis key changed (notification or local write): drops the entries
+ * tagged with it and, when it is a row or a secondary index of a table
+ * (see realtime_key_table()), the entries tagged with the table key
+ */
+unsigned int realtime_cache_invalidate_key(realtime_cache_t *cache, const char *key);
+void realtime_cache_flush(realtime_cache_t *cache);
+void realtime_cache_stats(realtime_cache_t *cache, realtime_cache_stats_t *stats);
+
+#endif /* _REALTIME_CACHE_H_ */
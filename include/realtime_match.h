@@ -0,0 +1,75 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _REALTIME_MATCH_H_
+#define _REALTIME_MATCH_H_
+
+#include <stddef.h>
+#include "shared.h"
+
+/*
+ * Realtime lookup predicates, evaluated locally against hash fields.
+ *
+ * The realtime api passes the operator as part of the field name, the way
+ * the sql drivers expect it: "name", "name LIKE", "regseconds <",
+ * "host !=", "ipaddr IS NULL". Without an operator it is an equality test.
+ * Equality is exact ("0100" is not "100"); the ordering operators compare
+ * numerically when both sides are numbers, otherwise bytewise.
+ * A missing field behaves like sql NULL: it only satisfies IS NULL.
+ */
+#define REALTIME_MATCH_MAX_FIELD 64
+
+typedef enum {
+	RT_OP_EQ = 0,
+	RT_OP_NE,
+	RT_OP_LT,
+	RT_OP_LE,
+	RT_OP_GT,
+	RT_OP_GE,
+	RT_OP_LIKE,
+	RT_OP_NOT_LIKE,
+	RT_OP_IS_NULL,
+	RT_OP_IS_NOT_NULL,
+} realtime_op_t;
+
+typedef struct realtime_filter {
+	char field[REALTIME_MATCH_MAX_FIELD];
+	realtime_op_t op;
+	const char *value;				/* not copied */
+} realtime_filter_t;
+
+exception_t realtime_filter_parse(realtime_filter_t *filter, const char *spec, const char *value);
+
+/* value is NULL when the row does not have the field */
+int realtime_filter_match(const realtime_filter_t *filter, const char *value);
+
+/* sql LIKE: '%' any run, '_' any one character, '\' escapes */
+int realtime_like(const char *pattern, const char *value);
+
+/* the literal start of a LIKE pattern, unescaped; returns 1 when there is nothing after it */
+int realtime_like_prefix(const char *pattern, char *prefix, size_t len);
+
+/*
+ * Which table a redis key of the realtime layout belongs to: the id set
+ * <database>:<table>, a row <database>:<table>:<id>, or a secondary index
+ * <database>:<table>#<field>[=<value>]. Copies <database>:<table> into
+ * table_key, RT_KEY_NONE when key is none of them or does not fit.
+ */
+typedef enum {
+	RT_KEY_NONE = 0,
+	RT_KEY_TABLE,
+	RT_KEY_ROW,
+	RT_KEY_INDEX,
+} realtime_key_t;
+
+realtime_key_t realtime_key_table(const char *key, char *table_key, size_t len);
+
+#endif /* _REALTIME_MATCH_H_ */
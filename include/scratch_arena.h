@@ -0,0 +1,59 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _SCRATCH_ARENA_H_
+#define _SCRATCH_ARENA_H_
+
+#include <stddef.h>
+
+/*
+ * Per-thread bump arena used by the encode/decode path. Everything allocated
+ * from it lives until the next scratch_reset(), which the caller does once per
+ * message. The backing buffer is allocated once per thread and released at
+ * thread exit.
+ */
+#define SCRATCH_ARENA_SIZE 16384
+
+/*
+ * Size-class pool for event buffers (ast_event objects under construction).
+ * Blocks are kept on per-thread freelists, so returning and re-getting a block
+ * on the same thread never touches the heap.
+ */
+#define SCRATCH_POOL_CLASSES 5				/* 128, 256, 512, 1024, 2048 bytes */
+#define SCRATCH_POOL_MIN_CLASS_SIZE 128
+#define SCRATCH_POOL_MAX_FREE 32			/* cached blocks per class */
+
+typedef struct scratch_arena scratch_arena_t;
+
+typedef struct scratch_stats {
+	unsigned long backing_allocs;			/* heap allocations done by arena + pool */
+	unsigned long arena_exhausted;			/* scratch_alloc requests that did not fit */
+	unsigned long pool_hits;
+	unsigned long pool_misses;
+	unsigned long pool_oversize;			/* requests larger than the biggest class */
+} scratch_stats_t;
+
+scratch_arena_t *scratch_arena_get(void);
+void *scratch_alloc(scratch_arena_t *arena, size_t len);
+char *scratch_strdup(scratch_arena_t *arena, const char *str);
+char *scratch_strndup(scratch_arena_t *arena, const char *str, size_t len);
+void scratch_reset(scratch_arena_t *arena);
+size_t scratch_used(const scratch_arena_t *arena);
+void scratch_rewind(scratch_arena_t *arena, size_t mark);
+
+void *scratch_pool_get(size_t len, size_t *capacity);
+void *scratch_pool_grow(void *ptr, size_t len, size_t *capacity);
+void scratch_pool_put(void *ptr);
+
+void scratch_get_stats(scratch_stats_t *stats);
+void scratch_reset_stats(void);
+
+#endif /* _SCRATCH_ARENA_H_ */
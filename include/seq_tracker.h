@@ -0,0 +1,45 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _SEQ_TRACKER_H_
+#define _SEQ_TRACKER_H_
+
+#include <stdint.h>
+#include <time.h>
+#include "shared.h"
+
+/*
+ * Per-origin sequence tracking.
+ *
+ * Every published event carries the origin's epoch (its start time) and a
+ * sequence number that increases by one per event of its stream (the event
+ * type: each type goes out on its own channel and arrives in its own order).
+ * Receivers remember the last sequence seen per origin EID and stream, so a
+ * lost message shows up as a gap at the next one and only that origin needs to
+ * be resynced. A new epoch means the origin restarted and starts counting again.
+ */
+typedef enum {
+	SEQ_NEW_ORIGIN = 0,				/* first event of this origin / stream / epoch */
+	SEQ_IN_ORDER,
+	SEQ_GAP,					/* *missed events were lost before this one */
+	SEQ_LATE,					/* at or before the last sequence seen */
+} seq_status_t;
+
+typedef struct seq_tracker seq_tracker_t;
+
+seq_tracker_t *seq_tracker_new(void);
+void seq_tracker_destroy(seq_tracker_t *tracker);
+seq_status_t seq_tracker_check(seq_tracker_t *tracker, const char *eid_str, const char *stream, uint32_t epoch, uint32_t seq, uint32_t *missed);
+
+/* TRUE (and remembers now) unless this origin was resynced less than interval seconds ago */
+boolean_t seq_tracker_resync_due(seq_tracker_t *tracker, const char *eid_str, time_t now, unsigned int interval);
+
+#endif /* _SEQ_TRACKER_H_ */
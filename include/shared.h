@@ -25,26 +25,34 @@ typedef enum { FALSE = 0, TRUE = 1 } boolean_t;
 typedef enum exceptions {
 	NO_EXCEPTION		= 0,
 	EID_SELF_EXCEPTION	= 1,
+	FILTERED_EXCEPTION	= 2,
 	MALLOC_EXCEPTION 	= 100,
 	LIBEVENT_EXCEPTION	= 101,
 	EXISTS_EXCEPTION	= 102,	
 	DECODING_EXCEPTION	= 103,
 	REDIS_EXCEPTION 	= 104,
 	GENERAL_EXCEPTION	= 105,
+	BUFFERSIZE_EXCEPTION	= 106,
+	INTERN_MISS_EXCEPTION	= 107,
 } exception_t;
 
+#ifndef __cplusplus	/* designated array initializers are C only */
 static struct {
 	const char *str;
-} exception2str[] = {
+} exception2str[] __attribute__((unused)) = {
 	[NO_EXCEPTION] = {""},
 	[EID_SELF_EXCEPTION] = {"EID Same as our own"},
+	[FILTERED_EXCEPTION] = {"Filtered"},
 	[MALLOC_EXCEPTION] = {"Malloc/Free Exception"},
 	[LIBEVENT_EXCEPTION] = {"LibEvent Exception"},
 	[EXISTS_EXCEPTION] = {"Already Exists Exception"},
 	[DECODING_EXCEPTION] = {"Decoding Exception"},
 	[REDIS_EXCEPTION] = {"Redis Exception"},
 	[GENERAL_EXCEPTION] = {"General Exception"},
+	[BUFFERSIZE_EXCEPTION] = {"Buffer Too Small Exception"},
+	[INTERN_MISS_EXCEPTION] = {"Unknown Interned String Exception"},
 };
+#endif
 
 /*
 enum returnvalues {
@@ -0,0 +1,46 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _STALE_FILTER_H_
+#define _STALE_FILTER_H_
+
+#include <stdint.h>
+#include "shared.h"
+
+/*
+ * Staleness filter on the origin timestamp of an event.
+ *
+ * Receivers remember the newest timestamp seen per key (origin, event type and
+ * device / mailbox), so an event that arrives after a newer one for the same
+ * key was queued somewhere and is dropped. With a max_age an event older than
+ * that is dropped as well, without touching the remembered timestamp. Only
+ * timestamps of the same origin are compared with each other; max_age compares
+ * against the local clock and assumes the nodes run NTP.
+ */
+typedef enum {
+	STALE_FRESH = 0,
+	STALE_TOO_OLD,					/* older than max_age */
+	STALE_SUPERSEDED,				/* older than the last event with this key */
+} stale_status_t;
+
+typedef struct stale_filter stale_filter_t;
+
+stale_filter_t *stale_filter_new(void);
+void stale_filter_destroy(stale_filter_t *filter);
+unsigned int stale_filter_count(stale_filter_t *filter);
+
+/* timestamps in ms, max_age 0 only checks for newer events */
+stale_status_t stale_filter_check(stale_filter_t *filter, const char *key, uint64_t ts, uint64_t now, uint64_t max_age);
+
+/* forget keys whose last event is older than before, returns how many */
+unsigned int stale_filter_expire(stale_filter_t *filter, uint64_t before);
+
+#endif /* _STALE_FILTER_H_ */
@@ -0,0 +1,59 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#ifndef _STATE_FILE_H_
+#define _STATE_FILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "shared.h"
+
+/*
+ * Local snapshot of the remote cluster state, read back at startup.
+ *
+ *   header | record | record | ...
+ *   record: uint16 event type, uint16 length, encoded message, '\0', padded to 4 bytes
+ *
+ * Written in host byte order to '<path>.tmp' and renamed over the previous
+ * one, so a reader never sees a half written file. The reader maps the file
+ * and walks the records in place; a wrong magic (or byte order), version,
+ * size or checksum rejects the whole file.
+ */
+#define STATE_FILE_MAGIC 0x52525346			/* "RRSF" */
+#define STATE_FILE_VERSION 1
+#define STATE_FILE_MAX_MSG 65535
+
+typedef struct state_file_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_len;
+	uint32_t count;
+	uint32_t checksum;				/* FNV-1a over the records */
+	uint64_t created;				/* unix time */
+	uint64_t records_len;
+} state_file_header_t;
+
+typedef struct state_file_writer state_file_writer_t;
+typedef struct state_file state_file_t;
+
+state_file_writer_t *state_file_writer_new(const char *path);
+exception_t state_file_writer_add(state_file_writer_t *writer, unsigned int type, const char *msg, size_t len);
+/* both free the writer */
+exception_t state_file_writer_commit(state_file_writer_t *writer, uint64_t created);
+void state_file_writer_abort(state_file_writer_t *writer);
+
+state_file_t *state_file_open(const char *path, exception_t *res);
+void state_file_close(state_file_t *file);
+const state_file_header_t *state_file_header(state_file_t *file);
+/* *msg is NULL after the last record; points into the mapping, valid until state_file_close() */
+exception_t state_file_next(state_file_t *file, size_t *cursor, unsigned int *type, const char **msg, size_t *len);
+
+#endif /* _STATE_FILE_H_ */
@@ -21,6 +21,8 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 419592 $")
 #include <asterisk/event.h>
 
 #include "../include/pbx_event_message_serializer.h"
+#include "../include/json_string.h"
+#include "../include/scratch_arena.h"
 #include "../include/shared.h"
 /*
  * declaration
@@ -49,6 +51,13 @@ static pbx_event_map_t event_map[AST_EVENT_TOTAL] = {
 	[EVENT_PING] =                {.ast_event_type = AST_EVENT_PING, .name = "ping"},
 };
 
+/* device name interning, disabled unless pbx_set_interning() installs a local table */
+static struct {
+	intern_table_t *local_table;
+	pbx_intern_announce_cb_t announce;
+	pbx_intern_miss_cb_t miss;
+} interning = {NULL, NULL, NULL};
+
 /*
  * public
  */
@@ -90,21 +99,32 @@ exception_t  pbx_publish(event_type_t event_type, char *jsonmsgbuffer, size_t bu
 	return res;
 }
 
+void pbx_set_interning(intern_table_t *local_table, pbx_intern_announce_cb_t announce, pbx_intern_miss_cb_t miss)
+{
+	ast_rwlock_wrlock(&event_map_lock);
+	interning.local_table = local_table;
+	interning.announce = announce;
+	interning.miss = miss;
+	ast_rwlock_unlock(&event_map_lock);
+}
+
 /*
  * private 
  */
 static void ast_event_cb(const struct ast_event *event, void *data) {
 	event_type_t event_type = (event_type_t)data;
+	scratch_arena_t *arena = scratch_arena_get();
 	char *jsonbuffer = NULL;
-	if (!(jsonbuffer = malloc(MAX_JSON_BUFFERLEN))) {
-		// malloc error
+	if (!(jsonbuffer = scratch_alloc(arena, MAX_JSON_BUFFERLEN))) {
+		log_debug("PBX: Scratch Arena Exhausted\n");
+		return;
 	}
-	if (message2json(jsonbuffer, MAX_JSON_BUFFERLEN, event)) {
+	if (!message2json(jsonbuffer, MAX_JSON_BUFFERLEN, event)) {
 		event_map[event_type].callback(event_type, jsonbuffer);
 	} else {
 		// error
 	}
-	ast_free(jsonbuffer);
+	scratch_reset(arena);
 }
 
 /* copied from asterisk/event.c */
@@ -117,6 +137,20 @@ struct ast_event {
         unsigned char payload[0];
 } __attribute__((packed));
 
+struct ast_event_ie {
+	enum ast_event_ie_type ie_type:16;
+	/*! Total length of the IE payload */
+	uint16_t ie_payload_len;
+	unsigned char ie_payload[0];
+} __attribute__((packed));
+
+struct ast_event_ie_str_payload {
+	/*! \brief A hash calculated with ast_str_hash(), for fast comparisons */
+	uint32_t hash;
+	/*! \brief The actual string, null terminated */
+	char str[1];
+} __attribute__((packed));
+
 static const struct ie_map {
 	enum ast_event_ie_pltype ie_pltype;
 	const char *name;
@@ -205,18 +239,13 @@ int fixed_ast_event_str_to_ie_type(const char *str, enum ast_event_ie_type *ie_t
 /* End Fix */
 
 
-inline static void trim_char_bothends(char *inout, char chr) 
+static inline boolean_t ie_is_internable(enum ast_event_ie_type ie_type)
 {
-	if (!chr || inout[0] == chr) {
-		memmove(inout+0, inout+1, strlen(inout)); 	// strip first
-	}
-	if (!chr || inout[strlen(inout)-1] == chr) {
-		inout[strlen(inout)-1] = '\0'; 	 	 	// strip last
-	}
+	return (ie_type == AST_EVENT_IE_DEVICE || ie_type == AST_EVENT_IE_MAILBOX || ie_type == AST_EVENT_IE_CONTEXT) ? TRUE : FALSE;
 }
 
-/* generic ast_event to json encode */
-exception_t message2json(char *msg, const size_t msg_len, const struct ast_event *event) 
+/* generic ast_event to json encode, intern: use the local intern table for device / mailbox names */
+static exception_t event2json(char *msg, const size_t msg_len, const struct ast_event *event, boolean_t intern)
 {
 	exception_t res = DECODING_EXCEPTION;
 	unsigned int curpos = 1;
@@ -229,6 +258,15 @@ exception_t message2json(char *msg, const size_t msg_len, const struct ast_event
 		return res;
 	}
 	ast_debug(1, "Encoding Event: %s\n", ast_event_get_type_name(event));
+
+	/* EntityID goes first, so that the receiver's lazy view (redis_filter_event) finds it without indexing the rest of the message */
+	const void *eid = ast_event_get_ie_raw(event, AST_EVENT_IE_EID);
+	if (eid) {
+		char eid_buf[32];
+		ast_eid_to_str(eid_buf, sizeof(eid_buf), (struct ast_eid *)eid);
+		snprintf(msg + curpos, msg_len - curpos, "\"%s\":\"%s\",", ast_event_get_ie_type_name(AST_EVENT_IE_EID), eid_buf);
+		curpos = strlen(msg);
+	}
 	do {
 		enum ast_event_ie_type ie_type;
 		enum ast_event_ie_pltype ie_pltype;
@@ -243,9 +281,29 @@ exception_t message2json(char *msg, const size_t msg_len, const struct ast_event
 			case AST_EVENT_IE_PLTYPE_EXISTS:
 				snprintf(msg + curpos, msg_len - curpos, "\"%s\":\"exists\",", ie_type_name);
 				break;
-			case AST_EVENT_IE_PLTYPE_STR:
-				snprintf(msg + curpos, msg_len - curpos, "\"%s\":\"%s\",", ie_type_name, ast_event_iterator_get_ie_str(&i));
+			case AST_EVENT_IE_PLTYPE_STR: {
+				const char *str = ast_event_iterator_get_ie_str(&i);
+				size_t escaped_len = 0;
+				unsigned int intern_id = 0;
+				boolean_t added = FALSE;
+				if (intern && interning.local_table && ie_is_internable(ie_type) && !intern_table_get_id(interning.local_table, str, &intern_id, &added)) {
+					if (added && interning.announce) {
+						/* announced before the event that uses it is published */
+						interning.announce(intern_id, str);
+					}
+					snprintf(msg + curpos, msg_len - curpos, "\"%s#\":%u,", ie_type_name, intern_id);
+					break;
+				}
+				snprintf(msg + curpos, msg_len - curpos, "\"%s\":\"", ie_type_name);
+				curpos = strlen(msg);
+				if (json_escape(msg + curpos, msg_len - curpos, str, strlen(str), &escaped_len)) {
+					ast_log(LOG_ERROR, "Failed to escape '%s', message too long\n", ie_type_name);
+					return BUFFERSIZE_EXCEPTION;
+				}
+				curpos += escaped_len;
+				snprintf(msg + curpos, msg_len - curpos, "\",");
 				break;
+			}
 			case AST_EVENT_IE_PLTYPE_UINT:
 				snprintf(msg + curpos, msg_len - curpos, "\"%s\":%u,", ie_type_name, ast_event_iterator_get_ie_uint(&i));
 				curpos = strlen(msg);
@@ -258,9 +316,7 @@ exception_t message2json(char *msg, const size_t msg_len, const struct ast_event
 				break;
 			case AST_EVENT_IE_PLTYPE_RAW:
 				if (ie_type == AST_EVENT_IE_EID) {
-					char eid_buf[32];
-					ast_eid_to_str(eid_buf, sizeof(eid_buf), ast_event_iterator_get_ie_raw(&i));
-					snprintf(msg + curpos, msg_len - curpos, "\"%s\":\"%s\",", ast_event_get_ie_type_name(ie_type), eid_buf);
+					/* already written up front */
 				} else {
 					const void *rawbuf = ast_event_get_ie_raw(event, ie_type);
 					snprintf(msg + curpos, msg_len - curpos, "\"%s\",", (unsigned char *)rawbuf);
@@ -278,98 +334,648 @@ exception_t message2json(char *msg, const size_t msg_len, const struct ast_event
 	return NO_EXCEPTION;
 }
 
-/* generic json to ast_event decoder */
-exception_t json2message(struct ast_event **eventref, enum ast_event_type event_type, const char *msg, boolean_t *cacheable)
+exception_t message2json(char *msg, const size_t msg_len, const struct ast_event *event)
+{
+	return event2json(msg, msg_len, event, TRUE);
+}
+
+/*
+ * Local ast_event_append_ie_* replacements, building the event inside a pooled
+ * buffer instead of realloc-ing it for every information element.
+ */
+static exception_t event_append_ie_raw(struct ast_event **eventref, size_t *capacity, enum ast_event_ie_type ie_type, const void *data, size_t data_len)
 {
-	exception_t res = DECODING_EXCEPTION;
 	struct ast_event *event = *eventref;
+	struct ast_event_ie *ie;
+	uint16_t event_len = ntohs(event->event_len);
+	size_t extra_len = sizeof(*ie) + data_len;
+
+	if (event_len + extra_len > UINT16_MAX) {
+		return DECODING_EXCEPTION;
+	}
+	if (!(event = scratch_pool_grow(event, event_len + extra_len, capacity))) {
+		return MALLOC_EXCEPTION;
+	}
+	ie = (struct ast_event_ie *) (((char *) event) + event_len);
+	ie->ie_type = htons(ie_type);
+	ie->ie_payload_len = htons(data_len);
+	memcpy(ie->ie_payload, data, data_len);
+	event->event_len = htons(event_len + extra_len);
+	*eventref = event;
+	return NO_EXCEPTION;
+}
+
+static exception_t event_append_ie_uint(struct ast_event **eventref, size_t *capacity, enum ast_event_ie_type ie_type, uint32_t data)
+{
+	data = htonl(data);
+	return event_append_ie_raw(eventref, capacity, ie_type, &data, sizeof(data));
+}
+
+static exception_t event_append_ie_str(struct ast_event **eventref, size_t *capacity, enum ast_event_ie_type ie_type, const char *str)
+{
+	struct ast_event_ie_str_payload *str_payload;
+	size_t payload_len = sizeof(*str_payload) + strlen(str);
+
+	if (!(str_payload = scratch_alloc(scratch_arena_get(), payload_len))) {
+		return MALLOC_EXCEPTION;
+	}
+	strcpy(str_payload->str, str);
+	str_payload->hash = ast_str_hash(str);
+	return event_append_ie_raw(eventref, capacity, ie_type, str_payload, payload_len);
+}
+
+/*
+ * Lazy decode view
+ *
+ * pbx_event_view_init() only copies the message into the scratch arena; the
+ * members are indexed by pbx_event_view_get_*() as far as needed to find the
+ * requested IE, so filters on origin / device / state touch a couple of
+ * members and never build an ast_event. pbx_event_view_materialize() indexes
+ * the rest and builds the event for accepted messages only.
+ *
+ * Token copies live in the calling thread's scratch arena; the caller owns the
+ * message boundary and resets the arena once it is done with the message.
+ */
+static exception_t view_index_next(pbx_event_view_t *view)
+{
+	pbx_event_view_member_t *member;
+	char *key, *value;
+	boolean_t is_string = FALSE;
+	size_t keylen;
+	exception_t res;
+
+	if ((res = json_next_member(&view->cursor, &key, &value, &is_string))) {
+		return res;
+	}
+	if (!key) {
+		view->complete = TRUE;
+		return NO_EXCEPTION;
+	}
+	if (view->num_members >= ARRAY_LEN(view->members)) {
+		return BUFFERSIZE_EXCEPTION;
+	}
+	member = &view->members[view->num_members++];
+	member->value = value;
+	member->is_string = is_string;
+	member->interned = FALSE;
+	keylen = strlen(key);
+	if (keylen > 1 && key[keylen - 1] == '#') {
+		/* interned string id, resolved against the origin's table on access */
+		key[keylen - 1] = '\0';
+		member->interned = TRUE;
+	}
+	if (fixed_ast_event_str_to_ie_type(key, &member->ie_type)) {
+		member->ie_type = AST_EVENT_IE_END;		/* informational member, e.g. "statestr" */
+	}
+	return NO_EXCEPTION;
+}
+
+static exception_t view_find(pbx_event_view_t *view, enum ast_event_ie_type ie_type, pbx_event_view_member_t **member)
+{
+	unsigned int n;
+	exception_t res;
+
+	for (n = 0; n < view->num_members; n++) {
+		if (view->members[n].ie_type == ie_type) {
+			*member = &view->members[n];
+			return NO_EXCEPTION;
+		}
+	}
+	while (!view->complete) {
+		if ((res = view_index_next(view))) {
+			return res;
+		}
+		if (!view->complete && view->members[view->num_members - 1].ie_type == ie_type) {
+			*member = &view->members[view->num_members - 1];
+			return NO_EXCEPTION;
+		}
+	}
+	return EXISTS_EXCEPTION;
+}
+
+static exception_t view_resolve_interned(pbx_event_view_t *view, pbx_event_view_member_t *member)
+{
+	char eid_str[32];
+	char *str;
+	intern_table_t *remote_table;
+	unsigned int id = strtoul(member->value, NULL, 10);
+	exception_t res;
+
+	if ((res = pbx_event_view_get_eid(view, NULL, eid_str, sizeof(eid_str)))) {
+		return res == EXISTS_EXCEPTION ? DECODING_EXCEPTION : res;
+	}
+	if (!(str = scratch_alloc(scratch_arena_get(), INTERN_MAX_STRLEN))) {
+		return MALLOC_EXCEPTION;
+	}
+	remote_table = intern_registry_get(eid_str, FALSE);
+	if (!remote_table || intern_table_copy(remote_table, id, str, INTERN_MAX_STRLEN)) {
+		ast_debug(1, "Unknown interned id %u from %s\n", id, eid_str);
+		if (interning.miss) {
+			interning.miss(eid_str);
+		}
+		return INTERN_MISS_EXCEPTION;
+	}
+	member->value = str;
+	member->interned = FALSE;
+	return NO_EXCEPTION;
+}
+
+exception_t pbx_event_view_init(pbx_event_view_t *view, enum ast_event_type event_type, const char *msg)
+{
+	view->event_type = event_type;
+	view->msg = msg;
+	view->num_members = 0;
+	view->complete = FALSE;
+	if (!(view->cursor = scratch_strdup(scratch_arena_get(), msg))) {
+		return MALLOC_EXCEPTION;
+	}
+	return NO_EXCEPTION;
+}
+
+exception_t pbx_event_view_get_str(pbx_event_view_t *view, enum ast_event_ie_type ie_type, const char **value)
+{
+	pbx_event_view_member_t *member;
+	exception_t res;
+
+	if ((res = view_find(view, ie_type, &member))) {
+		return res;
+	}
+	if (member->interned && (res = view_resolve_interned(view, member))) {
+		return res;
+	}
+	*value = member->value;
+	return NO_EXCEPTION;
+}
+
+exception_t pbx_event_view_get_uint(pbx_event_view_t *view, enum ast_event_ie_type ie_type, uint32_t *value)
+{
+	pbx_event_view_member_t *member;
+	exception_t res;
+
+	if ((res = view_find(view, ie_type, &member))) {
+		return res;
+	}
+	*value = strtoul(member->value, NULL, 10);
+	return NO_EXCEPTION;
+}
+
+/* origin of the message, eid and / or its string form; EID_SELF_EXCEPTION when it originated here */
+exception_t pbx_event_view_get_eid(pbx_event_view_t *view, struct ast_eid *eid, char *eid_str, size_t eid_str_len)
+{
+	pbx_event_view_member_t *member;
+	struct ast_eid tmp;
+	exception_t res;
+
+	if ((res = view_find(view, AST_EVENT_IE_EID, &member))) {
+		return res;
+	}
+	if (ast_str_to_eid(&tmp, member->value)) {
+		return DECODING_EXCEPTION;
+	}
+	if (eid) {
+		*eid = tmp;
+	}
+	if (eid_str) {
+		ast_copy_string(eid_str, member->value, eid_str_len);
+	}
+	return ast_eid_cmp(&ast_eid_default, &tmp) ? NO_EXCEPTION : EID_SELF_EXCEPTION;
+}
+
+/* builds the event in a pooled buffer, the caller hands it back with scratch_pool_put() */
+exception_t pbx_event_view_build(pbx_event_view_t *view, struct ast_event **eventref, boolean_t *cacheable)
+{
+	exception_t res = NO_EXCEPTION;
+	struct ast_event *event = NULL;
+	size_t capacity = 0;
 	struct ast_eid eid;
-	char *tokenstr = strdupa(msg);
-	trim_char_bothends(tokenstr,0);
+	boolean_t has_eid = FALSE;
+	int cache = 0;
+	unsigned int n;
 
-	char *entry = NULL;
-	char *key = NULL;
-	char *value = NULL;
-	char delims[]=",";
-	int cache = 0;;
+	while (!view->complete) {
+		if ((res = view_index_next(view))) {
+			ast_log(LOG_ERROR, "Malformed json message: '%s'\n", view->msg);
+			return res;
+		}
+	}
+	switch ((res = pbx_event_view_get_eid(view, &eid, NULL, 0))) {
+		case NO_EXCEPTION:
+			has_eid = TRUE;
+			break;
+		case EXISTS_EXCEPTION:
+			break;
+		default:
+			// Don't feed events back in that originated locally. Quit now.
+			return res;
+	}
 
 //	if (!(event = ast_event_new(event_type, AST_EVENT_IE_END))) {		/* can't use this because it automatically adds my local EID to the new event */
 //		return DECODING_EXCEPTION;
 //	}
-        if (!(event = ast_calloc(1, sizeof(*event)))) {				/* resorting to local copy of ast_event structure :-( */
-                return MALLOC_EXCEPTION; 
-        }
-        event->type = htons(event_type);
-        event->event_len = htons(sizeof(*event));
-	
-	ast_debug(1, "Decoding Msg2Event %s, content: '%s'\n", ast_event_get_type_name(event), tokenstr);
-	entry = strtok(tokenstr, delims);
-	while (entry) {
-		value = strdupa(entry);
-		key = strsep(&value, ":");
- 		trim_char_bothends(value, '"');
- 		trim_char_bothends(key, '"');
-		ast_debug(1, "Key: %s, Value: %s\n", key, value);
+	if (!(event = scratch_pool_get(MAX_JSON_BUFFERLEN / 2, &capacity))) {	/* resorting to local copy of ast_event structure :-( */
+		return MALLOC_EXCEPTION;
+	}
+	event->type = htons(view->event_type);
+	event->event_len = htons(sizeof(*event));
+	ast_debug(1, "Materializing %s from %u members\n", ast_event_get_type_name(event), view->num_members);
 
-		enum ast_event_ie_type ie_type;
-		enum ast_event_ie_pltype ie_pltype;
-		const char *ie_type_name;
-		if (!fixed_ast_event_str_to_ie_type(key, &ie_type)){
-			ie_pltype = ast_event_get_ie_pltype(ie_type);
-			ie_type_name = ast_event_get_ie_type_name(ie_type);
-			
-			ast_debug(1, "Dealing with %s\n", ie_type_name);
-
-			switch(ie_pltype) {
-				case AST_EVENT_IE_PLTYPE_UNKNOWN:
-					break;
-				case AST_EVENT_IE_PLTYPE_EXISTS:
-					ast_event_append_ie_uint(&event, AST_EVENT_IE_EXISTS, atoi(value));
-					break;
-				case AST_EVENT_IE_PLTYPE_UINT:
-					if (ie_type == AST_EVENT_IE_CACHABLE) {
-						cache = atoi(value);
-					}
-					ast_event_append_ie_uint(&event, ie_type, atoi(value));
-					break;
-				case AST_EVENT_IE_PLTYPE_BITFLAGS:
-					ast_event_append_ie_bitflags(&event, ie_type, atoi(value));
-					break;
-				case AST_EVENT_IE_PLTYPE_STR:
-					ast_event_append_ie_str(&event, ie_type, value);
-					break;
-				case AST_EVENT_IE_PLTYPE_RAW:
-					if (ie_type == AST_EVENT_IE_EID) {
-						ast_str_to_eid(&eid, value);
-						if (!ast_eid_cmp(&ast_eid_default, &eid)) {
-							// Don't feed events back in that originated locally. Quit now.
-							res = EID_SELF_EXCEPTION;
-							goto failed;
-						}
-					        ast_event_append_ie_raw(&event, ie_type, &eid, sizeof(eid));
-					} else {
-						ast_event_append_ie_raw(&event, ie_type, value, strlen(value));
-					}
+	res = NO_EXCEPTION;
+	for (n = 0; n < view->num_members && !res; n++) {
+		pbx_event_view_member_t *member = &view->members[n];
+		enum ast_event_ie_type ie_type = member->ie_type;
+
+		if (ie_type == AST_EVENT_IE_END) {
+			continue;
+		}
+		ast_debug(1, "Key: %s, Value: %s\n", ast_event_get_ie_type_name(ie_type), member->value);
+		switch (ast_event_get_ie_pltype(ie_type)) {
+			case AST_EVENT_IE_PLTYPE_UNKNOWN:
+				break;
+			case AST_EVENT_IE_PLTYPE_EXISTS:
+				res = event_append_ie_uint(&event, &capacity, AST_EVENT_IE_EXISTS, atoi(member->value));
+				break;
+			case AST_EVENT_IE_PLTYPE_UINT:
+				if (ie_type == AST_EVENT_IE_CACHABLE) {
+					cache = atoi(member->value);
+				}
+				res = event_append_ie_uint(&event, &capacity, ie_type, atoi(member->value));
+				break;
+			case AST_EVENT_IE_PLTYPE_BITFLAGS:
+				res = event_append_ie_uint(&event, &capacity, ie_type, atoi(member->value));
+				break;
+			case AST_EVENT_IE_PLTYPE_STR:
+				if (member->interned && (res = view_resolve_interned(view, member))) {
 					break;
-			}
-			/* realloc inside one of the append functions failed */
-			if (!event) {
-			        return DECODING_EXCEPTION;
-                        }
+				}
+				res = event_append_ie_str(&event, &capacity, ie_type, member->value);
+				break;
+			case AST_EVENT_IE_PLTYPE_RAW:
+				if (ie_type == AST_EVENT_IE_EID) {
+					res = event_append_ie_raw(&event, &capacity, ie_type, &eid, sizeof(eid));
+				} else {
+					res = event_append_ie_raw(&event, &capacity, ie_type, member->value, strlen(member->value));
+				}
+				break;
 		}
-		entry = strtok(NULL, delims);
+	}
+	if (res) {
+		goto failed;
 	}
 
-	if (!ast_event_get_ie_raw(event, AST_EVENT_IE_EID)) {
-	         ast_event_append_eid(&event);
+	if (!has_eid) {
+		if ((res = event_append_ie_raw(&event, &capacity, AST_EVENT_IE_EID, &ast_eid_default, sizeof(ast_eid_default)))) {
+			goto failed;
+		}
 	}
 
 	ast_debug(1, "decoded msg into event\n");
-	*cacheable = cache ? TRUE : FALSE;
 	*eventref = event;
+	*cacheable = cache ? TRUE : FALSE;
 	return NO_EXCEPTION;
 
 failed:
-	ast_event_destroy(event);
+	scratch_pool_put(event);
+	return res;
+}
+
+/*
+ * The event is built in a pooled buffer and only copied into an exact-size
+ * heap allocation once it is accepted, because Asterisk takes ownership of
+ * (and ast_free's) whatever we hand to ast_event_queue().
+ */
+exception_t pbx_event_view_materialize(pbx_event_view_t *view, struct ast_event **eventref, boolean_t *cacheable)
+{
+	exception_t res;
+	struct ast_event *event = NULL;
+
+	if ((res = pbx_event_view_build(view, &event, cacheable))) {
+		return res;
+	}
+	/* hand-off: asterisk owns (and frees) queued events */
+	if ((*eventref = ast_malloc(ntohs(event->event_len)))) {
+		memcpy(*eventref, event, ntohs(event->event_len));
+	} else {
+		res = MALLOC_EXCEPTION;
+	}
+	scratch_pool_put(event);
 	return res;
 }
+
+/* generic json to ast_event decoder */
+exception_t json2message(struct ast_event **eventref, enum ast_event_type event_type, const char *msg, boolean_t *cacheable)
+{
+	pbx_event_view_t view;
+	exception_t res;
+
+	if ((res = pbx_event_view_init(&view, event_type, msg))) {
+		return res;
+	}
+	return pbx_event_view_materialize(&view, eventref, cacheable);
+}
+
+/*
+ * Cache digest
+ */
+struct cache_walk {
+	unsigned int num_buckets;
+	pbx_digest_t *digests;				/* pbx_cache_digest */
+	const char *prefix;				/* pbx_cache_digest, NULL = every entry */
+	uint64_t bucket_mask;				/* pbx_cache_republish, pbx_cache_identities */
+	pbx_snapshot_cb_t callback;
+	pbx_identity_cb_t identity_callback;		/* pbx_cache_identities */
+	void *data;
+	unsigned int count;
+};
+
+static inline uint32_t digest_str(uint32_t hash, const char *str)
+{
+	while (str && *str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static inline uint32_t digest_uint(uint32_t hash, uint32_t value)
+{
+	hash ^= value;
+	hash *= 16777619u;
+	return hash;
+}
+
+static uint32_t event_identity_hash(const struct ast_event *event)
+{
+	uint32_t hash = 2166136261u;
+
+	switch (ast_event_get_type(event)) {
+		case AST_EVENT_DEVICE_STATE:
+		case AST_EVENT_DEVICE_STATE_CHANGE:
+			hash = digest_str(hash, ast_event_get_ie_str(event, AST_EVENT_IE_DEVICE));
+			break;
+		case AST_EVENT_MWI:
+			hash = digest_str(hash, ast_event_get_ie_str(event, AST_EVENT_IE_MAILBOX));
+			hash = digest_str(digest_uint(hash, '@'), ast_event_get_ie_str(event, AST_EVENT_IE_CONTEXT));
+			break;
+		default:
+			break;
+	}
+	return hash;
+}
+
+/* the device, or mailbox@context */
+static const char *event_identity(const struct ast_event *event, char *buf, size_t buf_len)
+{
+	if (ast_event_get_type(event) == AST_EVENT_MWI) {
+		snprintf(buf, buf_len, "%s@%s", S_OR(ast_event_get_ie_str(event, AST_EVENT_IE_MAILBOX), ""), S_OR(ast_event_get_ie_str(event, AST_EVENT_IE_CONTEXT), "default"));
+		return buf;
+	}
+	return ast_event_get_ie_str(event, AST_EVENT_IE_DEVICE);
+}
+
+static void cache_digest_cb(const struct ast_event *event, void *data)
+{
+	struct cache_walk *walk = data;
+	uint32_t hash = event_identity_hash(event);
+	pbx_digest_t *digest = &walk->digests[hash % walk->num_buckets];
+	const char *name;
+
+	if (!ast_strlen_zero(walk->prefix)) {
+		name = ast_event_get_ie_str(event, ast_event_get_type(event) == AST_EVENT_MWI ? AST_EVENT_IE_MAILBOX : AST_EVENT_IE_DEVICE);
+		if (!name || strncmp(name, walk->prefix, strlen(walk->prefix))) {
+			return;
+		}
+	}
+	switch (ast_event_get_type(event)) {
+		case AST_EVENT_DEVICE_STATE:
+		case AST_EVENT_DEVICE_STATE_CHANGE:
+			hash = digest_uint(hash, ast_event_get_ie_uint(event, AST_EVENT_IE_STATE));
+			break;
+		case AST_EVENT_MWI:
+			hash = digest_uint(hash, ast_event_get_ie_uint(event, AST_EVENT_IE_NEWMSGS));
+			hash = digest_uint(hash, ast_event_get_ie_uint(event, AST_EVENT_IE_OLDMSGS));
+			break;
+		default:
+			break;
+	}
+	digest->hash += hash;
+	digest->count++;
+}
+
+static void cache_republish_cb(const struct ast_event *event, void *data)
+{
+	struct cache_walk *walk = data;
+	scratch_arena_t *arena = scratch_arena_get();
+	size_t mark = scratch_used(arena);
+	char *msg;
+
+	if (!(walk->bucket_mask & (1ULL << (event_identity_hash(event) % walk->num_buckets)))) {
+		return;
+	}
+	if ((msg = scratch_alloc(arena, MAX_JSON_BUFFERLEN)) && !message2json(msg, MAX_JSON_BUFFERLEN, event)) {
+		walk->callback(ast_event_get_type(event), msg, strlen(msg), walk->data);
+		walk->count++;
+	}
+	scratch_rewind(arena, mark);
+}
+
+static void cache_identity_cb(const struct ast_event *event, void *data)
+{
+	struct cache_walk *walk = data;
+	char buf[256];
+	const char *identity;
+
+	if (!(walk->bucket_mask & (1ULL << (event_identity_hash(event) % walk->num_buckets)))) {
+		return;
+	}
+	if ((identity = event_identity(event, buf, sizeof(buf)))) {
+		walk->identity_callback(ast_event_get_type(event), identity, walk->data);
+		walk->count++;
+	}
+}
+
+static void cache_walk_own(enum ast_event_type event_type, const struct ast_eid *eid, ast_event_cb_t cb, struct cache_walk *walk)
+{
+	struct ast_event_sub *event_sub;
+
+	if (!(event_sub = ast_event_subscribe_new(event_type, cb, walk))) {
+		return;
+	}
+	ast_event_sub_append_ie_raw(event_sub, AST_EVENT_IE_EID, (void *) eid, sizeof(*eid));
+	ast_event_dump_cache(event_sub);
+	ast_event_sub_destroy(event_sub);
+}
+
+exception_t pbx_cache_digest(enum ast_event_type event_type, const struct ast_eid *eid, const char *prefix, unsigned int num_buckets, pbx_digest_t *digests)
+{
+	struct cache_walk walk = { .num_buckets = num_buckets, .digests = digests, .prefix = prefix };
+
+	if (!num_buckets || num_buckets > PBX_DIGEST_MAX_BUCKETS) {
+		return GENERAL_EXCEPTION;
+	}
+	memset(digests, 0, num_buckets * sizeof(*digests));
+	cache_walk_own(event_type, eid, cache_digest_cb, &walk);
+	return NO_EXCEPTION;
+}
+
+/* re-encode the locally originated entries of the buckets in bucket_mask and hand them to callback */
+unsigned int pbx_cache_republish(enum ast_event_type event_type, unsigned int num_buckets, uint64_t bucket_mask, pbx_snapshot_cb_t callback, void *data)
+{
+	struct cache_walk walk = { .num_buckets = num_buckets, .bucket_mask = bucket_mask, .callback = callback, .data = data };
+
+	if (!num_buckets || num_buckets > PBX_DIGEST_MAX_BUCKETS) {
+		return 0;
+	}
+	cache_walk_own(event_type, &ast_eid_default, cache_republish_cb, &walk);
+	return walk.count;
+}
+
+unsigned int pbx_cache_identities(enum ast_event_type event_type, unsigned int num_buckets, uint64_t bucket_mask, pbx_identity_cb_t callback, void *data)
+{
+	struct cache_walk walk = { .num_buckets = num_buckets, .bucket_mask = bucket_mask, .identity_callback = callback, .data = data };
+
+	if (!num_buckets || num_buckets > PBX_DIGEST_MAX_BUCKETS) {
+		return 0;
+	}
+	cache_walk_own(event_type, &ast_eid_default, cache_identity_cb, &walk);
+	return walk.count;
+}
+
+/*
+ * Purge: asterisk 11 has no way to drop single cache entries, so the state of
+ * every entry is overwritten with the neutral one (device state invalid, the
+ * lowest rank and where the aggregate starts, so it changes nothing; unknown
+ * would still win over a peer's invalid. No messages waiting). The cache is
+ * locked while it is dumped, the identities are collected first.
+ */
+struct cache_purge {
+	unsigned int count;
+	unsigned int size;
+	char **strs;					/* device, or mailbox and context */
+	unsigned int num_buckets;
+	uint64_t bucket_mask;
+	pbx_identity_cb_t keep;				/* NULL = purge everything in the buckets */
+	void *data;
+};
+
+static void cache_purge_cb(const struct ast_event *event, void *data)
+{
+	struct cache_purge *purge = data;
+	const char *first, *second = NULL;
+	char **strs;
+	char buf[256];
+
+	if (!(purge->bucket_mask & (1ULL << (event_identity_hash(event) % purge->num_buckets)))) {
+		return;
+	}
+	if (purge->keep && purge->keep(ast_event_get_type(event), event_identity(event, buf, sizeof(buf)), purge->data)) {
+		return;
+	}
+
+	if (ast_event_get_type(event) == AST_EVENT_MWI) {
+		first = ast_event_get_ie_str(event, AST_EVENT_IE_MAILBOX);
+		second = ast_event_get_ie_str(event, AST_EVENT_IE_CONTEXT);
+	} else {
+		first = ast_event_get_ie_str(event, AST_EVENT_IE_DEVICE);
+	}
+	if (ast_strlen_zero(first)) {
+		return;
+	}
+	if (purge->count + 2 > purge->size) {
+		if (!(strs = ast_realloc(purge->strs, (purge->size + 64) * sizeof(char *)))) {
+			return;
+		}
+		purge->strs = strs;
+		purge->size += 64;
+	}
+	purge->strs[purge->count++] = ast_strdup(first);
+	purge->strs[purge->count++] = ast_strdup(S_OR(second, ""));
+}
+
+unsigned int pbx_cache_purge(enum ast_event_type event_type, const struct ast_eid *eid)
+{
+	return pbx_cache_purge_missing(event_type, eid, 1, 1, NULL, NULL);
+}
+
+unsigned int pbx_cache_purge_missing(enum ast_event_type event_type, const struct ast_eid *eid, unsigned int num_buckets, uint64_t bucket_mask, pbx_identity_cb_t keep, void *data)
+{
+	struct cache_purge purge = { .num_buckets = num_buckets, .bucket_mask = bucket_mask, .keep = keep, .data = data };
+	struct ast_event_sub *event_sub;
+	struct ast_event *event;
+	unsigned int i, purged = 0;
+
+	if ((event_type != AST_EVENT_DEVICE_STATE_CHANGE && event_type != AST_EVENT_MWI) || !num_buckets || num_buckets > PBX_DIGEST_MAX_BUCKETS) {
+		return 0;
+	}
+	if (!(event_sub = ast_event_subscribe_new(event_type, cache_purge_cb, &purge))) {
+		return 0;
+	}
+	ast_event_sub_append_ie_raw(event_sub, AST_EVENT_IE_EID, (void *) eid, sizeof(*eid));
+	ast_event_dump_cache(event_sub);
+	ast_event_sub_destroy(event_sub);
+
+	for (i = 0; i + 1 < purge.count; i += 2) {
+		if (!purge.strs[i] || !purge.strs[i + 1]) {
+			event = NULL;
+		} else if (event_type == AST_EVENT_MWI) {
+			event = ast_event_new(AST_EVENT_MWI,
+				AST_EVENT_IE_MAILBOX, AST_EVENT_IE_PLTYPE_STR, purge.strs[i],
+				AST_EVENT_IE_CONTEXT, AST_EVENT_IE_PLTYPE_STR, purge.strs[i + 1],
+				AST_EVENT_IE_NEWMSGS, AST_EVENT_IE_PLTYPE_UINT, 0,
+				AST_EVENT_IE_OLDMSGS, AST_EVENT_IE_PLTYPE_UINT, 0,
+				AST_EVENT_IE_EID, AST_EVENT_IE_PLTYPE_RAW, eid, sizeof(*eid),
+				AST_EVENT_IE_END);
+		} else {
+			event = ast_event_new(AST_EVENT_DEVICE_STATE_CHANGE,
+				AST_EVENT_IE_DEVICE, AST_EVENT_IE_PLTYPE_STR, purge.strs[i],
+				AST_EVENT_IE_STATE, AST_EVENT_IE_PLTYPE_UINT, AST_DEVICE_INVALID,
+				AST_EVENT_IE_EID, AST_EVENT_IE_PLTYPE_RAW, eid, sizeof(*eid),
+				AST_EVENT_IE_END);
+		}
+		if (event && !ast_event_queue_and_cache(event)) {
+			purged++;
+		} else if (event) {
+			ast_event_destroy(event);
+		}
+		ast_free(purge.strs[i]);
+		ast_free(purge.strs[i + 1]);
+	}
+	ast_free(purge.strs);
+	return purged;
+}
+
+/*
+ * Remote dump: everything cached from other servers, with literal names so it
+ * can be decoded without any intern table (local state file).
+ */
+static void cache_dump_remote_cb(const struct ast_event *event, void *data)
+{
+	struct cache_walk *walk = data;
+	const struct ast_eid *eid = ast_event_get_ie_raw(event, AST_EVENT_IE_EID);
+	scratch_arena_t *arena = scratch_arena_get();
+	size_t mark = scratch_used(arena);
+	char *msg;
+
+	if (!eid || !ast_eid_cmp(&ast_eid_default, eid)) {
+		return;
+	}
+	if ((msg = scratch_alloc(arena, MAX_JSON_BUFFERLEN)) && !event2json(msg, MAX_JSON_BUFFERLEN, event, FALSE)) {
+		walk->callback(ast_event_get_type(event), msg, strlen(msg), walk->data);
+		walk->count++;
+	}
+	scratch_rewind(arena, mark);
+}
+
+unsigned int pbx_cache_dump_remote(enum ast_event_type event_type, pbx_snapshot_cb_t callback, void *data)
+{
+	struct cache_walk walk = { 0 };
+	struct ast_event_sub *event_sub;
+
+	walk.callback = callback;
+	walk.data = data;
+	if (!(event_sub = ast_event_subscribe_new(event_type, cache_dump_remote_cb, &walk))) {
+		return 0;
+	}
+	ast_event_dump_cache(event_sub);
+	ast_event_sub_destroy(event_sub);
+	return walk.count;
+}
@@ -18,18 +18,22 @@
 
 ASTERISK_FILE_VERSION(__FILE__, "$Revision: 419592 $")
 #include <asterisk/module.h>
+#include <asterisk/astobj2.h>
+#include <asterisk/app.h>
 #include <asterisk/devicestate.h>
 #include <asterisk/event.h>
 #include <asterisk/event_defs.h>
 #include <asterisk/stasis.h>
 
 #include "../include/pbx_event_message_serializer.h"
+#include "../include/json_string.h"
+#include "../include/scratch_arena.h"
 #include "../include/shared.h"
 
 /*
  * declaration
  */
-static void ast_event_cb(const struct ast_event *event, void *data);
+static void stasis_cb(void *data, struct stasis_subscription *sub, struct stasis_message *smsg);
 
 /*
  * globals
@@ -40,7 +44,7 @@ struct pbx_event_map {
 	int ast_event_type;
 	const char *name;
 	struct stasis_subscription *sub;
-	pbx_subscription_callback_t *callback;
+	pbx_subscription_callback_t callback;
 };
 static pbx_event_map_t event_map[AST_EVENT_TOTAL] = {
 	[EVENT_MWI] =                 {.ast_event_type = AST_EVENT_MWI, .name = "mwi"},
@@ -49,57 +53,657 @@ static pbx_event_map_t event_map[AST_EVENT_TOTAL] = {
 	[EVENT_PING] =                {.ast_event_type = AST_EVENT_PING, .name = "ping"},
 };
 
+/* device name interning, disabled unless pbx_set_interning() installs a local table */
+static struct {
+	intern_table_t *local_table;
+	pbx_intern_announce_cb_t announce;
+	pbx_intern_miss_cb_t miss;
+} interning = {NULL, NULL, NULL};
+
+/* the members carried for device state / mwi, same names as the ast_event serializer */
+static const struct ie_map {
+	enum ast_event_ie_type ie_type;
+	const char *name;
+} ie_maps[] = {
+	{ AST_EVENT_IE_NEWMSGS,  "NewMessages" },
+	{ AST_EVENT_IE_OLDMSGS,  "OldMessages" },
+	{ AST_EVENT_IE_MAILBOX,  "Mailbox" },
+	{ AST_EVENT_IE_DEVICE,   "Device" },
+	{ AST_EVENT_IE_STATE,    "State" },
+	{ AST_EVENT_IE_CONTEXT,  "Context" },
+	{ AST_EVENT_IE_EID,      "EntityID" },
+	{ AST_EVENT_IE_CACHABLE, "Cachable" },
+};
+
+static const char *ie_type2str(enum ast_event_ie_type ie_type)
+{
+	unsigned int i;
+	for (i = 0; i < ARRAY_LEN(ie_maps); i++) {
+		if (ie_maps[i].ie_type == ie_type) {
+			return ie_maps[i].name;
+		}
+	}
+	return "";
+}
+
+static int str2ie_type(const char *str, enum ast_event_ie_type *ie_type)
+{
+	unsigned int i;
+	for (i = 0; i < ARRAY_LEN(ie_maps); i++) {
+		if (!strcasecmp(ie_maps[i].name, str)) {
+			*ie_type = ie_maps[i].ie_type;
+			return 0;
+		}
+	}
+	return -1;
+}
+
 /*
- * public 
+ * public
  */
-int pbx_subscribe(event_type_t event_type, pbx_subscription_callback *callback)
+exception_t pbx_subscribe(event_type_t event_type, pbx_subscription_callback_t callback)
 {
-/*	ast_rwlock_rdlock(&event_map_lock);
+	exception_t res = GENERAL_EXCEPTION;
+	log_verbose(2, "PBX: Enter (%s)\n", __PRETTY_FUNCTION__);
+	ast_rwlock_wrlock(&event_map_lock);
 	if (event_map[event_type].sub) {
-		pbx_unsubscribe(event_type);
+		res = EXISTS_EXCEPTION;
 	} else {
 		event_map[event_type].callback = callback;
-		event_map[event_type].sub = ast_event_subscribe_new(event_map[event_type].ast_event_type, ast_event_cb, &event_type);
+		if ((event_map[event_type].sub = pbx_stasis_subscribe(event_map[event_type].ast_event_type, stasis_cb, (void *) (intptr_t) event_type))) {
+			res = NO_EXCEPTION;
+		}
 	}
 	ast_rwlock_unlock(&event_map_lock);
-	return 0;*/
-	return -1;
+	log_verbose(2, "Redis: Exit %s%s\n", res ? ", Exception Occured: " : "", res ? exception2str[res].str : "");
+	return res;
 }
 
-int pbx_unsubscribe(event_type_t event_type)
+exception_t pbx_unsubscribe(event_type_t event_type)
 {
-/*	ast_rwlock_rdlock(&event_map_lock);
+	exception_t res = GENERAL_EXCEPTION;
+	ast_rwlock_wrlock(&event_map_lock);
 	if (!event_map[event_type].sub) {
 		// not subscribed error
 	} else {
-		event_map[event_type].sub = ast_event_unsubscribe((struct ast_event_sub *)event_map[event_type].sub);
+		event_map[event_type].sub = stasis_unsubscribe(event_map[event_type].sub);
 		event_map[event_type].callback = NULL;
+		res = NO_EXCEPTION;
 	}
 	ast_rwlock_unlock(&event_map_lock);
-	return 0;*/
-	return -1;
+	return res;
 }
 
-int pbx_publish(event_type_t event_type, char *jsonmsgbuffer, size_t buf_len)
+exception_t pbx_publish(event_type_t event_type, char *jsonmsgbuffer, size_t buf_len)
 {
-	return -1;
+	return json2stasis(event_map[event_type].ast_event_type, jsonmsgbuffer, NULL);
+}
+
+void pbx_set_interning(intern_table_t *local_table, pbx_intern_announce_cb_t announce, pbx_intern_miss_cb_t miss)
+{
+	ast_rwlock_wrlock(&event_map_lock);
+	interning.local_table = local_table;
+	interning.announce = announce;
+	interning.miss = miss;
+	ast_rwlock_unlock(&event_map_lock);
+}
+
+/*
+ * device state changes and mwi are the only stasis messages carried on the wire;
+ * aggregate device states (AST_EVENT_DEVICE_STATE) carry no eid and are never
+ * encoded, so there is nothing to subscribe to for them.
+ */
+struct stasis_subscription *pbx_stasis_subscribe(enum ast_event_type event_type, stasis_subscription_cb callback, void *data)
+{
+	switch (event_type) {
+		case AST_EVENT_DEVICE_STATE_CHANGE:
+			return stasis_subscribe(ast_device_state_topic_all(), callback, data);
+		case AST_EVENT_MWI:
+			return stasis_subscribe(ast_mwi_topic_all(), callback, data);
+		default:
+			return NULL;
+	}
 }
 
 /*
  * private
  */
-static void ast_event_cb(void *userdata, struct stasis_subscription *sub, struct stasis_message *smsg);
-	event_type_t event_type = (event_type_t)data;
-/*	char *jsonbuffer = NULL;
-	if (!(jsonbuffer = malloc(MAX_JSON_BUFFERLEN))) {
-		// malloc error
+static void stasis_cb(void *data, struct stasis_subscription *sub, struct stasis_message *smsg)
+{
+	event_type_t event_type = (event_type_t) (intptr_t) data;
+	enum ast_event_type ast_event_type;
+	scratch_arena_t *arena = scratch_arena_get();
+	char *jsonbuffer = NULL;
+
+	if (stasis_subscription_final_message(sub, smsg) || !event_map[event_type].callback) {
+		return;
+	}
+	if (!(jsonbuffer = scratch_alloc(arena, MAX_JSON_BUFFERLEN))) {
+		log_debug("PBX: Scratch Arena Exhausted\n");
+		return;
 	}
-	if (message2json(jsonbuffer, MAX_JSON_BUFFERLEN, event)) {
+	if (!stasis2json(jsonbuffer, MAX_JSON_BUFFERLEN, smsg, &ast_event_type)) {
 		event_map[event_type].callback(event_type, jsonbuffer);
+	}
+	scratch_reset(arena);
+}
+
+/* appends '"Name":"escaped",' or '"Name#":id,' when the string is interned */
+static exception_t append_str(char *msg, const size_t msg_len, size_t *curpos, enum ast_event_ie_type ie_type, const char *str, boolean_t internable)
+{
+	const char *name = ie_type2str(ie_type);
+	unsigned int intern_id = 0;
+	boolean_t added = FALSE;
+	size_t escaped_len = 0;
+	int len;
+
+	if (internable && interning.local_table && !intern_table_get_id(interning.local_table, str, &intern_id, &added)) {
+		if (added && interning.announce) {
+			/* announced before the event that uses it is published */
+			interning.announce(intern_id, str);
+		}
+		len = snprintf(msg + *curpos, msg_len - *curpos, "\"%s#\":%u,", name, intern_id);
 	} else {
-		// error
+		len = snprintf(msg + *curpos, msg_len - *curpos, "\"%s\":\"", name);
+		if (len < 0 || *curpos + len >= msg_len) {
+			return BUFFERSIZE_EXCEPTION;
+		}
+		*curpos += len;
+		if (json_escape(msg + *curpos, msg_len - *curpos, str, strlen(str), &escaped_len)) {
+			return BUFFERSIZE_EXCEPTION;
+		}
+		*curpos += escaped_len;
+		len = snprintf(msg + *curpos, msg_len - *curpos, "\",");
+	}
+	if (len < 0 || *curpos + len >= msg_len) {
+		return BUFFERSIZE_EXCEPTION;
+	}
+	*curpos += len;
+	return NO_EXCEPTION;
+}
+
+static exception_t append_uint(char *msg, const size_t msg_len, size_t *curpos, enum ast_event_ie_type ie_type, unsigned int value)
+{
+	int len = snprintf(msg + *curpos, msg_len - *curpos, "\"%s\":%u,", ie_type2str(ie_type), value);
+
+	if (len < 0 || *curpos + len >= msg_len) {
+		return BUFFERSIZE_EXCEPTION;
+	}
+	*curpos += len;
+	return NO_EXCEPTION;
+}
+
+static exception_t append_eid(char *msg, const size_t msg_len, size_t *curpos, const struct ast_eid *eid)
+{
+	char eid_str[32];
+	int len;
+
+	ast_eid_to_str(eid_str, sizeof(eid_str), (struct ast_eid *) eid);
+	len = snprintf(msg + *curpos, msg_len - *curpos, "\"%s\":\"%s\",", ie_type2str(AST_EVENT_IE_EID), eid_str);
+	if (len < 0 || *curpos + len >= msg_len) {
+		return BUFFERSIZE_EXCEPTION;
+	}
+	*curpos += len;
+	return NO_EXCEPTION;
+}
+
+/*
+ * stasis message to json, straight from the message payload.
+ * Only messages that originated on this server are encoded; aggregate device
+ * states (no eid) and states learned from other servers return EID_SELF_EXCEPTION
+ * (nothing to send), unsupported message types GENERAL_EXCEPTION.
+ */
+/* remote: encode messages of other servers only, with literal names; otherwise only our own, interned */
+static exception_t smsg2json(char *msg, const size_t msg_len, struct stasis_message *smsg, enum ast_event_type *event_type, boolean_t remote)
+{
+	exception_t res = NO_EXCEPTION;
+	size_t curpos = 1;
+
+	if (msg_len < 2) {
+		return BUFFERSIZE_EXCEPTION;
+	}
+	msg[0] = '{';
+	if (stasis_message_type(smsg) == ast_device_state_message_type()) {
+		struct ast_device_state_message *dev_state = stasis_message_data(smsg);
+
+		if (!dev_state->eid || (remote ? !ast_eid_cmp(&ast_eid_default, dev_state->eid) : ast_eid_cmp(&ast_eid_default, dev_state->eid))) {
+			return EID_SELF_EXCEPTION;
+		}
+		*event_type = AST_EVENT_DEVICE_STATE_CHANGE;
+		if ((res = append_str(msg, msg_len, &curpos, AST_EVENT_IE_DEVICE, dev_state->device, !remote)) ||
+		    (res = append_uint(msg, msg_len, &curpos, AST_EVENT_IE_STATE, dev_state->state))) {
+			return res;
+		}
+		curpos += snprintf(msg + curpos, msg_len - curpos, "\"statestr\":\"%s\",", ast_devstate_str(dev_state->state));
+		if (curpos >= msg_len ||
+		    (res = append_uint(msg, msg_len, &curpos, AST_EVENT_IE_CACHABLE, dev_state->cachable == AST_DEVSTATE_CACHABLE)) ||
+		    (res = append_eid(msg, msg_len, &curpos, dev_state->eid))) {
+			return res ? res : BUFFERSIZE_EXCEPTION;
+		}
+	} else if (stasis_message_type(smsg) == ast_mwi_state_type()) {
+		struct ast_mwi_state *mwi_state = stasis_message_data(smsg);
+		char *mailbox = ast_strdupa(mwi_state->uniqueid);
+		char *context = strchr(mailbox, '@');
+
+		if (remote ? !ast_eid_cmp(&ast_eid_default, &mwi_state->eid) : ast_eid_cmp(&ast_eid_default, &mwi_state->eid)) {
+			return EID_SELF_EXCEPTION;
+		}
+		*event_type = AST_EVENT_MWI;
+		if (context) {
+			*context++ = '\0';
+		}
+		if ((res = append_str(msg, msg_len, &curpos, AST_EVENT_IE_MAILBOX, mailbox, !remote)) ||
+		    (!ast_strlen_zero(context) && (res = append_str(msg, msg_len, &curpos, AST_EVENT_IE_CONTEXT, context, !remote))) ||
+		    (res = append_uint(msg, msg_len, &curpos, AST_EVENT_IE_NEWMSGS, mwi_state->new_msgs)) ||
+		    (res = append_uint(msg, msg_len, &curpos, AST_EVENT_IE_OLDMSGS, mwi_state->old_msgs)) ||
+		    (res = append_eid(msg, msg_len, &curpos, &mwi_state->eid))) {
+			return res;
+		}
+	} else {
+		return GENERAL_EXCEPTION;
+	}
+
+	// replace the last comma with '}' instead
+	msg[curpos - 1] = '}';
+	msg[curpos] = '\0';
+	ast_debug(1, "encoded string: '%s'\n", msg);
+	return NO_EXCEPTION;
+}
+
+exception_t stasis2json(char *msg, const size_t msg_len, struct stasis_message *smsg, enum ast_event_type *event_type)
+{
+	return smsg2json(msg, msg_len, smsg, event_type, FALSE);
+}
+
+/*
+ * json to stasis, publishes the decoded state on behalf of the originating server.
+ * prefix: when set, device / mailbox names not starting with it are dropped with
+ * FILTERED_EXCEPTION, the same inbound filter as the ast_event path.
+ */
+exception_t json2stasis(enum ast_event_type event_type, const char *msg, const char *prefix)
+{
+	exception_t res = DECODING_EXCEPTION;
+	char *cursor, *key, *value;
+	boolean_t is_string = FALSE;
+	enum ast_event_ie_type ie_type;
+	const char *strs[AST_EVENT_IE_TOTAL] = { NULL };
+	unsigned int interned[AST_EVENT_IE_TOTAL] = { 0 };
+	unsigned int new_msgs = 0, old_msgs = 0, state = AST_DEVICE_UNKNOWN, cachable = 0;
+	struct ast_eid eid = ast_eid_default;
+	boolean_t has_eid = FALSE;
+	size_t keylen;
+
+	if (!(cursor = scratch_strdup(scratch_arena_get(), msg))) {
+		return MALLOC_EXCEPTION;
+	}
+	while (!(res = json_next_member(&cursor, &key, &value, &is_string)) && key) {
+		keylen = strlen(key);
+		if (keylen > 1 && key[keylen - 1] == '#') {
+			key[keylen - 1] = '\0';
+			if (!str2ie_type(key, &ie_type)) {
+				interned[ie_type] = strtoul(value, NULL, 10);
+			}
+			continue;
+		}
+		if (str2ie_type(key, &ie_type)) {
+			continue;
+		}
+		switch (ie_type) {
+			case AST_EVENT_IE_EID:
+				if (ast_str_to_eid(&eid, value)) {
+					return DECODING_EXCEPTION;
+				}
+				if (!ast_eid_cmp(&ast_eid_default, &eid)) {
+					// Don't feed events back in that originated locally. Quit now.
+					return EID_SELF_EXCEPTION;
+				}
+				has_eid = TRUE;
+				break;
+			case AST_EVENT_IE_STATE:
+				state = atoi(value);
+				break;
+			case AST_EVENT_IE_CACHABLE:
+				cachable = atoi(value);
+				break;
+			case AST_EVENT_IE_NEWMSGS:
+				new_msgs = atoi(value);
+				break;
+			case AST_EVENT_IE_OLDMSGS:
+				old_msgs = atoi(value);
+				break;
+			case AST_EVENT_IE_DEVICE:
+			case AST_EVENT_IE_MAILBOX:
+			case AST_EVENT_IE_CONTEXT:
+				strs[ie_type] = value;
+				break;
+			default:
+				break;
+		}
+	}
+	if (res) {
+		ast_log(LOG_ERROR, "Malformed json message: '%s'\n", msg);
+		return res;
+	}
+
+	for (ie_type = 0; ie_type < AST_EVENT_IE_TOTAL; ie_type++) {
+		char eid_str[32];
+		char *str;
+		intern_table_t *remote_table;
+
+		if (!interned[ie_type]) {
+			continue;
+		}
+		ast_eid_to_str(eid_str, sizeof(eid_str), &eid);
+		if (!has_eid || !(str = scratch_alloc(scratch_arena_get(), INTERN_MAX_STRLEN))) {
+			return has_eid ? MALLOC_EXCEPTION : DECODING_EXCEPTION;
+		}
+		remote_table = intern_registry_get(eid_str, FALSE);
+		if (!remote_table || intern_table_copy(remote_table, interned[ie_type], str, INTERN_MAX_STRLEN)) {
+			ast_debug(1, "Unknown interned id %u from %s\n", interned[ie_type], eid_str);
+			if (interning.miss) {
+				interning.miss(eid_str);
+			}
+			return INTERN_MISS_EXCEPTION;
+		}
+		strs[ie_type] = str;
+	}
+
+	if (!ast_strlen_zero(prefix)) {
+		const char *name = strs[event_type == AST_EVENT_MWI ? AST_EVENT_IE_MAILBOX : AST_EVENT_IE_DEVICE];
+		if (name && strncmp(name, prefix, strlen(prefix))) {
+			return FILTERED_EXCEPTION;
+		}
+	}
+
+	switch (event_type) {
+		case AST_EVENT_DEVICE_STATE:
+		case AST_EVENT_DEVICE_STATE_CHANGE:
+			if (ast_strlen_zero(strs[AST_EVENT_IE_DEVICE])) {
+				return DECODING_EXCEPTION;
+			}
+			if (ast_publish_device_state_full(strs[AST_EVENT_IE_DEVICE], state, cachable ? AST_DEVSTATE_CACHABLE : AST_DEVSTATE_NOT_CACHABLE, &eid)) {
+				return GENERAL_EXCEPTION;
+			}
+			break;
+		case AST_EVENT_MWI:
+			if (ast_strlen_zero(strs[AST_EVENT_IE_MAILBOX])) {
+				return DECODING_EXCEPTION;
+			}
+			if (ast_publish_mwi_state_full(strs[AST_EVENT_IE_MAILBOX], S_OR(strs[AST_EVENT_IE_CONTEXT], ""), new_msgs, old_msgs, NULL, &eid)) {
+				return GENERAL_EXCEPTION;
+			}
+			break;
+		default:
+			return GENERAL_EXCEPTION;
+	}
+	return NO_EXCEPTION;
+}
+
+static int event_type2cache(enum ast_event_type event_type, struct stasis_cache **cache, struct stasis_message_type **type)
+{
+	switch (event_type) {
+		case AST_EVENT_DEVICE_STATE_CHANGE:
+			*cache = ast_device_state_cache();
+			*type = ast_device_state_message_type();
+			return 0;
+		case AST_EVENT_MWI:
+			*cache = ast_mwi_state_cache();
+			*type = ast_mwi_state_type();
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+static inline uint32_t digest_str(uint32_t hash, const char *str)
+{
+	while (str && *str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static inline uint32_t digest_uint(uint32_t hash, uint32_t value)
+{
+	hash ^= value;
+	hash *= 16777619u;
+	return hash;
+}
+
+/* identity hash (the bucket) and, when state is set, the entry hash including the state */
+static uint32_t smsg_digest(struct stasis_message *smsg, uint32_t *state)
+{
+	uint32_t hash = 2166136261u;
+
+	if (stasis_message_type(smsg) == ast_device_state_message_type()) {
+		struct ast_device_state_message *dev_state = stasis_message_data(smsg);
+		hash = digest_str(hash, dev_state->device);
+		if (state) {
+			*state = digest_uint(hash, dev_state->state);
+		}
+	} else if (stasis_message_type(smsg) == ast_mwi_state_type()) {
+		struct ast_mwi_state *mwi_state = stasis_message_data(smsg);
+		hash = digest_str(hash, mwi_state->uniqueid);
+		if (state) {
+			*state = digest_uint(digest_uint(hash, mwi_state->new_msgs), mwi_state->old_msgs);
+		}
+	} else if (state) {
+		*state = hash;
+	}
+	return hash;
+}
+
+/*
+ * Walk the locally originated entries of the stasis cache in the buckets of
+ * bucket_mask and hand them to callback one at a time, each encoded into the
+ * same arena buffer, so a snapshot of any size never needs more than one
+ * message worth of memory.
+ */
+static unsigned int cache_stream(enum ast_event_type event_type, unsigned int num_buckets, uint64_t bucket_mask, pbx_snapshot_cb_t callback, void *data)
+{
+	struct stasis_cache *cache;
+	struct stasis_message_type *type;
+	struct ao2_container *cached;
+	struct ao2_iterator iter;
+	struct stasis_message *smsg;
+	enum ast_event_type msg_event_type;
+	scratch_arena_t *arena = scratch_arena_get();
+	size_t mark = scratch_used(arena);
+	char *jsonbuffer;
+	unsigned int count = 0;
+
+	if (event_type2cache(event_type, &cache, &type)) {
+		return 0;
 	}
-	ast_free(jsonbuffer);*/
+	if (!(jsonbuffer = scratch_alloc(arena, MAX_JSON_BUFFERLEN))) {
+		return 0;
+	}
+	if (!(cached = stasis_cache_dump_by_eid(cache, type, &ast_eid_default))) {
+		scratch_rewind(arena, mark);
+		return 0;
+	}
+	iter = ao2_iterator_init(cached, 0);
+	for (; (smsg = ao2_iterator_next(&iter)); ao2_ref(smsg, -1)) {
+		if (num_buckets > 1 && !(bucket_mask & (1ULL << (smsg_digest(smsg, NULL) % num_buckets)))) {
+			continue;
+		}
+		if (!stasis2json(jsonbuffer, MAX_JSON_BUFFERLEN, smsg, &msg_event_type)) {
+			callback(msg_event_type, jsonbuffer, strlen(jsonbuffer), data);
+			count++;
+		}
+	}
+	ao2_iterator_destroy(&iter);
+	ao2_ref(cached, -1);
+	scratch_rewind(arena, mark);
+	ast_debug(1, "Streamed %u cached %s messages\n", count, event_map[event_type].name);
+	return count;
 }
 
-#endif
\ No newline at end of file
+/* initial sync: the whole locally originated cache */
+unsigned int pbx_stream_cache_snapshot(enum ast_event_type event_type, pbx_snapshot_cb_t callback, void *data)
+{
+	return cache_stream(event_type, 1, 1, callback, data);
+}
+
+unsigned int pbx_cache_republish(enum ast_event_type event_type, unsigned int num_buckets, uint64_t bucket_mask, pbx_snapshot_cb_t callback, void *data)
+{
+	if (!num_buckets || num_buckets > PBX_DIGEST_MAX_BUCKETS) {
+		return 0;
+	}
+	return cache_stream(event_type, num_buckets, bucket_mask, callback, data);
+}
+
+/*
+ * Cache digest
+ */
+/* identity of the entry as the inbound prefix filter sees it: the device, or mailbox@context */
+static const char *smsg_name(struct stasis_message *smsg)
+{
+	if (stasis_message_type(smsg) == ast_device_state_message_type()) {
+		return ((struct ast_device_state_message *) stasis_message_data(smsg))->device;
+	} else if (stasis_message_type(smsg) == ast_mwi_state_type()) {
+		return ((struct ast_mwi_state *) stasis_message_data(smsg))->uniqueid;
+	}
+	return NULL;
+}
+
+exception_t pbx_cache_digest(enum ast_event_type event_type, const struct ast_eid *eid, const char *prefix, unsigned int num_buckets, pbx_digest_t *digests)
+{
+	struct stasis_cache *cache;
+	struct stasis_message_type *type;
+	struct ao2_container *cached;
+	struct ao2_iterator iter;
+	struct stasis_message *smsg;
+	pbx_digest_t *digest;
+	const char *name;
+	uint32_t entry;
+
+	if (!num_buckets || num_buckets > PBX_DIGEST_MAX_BUCKETS) {
+		return GENERAL_EXCEPTION;
+	}
+	memset(digests, 0, num_buckets * sizeof(*digests));
+	if (event_type2cache(event_type, &cache, &type)) {
+		return NO_EXCEPTION;
+	}
+	if (!(cached = stasis_cache_dump_by_eid(cache, type, eid))) {
+		return MALLOC_EXCEPTION;
+	}
+	iter = ao2_iterator_init(cached, 0);
+	for (; (smsg = ao2_iterator_next(&iter)); ao2_ref(smsg, -1)) {
+		if (!ast_strlen_zero(prefix) && (!(name = smsg_name(smsg)) || strncmp(name, prefix, strlen(prefix)))) {
+			continue;
+		}
+		digest = &digests[smsg_digest(smsg, &entry) % num_buckets];
+		digest->hash += entry;
+		digest->count++;
+	}
+	ao2_iterator_destroy(&iter);
+	ao2_ref(cached, -1);
+	return NO_EXCEPTION;
+}
+
+unsigned int pbx_cache_identities(enum ast_event_type event_type, unsigned int num_buckets, uint64_t bucket_mask, pbx_identity_cb_t callback, void *data)
+{
+	struct stasis_cache *cache;
+	struct stasis_message_type *type;
+	struct ao2_container *cached;
+	struct ao2_iterator iter;
+	struct stasis_message *smsg;
+	const char *name;
+	unsigned int count = 0;
+
+	if (!num_buckets || num_buckets > PBX_DIGEST_MAX_BUCKETS || event_type2cache(event_type, &cache, &type)) {
+		return 0;
+	}
+	if (!(cached = stasis_cache_dump_by_eid(cache, type, &ast_eid_default))) {
+		return 0;
+	}
+	iter = ao2_iterator_init(cached, 0);
+	for (; (smsg = ao2_iterator_next(&iter)); ao2_ref(smsg, -1)) {
+		if ((bucket_mask & (1ULL << (smsg_digest(smsg, NULL) % num_buckets))) && (name = smsg_name(smsg))) {
+			callback(event_type, name, data);
+			count++;
+		}
+	}
+	ao2_iterator_destroy(&iter);
+	ao2_ref(cached, -1);
+	return count;
+}
+
+/*
+ * Purge: publish a cache clear for every entry the origin contributed, the
+ * device state aggregate is recalculated without it.
+ */
+unsigned int pbx_cache_purge(enum ast_event_type event_type, const struct ast_eid *eid)
+{
+	return pbx_cache_purge_missing(event_type, eid, 1, 1, NULL, NULL);
+}
+
+unsigned int pbx_cache_purge_missing(enum ast_event_type event_type, const struct ast_eid *eid, unsigned int num_buckets, uint64_t bucket_mask, pbx_identity_cb_t keep, void *data)
+{
+	struct stasis_cache *cache;
+	struct stasis_message_type *type;
+	struct stasis_topic *topic;
+	struct ao2_container *cached;
+	struct ao2_iterator iter;
+	struct stasis_message *smsg, *clear;
+	unsigned int purged = 0;
+
+	if (!num_buckets || num_buckets > PBX_DIGEST_MAX_BUCKETS || event_type2cache(event_type, &cache, &type)) {
+		return 0;
+	}
+	topic = (event_type == AST_EVENT_MWI) ? ast_mwi_topic_all() : ast_device_state_topic_all();
+	if (!(cached = stasis_cache_dump_by_eid(cache, type, eid))) {
+		return 0;
+	}
+	iter = ao2_iterator_init(cached, 0);
+	for (; (smsg = ao2_iterator_next(&iter)); ao2_ref(smsg, -1)) {
+		if (!(bucket_mask & (1ULL << (smsg_digest(smsg, NULL) % num_buckets))) || (keep && keep(event_type, smsg_name(smsg), data))) {
+			continue;
+		}
+		if ((clear = stasis_cache_clear_create(smsg))) {
+			stasis_publish(topic, clear);
+			ao2_ref(clear, -1);
+			purged++;
+		}
+	}
+	ao2_iterator_destroy(&iter);
+	ao2_ref(cached, -1);
+	return purged;
+}
+
+/* everything cached from other servers, with literal names (local state file) */
+unsigned int pbx_cache_dump_remote(enum ast_event_type event_type, pbx_snapshot_cb_t callback, void *data)
+{
+	struct stasis_cache *cache;
+	struct stasis_message_type *type;
+	struct ao2_container *cached;
+	struct ao2_iterator iter;
+	struct stasis_message *smsg;
+	enum ast_event_type msg_event_type;
+	scratch_arena_t *arena = scratch_arena_get();
+	size_t mark = scratch_used(arena);
+	char *jsonbuffer;
+	unsigned int count = 0;
+
+	if (event_type2cache(event_type, &cache, &type) || !(jsonbuffer = scratch_alloc(arena, MAX_JSON_BUFFERLEN))) {
+		return 0;
+	}
+	if (!(cached = stasis_cache_dump_all(cache, type))) {
+		scratch_rewind(arena, mark);
+		return 0;
+	}
+	iter = ao2_iterator_init(cached, 0);
+	for (; (smsg = ao2_iterator_next(&iter)); ao2_ref(smsg, -1)) {
+		if (!smsg2json(jsonbuffer, MAX_JSON_BUFFERLEN, smsg, &msg_event_type, TRUE)) {
+			callback(msg_event_type, jsonbuffer, strlen(jsonbuffer), data);
+			count++;
+		}
+	}
+	ao2_iterator_destroy(&iter);
+	ao2_ref(cached, -1);
+	scratch_rewind(arena, mark);
+	return count;
+}
+#endif
@@ -0,0 +1,113 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../include/bloom_filter.h"
+#include "../include/shared.h"
+
+/*
+ * declarations
+ */
+struct bloom_filter {
+	uint64_t num_bits;
+	unsigned int num_hashes;
+	unsigned int count;
+	uint8_t *bits;
+};
+
+/*
+ * private
+ */
+static inline uint64_t bloom_hash(const char *str)
+{
+	uint64_t hash = 14695981039346656037ull;	/* FNV-1a 64 */
+	while (*str) {
+		hash ^= (unsigned char) *str++;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+/* double hashing: bit i is h1 + i * h2 */
+#define BLOOM_FOREACH_BIT(filter, key, bit, i)							\
+	uint64_t _hash = bloom_hash(key);							\
+	uint64_t _h1 = (uint32_t) _hash, _h2 = (_hash >> 32) | 1;				\
+	for (i = 0, bit = _h1 % (filter)->num_bits; i < (filter)->num_hashes;			\
+		i++, bit = (_h1 + i * _h2) % (filter)->num_bits)
+
+/*
+ * public
+ */
+bloom_filter_t *bloom_filter_new(unsigned int entries, unsigned int bits_per_entry)
+{
+	bloom_filter_t *filter;
+
+	if (!entries || !bits_per_entry || !(filter = calloc(1, sizeof(*filter)))) {
+		return NULL;
+	}
+	filter->num_bits = ((uint64_t) entries * bits_per_entry + 7) & ~7ull;
+	/* k = ln 2 * m / n */
+	filter->num_hashes = (bits_per_entry * 693 + 500) / 1000;
+	if (!filter->num_hashes) {
+		filter->num_hashes = 1;
+	}
+	if (!(filter->bits = calloc(filter->num_bits / 8, 1))) {
+		free(filter);
+		return NULL;
+	}
+	return filter;
+}
+
+void bloom_filter_destroy(bloom_filter_t *filter)
+{
+	if (filter) {
+		free(filter->bits);
+		free(filter);
+	}
+}
+
+void bloom_filter_add(bloom_filter_t *filter, const char *key)
+{
+	uint64_t bit;
+	unsigned int i;
+
+	BLOOM_FOREACH_BIT(filter, key, bit, i) {
+		filter->bits[bit >> 3] |= 1 << (bit & 7);
+	}
+	filter->count++;
+}
+
+int bloom_filter_check(const bloom_filter_t *filter, const char *key)
+{
+	uint64_t bit;
+	unsigned int i;
+
+	BLOOM_FOREACH_BIT(filter, key, bit, i) {
+		if (!(filter->bits[bit >> 3] & (1 << (bit & 7)))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void bloom_filter_clear(bloom_filter_t *filter)
+{
+	memset(filter->bits, 0, filter->num_bits / 8);
+	filter->count = 0;
+}
+
+unsigned int bloom_filter_count(const bloom_filter_t *filter)
+{
+	return filter->count;
+}
@@ -0,0 +1,288 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../include/conn_pool.h"
+#include "../include/shared.h"
+
+/*
+ * declarations
+ */
+typedef struct conn_slot {
+	void *conn;					/* NULL when free */
+	unsigned int generation;
+} conn_slot_t;
+
+struct conn_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t released;
+	unsigned int max;
+	unsigned int wait_ms;
+	unsigned int open;				/* includes connections being created */
+	unsigned int num_idle;
+	void **idle;					/* stack, most recently used on top */
+	conn_slot_t *slots;				/* every open connection */
+	unsigned int generation;
+	int draining;					/* acquire fails at once */
+	conn_pool_create_cb_t create;
+	conn_pool_destroy_cb_t destroy;
+	void *data;
+	unsigned long acquired;
+	unsigned long waited;
+	unsigned long timeouts;
+	unsigned long failed;
+};
+
+/*
+ * private
+ */
+static void deadline_after(struct timespec *ts, unsigned int ms)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long) (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/* pool locked */
+static conn_slot_t *slot_find(conn_pool_t *pool, void *conn)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->max; i++) {
+		if (pool->slots[i].conn == conn) {
+			return &pool->slots[i];
+		}
+	}
+	return NULL;
+}
+
+/* pool locked, returns a copy of the idle stack the caller destroys outside the lock */
+static void **idle_take(conn_pool_t *pool, unsigned int *num_idle)
+{
+	void **idle;
+	unsigned int i;
+	conn_slot_t *slot;
+
+	*num_idle = pool->num_idle;
+	if (!pool->num_idle || !(idle = malloc(pool->num_idle * sizeof(void *)))) {
+		*num_idle = 0;
+		return NULL;
+	}
+	memcpy(idle, pool->idle, pool->num_idle * sizeof(void *));
+	for (i = 0; i < pool->num_idle; i++) {
+		if ((slot = slot_find(pool, idle[i]))) {
+			slot->conn = NULL;
+		}
+	}
+	pool->open -= pool->num_idle;
+	pool->num_idle = 0;
+	pthread_cond_broadcast(&pool->released);
+	return idle;
+}
+
+static void idle_destroy(conn_pool_t *pool, void **idle, unsigned int num_idle)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_idle; i++) {
+		pool->destroy(idle[i], pool->data);
+	}
+	free(idle);
+}
+
+/*
+ * public
+ */
+conn_pool_t *conn_pool_new(unsigned int max, unsigned int wait_ms, conn_pool_create_cb_t create, conn_pool_destroy_cb_t destroy, void *data)
+{
+	conn_pool_t *pool;
+
+	if (!max || !create || !destroy || !(pool = calloc(1, sizeof(*pool)))) {
+		return NULL;
+	}
+	if (!(pool->idle = calloc(max, sizeof(void *))) || !(pool->slots = calloc(max, sizeof(conn_slot_t)))) {
+		free(pool->idle);
+		free(pool);
+		return NULL;
+	}
+	pool->max = max;
+	pool->wait_ms = wait_ms;
+	pool->create = create;
+	pool->destroy = destroy;
+	pool->data = data;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->released, NULL);
+	return pool;
+}
+
+/* all connections must have been released */
+void conn_pool_destroy(conn_pool_t *pool)
+{
+	if (!pool) {
+		return;
+	}
+	conn_pool_flush(pool);
+	pthread_cond_destroy(&pool->released);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->idle);
+	free(pool->slots);
+	free(pool);
+}
+
+void *conn_pool_acquire(conn_pool_t *pool)
+{
+	struct timespec deadline;
+	int waiting = 0;
+	unsigned int generation;
+	conn_slot_t *slot;
+	void *conn;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->draining || (!pool->num_idle && pool->open >= pool->max)) {
+		if (pool->draining) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		if (!waiting) {
+			deadline_after(&deadline, pool->wait_ms);
+			pool->waited++;
+			waiting = 1;
+		}
+		if (pthread_cond_timedwait(&pool->released, &pool->lock, &deadline) == ETIMEDOUT && !pool->num_idle && pool->open >= pool->max) {
+			pool->timeouts++;
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+	}
+	if (pool->num_idle) {
+		conn = pool->idle[--pool->num_idle];
+		pool->acquired++;
+		pthread_mutex_unlock(&pool->lock);
+		return conn;
+	}
+	/* reserve the slot, connect outside the lock */
+	pool->open++;
+	generation = pool->generation;
+	pthread_mutex_unlock(&pool->lock);
+
+	conn = pool->create(pool->data);
+
+	pthread_mutex_lock(&pool->lock);
+	if (conn) {
+		/* a slot is free: open counts this connection and never exceeds max */
+		slot = slot_find(pool, NULL);
+		slot->conn = conn;
+		slot->generation = generation;
+		pool->acquired++;
+	} else {
+		pool->open--;
+		pool->failed++;
+		pthread_cond_signal(&pool->released);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return conn;
+}
+
+void conn_pool_release(conn_pool_t *pool, void *conn, int broken)
+{
+	conn_slot_t *slot;
+
+	if (!conn) {
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	slot = slot_find(pool, conn);
+	if (!broken && slot && slot->generation == pool->generation && pool->num_idle < pool->max) {
+		pool->idle[pool->num_idle++] = conn;
+		conn = NULL;
+	} else {
+		if (slot) {
+			slot->conn = NULL;
+		}
+		pool->open--;
+	}
+	pthread_cond_signal(&pool->released);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (conn) {
+		pool->destroy(conn, pool->data);
+	}
+}
+
+void conn_pool_flush(conn_pool_t *pool)
+{
+	void **idle;
+	unsigned int num_idle;
+
+	pthread_mutex_lock(&pool->lock);
+	idle = idle_take(pool, &num_idle);
+	pthread_mutex_unlock(&pool->lock);
+	idle_destroy(pool, idle, num_idle);
+}
+
+void conn_pool_invalidate(conn_pool_t *pool)
+{
+	void **idle;
+	unsigned int num_idle;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->generation++;
+	idle = idle_take(pool, &num_idle);
+	pthread_mutex_unlock(&pool->lock);
+	idle_destroy(pool, idle, num_idle);
+}
+
+int conn_pool_drain(conn_pool_t *pool, unsigned int wait_ms)
+{
+	struct timespec deadline;
+	void **idle;
+	unsigned int num_idle;
+	int res = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->draining = 1;
+	/* waiting acquires give up, so every release wakes us */
+	pthread_cond_broadcast(&pool->released);
+	deadline_after(&deadline, wait_ms);
+	while (pool->open > pool->num_idle) {
+		if (pthread_cond_timedwait(&pool->released, &pool->lock, &deadline) == ETIMEDOUT && pool->open > pool->num_idle) {
+			pool->draining = 0;
+			res = -1;
+			break;
+		}
+	}
+	idle = idle_take(pool, &num_idle);
+	pthread_mutex_unlock(&pool->lock);
+	idle_destroy(pool, idle, num_idle);
+	return res;
+}
+
+void conn_pool_stats(conn_pool_t *pool, conn_pool_stats_t *stats)
+{
+	pthread_mutex_lock(&pool->lock);
+	stats->max = pool->max;
+	stats->open = pool->open;
+	stats->idle = pool->num_idle;
+	stats->acquired = pool->acquired;
+	stats->waited = pool->waited;
+	stats->timeouts = pool->timeouts;
+	stats->failed = pool->failed;
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,359 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "../include/device_lru.h"
+#include "../include/shared.h"
+
+/*
+ * declarations
+ */
+typedef struct device_origin {
+	char eid_str[32];
+	int state;
+} device_origin_t;
+
+typedef struct device_entry device_entry_t;
+struct device_entry {
+	char device[DEVICE_LRU_MAX_NAME];
+	int state;					/* aggregate */
+	unsigned int num_origins;
+	device_origin_t origins[DEVICE_LRU_MAX_ORIGINS];
+	boolean_t pinned;				/* asked for again while cached */
+	device_entry_t *hash_next;
+	device_entry_t *prev;				/* towards most recent */
+	device_entry_t *next;				/* towards least recent */
+};
+
+struct device_lru {
+	pthread_mutex_t lock;
+	device_lru_aggregate_t aggregate;
+	unsigned int capacity;
+	unsigned int count;
+	unsigned int bucket_mask;
+	device_entry_t **buckets;
+	device_entry_t *head;				/* most recent */
+	device_entry_t *tail;				/* least recent */
+};
+
+/*
+ * private
+ */
+static inline uint32_t device_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;			/* FNV-1a, device names compare case insensitive */
+	while (*str) {
+		hash ^= (unsigned char) tolower((unsigned char) *str++);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static device_entry_t *device_find(device_lru_t *lru, const char *device)
+{
+	device_entry_t *entry;
+
+	for (entry = lru->buckets[device_hash(device) & lru->bucket_mask]; entry; entry = entry->hash_next) {
+		if (!strcasecmp(entry->device, device)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void device_unlink(device_lru_t *lru, device_entry_t *entry)
+{
+	device_entry_t **pp;
+
+	for (pp = &lru->buckets[device_hash(entry->device) & lru->bucket_mask]; *pp; pp = &(*pp)->hash_next) {
+		if (*pp == entry) {
+			*pp = entry->hash_next;
+			break;
+		}
+	}
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		lru->head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		lru->tail = entry->prev;
+	}
+	lru->count--;
+}
+
+static void device_touch(device_lru_t *lru, device_entry_t *entry)
+{
+	if (lru->head == entry) {
+		return;
+	}
+	entry->prev->next = entry->next;
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		lru->tail = entry->prev;
+	}
+	entry->prev = NULL;
+	entry->next = lru->head;
+	lru->head->prev = entry;
+	lru->head = entry;
+}
+
+static int device_aggregate(device_lru_t *lru, device_entry_t *entry)
+{
+	int states[DEVICE_LRU_MAX_ORIGINS];
+	unsigned int i;
+
+	for (i = 0; i < entry->num_origins; i++) {
+		states[i] = entry->origins[i].state;
+	}
+	return lru->aggregate(states, entry->num_origins);
+}
+
+/*
+ * public
+ */
+device_lru_t *device_lru_new(unsigned int capacity, device_lru_aggregate_t aggregate)
+{
+	device_lru_t *lru;
+	unsigned int buckets = 16;
+
+	if (!capacity || !aggregate) {
+		return NULL;
+	}
+	if (!(lru = calloc(1, sizeof(*lru)))) {
+		return NULL;
+	}
+	while (buckets < capacity) {
+		buckets <<= 1;
+	}
+	if (!(lru->buckets = calloc(buckets, sizeof(device_entry_t *)))) {
+		free(lru);
+		return NULL;
+	}
+	lru->bucket_mask = buckets - 1;
+	lru->capacity = capacity;
+	lru->aggregate = aggregate;
+	pthread_mutex_init(&lru->lock, NULL);
+	return lru;
+}
+
+void device_lru_destroy(device_lru_t *lru)
+{
+	if (!lru) {
+		return;
+	}
+	device_lru_clear(lru, NULL, NULL);
+	pthread_mutex_destroy(&lru->lock);
+	free(lru->buckets);
+	free(lru);
+}
+
+unsigned int device_lru_count(device_lru_t *lru)
+{
+	unsigned int count;
+
+	pthread_mutex_lock(&lru->lock);
+	count = lru->count;
+	pthread_mutex_unlock(&lru->lock);
+	return count;
+}
+
+/* returns 0 and the aggregate when the device is cached (it becomes the most recent and pinned), -1 otherwise */
+int device_lru_get(device_lru_t *lru, const char *device, int *state)
+{
+	device_entry_t *entry;
+	int res = -1;
+
+	pthread_mutex_lock(&lru->lock);
+	if ((entry = device_find(lru, device))) {
+		device_touch(lru, entry);
+		entry->pinned = TRUE;
+		*state = entry->state;
+		res = 0;
+	}
+	pthread_mutex_unlock(&lru->lock);
+	return res;
+}
+
+/* evicted is set to "" unless the least recent unpinned entry had to make room */
+exception_t device_lru_add(device_lru_t *lru, const char *device, char *evicted, size_t evicted_len)
+{
+	device_entry_t *entry;
+	exception_t res = NO_EXCEPTION;
+
+	if (evicted && evicted_len) {
+		evicted[0] = '\0';
+	}
+	if (strlen(device) >= DEVICE_LRU_MAX_NAME) {
+		return BUFFERSIZE_EXCEPTION;
+	}
+	pthread_mutex_lock(&lru->lock);
+	if ((entry = device_find(lru, device))) {
+		device_touch(lru, entry);
+		res = EXISTS_EXCEPTION;
+		goto exit;
+	}
+	if (lru->count >= lru->capacity) {
+		/* all pinned: grow past capacity rather than drop a watched device */
+		entry = lru->tail;
+		while (entry && entry->pinned) {
+			entry = entry->prev;
+		}
+	}
+	if (entry) {
+		device_unlink(lru, entry);
+		if (evicted && evicted_len) {
+			snprintf(evicted, evicted_len, "%s", entry->device);
+		}
+		memset(entry, 0, sizeof(*entry));
+	} else if (!(entry = calloc(1, sizeof(*entry)))) {
+		res = MALLOC_EXCEPTION;
+		goto exit;
+	}
+	strcpy(entry->device, device);
+	entry->state = lru->aggregate(NULL, 0);
+	entry->hash_next = lru->buckets[device_hash(device) & lru->bucket_mask];
+	lru->buckets[device_hash(device) & lru->bucket_mask] = entry;
+	entry->next = lru->head;
+	if (lru->head) {
+		lru->head->prev = entry;
+	} else {
+		lru->tail = entry;
+	}
+	lru->head = entry;
+	lru->count++;
+exit:
+	pthread_mutex_unlock(&lru->lock);
+	return res;
+}
+
+/* store the state origin reports for a cached device, returns TRUE when the aggregate changed */
+boolean_t device_lru_update(device_lru_t *lru, const char *device, const char *origin, int state, int *aggregate)
+{
+	device_entry_t *entry;
+	boolean_t changed = FALSE;
+	unsigned int i;
+	int new_state;
+
+	pthread_mutex_lock(&lru->lock);
+	if (!(entry = device_find(lru, device))) {
+		goto exit;
+	}
+	for (i = 0; i < entry->num_origins; i++) {
+		if (!strcasecmp(entry->origins[i].eid_str, origin)) {
+			break;
+		}
+	}
+	if (i == entry->num_origins) {
+		if (i == DEVICE_LRU_MAX_ORIGINS) {
+			goto exit;
+		}
+		snprintf(entry->origins[i].eid_str, sizeof(entry->origins[i].eid_str), "%s", origin);
+		entry->num_origins++;
+	}
+	entry->origins[i].state = state;
+	new_state = device_aggregate(lru, entry);
+	changed = (new_state != entry->state) ? TRUE : FALSE;
+	entry->state = new_state;
+	if (aggregate) {
+		*aggregate = new_state;
+	}
+exit:
+	pthread_mutex_unlock(&lru->lock);
+	return changed;
+}
+
+void device_lru_remove(device_lru_t *lru, const char *device)
+{
+	device_entry_t *entry;
+
+	pthread_mutex_lock(&lru->lock);
+	if ((entry = device_find(lru, device))) {
+		device_unlink(lru, entry);
+		free(entry);
+	}
+	pthread_mutex_unlock(&lru->lock);
+}
+
+/* drop what origin reported from every entry, cb gets each device whose aggregate changed */
+unsigned int device_lru_forget_origin(device_lru_t *lru, const char *origin, void (*cb)(const char *device, int state, void *data), void *data)
+{
+	device_entry_t *entry;
+	unsigned int i, count = 0;
+	int new_state;
+
+	pthread_mutex_lock(&lru->lock);
+	for (entry = lru->head; entry; entry = entry->next) {
+		for (i = 0; i < entry->num_origins; i++) {
+			if (!strcasecmp(entry->origins[i].eid_str, origin)) {
+				break;
+			}
+		}
+		if (i == entry->num_origins) {
+			continue;
+		}
+		memmove(&entry->origins[i], &entry->origins[i + 1], (entry->num_origins - i - 1) * sizeof(device_origin_t));
+		entry->num_origins--;
+		count++;
+		new_state = device_aggregate(lru, entry);
+		if (new_state != entry->state) {
+			entry->state = new_state;
+			if (cb) {
+				cb(entry->device, new_state, data);
+			}
+		}
+	}
+	pthread_mutex_unlock(&lru->lock);
+	return count;
+}
+
+/* most recent first */
+unsigned int device_lru_list(device_lru_t *lru, void (*cb)(const char *device, void *data), void *data)
+{
+	device_entry_t *entry;
+	unsigned int count = 0;
+
+	pthread_mutex_lock(&lru->lock);
+	for (entry = lru->head; entry; entry = entry->next) {
+		cb(entry->device, data);
+		count++;
+	}
+	pthread_mutex_unlock(&lru->lock);
+	return count;
+}
+
+void device_lru_clear(device_lru_t *lru, void (*cb)(const char *device, void *data), void *data)
+{
+	device_entry_t *entry;
+
+	pthread_mutex_lock(&lru->lock);
+	while ((entry = lru->head)) {
+		lru->head = entry->next;
+		if (cb) {
+			cb(entry->device, data);
+		}
+		free(entry);
+	}
+	lru->tail = NULL;
+	lru->count = 0;
+	memset(lru->buckets, 0, (lru->bucket_mask + 1) * sizeof(device_entry_t *));
+	pthread_mutex_unlock(&lru->lock);
+}
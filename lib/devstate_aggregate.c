@@ -0,0 +1,67 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include "../include/devstate_aggregate.h"
+
+#define _STR(...) #__VA_ARGS__
+#define STR(...) _STR(__VA_ARGS__)
+
+/*
+ * globals
+ */
+static const int ranks[] = { DEVSTATE_AGGREGATE_RANKS };
+
+const char devstate_aggregate_script[] =
+	"if ARGV[2] == '' then "
+	"  redis.call('HDEL', KEYS[1], ARGV[1]) "
+	"  redis.call('SREM', KEYS[3], ARGV[6]) "
+	"else "
+	"  redis.call('HSET', KEYS[1], ARGV[1], ARGV[2]) "
+	"  redis.call('SADD', KEYS[3], ARGV[6]) "
+	"end "
+	"local order = {[0] = " STR(DEVSTATE_AGGREGATE_RANKS) "} "
+	"local agg, ringing, inuse = 4, false, false "
+	"for _, v in ipairs(redis.call('HVALS', KEYS[1])) do "
+	"  local s = tonumber(v) "
+	"  if s == 6 then ringing = true elseif s == 2 or s == 3 or s == 8 then inuse = true end "
+	"  if ringing and inuse then agg = 7 elseif order[s] and order[s] > order[agg] then agg = s end "
+	"end "
+	"if redis.call('GET', KEYS[2]) == tostring(agg) then return 0 end "
+	"redis.call('SET', KEYS[2], agg) "
+	"redis.call('PUBLISH', ARGV[3], ARGV[4] .. agg .. ARGV[5]) "
+	"return 1";
+
+/*
+ * public
+ */
+int devstate_aggregate(const int *states, unsigned int count)
+{
+	int agg = 4, ringing = 0, inuse = 0, s;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		s = states[i];
+		if (s < 0 || s > DEVSTATE_AGGREGATE_MAX_STATE) {
+			continue;
+		}
+		if (s == 6) {
+			ringing = 1;
+		} else if (s == 2 || s == 3 || s == 8) {
+			inuse = 1;
+		}
+		if (ringing && inuse) {
+			agg = 7;
+		} else if (ranks[s] > ranks[agg]) {
+			agg = s;
+		}
+	}
+	return agg;
+}
@@ -0,0 +1,177 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../include/dump_queue.h"
+#include "../include/shared.h"
+
+/*
+ * declarations
+ */
+struct dump_queue {
+	pthread_mutex_t lock;
+	dump_entry_t *head;
+	dump_entry_t *tail;
+	unsigned int len;
+};
+
+/*
+ * private
+ */
+/* called with the queue locked */
+static void dump_queue_unlink(dump_queue_t *queue, dump_entry_t *entry, dump_entry_t *prev)
+{
+	if (prev) {
+		prev->next = entry->next;
+	} else {
+		queue->head = entry->next;
+	}
+	if (queue->tail == entry) {
+		queue->tail = prev;
+	}
+	queue->len--;
+}
+
+/*
+ * public
+ */
+dump_queue_t *dump_queue_new(void)
+{
+	dump_queue_t *queue;
+
+	if (!(queue = calloc(1, sizeof(*queue)))) {
+		return NULL;
+	}
+	pthread_mutex_init(&queue->lock, NULL);
+	return queue;
+}
+
+void dump_queue_destroy(dump_queue_t *queue)
+{
+	if (!queue) {
+		return;
+	}
+	dump_queue_clear(queue, FALSE);
+	pthread_mutex_destroy(&queue->lock);
+	free(queue);
+}
+
+unsigned int dump_queue_len(dump_queue_t *queue)
+{
+	unsigned int len;
+
+	pthread_mutex_lock(&queue->lock);
+	len = queue->len;
+	pthread_mutex_unlock(&queue->lock);
+	return len;
+}
+
+exception_t dump_queue_push(dump_queue_t *queue, unsigned int type, boolean_t dump, const char *field, const char *msg, size_t len)
+{
+	dump_entry_t *entry;
+	size_t field_len = field ? strlen(field) : 0;
+
+	if (!(entry = malloc(sizeof(*entry) + len + 1 + field_len + 1))) {
+		return MALLOC_EXCEPTION;
+	}
+	entry->type = type;
+	entry->dump = dump;
+	entry->len = len;
+	entry->next = NULL;
+	memcpy(entry->msg, msg, len);
+	entry->msg[len] = '\0';
+	entry->field = entry->msg + len + 1;
+	memcpy(entry->msg + len + 1, field ? field : "", field_len + 1);
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->tail) {
+		queue->tail->next = entry;
+	} else {
+		queue->head = entry;
+	}
+	queue->tail = entry;
+	queue->len++;
+	pthread_mutex_unlock(&queue->lock);
+	return NO_EXCEPTION;
+}
+
+boolean_t dump_queue_supersede(dump_queue_t *queue, unsigned int type, const char *field)
+{
+	dump_entry_t *entry, *prev = NULL;
+	boolean_t found = FALSE;
+
+	if (!field || !*field) {
+		return FALSE;
+	}
+	pthread_mutex_lock(&queue->lock);
+	for (entry = queue->head; entry; prev = entry, entry = entry->next) {
+		if (entry->type == type && !strcmp(entry->field, field)) {
+			dump_queue_unlink(queue, entry, prev);
+			free(entry);
+			found = TRUE;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return found;
+}
+
+unsigned int dump_queue_clear(dump_queue_t *queue, boolean_t dump_only)
+{
+	dump_entry_t *entry, *next, *prev = NULL;
+	unsigned int count = 0;
+
+	pthread_mutex_lock(&queue->lock);
+	for (entry = queue->head; entry; entry = next) {
+		next = entry->next;
+		if (dump_only && !entry->dump) {
+			prev = entry;
+			continue;
+		}
+		dump_queue_unlink(queue, entry, prev);
+		free(entry);
+		count++;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return count;
+}
+
+dump_entry_t *dump_queue_pop(dump_queue_t *queue)
+{
+	dump_entry_t *entry;
+
+	pthread_mutex_lock(&queue->lock);
+	if ((entry = queue->head)) {
+		dump_queue_unlink(queue, entry, NULL);
+		entry->next = NULL;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return entry;
+}
+
+void dump_queue_entry_free(dump_entry_t *entry)
+{
+	free(entry);
+}
+
+size_t dump_queue_lane_budget(size_t realtime_bytes, unsigned int bulk_share, size_t idle_burst)
+{
+	if (!realtime_bytes) {
+		return idle_burst;
+	}
+	if (bulk_share >= 100) {
+		return (size_t) -1;
+	}
+	return realtime_bytes * bulk_share / (100 - bulk_share);
+}
@@ -0,0 +1,195 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/event_batch.h"
+#include "../include/shared.h"
+
+/*
+ * private
+ */
+static inline char *skip_ws(char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+		p++;
+	}
+	return p;
+}
+
+/* p points at '{', returns the position just past the matching '}' or NULL */
+static char *skip_object(char *p)
+{
+	unsigned int depth = 0;
+
+	while (*p) {
+		switch (*p) {
+			case '{':
+			case '[':
+				depth++;
+				p++;
+				break;
+			case '}':
+			case ']':
+				p++;
+				if (!--depth) {
+					return p;
+				}
+				break;
+			case '"':
+				for (p++; *p != '"'; p++) {
+					if (!*p) {
+						return NULL;
+					}
+					if (*p == '\\' && p[1]) {
+						p++;
+					}
+				}
+				p++;
+				break;
+			default:
+				p++;
+				break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * public
+ */
+exception_t event_batch_init(event_batch_t *batch, size_t size)
+{
+	memset(batch, 0, sizeof(*batch));
+	if (size < 3 || !(batch->buf = malloc(size))) {
+		return MALLOC_EXCEPTION;
+	}
+	batch->size = size;
+	event_batch_reset(batch);
+	return NO_EXCEPTION;
+}
+
+void event_batch_free(event_batch_t *batch)
+{
+	free(batch->buf);
+	memset(batch, 0, sizeof(*batch));
+}
+
+void event_batch_reset(event_batch_t *batch)
+{
+	batch->buf[0] = '[';
+	batch->len = 1;
+	batch->count = 0;
+}
+
+exception_t event_batch_append(event_batch_t *batch, const char *type_name, const char *msg, size_t msg_len)
+{
+	size_t name_len = strlen(type_name);
+	size_t needed = (batch->count ? 1 : 0) + 2 + name_len + 2 + msg_len + 1;
+
+	if (!name_len || name_len >= EVENT_BATCH_MAX_TYPE_NAME || !msg_len || msg[0] != '{') {
+		return GENERAL_EXCEPTION;
+	}
+	/* keep room for the closing "]\0" */
+	if (batch->len + needed + 2 > batch->size) {
+		return BUFFERSIZE_EXCEPTION;
+	}
+	if (batch->count) {
+		batch->buf[batch->len++] = ',';
+	}
+	batch->buf[batch->len++] = '[';
+	batch->buf[batch->len++] = '"';
+	memcpy(batch->buf + batch->len, type_name, name_len);
+	batch->len += name_len;
+	batch->buf[batch->len++] = '"';
+	batch->buf[batch->len++] = ',';
+	memcpy(batch->buf + batch->len, msg, msg_len);
+	batch->len += msg_len;
+	batch->buf[batch->len++] = ']';
+	batch->count++;
+	return NO_EXCEPTION;
+}
+
+/* returns the NUL-terminated payload; the batch stays valid until the next reset */
+const char *event_batch_finish(event_batch_t *batch, size_t *len)
+{
+	batch->buf[batch->len] = ']';
+	batch->buf[batch->len + 1] = '\0';
+	if (len) {
+		*len = batch->len + 1;
+	}
+	return batch->buf;
+}
+
+/* returns a cursor for event_batch_next when payload is a batch, NULL for a single event */
+char *event_batch_open(char *payload)
+{
+	char *p = skip_ws(payload);
+
+	if (*p != '[') {
+		return NULL;
+	}
+	p = skip_ws(p + 1);
+	return (*p == '[' || *p == ']') ? p : NULL;
+}
+
+exception_t event_batch_next(char **cursor, char **type_name, char **msg)
+{
+	char *p = skip_ws(*cursor);
+	char *end;
+
+	*type_name = NULL;
+	*msg = NULL;
+	if (*p == ',') {
+		p = skip_ws(p + 1);
+	}
+	if (*p == ']' || *p == '\0') {
+		*cursor = p;
+		return NO_EXCEPTION;
+	}
+	if (*p != '[') {
+		return DECODING_EXCEPTION;
+	}
+	p = skip_ws(p + 1);
+	if (*p != '"') {
+		return DECODING_EXCEPTION;
+	}
+	*type_name = ++p;
+	while (*p && *p != '"' && *p != '\\') {
+		p++;
+	}
+	if (*p != '"' || p == *type_name) {
+		*type_name = NULL;
+		return DECODING_EXCEPTION;
+	}
+	*p = '\0';
+	p = skip_ws(p + 1);
+	if (*p != ',') {
+		*type_name = NULL;
+		return DECODING_EXCEPTION;
+	}
+	p = skip_ws(p + 1);
+	if (*p != '{' || !(end = skip_object(p))) {
+		*type_name = NULL;
+		return DECODING_EXCEPTION;
+	}
+	*msg = p;
+	p = skip_ws(end);
+	if (*p != ']') {
+		*type_name = NULL;
+		*msg = NULL;
+		return DECODING_EXCEPTION;
+	}
+	*end = '\0';
+	*cursor = p + 1;
+	return NO_EXCEPTION;
+}
@@ -0,0 +1,323 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "../include/intern_table.h"
+#include "../include/shared.h"
+
+/*
+ * declarations
+ */
+typedef struct intern_slot {
+	uint32_t hash;
+	unsigned int id;				/* 0 = empty */
+} intern_slot_t;
+
+struct intern_table {
+	pthread_rwlock_t lock;
+	unsigned int max_entries;
+	unsigned int count;
+	unsigned int next_id;
+	unsigned int epoch;
+	char **strings;					/* id -> string, index 0 unused */
+	intern_slot_t *slots;				/* string -> id, only for reverse lookup tables */
+	unsigned int slot_mask;
+};
+
+typedef struct intern_registry_entry intern_registry_entry_t;
+struct intern_registry_entry {
+	char eid_str[32];
+	intern_table_t *table;
+	intern_registry_entry_t *next;
+};
+
+/*
+ * globals
+ */
+static pthread_rwlock_t intern_registry_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static intern_registry_entry_t *intern_registry_root = NULL;
+
+/*
+ * private
+ */
+static inline uint32_t intern_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;			/* FNV-1a */
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * public
+ */
+intern_table_t *intern_table_new(unsigned int max_entries, boolean_t reverse_lookup)
+{
+	intern_table_t *table;
+	unsigned int slots = 16;
+
+	if (!max_entries || max_entries > INTERN_MAX_ENTRIES) {
+		max_entries = INTERN_MAX_ENTRIES;
+	}
+	if (!(table = calloc(1, sizeof(*table)))) {
+		return NULL;
+	}
+	if (!(table->strings = calloc(max_entries + 1, sizeof(char *)))) {
+		free(table);
+		return NULL;
+	}
+	if (reverse_lookup) {
+		while (slots < max_entries * 2) {
+			slots <<= 1;
+		}
+		if (!(table->slots = calloc(slots, sizeof(intern_slot_t)))) {
+			free(table->strings);
+			free(table);
+			return NULL;
+		}
+		table->slot_mask = slots - 1;
+	}
+	table->max_entries = max_entries;
+	table->next_id = 1;
+	pthread_rwlock_init(&table->lock, NULL);
+	return table;
+}
+
+void intern_table_clear(intern_table_t *table)
+{
+	unsigned int id;
+
+	pthread_rwlock_wrlock(&table->lock);
+	for (id = 1; id <= table->max_entries; id++) {
+		if (table->strings[id]) {
+			free(table->strings[id]);
+			table->strings[id] = NULL;
+		}
+	}
+	if (table->slots) {
+		memset(table->slots, 0, (table->slot_mask + 1) * sizeof(intern_slot_t));
+	}
+	table->count = 0;
+	table->next_id = 1;
+	pthread_rwlock_unlock(&table->lock);
+}
+
+void intern_table_reset(intern_table_t *table, unsigned int epoch)
+{
+	intern_table_clear(table);
+	pthread_rwlock_wrlock(&table->lock);
+	table->epoch = epoch & 0xffff;
+	pthread_rwlock_unlock(&table->lock);
+}
+
+unsigned int intern_table_epoch(intern_table_t *table)
+{
+	unsigned int epoch;
+	pthread_rwlock_rdlock(&table->lock);
+	epoch = table->epoch;
+	pthread_rwlock_unlock(&table->lock);
+	return epoch;
+}
+
+void intern_table_destroy(intern_table_t *table)
+{
+	if (!table) {
+		return;
+	}
+	intern_table_clear(table);
+	pthread_rwlock_destroy(&table->lock);
+	free(table->slots);
+	free(table->strings);
+	free(table);
+}
+
+unsigned int intern_table_count(intern_table_t *table)
+{
+	unsigned int count;
+	pthread_rwlock_rdlock(&table->lock);
+	count = table->count;
+	pthread_rwlock_unlock(&table->lock);
+	return count;
+}
+
+/* sender side: look the string up, assigning the next free id when it is new */
+exception_t intern_table_get_id(intern_table_t *table, const char *str, unsigned int *id, boolean_t *added)
+{
+	uint32_t hash = intern_hash(str);
+	unsigned int pos;
+	exception_t res = GENERAL_EXCEPTION;
+
+	*added = FALSE;
+	if (!table->slots || strlen(str) >= INTERN_MAX_STRLEN) {
+		return res;
+	}
+
+	pthread_rwlock_rdlock(&table->lock);
+	for (pos = hash & table->slot_mask; table->slots[pos].id; pos = (pos + 1) & table->slot_mask) {
+		if (table->slots[pos].hash == hash && !strcmp(table->strings[table->slots[pos].id], str)) {
+			*id = (table->epoch << 16) | table->slots[pos].id;
+			pthread_rwlock_unlock(&table->lock);
+			return NO_EXCEPTION;
+		}
+	}
+	pthread_rwlock_unlock(&table->lock);
+
+	pthread_rwlock_wrlock(&table->lock);
+	/* re-probe, somebody might have added it in between */
+	for (pos = hash & table->slot_mask; table->slots[pos].id; pos = (pos + 1) & table->slot_mask) {
+		if (table->slots[pos].hash == hash && !strcmp(table->strings[table->slots[pos].id], str)) {
+			*id = (table->epoch << 16) | table->slots[pos].id;
+			res = NO_EXCEPTION;
+			goto exit;
+		}
+	}
+	if (table->next_id > table->max_entries) {
+		res = BUFFERSIZE_EXCEPTION;
+		goto exit;
+	}
+	if (!(table->strings[table->next_id] = strdup(str))) {
+		res = MALLOC_EXCEPTION;
+		goto exit;
+	}
+	table->slots[pos].hash = hash;
+	table->slots[pos].id = table->next_id;
+	*id = (table->epoch << 16) | table->next_id++;
+	*added = TRUE;
+	table->count++;
+	res = NO_EXCEPTION;
+exit:
+	pthread_rwlock_unlock(&table->lock);
+	return res;
+}
+
+/* receiver side: store the mapping announced by the origin */
+exception_t intern_table_set(intern_table_t *table, unsigned int id, const char *str)
+{
+	unsigned int epoch = INTERN_EPOCH(id);
+	char *dup;
+
+	id = INTERN_INDEX(id);
+	if (!id || id > table->max_entries || strlen(str) >= INTERN_MAX_STRLEN) {
+		return DECODING_EXCEPTION;
+	}
+	if (!(dup = strdup(str))) {
+		return MALLOC_EXCEPTION;
+	}
+	pthread_rwlock_wrlock(&table->lock);
+	if (epoch != table->epoch) {
+		pthread_rwlock_unlock(&table->lock);
+		free(dup);
+		return EXISTS_EXCEPTION;
+	}
+	if (table->strings[id]) {
+		free(table->strings[id]);
+	} else {
+		table->count++;
+	}
+	table->strings[id] = dup;
+	pthread_rwlock_unlock(&table->lock);
+	return NO_EXCEPTION;
+}
+
+/* copy (under lock) because a re-announcement may replace the string */
+exception_t intern_table_copy(intern_table_t *table, unsigned int id, char *buf, size_t buf_len)
+{
+	unsigned int epoch = INTERN_EPOCH(id);
+	exception_t res = EXISTS_EXCEPTION;
+
+	id = INTERN_INDEX(id);
+	if (!id || id > table->max_entries) {
+		return DECODING_EXCEPTION;
+	}
+	pthread_rwlock_rdlock(&table->lock);
+	if (epoch == table->epoch && table->strings[id]) {
+		size_t len = strlen(table->strings[id]);
+		if (len < buf_len) {
+			memcpy(buf, table->strings[id], len + 1);
+			res = NO_EXCEPTION;
+		} else {
+			res = BUFFERSIZE_EXCEPTION;
+		}
+	}
+	pthread_rwlock_unlock(&table->lock);
+	return res;
+}
+
+intern_table_t *intern_registry_get(const char *eid_str, boolean_t create)
+{
+	intern_registry_entry_t *entry;
+	intern_table_t *table = NULL;
+
+	pthread_rwlock_rdlock(&intern_registry_rwlock);
+	for (entry = intern_registry_root; entry; entry = entry->next) {
+		if (!strcasecmp(entry->eid_str, eid_str)) {
+			table = entry->table;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&intern_registry_rwlock);
+	if (table || !create) {
+		return table;
+	}
+
+	pthread_rwlock_wrlock(&intern_registry_rwlock);
+	for (entry = intern_registry_root; entry; entry = entry->next) {
+		if (!strcasecmp(entry->eid_str, eid_str)) {
+			table = entry->table;
+			goto exit;
+		}
+	}
+	if (!(entry = calloc(1, sizeof(*entry)))) {
+		goto exit;
+	}
+	if (!(entry->table = intern_table_new(INTERN_MAX_ENTRIES, FALSE))) {
+		free(entry);
+		goto exit;
+	}
+	strncpy(entry->eid_str, eid_str, sizeof(entry->eid_str) - 1);
+	entry->next = intern_registry_root;
+	intern_registry_root = entry;
+	table = entry->table;
+exit:
+	pthread_rwlock_unlock(&intern_registry_rwlock);
+	return table;
+}
+
+void intern_registry_list(void (*cb)(const char *eid_str, unsigned int count, void *data), void *data)
+{
+	intern_registry_entry_t *entry;
+
+	pthread_rwlock_rdlock(&intern_registry_rwlock);
+	for (entry = intern_registry_root; entry; entry = entry->next) {
+		cb(entry->eid_str, intern_table_count(entry->table), data);
+	}
+	pthread_rwlock_unlock(&intern_registry_rwlock);
+}
+
+void intern_registry_destroy_all(void)
+{
+	intern_registry_entry_t *entry;
+
+	pthread_rwlock_wrlock(&intern_registry_rwlock);
+	while ((entry = intern_registry_root)) {
+		intern_registry_root = entry->next;
+		intern_table_destroy(entry->table);
+		free(entry);
+	}
+	pthread_rwlock_unlock(&intern_registry_rwlock);
+}
@@ -0,0 +1,435 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#define HAVE_JSON_SIMD 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+#include "../include/json_string.h"
+#include "../include/shared.h"
+
+/*
+ * declarations
+ */
+typedef size_t (*find_special_fn_t)(const char *str, size_t len);
+static size_t find_special_resolve(const char *str, size_t len);
+
+/*
+ * globals
+ */
+static find_special_fn_t find_special = find_special_resolve;
+static json_kernel_t active_kernel = JSON_KERNEL_AUTO;
+
+static struct {
+	const char *str;
+} kernel2str[] = {
+	[JSON_KERNEL_AUTO] = {"auto"},
+	[JSON_KERNEL_SCALAR] = {"scalar"},
+	[JSON_KERNEL_SSE2] = {"sse2"},
+	[JSON_KERNEL_AVX2] = {"avx2"},
+};
+
+/*
+ * kernels: return the index of the first '"', '\\' or control character,
+ * or len when there is none
+ */
+static inline int is_special(unsigned char c)
+{
+	return c == '"' || c == '\\' || c < 0x20;
+}
+
+static size_t find_special_scalar(const char *str, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len && !is_special(str[i]); i++);
+	return i;
+}
+
+#ifdef HAVE_JSON_SIMD
+/* inlined into both kernels, so the avx2 tail loop stays VEX encoded */
+static inline __attribute__((always_inline)) size_t find_special_16(const char *str, size_t len)
+{
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i control = _mm_set1_epi8(0x1f);
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+		/* unsigned chunk <= 0x1f  <=>  max(chunk, 0x1f) == 0x1f */
+		__m128i hits = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+			_mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+		int mask = _mm_movemask_epi8(hits);
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	for (; i < len && !is_special(str[i]); i++);
+	return i;
+}
+
+static size_t find_special_sse2(const char *str, size_t len)
+{
+	return find_special_16(str, len);
+}
+
+__attribute__((target("avx2")))
+static size_t find_special_avx2(const char *str, size_t len)
+{
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i backslash = _mm256_set1_epi8('\\');
+	const __m256i control = _mm256_set1_epi8(0x1f);
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)(str + i));
+		__m256i hits = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash)),
+			_mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control), control));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(hits);
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + find_special_16(str + i, len - i);
+}
+#endif
+
+static size_t find_special_resolve(const char *str, size_t len)
+{
+	json_string_set_kernel(JSON_KERNEL_AUTO);
+	return find_special(str, len);
+}
+
+/*
+ * public
+ */
+json_kernel_t json_string_set_kernel(json_kernel_t kernel)
+{
+#ifdef HAVE_JSON_SIMD
+	/*
+	 * AUTO is SSE2: wire strings are short, and on them the wider AVX2 loop
+	 * lost to SSE2 in bench_json_string (its tail always goes through the
+	 * 16 byte kernel anyway). AVX2 stays available when asked for.
+	 */
+	if (kernel == JSON_KERNEL_AUTO) {
+		kernel = JSON_KERNEL_SSE2;
+	} else if (kernel == JSON_KERNEL_AVX2) {
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("avx2")) {
+			kernel = JSON_KERNEL_SSE2;
+		}
+	}
+	switch (kernel) {
+		case JSON_KERNEL_AVX2:
+			find_special = find_special_avx2;
+			break;
+		case JSON_KERNEL_SSE2:
+			find_special = find_special_sse2;
+			break;
+		default:
+			kernel = JSON_KERNEL_SCALAR;
+			find_special = find_special_scalar;
+	}
+#else
+	kernel = JSON_KERNEL_SCALAR;
+	find_special = find_special_scalar;
+#endif
+	active_kernel = kernel;
+	return kernel;
+}
+
+const char *json_kernel2str(json_kernel_t kernel)
+{
+	if (kernel > JSON_KERNEL_AVX2) {
+		return "unknown";
+	}
+	return kernel2str[kernel == JSON_KERNEL_AUTO ? active_kernel : kernel].str;
+}
+
+size_t json_string_find_special(const char *str, size_t len)
+{
+	return find_special(str, len);
+}
+
+exception_t json_escape(char *dst, size_t dst_len, const char *src, size_t src_len, size_t *out_len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t in = 0, out = 0, run;
+
+	while (in < src_len) {
+		run = find_special(src + in, src_len - in);
+		if (out + run >= dst_len) {
+			return BUFFERSIZE_EXCEPTION;
+		}
+		memcpy(dst + out, src + in, run);
+		out += run;
+		in += run;
+		if (in == src_len) {
+			break;
+		}
+
+		unsigned char c = src[in++];
+		char esc = 0;
+		switch (c) {
+			case '"':  esc = '"'; break;
+			case '\\': esc = '\\'; break;
+			case '\b': esc = 'b'; break;
+			case '\f': esc = 'f'; break;
+			case '\n': esc = 'n'; break;
+			case '\r': esc = 'r'; break;
+			case '\t': esc = 't'; break;
+		}
+		if (esc) {
+			if (out + 2 >= dst_len) {
+				return BUFFERSIZE_EXCEPTION;
+			}
+			dst[out++] = '\\';
+			dst[out++] = esc;
+		} else {
+			if (out + 6 >= dst_len) {
+				return BUFFERSIZE_EXCEPTION;
+			}
+			memcpy(dst + out, "\\u00", 4);
+			dst[out + 4] = hex[c >> 4];
+			dst[out + 5] = hex[c & 0xf];
+			out += 6;
+		}
+	}
+	if (out >= dst_len) {
+		return BUFFERSIZE_EXCEPTION;
+	}
+	dst[out] = '\0';
+	if (out_len) {
+		*out_len = out;
+	}
+	return NO_EXCEPTION;
+}
+
+static int hex4(const char *src, unsigned int *value)
+{
+	int i;
+	*value = 0;
+	for (i = 0; i < 4; i++) {
+		char c = src[i];
+		*value <<= 4;
+		if (c >= '0' && c <= '9') {
+			*value |= c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			*value |= c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			*value |= c - 'A' + 10;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* dst may be NULL (validate only) or equal to src (unescape in place) */
+static exception_t unescape_internal(char *dst, size_t dst_len, const char *src, size_t src_len, size_t *out_len)
+{
+	size_t in = 0, out = 0, run;
+
+	while (in < src_len) {
+		run = find_special(src + in, src_len - in);
+		if (dst) {
+			if (out + run >= dst_len) {
+				return BUFFERSIZE_EXCEPTION;
+			}
+			memmove(dst + out, src + in, run);
+		}
+		out += run;
+		in += run;
+		if (in == src_len) {
+			break;
+		}
+		/* only escape sequences may follow; a bare '"' or control character is invalid */
+		if (src[in] != '\\' || in + 1 >= src_len) {
+			return DECODING_EXCEPTION;
+		}
+		in++;
+
+		char utf8[4];
+		size_t utf8_len = 1;
+		unsigned int cp;
+		switch (src[in++]) {
+			case '"':  utf8[0] = '"'; break;
+			case '\\': utf8[0] = '\\'; break;
+			case '/':  utf8[0] = '/'; break;
+			case 'b':  utf8[0] = '\b'; break;
+			case 'f':  utf8[0] = '\f'; break;
+			case 'n':  utf8[0] = '\n'; break;
+			case 'r':  utf8[0] = '\r'; break;
+			case 't':  utf8[0] = '\t'; break;
+			case 'u':
+				if (in + 4 > src_len || hex4(src + in, &cp)) {
+					return DECODING_EXCEPTION;
+				}
+				in += 4;
+				if (cp >= 0xd800 && cp <= 0xdbff) {
+					unsigned int low;
+					if (in + 6 > src_len || src[in] != '\\' || src[in + 1] != 'u' || hex4(src + in + 2, &low) || low < 0xdc00 || low > 0xdfff) {
+						return DECODING_EXCEPTION;
+					}
+					in += 6;
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+				} else if (cp >= 0xdc00 && cp <= 0xdfff) {
+					return DECODING_EXCEPTION;
+				}
+				if (cp < 0x80) {
+					utf8[0] = cp;
+				} else if (cp < 0x800) {
+					utf8[0] = 0xc0 | (cp >> 6);
+					utf8[1] = 0x80 | (cp & 0x3f);
+					utf8_len = 2;
+				} else if (cp < 0x10000) {
+					utf8[0] = 0xe0 | (cp >> 12);
+					utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+					utf8[2] = 0x80 | (cp & 0x3f);
+					utf8_len = 3;
+				} else {
+					utf8[0] = 0xf0 | (cp >> 18);
+					utf8[1] = 0x80 | ((cp >> 12) & 0x3f);
+					utf8[2] = 0x80 | ((cp >> 6) & 0x3f);
+					utf8[3] = 0x80 | (cp & 0x3f);
+					utf8_len = 4;
+				}
+				break;
+			default:
+				return DECODING_EXCEPTION;
+		}
+		if (dst) {
+			if (out + utf8_len >= dst_len) {
+				return BUFFERSIZE_EXCEPTION;
+			}
+			memcpy(dst + out, utf8, utf8_len);
+		}
+		out += utf8_len;
+	}
+	if (dst) {
+		if (out >= dst_len) {
+			return BUFFERSIZE_EXCEPTION;
+		}
+		dst[out] = '\0';
+	}
+	if (out_len) {
+		*out_len = out;
+	}
+	return NO_EXCEPTION;
+}
+
+exception_t json_unescape(char *dst, size_t dst_len, const char *src, size_t src_len, size_t *out_len)
+{
+	return unescape_internal(dst, dst_len, src, src_len, out_len);
+}
+
+boolean_t json_validate_string(const char *src, size_t len)
+{
+	return unescape_internal(NULL, 0, src, len, NULL) ? FALSE : TRUE;
+}
+
+static inline char *skip_ws(char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+		p++;
+	}
+	return p;
+}
+
+/* parse the string starting after the opening quote, unescaping it in place */
+static exception_t parse_string(char **cursor, char **str)
+{
+	char *start = *cursor;
+	size_t len = strlen(start);
+	size_t i = 0;
+
+	for (;;) {
+		i += find_special(start + i, len - i);
+		if (i >= len || (unsigned char)start[i] < 0x20) {
+			return DECODING_EXCEPTION;
+		}
+		if (start[i] == '"') {
+			break;
+		}
+		/* backslash: skip the escaped character; \uXXXX digits are never special */
+		i += 2;
+		if (i > len) {
+			return DECODING_EXCEPTION;
+		}
+	}
+	*cursor = start + i + 1;
+	*str = start;
+	return unescape_internal(start, i + 1, start, i, NULL);
+}
+
+/*
+ * Walk the members of a flat json object, e.g. {"Device":"SIP/1000","State":2}.
+ * The buffer is modified in place: keys and values are unescaped and NUL
+ * terminated where they are, so no copies are made. At the end of the object
+ * *key is set to NULL.
+ */
+exception_t json_next_member(char **cursor, char **key, char **value, boolean_t *is_string)
+{
+	char *p = skip_ws(*cursor);
+	exception_t res;
+
+	*key = NULL;
+	*value = NULL;
+	if (*p == '{' || *p == ',') {
+		p = skip_ws(p + 1);
+	}
+	if (*p == '}' || *p == '\0') {
+		*cursor = p;
+		return NO_EXCEPTION;
+	}
+	if (*p != '"') {
+		return DECODING_EXCEPTION;
+	}
+	p++;
+	if ((res = parse_string(&p, key))) {
+		return res;
+	}
+	p = skip_ws(p);
+	if (*p != ':') {
+		return DECODING_EXCEPTION;
+	}
+	p = skip_ws(p + 1);
+	if (*p == '"') {
+		p++;
+		if ((res = parse_string(&p, value))) {
+			return res;
+		}
+		*is_string = TRUE;
+	} else {
+		*value = p;
+		while (*p && *p != ',' && *p != '}' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+			p++;
+		}
+		if (p == *value) {
+			return DECODING_EXCEPTION;
+		}
+		if (*p == ',' || *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+			*p++ = '\0';
+		} else if (*p == '}') {
+			*p = '\0';
+		}
+		*is_string = FALSE;
+	}
+	*cursor = p;
+	return NO_EXCEPTION;
+}
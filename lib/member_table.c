@@ -0,0 +1,159 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "../include/member_table.h"
+#include "../include/shared.h"
+
+/*
+ * declarations
+ */
+typedef struct member member_t;
+struct member {
+	member_info_t info;
+	member_t *next;
+};
+
+struct member_table {
+	pthread_mutex_t lock;
+	member_t *root;
+};
+
+/*
+ * private
+ */
+static member_t *member_find(member_table_t *table, const char *eid_str)
+{
+	member_t *member;
+
+	for (member = table->root; member; member = member->next) {
+		if (!strcasecmp(member->info.eid_str, eid_str)) {
+			return member;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * public
+ */
+member_table_t *member_table_new(void)
+{
+	member_table_t *table;
+
+	if (!(table = calloc(1, sizeof(*table)))) {
+		return NULL;
+	}
+	pthread_mutex_init(&table->lock, NULL);
+	return table;
+}
+
+void member_table_destroy(member_table_t *table)
+{
+	member_t *member;
+
+	if (!table) {
+		return;
+	}
+	while ((member = table->root)) {
+		table->root = member->next;
+		free(member);
+	}
+	pthread_mutex_destroy(&table->lock);
+	free(table);
+}
+
+/* returns TRUE when the heartbeat comes from a member not seen before */
+boolean_t member_table_heartbeat(member_table_t *table, const member_info_t *beat, int64_t now)
+{
+	member_t *member;
+	boolean_t added = FALSE;
+	uint32_t delta;
+
+	pthread_mutex_lock(&table->lock);
+	if (!(member = member_find(table, beat->eid_str))) {
+		if (!(member = calloc(1, sizeof(*member)))) {
+			goto exit;
+		}
+		snprintf(member->info.eid_str, sizeof(member->info.eid_str), "%s", beat->eid_str);
+		member->info.first_seen = now;
+		member->next = table->root;
+		table->root = member;
+		added = TRUE;
+	} else {
+		/* a restarted member starts counting again, only count forward gaps */
+		delta = beat->seq - member->info.seq;
+		if (delta > 1 && delta < UINT32_MAX / 2) {
+			member->info.missed += delta - 1;
+		}
+	}
+	member->info.seq = beat->seq;
+	member->info.last_seen = now;
+	member->info.rtt = beat->rtt;
+	member->info.load = beat->load;
+	member->info.events = beat->events;
+exit:
+	pthread_mutex_unlock(&table->lock);
+	return added;
+}
+
+int member_table_get(member_table_t *table, const char *eid_str, member_info_t *info)
+{
+	member_t *member;
+
+	pthread_mutex_lock(&table->lock);
+	if ((member = member_find(table, eid_str))) {
+		*info = member->info;
+	}
+	pthread_mutex_unlock(&table->lock);
+	return member ? 0 : -1;
+}
+
+unsigned int member_table_expire(member_table_t *table, int64_t now, int64_t timeout, member_table_cb_t cb, void *data)
+{
+	member_t **link, *member;
+	unsigned int expired = 0;
+
+	pthread_mutex_lock(&table->lock);
+	for (link = &table->root; (member = *link);) {
+		if (now - member->info.last_seen < timeout) {
+			link = &member->next;
+			continue;
+		}
+		*link = member->next;
+		if (cb) {
+			cb(&member->info, data);
+		}
+		free(member);
+		expired++;
+	}
+	pthread_mutex_unlock(&table->lock);
+	return expired;
+}
+
+unsigned int member_table_list(member_table_t *table, member_table_cb_t cb, void *data)
+{
+	member_t *member;
+	unsigned int count = 0;
+
+	pthread_mutex_lock(&table->lock);
+	for (member = table->root; member; member = member->next) {
+		cb(&member->info, data);
+		count++;
+	}
+	pthread_mutex_unlock(&table->lock);
+	return count;
+}
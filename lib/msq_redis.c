@@ -17,6 +17,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <malloc.h>
 #include <pthread.h>
 #include <hiredis/hiredis.h>
@@ -24,6 +25,7 @@
 #include <hiredis/adapters/libevent.h>
 
 #include "../include/shared.h"
+#include "../include/rate_limiter.h"
 
 /* 
  * declarations
@@ -53,13 +55,19 @@ struct msq_event_map {
 	char *channel;
 	char *pattern;
 	msq_subscription_callback_t callback;
+	int receivers;				/* subscribers at the last PUBLISH / NUMSUB, -1 = unknown */
+	time_t last_probe;
+	rate_limiter_t *limiter;
 };
 static msq_event_t msq_event_map[] = {
-	[EVENT_MWI]			= {.name="mwi",},
-	[EVENT_DEVICE_STATE]		= {.name="device_state",},
-	[EVENT_DEVICE_STATE_CHANGE] 	= {.name="device_state_change"},
-	[EVENT_PING]			= {.name="ping", .publish=TRUE, .subscribe=TRUE, .active=FALSE, .channel="asterisk:ping", .pattern="", .callback=redis_ping_subscription_cb}
+	[EVENT_MWI]			= {.name="mwi", .receivers=-1},
+	[EVENT_DEVICE_STATE]		= {.name="device_state", .receivers=-1},
+	[EVENT_DEVICE_STATE_CHANGE] 	= {.name="device_state_change", .receivers=-1},
+	[EVENT_PING]			= {.name="ping", .publish=TRUE, .subscribe=TRUE, .active=FALSE, .channel="asterisk:ping", .pattern="", .callback=redis_ping_subscription_cb, .receivers=-1}
 };
+#define MSQ_PROBE_INTERVAL 30			/* s, between PUBSUB NUMSUB probes of a channel nobody listens to */
+#define MSQ_RATE_MAX_PENDING 4096		/* devices / mailboxes waiting for a token, per channel */
+#define MSQ_RATE_TICK_MS 50
 
 enum connection_type {
 	NONE,
@@ -83,6 +91,8 @@ static server_t *servers_root = NULL;
 static server_t *current_server = NULL;
 
 pthread_mutex_t msq_startstop_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* hiredis async contexts are not thread safe: caller threads and the rate limit timer on the event loop write commands under this */
+static pthread_mutex_t msq_write_mutex = PTHREAD_MUTEX_INITIALIZER;
 volatile boolean_t stopped;
 
 /* RAII LOCK */
@@ -324,6 +334,7 @@ exception_t _msq_disconnect()
 	
 	if (!res && current_server) {
 		raii_wrlock(&msq_server_rwlock);
+		pthread_mutex_lock(&msq_write_mutex);
 		if (current_server->redisConn[PUBLISH]) {
 			// call general unsubscribe
 			redisAsyncDisconnect(current_server->redisConn[PUBLISH]);
@@ -336,6 +347,7 @@ exception_t _msq_disconnect()
 			res |= msq_processRedisAsyncConnError(current_server->redisConn[SUBSCRIBE]);
 			current_server->redisConn[SUBSCRIBE] = NULL;
 		}
+		pthread_mutex_unlock(&msq_write_mutex);
 		//res |= msq_stop_eventloop();
 	}
 	log_verbose(2, "RedisMSQ: (%s) exit %s%s%s\n", __PRETTY_FUNCTION__, res ? " [Exception Occured: " : "", res ? exception2str[res].str : "", res ? "]" : "");
@@ -541,16 +553,187 @@ exception_t _msq_toggle_subscriptions(boolean_t on)
 	return res;
 }
 
+/* receiver count from a PUBLISH (integer) or PUBSUB NUMSUB (array) reply */
+static void msq_receivers_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	msq_event_t *event = privdata;
+
+	if (reply && reply->type == REDIS_REPLY_INTEGER) {
+		event->receivers = (int) reply->integer;
+	} else if (reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 && reply->element[1]->type == REDIS_REPLY_INTEGER) {
+		event->receivers = (int) reply->element[1]->integer;
+	}
+}
+
+/* nobody but (maybe) ourselves subscribes: skip the PUBLISH, probe again every MSQ_PROBE_INTERVAL; msq_write_mutex held */
+static boolean_t msq_publish_suppressed(msq_event_t *event)
+{
+	int own = (event->subscribe && event->active) ? 1 : 0;
+	time_t now = time(NULL);
+
+	if (event->receivers < 0 || event->receivers > own) {
+		return FALSE;
+	}
+	if (now - event->last_probe >= MSQ_PROBE_INTERVAL) {
+		event->last_probe = now;
+		redisAsyncCommand(current_server->redisConn[PUBLISH], msq_receivers_cb, event, "PUBSUB NUMSUB %s", event->channel);
+	}
+	return TRUE;
+}
+
+static uint64_t msq_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Raw (still escaped) value of member name in a message as encoded by
+ * message2json(), scanned in place on the publish path. An interned id
+ * ("name#":id) comes back as "#id". Returns the length, 0 if not found.
+ */
+static size_t msq_member_value(const char *msg, const char *name, char *buf, size_t buf_len)
+{
+	size_t name_len = strlen(name);
+	size_t len = 0;
+	const char *p, *value;
+
+	buf[0] = '\0';
+	for (p = strchr(msg, '"'); p; p = strchr(p + 1, '"')) {
+		if (p == msg || (p[-1] != '{' && p[-1] != ',') || strncasecmp(p + 1, name, name_len)) {
+			continue;
+		}
+		value = p + 1 + name_len;
+		if (*value == '#') {
+			if (len + 2 < buf_len) {
+				buf[len++] = '#';
+			}
+			value++;
+		}
+		if (value[0] != '"' || value[1] != ':') {
+			len = 0;
+			continue;
+		}
+		value += 2;
+		if (*value == '"') {
+			for (value++; *value && *value != '"' && len + 2 < buf_len; value++) {
+				if (*value == '\\' && value[1]) {
+					buf[len++] = *value++;
+				}
+				buf[len++] = *value;
+			}
+		} else {
+			while (*value && *value != ',' && *value != '}' && len + 1 < buf_len) {
+				buf[len++] = *value++;
+			}
+		}
+		buf[len] = '\0';
+		return len;
+	}
+	return 0;
+}
+
+/* coalescing key of an encoded event: Device, or Mailbox@Context */
+static void msq_message_key(const char *msg, char *key, size_t key_len)
+{
+	size_t len;
+
+	if (msq_member_value(msg, "Device", key, key_len)) {
+		return;
+	}
+	if ((len = msq_member_value(msg, "Mailbox", key, key_len)) && len + 1 < key_len) {
+		key[len++] = '@';
+		if (!msq_member_value(msg, "Context", key + len, key_len - len)) {
+			snprintf(key + len, key_len - len, "default");
+		}
+	}
+}
+
+static void msq_rate_send_cb(const char *key, const char *msg, void *data)
+{
+	msq_event_t *event = data;
+
+	pthread_mutex_lock(&msq_write_mutex);
+	if (msq_publish_suppressed(event)) {
+		log_verbose(2, "RedisMSQ: no subscribers on '%s', dropping held back '%s'\n", event->channel, key);
+	} else {
+		redisAsyncCommand(current_server->redisConn[PUBLISH], msq_receivers_cb, event, "PUBLISH %s %b", event->channel, msg, strlen(msg));
+	}
+	pthread_mutex_unlock(&msq_write_mutex);
+}
+
+/* rate = 0 removes the limit */
+exception_t msq_set_rate_limit(event_type_t channel, unsigned int rate, unsigned int burst)
+{
+	exception_t res = NO_EXCEPTION;
+
+	raii_wrlock(&msq_event_map_rwlock);
+	if (!msq_event_map[channel].name) {
+		return GENERAL_EXCEPTION;
+	}
+	rate_limiter_destroy(msq_event_map[channel].limiter);
+	msq_event_map[channel].limiter = NULL;
+	if (rate && !(msq_event_map[channel].limiter = rate_limiter_new(rate, burst, MSQ_RATE_MAX_PENDING))) {
+		res = MALLOC_EXCEPTION;
+	}
+	return res;
+}
+
+exception_t msq_get_rate_limit_stats(event_type_t channel, rate_limiter_stats_t *stats)
+{
+	raii_rdlock(&msq_event_map_rwlock);
+	if (!msq_event_map[channel].name || !msq_event_map[channel].limiter) {
+		return EXISTS_EXCEPTION;
+	}
+	rate_limiter_stats(msq_event_map[channel].limiter, stats);
+	return NO_EXCEPTION;
+}
+
+/* send whatever the refilled buckets allow, from the event loop timer and ahead of every publish */
+static void _msq_drain_rate_limits(void)
+{
+	event_type_t chan;
+	uint64_t now = msq_now_ms();
+
+	for (chan = 0; chan < ARRAY_LEN(msq_event_map); chan++) {
+		if (msq_event_map[chan].limiter && msq_event_map[chan].channel && current_server) {
+			rate_limiter_drain(msq_event_map[chan].limiter, now, msq_rate_send_cb, &msq_event_map[chan]);
+		}
+	}
+}
+
+static void msq_rate_timer_cb(evutil_socket_t fd, short what, void *data)
+{
+	raii_rdlock(&msq_event_map_rwlock);
+	_msq_drain_rate_limits();
+}
+
 exception_t msq_publish(event_type_t channel, const char *publishmsg)
 {
 	log_verbose(2, "RedisMSQ: (%s) enter\n", __PRETTY_FUNCTION__);
 	exception_t res = NO_EXCEPTION;
+	char key[160];
 	raii_rdlock(&msq_event_map_rwlock);
-	if (msq_event_map[channel].channel) {
+	if (msq_event_map[channel].limiter && msq_event_map[channel].channel) {
+		_msq_drain_rate_limits();
+		msq_message_key(publishmsg, key, sizeof(key));
+		if (rate_limiter_submit(msq_event_map[channel].limiter, key, publishmsg, msq_now_ms()) != RATE_PASS) {
+			log_verbose(2, "RedisMSQ: rate limit on '%s', holding back '%s'\n", msq_event_map[channel].channel, key);
+			return res;
+		}
+	}
+	pthread_mutex_lock(&msq_write_mutex);
+	if (msq_event_map[channel].channel && msq_publish_suppressed(&msq_event_map[channel])) {
+		log_verbose(2, "RedisMSQ: no subscribers on '%s', skipping PUBLISH\n", msq_event_map[channel].channel);
+	} else if (msq_event_map[channel].channel) {
 		log_verbose(1,"RedisMSQ: PUBLISH channel: '%s', mesg: '%s'\n", msq_event_map[channel].channel, publishmsg);
-		redisAsyncCommand(current_server->redisConn[PUBLISH], NULL, NULL, "PUBLISH %s %b", msq_event_map[channel].channel, publishmsg, (size_t)strlen(publishmsg));
+		redisAsyncCommand(current_server->redisConn[PUBLISH], msq_receivers_cb, &msq_event_map[channel], "PUBLISH %s %b", msq_event_map[channel].channel, publishmsg, (size_t)strlen(publishmsg));
 		res |= msq_processRedisAsyncConnError(current_server->redisConn[PUBLISH]);
 	} 
+	pthread_mutex_unlock(&msq_write_mutex);
 	log_verbose(2, "RedisMSQ: (%s) exit %s%s%s\n", __PRETTY_FUNCTION__, res ? " [Exception Occured: " : "", res ? exception2str[res].str : "", res ? "]" : "");
 	return res;
 }
@@ -565,12 +748,16 @@ exception_t msq_send_subscribe(event_type_t channel)
 		if (msq_event_map[channel].channel || msq_event_map[channel].callback) {
 			if (msq_event_map[channel].pattern) {
 				log_verbose(1,"RedisMSQ: SUBSCRIBE channel: '%s:%s'\n", msq_event_map[channel].channel, msq_event_map[channel].pattern);
+				pthread_mutex_lock(&msq_write_mutex);
 				redisAsyncCommand(current_server->redisConn[SUBSCRIBE], NULL, NULL, "SUBSCRIBE %s:%s", msq_event_map[channel].channel, msq_event_map[channel].pattern);
 				res |= msq_processRedisAsyncConnError(current_server->redisConn[SUBSCRIBE]);
+				pthread_mutex_unlock(&msq_write_mutex);
 			} else {
 				log_verbose(1,"RedisMSQ: SUBSCRIBE channel: '%s'\n", msq_event_map[channel].channel);
+				pthread_mutex_lock(&msq_write_mutex);
 				redisAsyncCommand(current_server->redisConn[SUBSCRIBE], NULL, NULL, "SUBSCRIBE %s", msq_event_map[channel].channel);
 				res |= msq_processRedisAsyncConnError(current_server->redisConn[SUBSCRIBE]);
+				pthread_mutex_unlock(&msq_write_mutex);
 			}
 		} else {
 			res = GENERAL_EXCEPTION;
@@ -592,12 +779,16 @@ exception_t msq_send_unsubscribe(event_type_t channel)
 		if (!msq_event_map[channel].channel || !msq_event_map[channel].callback) {
 			if (msq_event_map[channel].pattern) {
 				log_verbose(1,"RedisMSQ: UNSUBSCRIBE channel: '%s:%s'\n", msq_event_map[channel].channel, msq_event_map[channel].pattern);
+				pthread_mutex_lock(&msq_write_mutex);
 				redisAsyncCommand(current_server->redisConn[SUBSCRIBE], NULL, NULL, "UNSUBSCRIBE %s:%s", msq_event_map[channel].channel, msq_event_map[channel].pattern);
 				res |= msq_processRedisAsyncConnError(current_server->redisConn[SUBSCRIBE]);
+				pthread_mutex_unlock(&msq_write_mutex);
 			} else {
 				log_verbose(1,"RedisMSQ: UNSUBSCRIBE channel: '%s'\n", msq_event_map[channel].channel);
+				pthread_mutex_lock(&msq_write_mutex);
 				redisAsyncCommand(current_server->redisConn[SUBSCRIBE], NULL, NULL, "UNSUBSCRIBE %s", msq_event_map[channel].channel);
 				res |= msq_processRedisAsyncConnError(current_server->redisConn[SUBSCRIBE]);
+				pthread_mutex_unlock(&msq_write_mutex);
 			}
 		} else {
 			res = GENERAL_EXCEPTION;
@@ -661,7 +852,12 @@ static void *eventloop_dispatch_thread(void *data)
 	redisAsyncSetConnectCallback(current_server->redisConn[SUBSCRIBE], redis_connect_cb);
 	redisAsyncSetDisconnectCallback(current_server->redisConn[SUBSCRIBE], redis_disconnect_cb);
 
+	struct timeval tv = { 0, MSQ_RATE_TICK_MS * 1000 };
+	struct event *rate_timer = event_new(eventbase, -1, EV_PERSIST, msq_rate_timer_cb, NULL);
+	event_add(rate_timer, &tv);
+
 	event_base_dispatch(eventbase);
+	event_free(rate_timer);
 	log_debug("Exiting eventlog_dispatch thread");
 	
 	// cleanup ?
@@ -0,0 +1,220 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "../include/rate_limiter.h"
+#include "../include/shared.h"
+
+/*
+ * declarations
+ */
+#define RATE_LIMITER_BUCKETS 256
+#define TOKEN 1000					/* tokens are kept in 1/1000 */
+
+typedef struct rate_entry rate_entry_t;
+struct rate_entry {
+	char *key;					/* NULL: not coalesced */
+	char *msg;
+	uint32_t hash;
+	rate_entry_t *hash_next;
+	rate_entry_t *next;				/* FIFO */
+};
+
+struct rate_limiter {
+	pthread_mutex_t lock;
+	uint64_t rate;					/* tokens per second == 1/1000 tokens per ms */
+	uint64_t capacity;
+	uint64_t tokens;
+	uint64_t last;
+	unsigned int max_pending;
+	rate_entry_t *buckets[RATE_LIMITER_BUCKETS];
+	rate_entry_t *head;
+	rate_entry_t *tail;
+	rate_limiter_stats_t stats;
+};
+
+/*
+ * private
+ */
+static inline uint32_t rate_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;			/* FNV-1a */
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void rate_refill(rate_limiter_t *limiter, uint64_t now)
+{
+	if (now > limiter->last) {
+		limiter->tokens += (now - limiter->last) * limiter->rate;
+		if (limiter->tokens > limiter->capacity) {
+			limiter->tokens = limiter->capacity;
+		}
+	}
+	limiter->last = now;
+}
+
+static void rate_entry_free(rate_entry_t *entry)
+{
+	free(entry->key);
+	free(entry->msg);
+	free(entry);
+}
+
+/* unlink the head of the FIFO */
+static rate_entry_t *rate_pop(rate_limiter_t *limiter)
+{
+	rate_entry_t *entry = limiter->head, **pp;
+
+	if (!entry) {
+		return NULL;
+	}
+	if (!(limiter->head = entry->next)) {
+		limiter->tail = NULL;
+	}
+	if (entry->key) {
+		for (pp = &limiter->buckets[entry->hash % RATE_LIMITER_BUCKETS]; *pp; pp = &(*pp)->hash_next) {
+			if (*pp == entry) {
+				*pp = entry->hash_next;
+				break;
+			}
+		}
+	}
+	limiter->stats.pending--;
+	return entry;
+}
+
+/*
+ * public
+ */
+rate_limiter_t *rate_limiter_new(unsigned int rate, unsigned int burst, unsigned int max_pending)
+{
+	rate_limiter_t *limiter;
+
+	if (!rate || !(limiter = calloc(1, sizeof(*limiter)))) {
+		return NULL;
+	}
+	limiter->rate = rate;
+	limiter->capacity = (uint64_t) (burst ? burst : rate) * TOKEN;
+	limiter->tokens = limiter->capacity;
+	limiter->max_pending = max_pending;
+	pthread_mutex_init(&limiter->lock, NULL);
+	return limiter;
+}
+
+void rate_limiter_destroy(rate_limiter_t *limiter)
+{
+	rate_entry_t *entry;
+
+	if (!limiter) {
+		return;
+	}
+	while ((entry = rate_pop(limiter))) {
+		rate_entry_free(entry);
+	}
+	pthread_mutex_destroy(&limiter->lock);
+	free(limiter);
+}
+
+rate_status_t rate_limiter_submit(rate_limiter_t *limiter, const char *key, const char *msg, uint64_t now)
+{
+	rate_status_t status = RATE_DEFERRED;
+	rate_entry_t *entry = NULL;
+	uint32_t hash = 0;
+	char *copy;
+
+	pthread_mutex_lock(&limiter->lock);
+	rate_refill(limiter, now);
+	/* nothing may overtake what is already waiting */
+	if (!limiter->head && limiter->tokens >= TOKEN) {
+		limiter->tokens -= TOKEN;
+		limiter->stats.passed++;
+		status = RATE_PASS;
+		goto exit;
+	}
+	if (key && *key) {
+		hash = rate_hash(key);
+		for (entry = limiter->buckets[hash % RATE_LIMITER_BUCKETS]; entry; entry = entry->hash_next) {
+			if (entry->hash == hash && !strcmp(entry->key, key)) {
+				break;
+			}
+		}
+	}
+	if (entry) {
+		if (!(copy = strdup(msg))) {
+			status = RATE_DROPPED;
+			limiter->stats.dropped++;
+			goto exit;
+		}
+		free(entry->msg);
+		entry->msg = copy;
+		limiter->stats.coalesced++;
+		status = RATE_COALESCED;
+		goto exit;
+	}
+	if (limiter->stats.pending >= limiter->max_pending || !(entry = calloc(1, sizeof(*entry)))
+		|| !(entry->msg = strdup(msg)) || (key && *key && !(entry->key = strdup(key)))) {
+		if (entry) {
+			rate_entry_free(entry);
+		}
+		limiter->stats.dropped++;
+		status = RATE_DROPPED;
+		goto exit;
+	}
+	if (entry->key) {
+		entry->hash = hash;
+		entry->hash_next = limiter->buckets[hash % RATE_LIMITER_BUCKETS];
+		limiter->buckets[hash % RATE_LIMITER_BUCKETS] = entry;
+	}
+	if (limiter->tail) {
+		limiter->tail->next = entry;
+	} else {
+		limiter->head = entry;
+	}
+	limiter->tail = entry;
+	limiter->stats.pending++;
+	limiter->stats.deferred++;
+exit:
+	pthread_mutex_unlock(&limiter->lock);
+	return status;
+}
+
+unsigned int rate_limiter_drain(rate_limiter_t *limiter, uint64_t now, rate_limiter_cb_t callback, void *data)
+{
+	rate_entry_t *entry;
+	unsigned int count = 0;
+
+	pthread_mutex_lock(&limiter->lock);
+	rate_refill(limiter, now);
+	while (limiter->head && limiter->tokens >= TOKEN) {
+		limiter->tokens -= TOKEN;
+		entry = rate_pop(limiter);
+		callback(entry->key, entry->msg, data);
+		rate_entry_free(entry);
+		count++;
+	}
+	pthread_mutex_unlock(&limiter->lock);
+	return count;
+}
+
+void rate_limiter_stats(rate_limiter_t *limiter, rate_limiter_stats_t *stats)
+{
+	pthread_mutex_lock(&limiter->lock);
+	*stats = limiter->stats;
+	pthread_mutex_unlock(&limiter->lock);
+}
@@ -0,0 +1,397 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "../include/realtime_cache.h"
+#include "../include/realtime_match.h"
+#include "../include/shared.h"
+
+/*
+ * declarations
+ */
+typedef struct cache_entry cache_entry_t;
+struct cache_entry {
+	cache_entry_t *key_next;			/* key bucket chain */
+	cache_entry_t *tag_next;			/* tag bucket chain */
+	cache_entry_t *prev;				/* towards most recent */
+	cache_entry_t *next;				/* towards least recent */
+	uint32_t key_hash;
+	uint32_t tag_hash;
+	uint64_t expires;				/* 0 never */
+	unsigned int num_pairs;
+	char *tag;
+	char *pairs;					/* name\0value\0... */
+	char key[];					/* followed by tag and pairs */
+};
+
+typedef struct cache_shard {
+	pthread_mutex_t lock;
+	unsigned int count;
+	cache_entry_t **key_buckets;
+	cache_entry_t **tag_buckets;
+	cache_entry_t *head;				/* most recent */
+	cache_entry_t *tail;				/* least recent */
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long inserts;
+	unsigned long evictions;
+	unsigned long invalidations;
+	unsigned long discarded;
+} cache_shard_t;
+
+struct realtime_cache {
+	unsigned int num_shards;
+	unsigned int shard_capacity;
+	unsigned int bucket_mask;
+	unsigned int ttl;
+	pthread_mutex_t epoch_lock;
+	unsigned long epoch;
+	cache_shard_t shards[];
+};
+
+/*
+ * private
+ */
+static inline uint32_t cache_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;			/* FNV-1a */
+	while (*str) {
+		hash ^= (unsigned char) *str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static inline cache_shard_t *cache_shard(realtime_cache_t *cache, uint32_t key_hash)
+{
+	/* the low bits pick the bucket, use the high ones for the shard */
+	return &cache->shards[(key_hash >> 16) % cache->num_shards];
+}
+
+static void cache_unlink(realtime_cache_t *cache, cache_shard_t *shard, cache_entry_t *entry)
+{
+	cache_entry_t **pp;
+
+	for (pp = &shard->key_buckets[entry->key_hash & cache->bucket_mask]; *pp; pp = &(*pp)->key_next) {
+		if (*pp == entry) {
+			*pp = entry->key_next;
+			break;
+		}
+	}
+	for (pp = &shard->tag_buckets[entry->tag_hash & cache->bucket_mask]; *pp; pp = &(*pp)->tag_next) {
+		if (*pp == entry) {
+			*pp = entry->tag_next;
+			break;
+		}
+	}
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		shard->head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		shard->tail = entry->prev;
+	}
+	shard->count--;
+}
+
+static void cache_push_front(cache_shard_t *shard, cache_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = shard->head;
+	if (shard->head) {
+		shard->head->prev = entry;
+	} else {
+		shard->tail = entry;
+	}
+	shard->head = entry;
+}
+
+static cache_entry_t *cache_find(realtime_cache_t *cache, cache_shard_t *shard, const char *key, uint32_t key_hash)
+{
+	cache_entry_t *entry;
+
+	for (entry = shard->key_buckets[key_hash & cache->bucket_mask]; entry; entry = entry->key_next) {
+		if (entry->key_hash == key_hash && !strcmp(entry->key, key)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void cache_bump_epoch(realtime_cache_t *cache)
+{
+	pthread_mutex_lock(&cache->epoch_lock);
+	cache->epoch++;
+	pthread_mutex_unlock(&cache->epoch_lock);
+}
+
+/*
+ * public
+ */
+realtime_cache_t *realtime_cache_new(unsigned int shards, unsigned int capacity, unsigned int ttl)
+{
+	realtime_cache_t *cache;
+	unsigned int buckets = 16, i;
+
+	if (!shards || capacity < shards) {
+		return NULL;
+	}
+	if (!(cache = calloc(1, sizeof(*cache) + shards * sizeof(cache_shard_t)))) {
+		return NULL;
+	}
+	cache->num_shards = shards;
+	cache->shard_capacity = capacity / shards;
+	cache->ttl = ttl;
+	while (buckets < cache->shard_capacity * 2) {
+		buckets <<= 1;
+	}
+	cache->bucket_mask = buckets - 1;
+	pthread_mutex_init(&cache->epoch_lock, NULL);
+	for (i = 0; i < shards; i++) {
+		pthread_mutex_init(&cache->shards[i].lock, NULL);
+		if (!(cache->shards[i].key_buckets = calloc(buckets, sizeof(cache_entry_t *))) ||
+			!(cache->shards[i].tag_buckets = calloc(buckets, sizeof(cache_entry_t *)))) {
+			cache->num_shards = i + 1;
+			realtime_cache_destroy(cache);
+			return NULL;
+		}
+	}
+	return cache;
+}
+
+void realtime_cache_destroy(realtime_cache_t *cache)
+{
+	unsigned int i;
+
+	if (!cache) {
+		return;
+	}
+	for (i = 0; i < cache->num_shards; i++) {
+		cache_shard_t *shard = &cache->shards[i];
+		cache_entry_t *entry, *next;
+
+		for (entry = shard->head; entry; entry = next) {
+			next = entry->next;
+			free(entry);
+		}
+		free(shard->key_buckets);
+		free(shard->tag_buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	pthread_mutex_destroy(&cache->epoch_lock);
+	free(cache);
+}
+
+int realtime_cache_get(realtime_cache_t *cache, const char *key, uint64_t now, realtime_cache_cb_t callback, void *data)
+{
+	uint32_t key_hash = cache_hash(key);
+	cache_shard_t *shard = cache_shard(cache, key_hash);
+	cache_entry_t *entry;
+	const char *p;
+	unsigned int i;
+
+	pthread_mutex_lock(&shard->lock);
+	if (!(entry = cache_find(cache, shard, key, key_hash))) {
+		shard->misses++;
+		pthread_mutex_unlock(&shard->lock);
+		return 0;
+	}
+	if (entry->expires && entry->expires <= now) {
+		cache_unlink(cache, shard, entry);
+		free(entry);
+		shard->misses++;
+		pthread_mutex_unlock(&shard->lock);
+		return 0;
+	}
+	if (entry != shard->head) {
+		/* move to front */
+		entry->prev->next = entry->next;
+		if (entry->next) {
+			entry->next->prev = entry->prev;
+		} else {
+			shard->tail = entry->prev;
+		}
+		cache_push_front(shard, entry);
+	}
+	for (i = 0, p = entry->pairs; i < entry->num_pairs; i++) {
+		const char *name = p;
+		const char *value = name + strlen(name) + 1;
+
+		p = value + strlen(value) + 1;
+		callback(name, value, data);
+	}
+	shard->hits++;
+	pthread_mutex_unlock(&shard->lock);
+	return 1;
+}
+
+unsigned long realtime_cache_epoch(realtime_cache_t *cache)
+{
+	unsigned long epoch;
+
+	pthread_mutex_lock(&cache->epoch_lock);
+	epoch = cache->epoch;
+	pthread_mutex_unlock(&cache->epoch_lock);
+	return epoch;
+}
+
+exception_t realtime_cache_put(realtime_cache_t *cache, const char *key, const char *tag, const char *const *names, const char *const *values, unsigned int num_pairs, unsigned long epoch, uint64_t now)
+{
+	uint32_t key_hash = cache_hash(key);
+	cache_shard_t *shard = cache_shard(cache, key_hash);
+	size_t key_len = strlen(key) + 1, tag_len = strlen(tag) + 1, size = 0;
+	cache_entry_t *entry, *old;
+	char *p;
+	unsigned int i;
+
+	for (i = 0; i < num_pairs; i++) {
+		size += strlen(names[i]) + 1 + strlen(values[i] ? values[i] : "") + 1;
+	}
+	if (!(entry = malloc(sizeof(*entry) + key_len + tag_len + size))) {
+		return MALLOC_EXCEPTION;
+	}
+	entry->key_hash = key_hash;
+	entry->tag_hash = cache_hash(tag);
+	entry->expires = cache->ttl ? now + cache->ttl : 0;
+	entry->num_pairs = num_pairs;
+	memcpy(entry->key, key, key_len);
+	entry->tag = entry->key + key_len;
+	memcpy(entry->tag, tag, tag_len);
+	entry->pairs = p = entry->tag + tag_len;
+	for (i = 0; i < num_pairs; i++) {
+		size_t len = strlen(names[i]) + 1;
+
+		memcpy(p, names[i], len);
+		p += len;
+		len = strlen(values[i] ? values[i] : "") + 1;
+		memcpy(p, values[i] ? values[i] : "", len);
+		p += len;
+	}
+
+	pthread_mutex_lock(&shard->lock);
+	/* an invalidation that started after epoch was taken has either run on this shard or will */
+	if (realtime_cache_epoch(cache) != epoch) {
+		shard->discarded++;
+		pthread_mutex_unlock(&shard->lock);
+		free(entry);
+		return GENERAL_EXCEPTION;
+	}
+	if ((old = cache_find(cache, shard, key, key_hash))) {
+		cache_unlink(cache, shard, old);
+		free(old);
+	}
+	while (shard->count >= cache->shard_capacity && shard->tail) {
+		old = shard->tail;
+		cache_unlink(cache, shard, old);
+		free(old);
+		shard->evictions++;
+	}
+	entry->key_next = shard->key_buckets[key_hash & cache->bucket_mask];
+	shard->key_buckets[key_hash & cache->bucket_mask] = entry;
+	entry->tag_next = shard->tag_buckets[entry->tag_hash & cache->bucket_mask];
+	shard->tag_buckets[entry->tag_hash & cache->bucket_mask] = entry;
+	cache_push_front(shard, entry);
+	shard->count++;
+	shard->inserts++;
+	pthread_mutex_unlock(&shard->lock);
+	return NO_EXCEPTION;
+}
+
+unsigned int realtime_cache_invalidate(realtime_cache_t *cache, const char *tag)
+{
+	uint32_t tag_hash = cache_hash(tag);
+	unsigned int removed = 0, i;
+
+	cache_bump_epoch(cache);
+	for (i = 0; i < cache->num_shards; i++) {
+		cache_shard_t *shard = &cache->shards[i];
+		cache_entry_t *entry, *next;
+
+		pthread_mutex_lock(&shard->lock);
+		for (entry = shard->tag_buckets[tag_hash & cache->bucket_mask]; entry; entry = next) {
+			next = entry->tag_next;
+			if (entry->tag_hash == tag_hash && !strcmp(entry->tag, tag)) {
+				cache_unlink(cache, shard, entry);
+				free(entry);
+				shard->invalidations++;
+				removed++;
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	return removed;
+}
+
+unsigned int realtime_cache_invalidate_key(realtime_cache_t *cache, const char *key)
+{
+	char table_key[256];
+	unsigned int count = realtime_cache_invalidate(cache, key);
+
+	switch (realtime_key_table(key, table_key, sizeof(table_key))) {
+		case RT_KEY_ROW:
+		case RT_KEY_INDEX:
+			count += realtime_cache_invalidate(cache, table_key);
+			break;
+		default:
+			break;
+	}
+	return count;
+}
+
+void realtime_cache_flush(realtime_cache_t *cache)
+{
+	unsigned int i;
+
+	cache_bump_epoch(cache);
+	for (i = 0; i < cache->num_shards; i++) {
+		cache_shard_t *shard = &cache->shards[i];
+		cache_entry_t *entry, *next;
+
+		pthread_mutex_lock(&shard->lock);
+		for (entry = shard->head; entry; entry = next) {
+			next = entry->next;
+			free(entry);
+			shard->invalidations++;
+		}
+		memset(shard->key_buckets, 0, (cache->bucket_mask + 1) * sizeof(cache_entry_t *));
+		memset(shard->tag_buckets, 0, (cache->bucket_mask + 1) * sizeof(cache_entry_t *));
+		shard->head = shard->tail = NULL;
+		shard->count = 0;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+void realtime_cache_stats(realtime_cache_t *cache, realtime_cache_stats_t *stats)
+{
+	unsigned int i;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < cache->num_shards; i++) {
+		cache_shard_t *shard = &cache->shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->inserts += shard->inserts;
+		stats->evictions += shard->evictions;
+		stats->invalidations += shard->invalidations;
+		stats->discarded += shard->discarded;
+		stats->entries += shard->count;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
@@ -0,0 +1,187 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "../include/realtime_match.h"
+#include "../include/shared.h"
+
+/*
+ * private
+ */
+static const struct {
+	const char *str;
+	realtime_op_t op;
+} operators[] = {
+	{"=", RT_OP_EQ},
+	{"==", RT_OP_EQ},
+	{"!=", RT_OP_NE},
+	{"<>", RT_OP_NE},
+	{"<", RT_OP_LT},
+	{"<=", RT_OP_LE},
+	{">", RT_OP_GT},
+	{">=", RT_OP_GE},
+	{"LIKE", RT_OP_LIKE},
+	{"NOT LIKE", RT_OP_NOT_LIKE},
+	{"IS NULL", RT_OP_IS_NULL},
+	{"IS NOT NULL", RT_OP_IS_NOT_NULL},
+};
+
+static int parse_number(const char *str, double *number)
+{
+	char *end;
+
+	if (!*str) {
+		return 0;
+	}
+	*number = strtod(str, &end);
+	return *end == '\0';
+}
+
+static int compare(const char *a, const char *b)
+{
+	double na, nb;
+
+	if (parse_number(a, &na) && parse_number(b, &nb)) {
+		return (na > nb) - (na < nb);
+	}
+	return strcmp(a, b);
+}
+
+/*
+ * public
+ */
+exception_t realtime_filter_parse(realtime_filter_t *filter, const char *spec, const char *value)
+{
+	const char *op = strchr(spec, ' ');
+	size_t len = op ? (size_t) (op - spec) : strlen(spec);
+	unsigned int i;
+
+	if (!len || len >= REALTIME_MATCH_MAX_FIELD) {
+		return GENERAL_EXCEPTION;
+	}
+	memcpy(filter->field, spec, len);
+	filter->field[len] = '\0';
+	filter->op = RT_OP_EQ;
+	filter->value = value ? value : "";
+	if (!op) {
+		return NO_EXCEPTION;
+	}
+	while (*op == ' ') {
+		op++;
+	}
+	if (!*op) {
+		return NO_EXCEPTION;
+	}
+	for (i = 0; i < ARRAY_LEN(operators); i++) {
+		if (!strcasecmp(op, operators[i].str)) {
+			filter->op = operators[i].op;
+			return NO_EXCEPTION;
+		}
+	}
+	return GENERAL_EXCEPTION;
+}
+
+int realtime_filter_match(const realtime_filter_t *filter, const char *value)
+{
+	if (filter->op == RT_OP_IS_NULL) {
+		return value == NULL;
+	}
+	if (!value) {
+		return 0;
+	}
+	switch (filter->op) {
+		case RT_OP_EQ:
+			return !strcmp(value, filter->value);
+		case RT_OP_NE:
+			return strcmp(value, filter->value) != 0;
+		case RT_OP_LT:
+			return compare(value, filter->value) < 0;
+		case RT_OP_LE:
+			return compare(value, filter->value) <= 0;
+		case RT_OP_GT:
+			return compare(value, filter->value) > 0;
+		case RT_OP_GE:
+			return compare(value, filter->value) >= 0;
+		case RT_OP_LIKE:
+			return realtime_like(filter->value, value);
+		case RT_OP_NOT_LIKE:
+			return !realtime_like(filter->value, value);
+		case RT_OP_IS_NOT_NULL:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+int realtime_like(const char *pattern, const char *value)
+{
+	const char *star_pattern = NULL;		/* position after the last '%' */
+	const char *star_value = NULL;
+
+	while (*value) {
+		if (*pattern == '%') {
+			star_pattern = ++pattern;
+			star_value = value;
+			continue;
+		}
+		if (*pattern == '_' || (*pattern == '\\' && pattern[1] && pattern[1] == *value) || (*pattern != '\\' && *pattern == *value)) {
+			pattern += (*pattern == '\\') ? 2 : 1;
+			value++;
+			continue;
+		}
+		if (!star_pattern) {
+			return 0;
+		}
+		pattern = star_pattern;
+		value = ++star_value;
+	}
+	while (*pattern == '%') {
+		pattern++;
+	}
+	return *pattern == '\0';
+}
+
+int realtime_like_prefix(const char *pattern, char *prefix, size_t len)
+{
+	size_t used = 0;
+
+	while (*pattern && *pattern != '%' && *pattern != '_' && used + 1 < len) {
+		if (*pattern == '\\' && pattern[1]) {
+			pattern++;
+		}
+		prefix[used++] = *pattern++;
+	}
+	prefix[used] = '\0';
+	return !*pattern;
+}
+
+realtime_key_t realtime_key_table(const char *key, char *table_key, size_t len)
+{
+	const char *colon, *end;
+
+	if (!(colon = strchr(key, ':'))) {
+		return RT_KEY_NONE;
+	}
+	/* the id or the index value may hold anything, the table ends at the first ':' or '#' */
+	end = colon + 1 + strcspn(colon + 1, ":#");
+	if (end == colon + 1 || (size_t) (end - key) >= len) {
+		return RT_KEY_NONE;
+	}
+	memcpy(table_key, key, end - key);
+	table_key[end - key] = '\0';
+	if (!*end) {
+		return RT_KEY_TABLE;
+	}
+	return *end == ':' ? RT_KEY_ROW : RT_KEY_INDEX;
+}
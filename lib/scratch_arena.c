@@ -0,0 +1,261 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../include/scratch_arena.h"
+
+/*
+ * declarations
+ */
+typedef struct pool_block pool_block_t;
+struct pool_block {
+	unsigned int size_class;
+	size_t size;
+	pool_block_t *next;
+} __attribute__((aligned(16)));
+
+struct scratch_arena {
+	size_t used;
+	size_t size;
+	unsigned char *buf;
+};
+
+typedef struct scratch_thread_state {
+	scratch_arena_t arena;
+	pool_block_t *freelist[SCRATCH_POOL_CLASSES];
+	unsigned int freecount[SCRATCH_POOL_CLASSES];
+	scratch_stats_t stats;
+} scratch_thread_state_t;
+
+#define POOL_OVERSIZE_CLASS SCRATCH_POOL_CLASSES
+
+/*
+ * globals
+ */
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * private
+ */
+static void scratch_thread_state_destroy(void *data)
+{
+	scratch_thread_state_t *state = data;
+	unsigned int class;
+	pool_block_t *block;
+
+	for (class = 0; class < SCRATCH_POOL_CLASSES; class++) {
+		while ((block = state->freelist[class])) {
+			state->freelist[class] = block->next;
+			free(block);
+		}
+	}
+	free(state->arena.buf);
+	free(state);
+}
+
+static void scratch_key_create(void)
+{
+	pthread_key_create(&scratch_key, scratch_thread_state_destroy);
+}
+
+static scratch_thread_state_t *scratch_thread_state(void)
+{
+	scratch_thread_state_t *state;
+
+	pthread_once(&scratch_key_once, scratch_key_create);
+	if ((state = pthread_getspecific(scratch_key))) {
+		return state;
+	}
+	if (!(state = calloc(1, sizeof(*state)))) {
+		return NULL;
+	}
+	if (!(state->arena.buf = malloc(SCRATCH_ARENA_SIZE))) {
+		free(state);
+		return NULL;
+	}
+	state->arena.size = SCRATCH_ARENA_SIZE;
+	state->stats.backing_allocs = 2;
+	pthread_setspecific(scratch_key, state);
+	return state;
+}
+
+static inline unsigned int pool_size_class(size_t len)
+{
+	unsigned int class = 0;
+	size_t class_size = SCRATCH_POOL_MIN_CLASS_SIZE;
+
+	while (class < SCRATCH_POOL_CLASSES && class_size < len) {
+		class_size <<= 1;
+		class++;
+	}
+	return class;
+}
+
+static inline size_t pool_class_size(unsigned int class)
+{
+	return (size_t)SCRATCH_POOL_MIN_CLASS_SIZE << class;
+}
+
+/*
+ * public
+ */
+scratch_arena_t *scratch_arena_get(void)
+{
+	scratch_thread_state_t *state = scratch_thread_state();
+	return state ? &state->arena : NULL;
+}
+
+void *scratch_alloc(scratch_arena_t *arena, size_t len)
+{
+	void *ptr;
+	size_t aligned = (len + 15) & ~(size_t)15;
+
+	if (!arena || aligned > arena->size - arena->used) {
+		scratch_thread_state_t *state = scratch_thread_state();
+		if (state) {
+			state->stats.arena_exhausted++;
+		}
+		return NULL;
+	}
+	ptr = arena->buf + arena->used;
+	arena->used += aligned;
+	return ptr;
+}
+
+char *scratch_strndup(scratch_arena_t *arena, const char *str, size_t len)
+{
+	char *dst;
+
+	if (!(dst = scratch_alloc(arena, len + 1))) {
+		return NULL;
+	}
+	memcpy(dst, str, len);
+	dst[len] = '\0';
+	return dst;
+}
+
+char *scratch_strdup(scratch_arena_t *arena, const char *str)
+{
+	return scratch_strndup(arena, str, strlen(str));
+}
+
+void scratch_reset(scratch_arena_t *arena)
+{
+	if (arena) {
+		arena->used = 0;
+	}
+}
+
+size_t scratch_used(const scratch_arena_t *arena)
+{
+	return arena ? arena->used : 0;
+}
+
+/* release what was allocated since mark (an earlier scratch_used()), for helpers called inside a message */
+void scratch_rewind(scratch_arena_t *arena, size_t mark)
+{
+	if (arena && mark < arena->used) {
+		arena->used = mark;
+	}
+}
+
+void *scratch_pool_get(size_t len, size_t *capacity)
+{
+	scratch_thread_state_t *state = scratch_thread_state();
+	unsigned int class = pool_size_class(len);
+	pool_block_t *block;
+	size_t block_size;
+
+	if (!state) {
+		return NULL;
+	}
+	if (class == POOL_OVERSIZE_CLASS) {
+		state->stats.pool_oversize++;
+		block_size = len;
+	} else if ((block = state->freelist[class])) {
+		state->freelist[class] = block->next;
+		state->freecount[class]--;
+		state->stats.pool_hits++;
+		*capacity = pool_class_size(class);
+		return block + 1;
+	} else {
+		state->stats.pool_misses++;
+		block_size = pool_class_size(class);
+	}
+	if (!(block = malloc(sizeof(*block) + block_size))) {
+		return NULL;
+	}
+	state->stats.backing_allocs++;
+	block->size_class = class;
+	block->size = block_size;
+	block->next = NULL;
+	*capacity = block_size;
+	return block + 1;
+}
+
+void *scratch_pool_grow(void *ptr, size_t len, size_t *capacity)
+{
+	void *newptr;
+
+	if (ptr && len <= *capacity) {
+		return ptr;
+	}
+	if (!(newptr = scratch_pool_get(len, capacity))) {
+		return NULL;
+	}
+	if (ptr) {
+		pool_block_t *block = (pool_block_t *)ptr - 1;
+		memcpy(newptr, ptr, block->size < len ? block->size : len);
+		scratch_pool_put(ptr);
+	}
+	return newptr;
+}
+
+void scratch_pool_put(void *ptr)
+{
+	scratch_thread_state_t *state;
+	pool_block_t *block;
+
+	if (!ptr) {
+		return;
+	}
+	block = (pool_block_t *)ptr - 1;
+	state = scratch_thread_state();
+	if (!state || block->size_class == POOL_OVERSIZE_CLASS || state->freecount[block->size_class] >= SCRATCH_POOL_MAX_FREE) {
+		free(block);
+		return;
+	}
+	block->next = state->freelist[block->size_class];
+	state->freelist[block->size_class] = block;
+	state->freecount[block->size_class]++;
+}
+
+void scratch_get_stats(scratch_stats_t *stats)
+{
+	scratch_thread_state_t *state = scratch_thread_state();
+	if (state) {
+		*stats = state->stats;
+	} else {
+		memset(stats, 0, sizeof(*stats));
+	}
+}
+
+void scratch_reset_stats(void)
+{
+	scratch_thread_state_t *state = scratch_thread_state();
+	if (state) {
+		memset(&state->stats, 0, sizeof(state->stats));
+	}
+}
@@ -0,0 +1,158 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "../include/seq_tracker.h"
+#include "../include/shared.h"
+
+/*
+ * declarations
+ */
+typedef struct seq_stream seq_stream_t;
+struct seq_stream {
+	char name[32];
+	uint32_t epoch;
+	uint32_t last_seq;
+	seq_stream_t *next;
+};
+
+typedef struct seq_origin seq_origin_t;
+struct seq_origin {
+	char eid_str[32];
+	time_t last_resync;				/* 0 = never */
+	seq_stream_t *streams;
+	seq_origin_t *next;
+};
+
+struct seq_tracker {
+	pthread_mutex_t lock;
+	seq_origin_t *root;
+};
+
+/*
+ * private
+ */
+/* called with the lock held */
+static seq_origin_t *seq_tracker_origin(seq_tracker_t *tracker, const char *eid_str)
+{
+	seq_origin_t *origin;
+
+	for (origin = tracker->root; origin; origin = origin->next) {
+		if (!strcasecmp(origin->eid_str, eid_str)) {
+			return origin;
+		}
+	}
+	if (!(origin = calloc(1, sizeof(*origin)))) {
+		return NULL;
+	}
+	snprintf(origin->eid_str, sizeof(origin->eid_str), "%s", eid_str);
+	origin->next = tracker->root;
+	tracker->root = origin;
+	return origin;
+}
+
+/*
+ * public
+ */
+seq_tracker_t *seq_tracker_new(void)
+{
+	seq_tracker_t *tracker;
+
+	if (!(tracker = calloc(1, sizeof(*tracker)))) {
+		return NULL;
+	}
+	pthread_mutex_init(&tracker->lock, NULL);
+	return tracker;
+}
+
+void seq_tracker_destroy(seq_tracker_t *tracker)
+{
+	seq_origin_t *origin;
+	seq_stream_t *stream;
+
+	if (!tracker) {
+		return;
+	}
+	while ((origin = tracker->root)) {
+		tracker->root = origin->next;
+		while ((stream = origin->streams)) {
+			origin->streams = stream->next;
+			free(stream);
+		}
+		free(origin);
+	}
+	pthread_mutex_destroy(&tracker->lock);
+	free(tracker);
+}
+
+seq_status_t seq_tracker_check(seq_tracker_t *tracker, const char *eid_str, const char *stream_name, uint32_t epoch, uint32_t seq, uint32_t *missed)
+{
+	seq_origin_t *origin;
+	seq_stream_t *stream;
+	seq_status_t status = SEQ_NEW_ORIGIN;
+	uint32_t delta;
+
+	*missed = 0;
+	pthread_mutex_lock(&tracker->lock);
+	if (!(origin = seq_tracker_origin(tracker, eid_str))) {
+		goto exit;
+	}
+	for (stream = origin->streams; stream; stream = stream->next) {
+		if (!strcmp(stream->name, stream_name)) {
+			break;
+		}
+	}
+	if (!stream) {
+		if (!(stream = calloc(1, sizeof(*stream)))) {
+			goto exit;
+		}
+		snprintf(stream->name, sizeof(stream->name), "%s", stream_name);
+		stream->next = origin->streams;
+		origin->streams = stream;
+	} else if (stream->epoch == epoch) {
+		/* modulo 2^32, so the counter may wrap */
+		delta = seq - stream->last_seq;
+		if (!delta || delta > UINT32_MAX / 2) {
+			status = SEQ_LATE;
+			goto exit;
+		}
+		if (delta == 1) {
+			status = SEQ_IN_ORDER;
+		} else {
+			status = SEQ_GAP;
+			*missed = delta - 1;
+		}
+	}
+	stream->epoch = epoch;
+	stream->last_seq = seq;
+exit:
+	pthread_mutex_unlock(&tracker->lock);
+	return status;
+}
+
+boolean_t seq_tracker_resync_due(seq_tracker_t *tracker, const char *eid_str, time_t now, unsigned int interval)
+{
+	seq_origin_t *origin;
+	boolean_t due = FALSE;
+
+	pthread_mutex_lock(&tracker->lock);
+	if ((origin = seq_tracker_origin(tracker, eid_str)) && (!origin->last_resync || now - origin->last_resync >= (time_t) interval)) {
+		origin->last_resync = now;
+		due = TRUE;
+	}
+	pthread_mutex_unlock(&tracker->lock);
+	return due;
+}
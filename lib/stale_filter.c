@@ -0,0 +1,185 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "../include/stale_filter.h"
+#include "../include/shared.h"
+
+/*
+ * declarations
+ */
+#define STALE_FILTER_MIN_BUCKETS 256
+
+typedef struct stale_entry stale_entry_t;
+struct stale_entry {
+	uint32_t hash;
+	uint64_t ts;
+	stale_entry_t *next;
+	char key[];
+};
+
+struct stale_filter {
+	pthread_mutex_t lock;
+	unsigned int count;
+	unsigned int bucket_mask;
+	stale_entry_t **buckets;
+};
+
+/*
+ * private
+ */
+static inline uint32_t stale_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;			/* FNV-1a */
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* keep the chains short, a failed grow just leaves them longer */
+static void stale_grow(stale_filter_t *filter)
+{
+	unsigned int num_buckets = (filter->bucket_mask + 1) * 2;
+	stale_entry_t **buckets, *entry;
+	unsigned int i;
+
+	if (!(buckets = calloc(num_buckets, sizeof(*buckets)))) {
+		return;
+	}
+	for (i = 0; i <= filter->bucket_mask; i++) {
+		while ((entry = filter->buckets[i])) {
+			filter->buckets[i] = entry->next;
+			entry->next = buckets[entry->hash & (num_buckets - 1)];
+			buckets[entry->hash & (num_buckets - 1)] = entry;
+		}
+	}
+	free(filter->buckets);
+	filter->buckets = buckets;
+	filter->bucket_mask = num_buckets - 1;
+}
+
+/*
+ * public
+ */
+stale_filter_t *stale_filter_new(void)
+{
+	stale_filter_t *filter;
+
+	if (!(filter = calloc(1, sizeof(*filter)))) {
+		return NULL;
+	}
+	if (!(filter->buckets = calloc(STALE_FILTER_MIN_BUCKETS, sizeof(*filter->buckets)))) {
+		free(filter);
+		return NULL;
+	}
+	filter->bucket_mask = STALE_FILTER_MIN_BUCKETS - 1;
+	pthread_mutex_init(&filter->lock, NULL);
+	return filter;
+}
+
+void stale_filter_destroy(stale_filter_t *filter)
+{
+	stale_entry_t *entry;
+	unsigned int i;
+
+	if (!filter) {
+		return;
+	}
+	for (i = 0; i <= filter->bucket_mask; i++) {
+		while ((entry = filter->buckets[i])) {
+			filter->buckets[i] = entry->next;
+			free(entry);
+		}
+	}
+	free(filter->buckets);
+	pthread_mutex_destroy(&filter->lock);
+	free(filter);
+}
+
+unsigned int stale_filter_count(stale_filter_t *filter)
+{
+	unsigned int count;
+
+	pthread_mutex_lock(&filter->lock);
+	count = filter->count;
+	pthread_mutex_unlock(&filter->lock);
+	return count;
+}
+
+stale_status_t stale_filter_check(stale_filter_t *filter, const char *key, uint64_t ts, uint64_t now, uint64_t max_age)
+{
+	uint32_t hash = stale_hash(key);
+	stale_entry_t *entry;
+	stale_status_t status = STALE_FRESH;
+	size_t key_len;
+
+	if (max_age && ts + max_age < now) {
+		return STALE_TOO_OLD;
+	}
+	pthread_mutex_lock(&filter->lock);
+	for (entry = filter->buckets[hash & filter->bucket_mask]; entry; entry = entry->next) {
+		if (entry->hash == hash && !strcmp(entry->key, key)) {
+			break;
+		}
+	}
+	if (entry) {
+		/* equal is fine, an origin can send two events within the same ms */
+		if (ts < entry->ts) {
+			status = STALE_SUPERSEDED;
+		} else {
+			entry->ts = ts;
+		}
+		goto exit;
+	}
+	key_len = strlen(key);
+	if (!(entry = malloc(sizeof(*entry) + key_len + 1))) {
+		goto exit;
+	}
+	entry->hash = hash;
+	entry->ts = ts;
+	memcpy(entry->key, key, key_len + 1);
+	entry->next = filter->buckets[hash & filter->bucket_mask];
+	filter->buckets[hash & filter->bucket_mask] = entry;
+	if (++filter->count > (filter->bucket_mask + 1) * 2) {
+		stale_grow(filter);
+	}
+exit:
+	pthread_mutex_unlock(&filter->lock);
+	return status;
+}
+
+unsigned int stale_filter_expire(stale_filter_t *filter, uint64_t before)
+{
+	stale_entry_t **pp, *entry;
+	unsigned int i, expired = 0;
+
+	pthread_mutex_lock(&filter->lock);
+	for (i = 0; i <= filter->bucket_mask; i++) {
+		for (pp = &filter->buckets[i]; (entry = *pp);) {
+			if (entry->ts < before) {
+				*pp = entry->next;
+				free(entry);
+				expired++;
+			} else {
+				pp = &entry->next;
+			}
+		}
+	}
+	filter->count -= expired;
+	pthread_mutex_unlock(&filter->lock);
+	return expired;
+}
@@ -0,0 +1,213 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../include/state_file.h"
+#include "../include/shared.h"
+
+/*
+ * declarations
+ */
+struct state_file_writer {
+	FILE *fp;
+	char *path;
+	char *tmp_path;
+	state_file_header_t header;
+};
+
+struct state_file {
+	const unsigned char *map;
+	size_t size;
+	const state_file_header_t *header;
+};
+
+/*
+ * private
+ */
+static inline uint32_t state_file_checksum(uint32_t hash, const unsigned char *data, size_t len)
+{
+	while (len--) {
+		hash ^= *data++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void state_file_writer_free(state_file_writer_t *writer)
+{
+	free(writer->path);
+	free(writer->tmp_path);
+	free(writer);
+}
+
+/*
+ * public
+ */
+state_file_writer_t *state_file_writer_new(const char *path)
+{
+	state_file_writer_t *writer;
+
+	if (!(writer = calloc(1, sizeof(*writer)))) {
+		return NULL;
+	}
+	if (!(writer->path = strdup(path)) || !(writer->tmp_path = malloc(strlen(path) + 5))) {
+		state_file_writer_free(writer);
+		return NULL;
+	}
+	sprintf(writer->tmp_path, "%s.tmp", path);
+	if (!(writer->fp = fopen(writer->tmp_path, "w"))) {
+		state_file_writer_free(writer);
+		return NULL;
+	}
+	writer->header.magic = STATE_FILE_MAGIC;
+	writer->header.version = STATE_FILE_VERSION;
+	writer->header.header_len = sizeof(state_file_header_t);
+	writer->header.checksum = 2166136261u;
+	/* placeholder, the real header is written by state_file_writer_commit() */
+	if (fwrite(&writer->header, sizeof(writer->header), 1, writer->fp) != 1) {
+		state_file_writer_abort(writer);
+		return NULL;
+	}
+	return writer;
+}
+
+exception_t state_file_writer_add(state_file_writer_t *writer, unsigned int type, const char *msg, size_t len)
+{
+	static const unsigned char padding[4] = { 0 };
+	uint16_t record[2] = { type, len };
+	size_t pad = (4 - (len + 1) % 4) % 4;
+
+	if (len > STATE_FILE_MAX_MSG || type > 0xffff) {
+		return BUFFERSIZE_EXCEPTION;
+	}
+	if (fwrite(record, sizeof(record), 1, writer->fp) != 1 || fwrite(msg, 1, len, writer->fp) != len
+		|| fwrite(padding, 1, pad + 1, writer->fp) != pad + 1) {
+		return GENERAL_EXCEPTION;
+	}
+	writer->header.checksum = state_file_checksum(writer->header.checksum, (const unsigned char *) record, sizeof(record));
+	writer->header.checksum = state_file_checksum(writer->header.checksum, (const unsigned char *) msg, len);
+	writer->header.checksum = state_file_checksum(writer->header.checksum, padding, pad + 1);
+	writer->header.records_len += sizeof(record) + len + pad + 1;
+	writer->header.count++;
+	return NO_EXCEPTION;
+}
+
+exception_t state_file_writer_commit(state_file_writer_t *writer, uint64_t created)
+{
+	exception_t res = GENERAL_EXCEPTION;
+
+	writer->header.created = created;
+	if (!fseek(writer->fp, 0, SEEK_SET) && fwrite(&writer->header, sizeof(writer->header), 1, writer->fp) == 1
+		&& !fflush(writer->fp) && !fsync(fileno(writer->fp))) {
+		res = NO_EXCEPTION;
+	}
+	if (fclose(writer->fp) || res || rename(writer->tmp_path, writer->path)) {
+		unlink(writer->tmp_path);
+		res = GENERAL_EXCEPTION;
+	}
+	state_file_writer_free(writer);
+	return res;
+}
+
+void state_file_writer_abort(state_file_writer_t *writer)
+{
+	fclose(writer->fp);
+	unlink(writer->tmp_path);
+	state_file_writer_free(writer);
+}
+
+state_file_t *state_file_open(const char *path, exception_t *res)
+{
+	state_file_t *file;
+	struct stat st;
+	int fd;
+
+	*res = EXISTS_EXCEPTION;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return NULL;
+	}
+	*res = DECODING_EXCEPTION;
+	if (fstat(fd, &st) || (size_t) st.st_size < sizeof(state_file_header_t)) {
+		close(fd);
+		return NULL;
+	}
+	if (!(file = calloc(1, sizeof(*file)))) {
+		*res = MALLOC_EXCEPTION;
+		close(fd);
+		return NULL;
+	}
+	file->size = st.st_size;
+	file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (file->map == MAP_FAILED) {
+		*res = GENERAL_EXCEPTION;
+		free(file);
+		return NULL;
+	}
+	file->header = (const state_file_header_t *) file->map;
+	if (file->header->magic != STATE_FILE_MAGIC || file->header->version != STATE_FILE_VERSION
+		|| file->header->header_len != sizeof(state_file_header_t)
+		|| file->header->records_len != file->size - sizeof(state_file_header_t)
+		|| state_file_checksum(2166136261u, file->map + sizeof(state_file_header_t), file->header->records_len) != file->header->checksum) {
+		state_file_close(file);
+		return NULL;
+	}
+	*res = NO_EXCEPTION;
+	return file;
+}
+
+void state_file_close(state_file_t *file)
+{
+	if (!file) {
+		return;
+	}
+	munmap((void *) file->map, file->size);
+	free(file);
+}
+
+const state_file_header_t *state_file_header(state_file_t *file)
+{
+	return file->header;
+}
+
+/* start with *cursor = 0 */
+exception_t state_file_next(state_file_t *file, size_t *cursor, unsigned int *type, const char **msg, size_t *len)
+{
+	const unsigned char *records = file->map + sizeof(state_file_header_t);
+	size_t remaining = file->header->records_len - *cursor;
+	uint16_t record[2];
+	size_t pad;
+
+	*msg = NULL;
+	if (!remaining) {
+		return NO_EXCEPTION;
+	}
+	if (remaining < sizeof(record)) {
+		return DECODING_EXCEPTION;
+	}
+	memcpy(record, records + *cursor, sizeof(record));
+	pad = (4 - (record[1] + 1) % 4) % 4;
+	if (remaining < sizeof(record) + record[1] + pad + 1 || records[*cursor + sizeof(record) + record[1]] != '\0') {
+		return DECODING_EXCEPTION;
+	}
+	*type = record[0];
+	*msg = (const char *) records + *cursor + sizeof(record);
+	*len = record[1];
+	*cursor += sizeof(record) + record[1] + pad + 1;
+	return NO_EXCEPTION;
+}
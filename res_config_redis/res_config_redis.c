@@ -22,33 +22,1313 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 419592 $")
 #include <asterisk/threadstorage.h>
 
 #include "config.h"
- 
-AST_MUTEX_DEFINE_STATIC(redis_lock);
-AST_THREADSTORAGE(query_buf);
-AST_THREADSTORAGE(result_buf);
+#include "../include/shared.h"
+#include "../include/realtime_match.h"
+#include "../include/conn_pool.h"
+#include "../include/realtime_cache.h"
+#include "../include/bloom_filter.h"
+
+#include <sys/socket.h>
+
+AST_MUTEX_DEFINE_STATIC(redis_lock);				/* guards the settings below, never held during a request */
+AST_THREADSTORAGE(query_buf);				/* row key */
+AST_THREADSTORAGE(result_buf);				/* table key */
 
 #define RES_CONFIG_REDIS_CONF "res_config_redis.conf"
 
-static redisContext *redisConn = NULL;
+/*
+ * Tables are stored as one redis hash per row plus a set of row ids:
+ *
+ *   <database>:<table>:<id>	HASH	field -> value
+ *   <database>:<table>		SET	<id>, ...
+ *
+ * <id> is the value of the table's key field (keyfield, or the table entry
+ * in [keyfields]). An equality lookup on the key field is a single HGETALL;
+ * any other lookup walks the id set with pipelined HGETALLs and filters
+ * locally.
+ */
+static conn_pool_t *pool = NULL;
+
+/*
+ * connection_mode = thread: every Asterisk thread that does realtime
+ * lookups keeps its own lazily connected context in thread storage. The
+ * only lock on the request path is the slot's own mutex, which nobody but
+ * the reaper ever contends for. Slots are linked into a registry so idle
+ * contexts can be closed from whichever thread happens to run the reaper.
+ */
+struct redis_thread_conn {
+	ast_mutex_t lock;				/* held by the owner for the duration of a request */
+	redisContext *ctx;
+	time_t last_used;
+	int generation;					/* reconnect after a reload */
+	struct redis_thread_conn *prev;
+	struct redis_thread_conn *next;
+};
+
+static int redis_thread_conn_init(void *data);
+static void redis_thread_conn_cleanup(void *data);
+AST_THREADSTORAGE_CUSTOM(thread_conn_buf, redis_thread_conn_init, redis_thread_conn_cleanup);
+AST_MUTEX_DEFINE_STATIC(thread_conns_lock);
+static struct redis_thread_conn *thread_conns = NULL;
+static int thread_conns_freed = 0;			/* unload freed every slot */
+static time_t thread_conns_reaped_at = 0;
+static int conn_generation = 0;
+static int thread_conns_open = 0;
+static int thread_conns_connects = 0;
+static int thread_conns_reaps = 0;
+
+/*
+ * cache = yes: realtime_redis() results are kept in a sharded LRU, tagged
+ * with the row key they came from (lookup by key field) or the table key
+ * (any other lookup). A background thread holds a blocking connection
+ * PSUBSCRIBEd to the keyspace notifications of the cached tables and drops
+ * the entries whose row or table changed. The cache is only used while
+ * that subscription is up; it is flushed whenever it drops.
+ *
+ * cache_invalidation = tracking uses redis 6 client side caching instead:
+ * that connection SUBSCRIBEs to __redis__:invalidate and every request
+ * connection enables CLIENT TRACKING with REDIRECT to it, so redis only
+ * reports keys this node has read.
+ */
+static realtime_cache_t *cache = NULL;
+static int cache_ready = 0;
+static pthread_t notify_thread = AST_PTHREADT_NULL;
+AST_MUTEX_DEFINE_STATIC(notify_lock);
+static redisContext *notify_ctx = NULL;
+static int notify_stop = 0;
+static int cache_tracking = 0;				/* CLIENT TRACKING instead of keyspace notifications */
+static long long tracking_redirect = 0;			/* client id of the invalidation connection */
+
 
 #define MAX_DB_OPTION_SIZE 64
-static char hostname[MAX_DB_OPTION_SIZE] = "";
-//static char dbuser[MAX_DB_OPTION_SIZE] = "";
-//static char dbpass[MAX_DB_OPTION_SIZE] = "";
-//static char dbname[MAX_DB_OPTION_SIZE] = "";
-//static char dbappname[MAX_DB_OPTION_SIZE] = "";
-//static char dbsock[MAX_DB_OPTION_SIZE] = "";
+#define MAX_FIELDS 64					/* per realtime call */
+#define MAX_KEYFIELDS 32
+#define SCAN_CHUNK 256					/* HGETALLs per pipeline round trip */
+#define INDEX_SEP "\x1f"				/* between value and id in sorted set members */
+#define UNLOAD_DRAIN_MS 5000				/* wait for realtime requests in flight on unload */
+static char hostname[MAX_DB_OPTION_SIZE] = "127.0.0.1";
+static char dbpass[MAX_DB_OPTION_SIZE] = "";
+static char dbsock[MAX_DB_OPTION_SIZE] = "";
 static int port = 6379;
-struct timeval timeout = { 1, 500000 }; 	// 1.5 seconds
+static int dbnum = 0;
+static struct timeval timeout = { 1, 500000 }; 	// 1.5 seconds
+static unsigned int max_connections = 8;
+static unsigned int pool_wait = 500;			/* ms */
+static int thread_mode = 0;
+static unsigned int thread_idle_timeout = 300;		/* seconds, 0 keeps them */
+static int cache_enabled = 0;
+static unsigned int cache_size = 4096;
+static unsigned int cache_ttl = 60;			/* seconds, bounds staleness while a lost subscription goes unnoticed */
+static unsigned int cache_shards = 16;
+static char cache_tables[MAX_KEYFIELDS][MAX_DB_OPTION_SIZE];	/* none: every table */
+static unsigned int num_cache_tables = 0;
+static int negative_cache_enabled = 0;
+static unsigned int negative_cache_size = 8192;
+static unsigned int negative_cache_ttl = 5;		/* seconds */
+static char bloom_tables[MAX_KEYFIELDS][MAX_DB_OPTION_SIZE];
+static unsigned int num_bloom_tables = 0;
+static unsigned int bloom_entries = 100000;		/* expected rows per table, 10 bits each */
+static unsigned int bloom_rebuild = 3600;		/* seconds, 0 never */
+static char default_keyfield[MAX_DB_OPTION_SIZE] = "name";
+static struct {
+	char table[MAX_DB_OPTION_SIZE];
+	char field[MAX_DB_OPTION_SIZE];
+} keyfields[MAX_KEYFIELDS];
+static unsigned int num_keyfields = 0;
+static struct {
+	char table[MAX_DB_OPTION_SIZE];
+	char field[MAX_DB_OPTION_SIZE];
+} indexes[MAX_KEYFIELDS];
+static unsigned int num_indexes = 0;
+
+/*
+ * negative_cache = yes: lookups that found nothing are remembered for
+ * negative_cache_ttl seconds, so a scanner hammering unknown usernames is
+ * answered locally. Entries are tagged like the positive cache and dropped
+ * by local writes and, while it runs, by the invalidation subscription.
+ *
+ * bloom_tables: a Bloom filter of the row ids of each listed table, filled
+ * with SSCAN over the id set and kept current from keyspace notifications
+ * and local stores. A lookup by key field whose id is not in the filter is
+ * answered without asking redis. The filter cannot forget ids, so it is
+ * rebuilt every bloom_rebuild seconds; it is only trusted while keyspace
+ * notifications are flowing and is rebuilt after they resume. Rebuilds run
+ * on bloom_thread into a new filter that is swapped in when complete, a
+ * filter that is merely old keeps answering meanwhile.
+ */
+static realtime_cache_t *negative = NULL;
+static int negative_hits = 0;
+
+enum redis_bloom_state {
+	BLOOM_STALE = 0,
+	BLOOM_READY,
+};
+
+struct redis_bloom {
+	char table_key[MAX_DB_OPTION_SIZE * 2 + 2];	/* <database>:<table> */
+	ast_mutex_t lock;
+	bloom_filter_t *filter;				/* answers while BLOOM_READY */
+	bloom_filter_t *next;				/* being rebuilt, NULL otherwise */
+	enum redis_bloom_state state;
+	int rebuild;					/* queued for or running on bloom_thread */
+	int epoch;					/* bumped when marked stale, voids a rebuild in progress */
+	time_t built;
+};
+AST_MUTEX_DEFINE_STATIC(blooms_lock);			/* guards num_blooms and the bloom_thread wakeup, entries never move */
+static struct redis_bloom blooms[MAX_KEYFIELDS];
+static unsigned int num_blooms = 0;
+static int bloom_rejects = 0;
+static pthread_t bloom_thread = AST_PTHREADT_NULL;
+static ast_cond_t bloom_cond;
+static int bloom_wakeup = 0;
+static int bloom_stop = 0;
+
+struct redis_field {
+	const char *name;
+	const char *value;
+};
+
+typedef int (*redis_row_cb)(redisContext *ctx, const char *id, redisReply *hash, void *data);
+
+struct redis_id_list {
+	char **ids;
+	int count;
+	int size;
+};
 
 static int parse_config(int reload);
-static int redis_reconnect(const char *database);
+static redisContext *redis_open(int tracking);
+static void *redis_connect(void *data);
+static void redis_disconnect(void *conn, void *data);
 static char *handle_cli_realtime_redis_status(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+static char *handle_cli_realtime_redis_reindex(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
 
 static struct ast_cli_entry cli_realtime[] = {
 	AST_CLI_DEFINE(handle_cli_realtime_redis_status, "Shows connection information for the Redis RealTime driver"),
+	AST_CLI_DEFINE(handle_cli_realtime_redis_reindex, "Rebuilds the secondary indexes of a Redis RealTime table"),
+};
+
+/*
+ * field lists
+ */
+#ifdef HAVE_PBX_VERSION_11
+/* name/value pairs up to a NULL name; with second, a second list follows the first (update2) */
+static int redis_fields_va(va_list ap, struct redis_field *first, int *num_first, struct redis_field *second, int *num_second)
+{
+	struct redis_field *fields = first;
+	int *num = num_first;
+	const char *name;
+
+	*num_first = 0;
+	if (num_second) {
+		*num_second = 0;
+	}
+	for (;;) {
+		if (!(name = va_arg(ap, const char *))) {
+			if (fields == first && second) {
+				fields = second;
+				num = num_second;
+				continue;
+			}
+			return 0;
+		}
+		if (*num >= MAX_FIELDS) {
+			ast_log(LOG_WARNING, "More than %d fields in realtime request\n", MAX_FIELDS);
+			return -1;
+		}
+		fields[*num].name = name;
+		fields[(*num)++].value = va_arg(ap, const char *);
+	}
+}
+#else
+static int redis_fields_list(const struct ast_variable *vars, struct redis_field *fields, int *num)
+{
+	for (*num = 0; vars; vars = vars->next) {
+		if (*num >= MAX_FIELDS) {
+			ast_log(LOG_WARNING, "More than %d fields in realtime request\n", MAX_FIELDS);
+			return -1;
+		}
+		fields[*num].name = vars->name;
+		fields[(*num)++].value = vars->value;
+	}
+	return 0;
+}
+#endif
+
+static int redis_filters(const struct redis_field *fields, int num, realtime_filter_t *filters)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (realtime_filter_parse(&filters[i], fields[i].name, fields[i].value) != NO_EXCEPTION) {
+			ast_log(LOG_WARNING, "Unsupported realtime field '%s'\n", fields[i].name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * keys
+ */
+static void redis_keyfield(const char *table, char *field, size_t len)
+{
+	unsigned int i;
+
+	ast_mutex_lock(&redis_lock);
+	ast_copy_string(field, default_keyfield, len);
+	for (i = 0; i < num_keyfields; i++) {
+		if (!strcmp(keyfields[i].table, table)) {
+			ast_copy_string(field, keyfields[i].field, len);
+			break;
+		}
+	}
+	ast_mutex_unlock(&redis_lock);
+}
+
+static const char *redis_table_key(const char *database, const char *table)
+{
+	struct ast_str *buf = ast_str_thread_get(&result_buf, 64);
+
+	if (!buf) {
+		return NULL;
+	}
+	ast_str_set(&buf, 0, "%s:%s", database, table);
+	return ast_str_buffer(buf);
+}
+
+static const char *redis_row_key(const char *database, const char *table, const char *id)
+{
+	struct ast_str *buf = ast_str_thread_get(&query_buf, 128);
+
+	if (!buf) {
+		return NULL;
+	}
+	ast_str_set(&buf, 0, "%s:%s:%s", database, table, id);
+	return ast_str_buffer(buf);
+}
+
+/* index of the equality filter on the table's key field, -1 when the lookup needs a table walk */
+static int redis_key_filter(const char *table, const realtime_filter_t *filters, int num_filters)
+{
+	char keyfield[MAX_DB_OPTION_SIZE];
+	int i;
+
+	redis_keyfield(table, keyfield, sizeof(keyfield));
+	for (i = 0; i < num_filters; i++) {
+		if (filters[i].op == RT_OP_EQ && !strcmp(filters[i].field, keyfield)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * rows
+ */
+static const char *redis_row_field(const redisReply *hash, const char *field)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < hash->elements; i += 2) {
+		if (!strcmp(hash->element[i]->str, field)) {
+			return hash->element[i + 1]->str;
+		}
+	}
+	return NULL;
+}
+
+static int redis_row_matches(const redisReply *hash, const realtime_filter_t *filters, int num_filters)
+{
+	int i;
+
+	if (hash->type != REDIS_REPLY_ARRAY || !hash->elements) {
+		return 0;
+	}
+	for (i = 0; i < num_filters; i++) {
+		if (!realtime_filter_match(&filters[i], redis_row_field(hash, filters[i].field))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static struct ast_variable *redis_row_variables(const redisReply *hash)
+{
+	struct ast_variable *var = NULL, *prev = NULL, *new_var;
+	size_t i;
+
+	for (i = 0; i + 1 < hash->elements; i += 2) {
+		if (!(new_var = ast_variable_new(hash->element[i]->str, hash->element[i + 1]->str, ""))) {
+			ast_variables_destroy(var);
+			return NULL;
+		}
+		if (prev) {
+			prev->next = new_var;
+		} else {
+			var = new_var;
+		}
+		prev = new_var;
+	}
+	return var;
+}
+
+/* older hiredis does not accept NULL */
+static void redis_reply_free(redisReply *reply)
+{
+	if (reply) {
+		freeReplyObject(reply);
+	}
+}
+
+static int redis_reply_failed(redisContext *ctx, redisReply *reply, const char *command)
+{
+	if (!reply) {
+		ast_log(LOG_ERROR, "Redis %s failed: %s\n", command, ctx->errstr);
+		return 1;
+	}
+	if (reply->type == REDIS_REPLY_ERROR) {
+		ast_log(LOG_WARNING, "Redis %s failed: %s\n", command, reply->str);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * secondary indexes, [indexes]
+ *
+ * <database>:<table>#<field>=<value>	SET   ids of the rows with that value
+ * <database>:<table>#<field>		ZSET  <value>\x1f<id>, all scores 0, for ZRANGEBYLEX
+ * <database>:<table>#			SET   fields whose index is complete
+ *
+ * Writes keep the entries of every configured field; an index is only read
+ * once 'realtime redis reindex' has filled it from the existing rows and
+ * listed the field in the catalog. Rows found through an index are checked
+ * against all filters again, so a stale entry costs an HGETALL, never a
+ * wrong answer.
+ */
+static int redis_index_fields(const char *table, char fields[MAX_KEYFIELDS][MAX_DB_OPTION_SIZE])
+{
+	unsigned int i;
+	int num = 0;
+
+	ast_mutex_lock(&redis_lock);
+	for (i = 0; i < num_indexes; i++) {
+		if (!strcmp(indexes[i].table, table)) {
+			ast_copy_string(fields[num++], indexes[i].field, MAX_DB_OPTION_SIZE);
+		}
+	}
+	ast_mutex_unlock(&redis_lock);
+	return num;
+}
+
+/* row ids in a SMEMBERS or, with sorted, a ZRANGEBYLEX reply; they point into reply */
+static char **redis_reply_ids(const redisReply *reply, int sorted, size_t *num)
+{
+	char **ids;
+	char *sep;
+	size_t i;
+
+	*num = 0;
+	if (!(ids = ast_malloc((reply->elements ? reply->elements : 1) * sizeof(char *)))) {
+		return NULL;
+	}
+	for (i = 0; i < reply->elements; i++) {
+		if (!sorted) {
+			ids[(*num)++] = reply->element[i]->str;
+		} else if ((sep = strrchr(reply->element[i]->str, INDEX_SEP[0]))) {
+			ids[(*num)++] = sep + 1;
+		}
+	}
+	return ids;
+}
+
+/*
+ * Row ids from the index of one of the filters: the set for an equality,
+ * a ZRANGEBYLEX for a LIKE with a literal prefix. Returns 1 with *reply
+ * and *ids set, 0 when no complete index applies, -1 on error.
+ */
+static int redis_index_lookup(redisContext *ctx, const char *database, const char *table, const realtime_filter_t *filters, int num_filters,
+	redisReply **reply, char ***ids, size_t *num_ids)
+{
+	char fields[MAX_KEYFIELDS][MAX_DB_OPTION_SIZE];
+	char prefix[256];
+	const char *field = NULL, *value = NULL;
+	redisReply *ready = NULL;
+	int num_fields, pass, exact = 0, i, j;
+
+	if (!(num_fields = redis_index_fields(table, fields))) {
+		return 0;
+	}
+	/* an equality narrows best, a prefix next */
+	for (pass = 0; pass < 2 && !field; pass++) {
+		for (i = 0; i < num_filters && !field; i++) {
+			for (j = 0; j < num_fields && strcmp(fields[j], filters[i].field); j++);
+			if (j == num_fields) {
+				continue;
+			}
+			if (!pass && filters[i].op == RT_OP_EQ) {
+				field = filters[i].field;
+				value = filters[i].value;
+				exact = 1;
+			} else if (pass && filters[i].op == RT_OP_LIKE) {
+				exact = realtime_like_prefix(filters[i].value, prefix, sizeof(prefix));
+				if (!ast_strlen_zero(prefix)) {
+					field = filters[i].field;
+					value = prefix;
+				}
+			}
+		}
+	}
+	if (!field) {
+		return 0;
+	}
+
+	if ((exact ? redisAppendCommand(ctx, "SMEMBERS %s:%s#%s=%s", database, table, field, value) :
+		redisAppendCommand(ctx, "ZRANGEBYLEX %s:%s#%s [%s [%s\xff", database, table, field, value, value)) != REDIS_OK ||
+		redisAppendCommand(ctx, "SISMEMBER %s:%s# %s", database, table, field) != REDIS_OK) {
+		return -1;
+	}
+	*reply = NULL;
+	if (redisGetReply(ctx, (void **) reply) != REDIS_OK || redisGetReply(ctx, (void **) &ready) != REDIS_OK) {
+		ast_log(LOG_ERROR, "Redis index lookup failed: %s\n", ctx->errstr);
+		redis_reply_free(*reply);
+		return -1;
+	}
+	if (redis_reply_failed(ctx, *reply, exact ? "SMEMBERS" : "ZRANGEBYLEX") || redis_reply_failed(ctx, ready, "SISMEMBER")) {
+		redis_reply_free(*reply);
+		redis_reply_free(ready);
+		return -1;
+	}
+	if (ready->type != REDIS_REPLY_INTEGER || ready->integer != 1) {
+		ast_debug(1, "Index of '%s' in '%s' not built yet, scanning\n", field, table);
+		redis_reply_free(*reply);
+		redis_reply_free(ready);
+		return 0;
+	}
+	redis_reply_free(ready);
+	if (!(*ids = redis_reply_ids(*reply, !exact, num_ids))) {
+		redis_reply_free(*reply);
+		return -1;
+	}
+	return 1;
+}
+
+/* pipelined HMGET of fields for each id, one reply per id; NULL on error */
+static redisReply **redis_index_read(redisContext *ctx, const char *database, const char *table, char **ids, int count, const char **fields, int num_fields)
+{
+	const char *argv[2 + MAX_KEYFIELDS];
+	redisReply **olds;
+	int appended, i;
+
+	if (!(olds = ast_calloc(count ? count : 1, sizeof(*olds)))) {
+		return NULL;
+	}
+	argv[0] = "HMGET";
+	memcpy(argv + 2, fields, num_fields * sizeof(*fields));
+	for (appended = 0; appended < count; appended++) {
+		if (!(argv[1] = redis_row_key(database, table, ids[appended])) || redisAppendCommandArgv(ctx, 2 + num_fields, argv, NULL) != REDIS_OK) {
+			break;
+		}
+	}
+	for (i = 0; i < appended; i++) {
+		if (redisGetReply(ctx, (void **) &olds[i]) != REDIS_OK) {
+			ast_log(LOG_ERROR, "Redis HMGET failed: %s\n", ctx->errstr);
+			break;
+		}
+	}
+	if (i < count) {
+		for (i = 0; i < count; i++) {
+			redis_reply_free(olds[i]);
+		}
+		ast_free(olds);
+		return NULL;
+	}
+	return olds;
+}
+
+static void redis_index_olds_free(redisReply **olds, int count)
+{
+	int i;
+
+	if (olds) {
+		for (i = 0; i < count; i++) {
+			redis_reply_free(olds[i]);
+		}
+		ast_free(olds);
+	}
+}
+
+/* field n of an HMGET reply, NULL when the row does not have it */
+static const char *redis_index_old(const redisReply *old, int n)
+{
+	if (!old || old->type != REDIS_REPLY_ARRAY || (size_t) n >= old->elements || old->element[n]->type != REDIS_REPLY_STRING) {
+		return NULL;
+	}
+	return old->element[n]->str;
+}
+
+/* appends the commands that move id from old to value in the index of field; returns how many, -1 on error */
+static int redis_index_append(redisContext *ctx, const char *database, const char *table, const char *field, const char *id, const char *old, const char *value)
+{
+	int num = 0;
+
+	if (old && value && !strcmp(old, value)) {
+		return 0;
+	}
+	if (old) {
+		if (redisAppendCommand(ctx, "SREM %s:%s#%s=%s %s", database, table, field, old, id) != REDIS_OK ||
+			redisAppendCommand(ctx, "ZREM %s:%s#%s %s" INDEX_SEP "%s", database, table, field, old, id) != REDIS_OK) {
+			return -1;
+		}
+		num += 2;
+	}
+	if (value) {
+		if (redisAppendCommand(ctx, "SADD %s:%s#%s=%s %s", database, table, field, value, id) != REDIS_OK ||
+			redisAppendCommand(ctx, "ZADD %s:%s#%s 0 %s" INDEX_SEP "%s", database, table, field, value, id) != REDIS_OK) {
+			return -1;
+		}
+		num += 2;
+	}
+	return num;
+}
+
+/*
+ * A pipeline that could not be queued completely. Appended commands are only
+ * sent by the first read, so none of it reached redis; the connection is
+ * marked broken and closed on release, together with its output buffer and
+ * any MULTI / WATCH it was in.
+ */
+static void redis_pipeline_abort(redisContext *ctx)
+{
+	ast_log(LOG_ERROR, "Could not queue a redis pipeline, dropping the connection\n");
+	ctx->err = REDIS_ERR_OTHER;
+	ast_copy_string(ctx->errstr, "pipeline aborted", sizeof(ctx->errstr));
+}
+
+/* reads num pipelined replies; -1 when any failed, including commands inside an EXEC */
+static int redis_pipeline_read(redisContext *ctx, int num, const char *command)
+{
+	redisReply *reply;
+	int i, res = 0;
+	size_t j;
+
+	for (i = 0; i < num; i++) {
+		if (redisGetReply(ctx, (void **) &reply) != REDIS_OK) {
+			ast_log(LOG_ERROR, "Redis %s failed: %s\n", command, ctx->errstr);
+			return -1;
+		}
+		if (redis_reply_failed(ctx, reply, command)) {
+			res = -1;
+		} else if (reply->type == REDIS_REPLY_ARRAY) {
+			for (j = 0; j < reply->elements; j++) {
+				if (redis_reply_failed(ctx, reply->element[j], command)) {
+					res = -1;
+				}
+			}
+		}
+		redis_reply_free(reply);
+	}
+	return res;
+}
+
+/*
+ * Hands every row of table that satisfies all filters to callback, until
+ * it returns non-zero. Returns the number of rows handed out, -1 on error.
+ * Candidates come from the key field, an index, or the table's id set.
+ */
+static int redis_find_rows(redisContext *ctx, const char *database, const char *table, const realtime_filter_t *filters, int num_filters, redis_row_cb callback, void *data)
+{
+	const char *table_key;
+	const char *argv[2] = { "HGETALL", NULL };
+	redisReply *reply = NULL, *hash;
+	char **ids;
+	size_t num_ids, start, end, i;
+	int found = 0, stop = 0, res = 0, key;
+
+	if ((key = redis_key_filter(table, filters, num_filters)) >= 0) {
+		if (!(argv[1] = redis_row_key(database, table, filters[key].value))) {
+			return -1;
+		}
+		hash = redisCommandArgv(ctx, 2, argv, NULL);
+		if (redis_reply_failed(ctx, hash, "HGETALL")) {
+			redis_reply_free(hash);
+			return -1;
+		}
+		if (redis_row_matches(hash, filters, num_filters)) {
+			callback(ctx, filters[key].value, hash, data);
+			found = 1;
+		}
+		redis_reply_free(hash);
+		return found;
+	}
+
+	if ((res = redis_index_lookup(ctx, database, table, filters, num_filters, &reply, &ids, &num_ids)) < 0) {
+		return -1;
+	}
+	if (!res) {
+		if (!(table_key = redis_table_key(database, table))) {
+			return -1;
+		}
+		reply = redisCommand(ctx, "SMEMBERS %s", table_key);
+		if (redis_reply_failed(ctx, reply, "SMEMBERS") || !(ids = redis_reply_ids(reply, 0, &num_ids))) {
+			redis_reply_free(reply);
+			return -1;
+		}
+	}
+	res = 0;
+	for (start = 0; start < num_ids && !stop && !res; start = end) {
+		end = start + SCAN_CHUNK < num_ids ? start + SCAN_CHUNK : num_ids;
+		for (i = start; i < end; i++) {
+			if (!(argv[1] = redis_row_key(database, table, ids[i])) || redisAppendCommandArgv(ctx, 2, argv, NULL) != REDIS_OK) {
+				res = -1;
+				break;
+			}
+		}
+		/* read back every reply that went out, so the connection stays in sync */
+		end = i;
+		for (i = start; i < end; i++) {
+			if (redisGetReply(ctx, (void **) &hash) != REDIS_OK) {
+				ast_log(LOG_ERROR, "Redis HGETALL failed: %s\n", ctx->errstr);
+				res = -1;
+				break;
+			}
+			if (!stop && hash->type == REDIS_REPLY_ARRAY && redis_row_matches(hash, filters, num_filters)) {
+				found++;
+				stop = callback(ctx, ids[i], hash, data);
+			}
+			redis_reply_free(hash);
+		}
+	}
+	ast_free(ids);
+	redis_reply_free(reply);
+	return res ? res : found;
+}
+
+/*
+ * cache
+ */
+static uint64_t redis_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int redis_cache_table(const char *table)
+{
+	unsigned int i;
+	int res;
+
+	if (!cache || !cache_ready) {
+		return 0;
+	}
+	ast_mutex_lock(&redis_lock);
+	res = !num_cache_tables;
+	for (i = 0; i < num_cache_tables && !res; i++) {
+		res = !strcmp(cache_tables[i], table);
+	}
+	ast_mutex_unlock(&redis_lock);
+	return res;
+}
+
+/* <database>:<table> followed by the lookup fields as passed, including their operators */
+static const char *redis_cache_key(char *buf, size_t len, const char *database, const char *table, const struct redis_field *fields, int num)
+{
+	size_t used = snprintf(buf, len, "%s:%s", database, table);
+	int i;
+
+	for (i = 0; i < num && used < len; i++) {
+		used += snprintf(buf + used, len - used, "\x1f%s\x1f%s", fields[i].name, S_OR(fields[i].value, ""));
+	}
+	return used < len ? buf : NULL;
+}
+
+struct redis_cache_hit {
+	struct ast_variable *var;
+	struct ast_variable *last;
+	int failed;
 };
 
+static void redis_cache_hit_cb(const char *name, const char *value, void *data)
+{
+	struct redis_cache_hit *hit = data;
+	struct ast_variable *new_var;
+
+	if (hit->failed || !(new_var = ast_variable_new(name, value, ""))) {
+		hit->failed = 1;
+		return;
+	}
+	if (hit->last) {
+		hit->last->next = new_var;
+	} else {
+		hit->var = new_var;
+	}
+	hit->last = new_var;
+}
+
+static void redis_cache_store(const char *key, const char *tag, const struct ast_variable *var, unsigned long epoch)
+{
+	const struct ast_variable *v;
+	const char **names;
+	const char **values;
+	unsigned int num = 0;
+
+	for (v = var; v; v = v->next) {
+		num++;
+	}
+	if (!(names = ast_malloc(num * 2 * sizeof(char *)))) {
+		return;
+	}
+	values = names + num;
+	for (num = 0, v = var; v; v = v->next, num++) {
+		names[num] = v->name;
+		values[num] = v->value;
+	}
+	realtime_cache_put(cache, key, tag, names, values, num, epoch, redis_now_ms());
+	ast_free(names);
+}
+
+/* a local write; the keyspace notification will follow, but this node reads its own writes right away */
+static void redis_caches_drop(const char *tag)
+{
+	if (cache) {
+		realtime_cache_invalidate(cache, tag);
+	}
+	if (negative) {
+		realtime_cache_invalidate(negative, tag);
+	}
+}
+
+static void redis_cache_invalidate(const char *database, const char *table, const struct redis_id_list *list)
+{
+	const char *key;
+	int i;
+
+	if (!cache && !negative) {
+		return;
+	}
+	for (i = 0; list && i < list->count; i++) {
+		if ((key = redis_row_key(database, table, list->ids[i]))) {
+			redis_caches_drop(key);
+		}
+	}
+	if ((key = redis_table_key(database, table))) {
+		redis_caches_drop(key);
+	}
+}
+
+/* collects matching row ids for the write paths, which must not pipeline while a scan is being read */
+static int redis_collect_id(redisContext *ctx, const char *id, redisReply *hash, void *data)
+{
+	struct redis_id_list *list = data;
+	char **ids;
+
+	if (list->count == list->size) {
+		if (!(ids = ast_realloc(list->ids, (list->size ? list->size * 2 : 16) * sizeof(char *)))) {
+			return 1;
+		}
+		list->ids = ids;
+		list->size = list->size ? list->size * 2 : 16;
+	}
+	if ((list->ids[list->count] = ast_strdup(id))) {
+		list->count++;
+	}
+	return 0;
+}
+
+static void redis_id_list_free(struct redis_id_list *list)
+{
+	int i;
+
+	for (i = 0; i < list->count; i++) {
+		ast_free(list->ids[i]);
+	}
+	ast_free(list->ids);
+}
+
+/*
+ * HSET the update fields on every row matching filters, returns the number
+ * of rows or -1. When an indexed field changes, the old values are read
+ * first and each row is updated with its index entries in one MULTI.
+ */
+static int redis_update_rows(redisContext *ctx, const char *database, const char *table, const realtime_filter_t *filters, int num_filters, const struct redis_field *updates, int num_updates)
+{
+	char keyfield[MAX_DB_OPTION_SIZE];
+	char fields[MAX_KEYFIELDS][MAX_DB_OPTION_SIZE];
+	const char *argv[2 + MAX_FIELDS * 2];
+	const char *index_names[MAX_KEYFIELDS], *index_values[MAX_KEYFIELDS];
+	struct redis_id_list list = { NULL, 0, 0 };
+	redisReply **olds = NULL;
+	int argc, i, j, k, res, num_fields, num_indexed = 0, queued = 0;
+
+	if (!num_updates) {
+		return 0;
+	}
+	redis_keyfield(table, keyfield, sizeof(keyfield));
+	num_fields = redis_index_fields(table, fields);
+	for (i = 0; i < num_updates; i++) {
+		if (!strcmp(updates[i].name, keyfield)) {
+			ast_log(LOG_WARNING, "Cannot update key field '%s' of table '%s'\n", keyfield, table);
+			return -1;
+		}
+		argv[2 + i * 2] = updates[i].name;
+		argv[3 + i * 2] = S_OR(updates[i].value, "");
+		for (j = 0; j < num_fields && strcmp(fields[j], updates[i].name); j++);
+		if (j < num_fields && num_indexed < MAX_KEYFIELDS) {
+			index_names[num_indexed] = updates[i].name;
+			index_values[num_indexed++] = argv[3 + i * 2];
+		}
+	}
+	argv[0] = "HMSET";
+	argc = 2 + num_updates * 2;
+
+	if ((res = redis_find_rows(ctx, database, table, filters, num_filters, redis_collect_id, &list)) <= 0) {
+		redis_id_list_free(&list);
+		return res;
+	}
+	if (num_indexed && !(olds = redis_index_read(ctx, database, table, list.ids, list.count, index_names, num_indexed))) {
+		redis_id_list_free(&list);
+		return -1;
+	}
+	for (i = 0; i < list.count; i++) {
+		if (olds) {
+			if (redisAppendCommand(ctx, "MULTI") != REDIS_OK) {
+				break;
+			}
+			queued++;
+		}
+		if (!(argv[1] = redis_row_key(database, table, list.ids[i])) || redisAppendCommandArgv(ctx, argc, argv, NULL) != REDIS_OK) {
+			break;
+		}
+		queued++;
+		for (j = 0; j < num_indexed && (k = redis_index_append(ctx, database, table, index_names[j], list.ids[i], redis_index_old(olds[i], j), index_values[j])) >= 0; j++) {
+			queued += k;
+		}
+		if (j < num_indexed) {
+			break;
+		}
+		if (olds) {
+			if (redisAppendCommand(ctx, "EXEC") != REDIS_OK) {
+				break;
+			}
+			queued++;
+		}
+	}
+	if (i < list.count) {
+		/* possibly inside a MULTI: send nothing at all */
+		redis_pipeline_abort(ctx);
+		res = -1;
+	} else if ((res = i) && redis_pipeline_read(ctx, queued, "HMSET") < 0) {
+		res = -1;
+	}
+	redis_index_olds_free(olds, list.count);
+	redis_cache_invalidate(database, table, &list);
+	redis_id_list_free(&list);
+	return res;
+}
+
+/*
+ * per-thread contexts
+ */
+static int redis_thread_conn_init(void *data)
+{
+	struct redis_thread_conn *conn = data;
+
+	ast_mutex_init(&conn->lock);
+	ast_mutex_lock(&thread_conns_lock);
+	conn->next = thread_conns;
+	if (thread_conns) {
+		thread_conns->prev = conn;
+	}
+	thread_conns = conn;
+	ast_mutex_unlock(&thread_conns_lock);
+	return 0;
+}
+
+/* thread exit */
+static void redis_thread_conn_cleanup(void *data)
+{
+	struct redis_thread_conn *conn = data;
+
+	ast_mutex_lock(&thread_conns_lock);
+	if (thread_conns_freed) {
+		ast_mutex_unlock(&thread_conns_lock);
+		return;
+	}
+	if (conn->prev) {
+		conn->prev->next = conn->next;
+	} else {
+		thread_conns = conn->next;
+	}
+	if (conn->next) {
+		conn->next->prev = conn->prev;
+	}
+	ast_mutex_unlock(&thread_conns_lock);
+	if (conn->ctx) {
+		redisFree(conn->ctx);
+		ast_atomic_fetchadd_int(&thread_conns_open, -1);
+	}
+	ast_mutex_destroy(&conn->lock);
+	ast_free(conn);
+}
+
+static void redis_thread_conn_close(struct redis_thread_conn *conn)
+{
+	if (conn->ctx) {
+		redisFree(conn->ctx);
+		conn->ctx = NULL;
+		ast_atomic_fetchadd_int(&thread_conns_open, -1);
+	}
+}
+
+/* close contexts other threads have not used for thread_idle_timeout, skipping any that are busy */
+static void redis_thread_conns_reap(struct redis_thread_conn *self, time_t now, int all)
+{
+	struct redis_thread_conn *conn;
+
+	if (all) {
+		ast_mutex_lock(&thread_conns_lock);
+	} else if (ast_mutex_trylock(&thread_conns_lock)) {
+		return;
+	}
+	thread_conns_reaped_at = now;
+	for (conn = thread_conns; conn; conn = conn->next) {
+		if (conn == self || !conn->ctx) {
+			continue;
+		}
+		if (all) {
+			ast_mutex_lock(&conn->lock);
+		} else if (ast_mutex_trylock(&conn->lock)) {
+			continue;
+		}
+		if (all || now - conn->last_used >= (time_t) thread_idle_timeout) {
+			redis_thread_conn_close(conn);
+			ast_atomic_fetchadd_int(&thread_conns_reaps, 1);
+		}
+		ast_mutex_unlock(&conn->lock);
+	}
+	ast_mutex_unlock(&thread_conns_lock);
+}
+
+/*
+ * unload: the key's destructor lives in this module, so free every slot here
+ * and delete the key, threads exiting later must not call into unmapped code.
+ * Waits for the requests in flight, they hold their slot's lock
+ */
+static void redis_thread_conns_free(void)
+{
+	struct redis_thread_conn *conn;
+
+	ast_mutex_lock(&thread_conns_lock);
+	/* the key only exists once a thread used it */
+	pthread_once(&thread_conn_buf.once, thread_conn_buf.key_init);
+	pthread_key_delete(thread_conn_buf.key);
+	thread_conns_freed = 1;
+	while ((conn = thread_conns)) {
+		thread_conns = conn->next;
+		ast_mutex_lock(&conn->lock);
+		redis_thread_conn_close(conn);
+		ast_mutex_unlock(&conn->lock);
+		ast_mutex_destroy(&conn->lock);
+		ast_free(conn);
+	}
+	ast_mutex_unlock(&thread_conns_lock);
+}
+
+static redisContext *redis_thread_acquire(void)
+{
+	struct redis_thread_conn *conn;
+	time_t now = time(NULL);
+
+	if (!(conn = ast_threadstorage_get(&thread_conn_buf, sizeof(*conn)))) {
+		return NULL;
+	}
+	if (thread_idle_timeout && now - thread_conns_reaped_at >= (time_t) (thread_idle_timeout / 2 + 1)) {
+		redis_thread_conns_reap(conn, now, 0);
+	}
+	ast_mutex_lock(&conn->lock);
+	if (conn->ctx && (conn->ctx->err || conn->generation != conn_generation)) {
+		redis_thread_conn_close(conn);
+	}
+	if (!conn->ctx) {
+		conn->generation = conn_generation;
+		if (!(conn->ctx = redis_open(1))) {
+			ast_mutex_unlock(&conn->lock);
+			return NULL;
+		}
+		ast_atomic_fetchadd_int(&thread_conns_open, 1);
+		ast_atomic_fetchadd_int(&thread_conns_connects, 1);
+	}
+	conn->last_used = now;
+	return conn->ctx;
+}
+
+static void redis_thread_release(redisContext *ctx)
+{
+	struct redis_thread_conn *conn = ast_threadstorage_get(&thread_conn_buf, sizeof(*conn));
+
+	if (conn->ctx == ctx && ctx->err) {
+		redis_thread_conn_close(conn);
+	}
+	ast_mutex_unlock(&conn->lock);
+}
+
+static redisContext *redis_acquire(void)
+{
+	redisContext *ctx;
+
+	if (thread_mode) {
+		if (!(ctx = redis_thread_acquire())) {
+			ast_log(LOG_WARNING, "No redis connection available for realtime request\n");
+		}
+		return ctx;
+	}
+	if (!pool) {
+		return NULL;
+	}
+	if (!(ctx = conn_pool_acquire(pool))) {
+		ast_log(LOG_WARNING, "No redis connection available for realtime request\n");
+	}
+	return ctx;
+}
+
+static void redis_release(redisContext *ctx)
+{
+	if (thread_mode) {
+		redis_thread_release(ctx);
+		return;
+	}
+	conn_pool_release(pool, ctx, ctx->err != 0);
+}
+
+/*
+ * bloom filters
+ */
+static struct redis_bloom *redis_bloom_find(const char *table_key)
+{
+	struct redis_bloom *bloom = NULL;
+	unsigned int i;
+
+	ast_mutex_lock(&blooms_lock);
+	for (i = 0; i < num_blooms && !bloom; i++) {
+		if (!strcmp(blooms[i].table_key, table_key)) {
+			bloom = &blooms[i];
+		}
+	}
+	ast_mutex_unlock(&blooms_lock);
+	return bloom;
+}
+
+/* the filter for database:table, created on first use; NULL when the table has none or it cannot be trusted now */
+static struct redis_bloom *redis_bloom_get(const char *database, const char *table)
+{
+	char table_key[MAX_DB_OPTION_SIZE * 2 + 2];
+	struct redis_bloom *bloom = NULL;
+	unsigned int i;
+
+	/* needs the notifications of this table to learn its new ids */
+	if (!num_bloom_tables || cache_tracking || !redis_cache_table(table)) {
+		return NULL;
+	}
+	snprintf(table_key, sizeof(table_key), "%s:%s", database, table);
+	if ((bloom = redis_bloom_find(table_key))) {
+		return bloom;
+	}
+	for (i = 0; i < num_bloom_tables && strcmp(bloom_tables[i], table); i++);
+	if (i == num_bloom_tables) {
+		return NULL;
+	}
+	ast_mutex_lock(&blooms_lock);
+	for (i = 0; i < num_blooms && strcmp(blooms[i].table_key, table_key); i++);
+	if (i < num_blooms) {
+		bloom = &blooms[i];
+	} else if (num_blooms < MAX_KEYFIELDS && (blooms[i].filter = bloom_filter_new(bloom_entries, 10))) {
+		bloom = &blooms[i];
+		ast_copy_string(bloom->table_key, table_key, sizeof(bloom->table_key));
+		ast_mutex_init(&bloom->lock);
+		bloom->state = BLOOM_STALE;
+		num_blooms++;
+	}
+	ast_mutex_unlock(&blooms_lock);
+	return bloom;
+}
+
+/* every filter has missed or may miss ids, e.g. while notifications were down */
+static void redis_blooms_stale(void)
+{
+	unsigned int i;
+
+	ast_mutex_lock(&blooms_lock);
+	for (i = 0; i < num_blooms; i++) {
+		ast_mutex_lock(&blooms[i].lock);
+		blooms[i].state = BLOOM_STALE;
+		blooms[i].epoch++;
+		ast_mutex_unlock(&blooms[i].lock);
+	}
+	ast_mutex_unlock(&blooms_lock);
+}
+
+/* key is a row key <database>:<table>:<id> that exists now */
+static void redis_bloom_note(const char *key)
+{
+	char table_key[MAX_DB_OPTION_SIZE * 2 + 2];
+	struct redis_bloom *bloom;
+	const char *colon;
+
+	if (!num_blooms || !(colon = strchr(key, ':')) || !(colon = strchr(colon + 1, ':')) || (size_t) (colon - key) >= sizeof(table_key)) {
+		return;
+	}
+	memcpy(table_key, key, colon - key);
+	table_key[colon - key] = '\0';
+	if ((bloom = redis_bloom_find(table_key))) {
+		ast_mutex_lock(&bloom->lock);
+		if (bloom->state != BLOOM_STALE) {
+			bloom_filter_add(bloom->filter, colon + 1);
+		}
+		if (bloom->next) {
+			bloom_filter_add(bloom->next, colon + 1);
+		}
+		ast_mutex_unlock(&bloom->lock);
+	}
+}
+
+/* bloom_thread: SSCAN the id set into a new filter and swap it in; ids noted meanwhile are kept */
+static void redis_bloom_rebuild(struct redis_bloom *bloom)
+{
+	char cursor[32] = "0";
+	bloom_filter_t *filter;
+	redisContext *ctx;
+	redisReply *reply;
+	int epoch, done = 0;
+	size_t i;
+
+	if (!(filter = bloom_filter_new(bloom_entries, 10))) {
+		ast_mutex_lock(&bloom->lock);
+		bloom->rebuild = 0;
+		ast_mutex_unlock(&bloom->lock);
+		return;
+	}
+	ast_mutex_lock(&bloom->lock);
+	epoch = bloom->epoch;
+	bloom->next = filter;
+	ast_mutex_unlock(&bloom->lock);
+
+	if ((ctx = redis_acquire())) {
+		do {
+			reply = redisCommand(ctx, "SSCAN %s %s COUNT 1000", bloom->table_key, cursor);
+			if (redis_reply_failed(ctx, reply, "SSCAN") || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+				redis_reply_free(reply);
+				break;
+			}
+			ast_copy_string(cursor, reply->element[0]->str, sizeof(cursor));
+			ast_mutex_lock(&bloom->lock);
+			for (i = 0; i < reply->element[1]->elements; i++) {
+				bloom_filter_add(filter, reply->element[1]->element[i]->str);
+			}
+			ast_mutex_unlock(&bloom->lock);
+			redis_reply_free(reply);
+			done = !strcmp(cursor, "0");
+		} while (!done && !bloom_stop);
+		redis_release(ctx);
+	}
+
+	ast_mutex_lock(&bloom->lock);
+	bloom->next = NULL;
+	bloom->rebuild = 0;
+	if (done && bloom->epoch == epoch) {
+		/* the old one goes */
+		bloom_filter_t *old = bloom->filter;
+		bloom->filter = filter;
+		filter = old;
+		bloom->state = BLOOM_READY;
+		bloom->built = time(NULL);
+		ast_debug(1, "Bloom filter for '%s' rebuilt with %u ids\n", bloom->table_key, bloom_filter_count(bloom->filter));
+	}
+	ast_mutex_unlock(&bloom->lock);
+	bloom_filter_destroy(filter);
+}
+
+static void *redis_bloom_thread_handler(void *data)
+{
+	unsigned int i, num;
+	int rebuild;
+
+	ast_mutex_lock(&blooms_lock);
+	while (!bloom_stop) {
+		if (!bloom_wakeup) {
+			ast_cond_wait(&bloom_cond, &blooms_lock);
+			continue;
+		}
+		bloom_wakeup = 0;
+		num = num_blooms;
+		ast_mutex_unlock(&blooms_lock);
+		for (i = 0; i < num && !bloom_stop; i++) {
+			ast_mutex_lock(&blooms[i].lock);
+			rebuild = blooms[i].rebuild;
+			ast_mutex_unlock(&blooms[i].lock);
+			if (rebuild) {
+				redis_bloom_rebuild(&blooms[i]);
+			}
+		}
+		ast_mutex_lock(&blooms_lock);
+	}
+	ast_mutex_unlock(&blooms_lock);
+	return NULL;
+}
+
+static void redis_bloom_thread_shutdown(void)
+{
+	if (bloom_thread == AST_PTHREADT_NULL) {
+		return;
+	}
+	ast_mutex_lock(&blooms_lock);
+	bloom_stop = 1;
+	ast_cond_signal(&bloom_cond);
+	ast_mutex_unlock(&blooms_lock);
+	pthread_join(bloom_thread, NULL);
+	bloom_thread = AST_PTHREADT_NULL;
+	ast_cond_destroy(&bloom_cond);
+}
+
+/* 1 when id is certainly not in the table; an old or stale filter is queued for a rebuild on bloom_thread */
+static int redis_bloom_rejects(const char *database, const char *table, const char *id)
+{
+	struct redis_bloom *bloom = redis_bloom_get(database, table);
+	time_t now = time(NULL);
+	int queue = 0, res = 0;
+
+	if (!bloom) {
+		return 0;
+	}
+	ast_mutex_lock(&bloom->lock);
+	if (!bloom->rebuild && (bloom->state == BLOOM_STALE || (bloom_rebuild && now - bloom->built >= (time_t) bloom_rebuild))) {
+		bloom->rebuild = queue = 1;
+	}
+	if (bloom->state == BLOOM_READY) {
+		res = !bloom_filter_check(bloom->filter, id);
+	}
+	ast_mutex_unlock(&bloom->lock);
+	if (queue) {
+		ast_mutex_lock(&blooms_lock);
+		bloom_wakeup = 1;
+		ast_cond_signal(&bloom_cond);
+		ast_mutex_unlock(&blooms_lock);
+	}
+	return res;
+}
+
+/*
+ * engine
+ */
+static int redis_first_row_cb(redisContext *ctx, const char *id, redisReply *hash, void *data)
+{
+	struct ast_variable **var = data;
+
+	*var = redis_row_variables(hash);
+	return 1;
+}
 
 #ifdef HAVE_PBX_VERSION_11
 static struct ast_variable *realtime_redis(const char *database, const char *tablename, va_list ap)
@@ -57,17 +1337,135 @@ static struct ast_variable *realtime_redis(const char *database, const char *tab
 #endif
 {
 	struct ast_variable *var = NULL;
+	struct redis_field params[MAX_FIELDS];
+	realtime_filter_t filters[MAX_FIELDS];
+	struct redis_cache_hit hit = { NULL, NULL, 0 };
+	char cache_key_buf[512];
+	const char *cache_key = NULL;
+	char tag[512];
+	unsigned long epoch = 0, negative_epoch = 0;
+	redisContext *ctx;
+	int num, key, use_cache, res;
+
+#ifdef HAVE_PBX_VERSION_11
+	if (redis_fields_va(ap, params, &num, NULL, NULL)) {
+#else
+	if (redis_fields_list(fields, params, &num)) {
+#endif
+		return NULL;
+	}
+	if (!num || redis_filters(params, num, filters)) {
+		return NULL;
+	}
+	key = redis_key_filter(tablename, filters, num);
+	use_cache = redis_cache_table(tablename);
+	if ((use_cache || negative) && (cache_key = redis_cache_key(cache_key_buf, sizeof(cache_key_buf), database, tablename, params, num))) {
+		if (negative) {
+			if (realtime_cache_get(negative, cache_key, redis_now_ms(), redis_cache_hit_cb, &hit)) {
+				ast_atomic_fetchadd_int(&negative_hits, 1);
+				return NULL;
+			}
+			negative_epoch = realtime_cache_epoch(negative);
+		}
+		if (use_cache) {
+			if (realtime_cache_get(cache, cache_key, redis_now_ms(), redis_cache_hit_cb, &hit)) {
+				if (!hit.failed) {
+					return hit.var;
+				}
+				ast_variables_destroy(hit.var);
+			}
+			epoch = realtime_cache_epoch(cache);
+		}
+		if (key >= 0) {
+			snprintf(tag, sizeof(tag), "%s:%s:%s", database, tablename, filters[key].value);
+		} else {
+			snprintf(tag, sizeof(tag), "%s:%s", database, tablename);
+		}
+	}
+	if (key >= 0 && redis_bloom_rejects(database, tablename, filters[key].value)) {
+		ast_atomic_fetchadd_int(&bloom_rejects, 1);
+		return NULL;
+	}
+	if (!(ctx = redis_acquire())) {
+		return NULL;
+	}
+	res = redis_find_rows(ctx, database, tablename, filters, num, redis_first_row_cb, &var);
+	redis_release(ctx);
+	if (cache_key) {
+		if (var && use_cache) {
+			redis_cache_store(cache_key, tag, var, epoch);
+		} else if (!res && negative) {
+			realtime_cache_put(negative, cache_key, tag, NULL, NULL, 0, negative_epoch, redis_now_ms());
+		}
+	}
 	return var;
 }
 
+struct redis_multi_result {
+	struct ast_config *cfg;
+	const char *initfield;
+};
+
+static int redis_multi_row_cb(redisContext *ctx, const char *id, redisReply *hash, void *data)
+{
+	struct redis_multi_result *result = data;
+	struct ast_category *cat;
+	struct ast_variable *var;
+	const char *initvalue;
+
+	if (!(cat = ast_category_new("", "", 99999))) {
+		return 1;
+	}
+	if ((initvalue = redis_row_field(hash, result->initfield))) {
+		ast_category_rename(cat, initvalue);
+	}
+	for (var = redis_row_variables(hash); var; ) {
+		struct ast_variable *next = var->next;
+		var->next = NULL;
+		ast_variable_append(cat, var);
+		var = next;
+	}
+	ast_category_append(result->cfg, cat);
+	return 0;
+}
+
 #ifdef HAVE_PBX_VERSION_11
 static struct ast_config *realtime_multi_redis(const char *database, const char *table, va_list ap)
 #else
 static struct ast_config *realtime_multi_redis(const char *database, const char *table, const struct ast_variable *fields)
 #endif
 {
-	struct ast_config *cfg = NULL;
-	return cfg;
+	struct redis_multi_result result = { NULL, NULL };
+	struct redis_field params[MAX_FIELDS];
+	realtime_filter_t filters[MAX_FIELDS];
+	redisContext *ctx;
+	int num, res;
+
+#ifdef HAVE_PBX_VERSION_11
+	if (redis_fields_va(ap, params, &num, NULL, NULL)) {
+#else
+	if (redis_fields_list(fields, params, &num)) {
+#endif
+		return NULL;
+	}
+	if (!num || redis_filters(params, num, filters)) {
+		return NULL;
+	}
+	if (!(result.cfg = ast_config_new())) {
+		return NULL;
+	}
+	result.initfield = filters[0].field;
+	if (!(ctx = redis_acquire())) {
+		ast_config_destroy(result.cfg);
+		return NULL;
+	}
+	res = redis_find_rows(ctx, database, table, filters, num, redis_multi_row_cb, &result);
+	redis_release(ctx);
+	if (res < 0) {
+		ast_config_destroy(result.cfg);
+		return NULL;
+	}
+	return result.cfg;
 }
 
 #ifdef HAVE_PBX_VERSION_11
@@ -78,7 +1476,24 @@ static int update_redis(const char *database, const char *tablename, const char
 						const char *lookup, const struct ast_variable *fields)
 #endif
 {
-	return -1;
+	struct redis_field params[MAX_FIELDS];
+	realtime_filter_t filter;
+	redisContext *ctx;
+	int num, res;
+
+#ifdef HAVE_PBX_VERSION_11
+	if (redis_fields_va(ap, params, &num, NULL, NULL)) {
+#else
+	if (redis_fields_list(fields, params, &num)) {
+#endif
+		return -1;
+	}
+	if (realtime_filter_parse(&filter, keyfield, lookup) != NO_EXCEPTION || !(ctx = redis_acquire())) {
+		return -1;
+	}
+	res = redis_update_rows(ctx, database, tablename, &filter, 1, params, num);
+	redis_release(ctx);
+	return res;
 }
 
 #ifdef HAVE_PBX_VERSION_11
@@ -87,7 +1502,24 @@ static int update2_redis(const char *database, const char *tablename, va_list ap
 static int update2_redis(const char *database, const char *tablename, const struct ast_variable *lookup_fields, const struct ast_variable *update_fields)
 #endif
 {
-	return -1;
+	struct redis_field lookups[MAX_FIELDS], updates[MAX_FIELDS];
+	realtime_filter_t filters[MAX_FIELDS];
+	redisContext *ctx;
+	int num_lookups, num_updates, res;
+
+#ifdef HAVE_PBX_VERSION_11
+	if (redis_fields_va(ap, lookups, &num_lookups, updates, &num_updates)) {
+#else
+	if (redis_fields_list(lookup_fields, lookups, &num_lookups) || redis_fields_list(update_fields, updates, &num_updates)) {
+#endif
+		return -1;
+	}
+	if (!num_lookups || redis_filters(lookups, num_lookups, filters) || !(ctx = redis_acquire())) {
+		return -1;
+	}
+	res = redis_update_rows(ctx, database, tablename, filters, num_lookups, updates, num_updates);
+	redis_release(ctx);
+	return res;
 }
 
 #ifdef HAVE_PBX_VERSION_11
@@ -96,12 +1528,119 @@ static int store_redis(const char *database, const char *table, va_list ap)
 static int store_redis(const char *database, const char *table, const struct ast_variable *fields)
 #endif
 {
-	ast_mutex_unlock(&redis_lock);
-	if (!redis_reconnect(database)) {
-		ast_mutex_unlock(&redis_lock);
+	struct redis_field params[MAX_FIELDS];
+	char keyfield[MAX_DB_OPTION_SIZE];
+	char index_fields[MAX_KEYFIELDS][MAX_DB_OPTION_SIZE];
+	const char *table_key;
+	const char *argv[2 + MAX_FIELDS * 2];
+	const char *id = NULL;
+	redisContext *ctx;
+	redisReply *reply = NULL;
+	int num, i, j, k, res = -1, num_fields, queued = 0, watching = 0;
+
+#ifdef HAVE_PBX_VERSION_11
+	if (redis_fields_va(ap, params, &num, NULL, NULL)) {
+#else
+	if (redis_fields_list(fields, params, &num)) {
+#endif
 		return -1;
 	}
-	return -1;
+	redis_keyfield(table, keyfield, sizeof(keyfield));
+	for (i = 0; i < num; i++) {
+		if (!strcmp(params[i].name, keyfield)) {
+			id = params[i].value;
+		}
+		argv[2 + i * 2] = params[i].name;
+		argv[3 + i * 2] = S_OR(params[i].value, "");
+	}
+	if (ast_strlen_zero(id)) {
+		ast_log(LOG_WARNING, "Cannot store a row in '%s' without its key field '%s'\n", table, keyfield);
+		return -1;
+	}
+	if (!(table_key = redis_table_key(database, table)) || !(ctx = redis_acquire())) {
+		return -1;
+	}
+
+	/* a concurrent store or destroy of the same id touches the row and makes our EXEC fail */
+	argv[0] = "HMSET";
+	if (!(argv[1] = redis_row_key(database, table, id))) {
+		goto done;
+	}
+	reply = redisCommand(ctx, "WATCH %s", argv[1]);
+	if (redis_reply_failed(ctx, reply, "WATCH")) {
+		goto done;
+	}
+	redis_reply_free(reply);
+	watching = 1;
+
+	/* the id set decides who inserts, like a primary key */
+	reply = redisCommand(ctx, "SISMEMBER %s %s", table_key, id);
+	if (redis_reply_failed(ctx, reply, "SISMEMBER")) {
+		goto done;
+	}
+	if (reply->integer) {
+		ast_log(LOG_WARNING, "Row '%s' already exists in '%s'\n", id, table);
+		goto done;
+	}
+	redis_reply_free(reply);
+	reply = NULL;
+
+	/* the row, its id and its index entries in one transaction */
+	if (redisAppendCommand(ctx, "MULTI") != REDIS_OK || redisAppendCommand(ctx, "SADD %s %s", table_key, id) != REDIS_OK ||
+		redisAppendCommandArgv(ctx, 2 + num * 2, argv, NULL) != REDIS_OK) {
+		redis_pipeline_abort(ctx);
+		goto done;
+	}
+	queued = 3;
+	num_fields = redis_index_fields(table, index_fields);
+	for (i = 0; i < num; i++) {
+		for (j = 0; j < num_fields && strcmp(index_fields[j], params[i].name); j++);
+		if (j == num_fields) {
+			continue;
+		}
+		if ((k = redis_index_append(ctx, database, table, params[i].name, id, NULL, argv[3 + i * 2])) < 0) {
+			redis_pipeline_abort(ctx);
+			goto done;
+		}
+		queued += k;
+	}
+	if (redisAppendCommand(ctx, "EXEC") != REDIS_OK) {
+		redis_pipeline_abort(ctx);
+		goto done;
+	}
+	watching = 0;
+	if (redis_pipeline_read(ctx, queued, "MULTI") < 0 || redisGetReply(ctx, (void **) &reply) != REDIS_OK) {
+		goto done;
+	}
+	if (reply->type == REDIS_REPLY_NIL) {
+		ast_log(LOG_WARNING, "Row '%s' of '%s' changed while it was stored\n", id, table);
+		goto done;
+	}
+	if (redis_reply_failed(ctx, reply, "EXEC")) {
+		goto done;
+	}
+	for (i = 0; reply->type == REDIS_REPLY_ARRAY && i < (int) reply->elements; i++) {
+		if (redis_reply_failed(ctx, reply->element[i], "HMSET")) {
+			goto done;
+		}
+	}
+	res = 1;
+done:
+	redis_reply_free(reply);
+	if (watching && !ctx->err) {
+		redis_reply_free(redisCommand(ctx, "UNWATCH"));
+	}
+	redis_release(ctx);
+	if (res == 1) {
+		struct redis_id_list list = { (char **) &id, 1, 1 };
+		const char *key = redis_row_key(database, table, id);
+
+		if (key) {
+			redis_bloom_note(key);
+		}
+		redis_cache_invalidate(database, table, &list);
+	}
+	return res;
 }
 
 #ifdef HAVE_PBX_VERSION_11
@@ -110,33 +1649,225 @@ static int destroy_redis(const char *database, const char *table, const char *ke
 static int destroy_redis(const char *database, const char *table, const char *keyfield, const char *lookup, const struct ast_variable *fields)
 #endif
 {
-	ast_mutex_unlock(&redis_lock);
-	if (!redis_reconnect(database)) {
-		ast_mutex_unlock(&redis_lock);
+	struct redis_field params[MAX_FIELDS + 1];
+	realtime_filter_t filters[MAX_FIELDS + 1];
+	struct redis_id_list list = { NULL, 0, 0 };
+	char index_fields[MAX_KEYFIELDS][MAX_DB_OPTION_SIZE];
+	const char *index_names[MAX_KEYFIELDS];
+	const char *table_key;
+	const char *argv[2];
+	redisContext *ctx;
+	redisReply **olds = NULL;
+	int num, i, j, k, res, num_fields, queued = 0;
+
+	params[0].name = keyfield;
+	params[0].value = lookup;
+#ifdef HAVE_PBX_VERSION_11
+	if (redis_fields_va(ap, params + 1, &num, NULL, NULL)) {
+#else
+	if (redis_fields_list(fields, params + 1, &num)) {
+#endif
 		return -1;
 	}
-	return -1;
+	if (redis_filters(params, num + 1, filters) || !(ctx = redis_acquire())) {
+		return -1;
+	}
+	if ((res = redis_find_rows(ctx, database, table, filters, num + 1, redis_collect_id, &list)) <= 0) {
+		goto done;
+	}
+	if (!(table_key = redis_table_key(database, table))) {
+		res = -1;
+		goto done;
+	}
+	/* the index entries go with the row, read what they are first */
+	num_fields = redis_index_fields(table, index_fields);
+	for (j = 0; j < num_fields; j++) {
+		index_names[j] = index_fields[j];
+	}
+	if (num_fields && !(olds = redis_index_read(ctx, database, table, list.ids, list.count, index_names, num_fields))) {
+		res = -1;
+		goto done;
+	}
+	argv[0] = "DEL";
+	for (i = 0; i < list.count; i++) {
+		if (olds) {
+			if (redisAppendCommand(ctx, "MULTI") != REDIS_OK) {
+				break;
+			}
+			queued++;
+		}
+		if (!(argv[1] = redis_row_key(database, table, list.ids[i])) || redisAppendCommandArgv(ctx, 2, argv, NULL) != REDIS_OK ||
+			redisAppendCommand(ctx, "SREM %s %s", table_key, list.ids[i]) != REDIS_OK) {
+			break;
+		}
+		queued += 2;
+		for (j = 0; j < num_fields && (k = redis_index_append(ctx, database, table, index_names[j], list.ids[i], redis_index_old(olds[i], j), NULL)) >= 0; j++) {
+			queued += k;
+		}
+		if (j < num_fields) {
+			break;
+		}
+		if (olds) {
+			if (redisAppendCommand(ctx, "EXEC") != REDIS_OK) {
+				break;
+			}
+			queued++;
+		}
+	}
+	if (i < list.count) {
+		/* possibly inside a MULTI: send nothing at all */
+		redis_pipeline_abort(ctx);
+		res = -1;
+	} else if ((res = i) && redis_pipeline_read(ctx, queued, "DEL") < 0) {
+		res = -1;
+	}
+	redis_index_olds_free(olds, list.count);
+	redis_cache_invalidate(database, table, &list);
+done:
+	redis_id_list_free(&list);
+	redis_release(ctx);
+	return res;
+}
+
+/*
+ * static configuration, rows like the sql drivers use them:
+ * cat_metric, var_metric, category, var_name, var_val, filename, commented
+ */
+struct redis_static_row {
+	int cat_metric;
+	int var_metric;
+	char *category;
+	char *var_name;
+	char *var_val;
+};
+
+struct redis_static_rows {
+	struct redis_static_row *rows;
+	int count;
+	int size;
+};
+
+static int redis_static_row_cb(redisContext *ctx, const char *id, redisReply *hash, void *data)
+{
+	struct redis_static_rows *result = data;
+	struct redis_static_row *row;
+	const char *category = redis_row_field(hash, "category");
+	const char *var_name = redis_row_field(hash, "var_name");
+	const char *commented = redis_row_field(hash, "commented");
+
+	if (ast_strlen_zero(category) || ast_strlen_zero(var_name) || (commented && atoi(commented))) {
+		return 0;
+	}
+	if (result->count == result->size) {
+		if (!(row = ast_realloc(result->rows, (result->size ? result->size * 2 : 64) * sizeof(*row)))) {
+			return 1;
+		}
+		result->rows = row;
+		result->size = result->size ? result->size * 2 : 64;
+	}
+	row = &result->rows[result->count++];
+	row->cat_metric = atoi(S_OR(redis_row_field(hash, "cat_metric"), "0"));
+	row->var_metric = atoi(S_OR(redis_row_field(hash, "var_metric"), "0"));
+	row->category = ast_strdup(category);
+	row->var_name = ast_strdup(var_name);
+	row->var_val = ast_strdup(S_OR(redis_row_field(hash, "var_val"), ""));
+	return 0;
+}
+
+/* ORDER BY cat_metric DESC, var_metric ASC, category, var_name */
+static int redis_static_row_cmp(const void *a, const void *b)
+{
+	const struct redis_static_row *ra = a, *rb = b;
+	int res;
+
+	if (ra->cat_metric != rb->cat_metric) {
+		return ra->cat_metric > rb->cat_metric ? -1 : 1;
+	}
+	if (ra->var_metric != rb->var_metric) {
+		return ra->var_metric < rb->var_metric ? -1 : 1;
+	}
+	if ((res = strcmp(S_OR(ra->category, ""), S_OR(rb->category, "")))) {
+		return res;
+	}
+	return strcmp(S_OR(ra->var_name, ""), S_OR(rb->var_name, ""));
 }
 
 static struct ast_config *config_redis(const char *database, const char *table,
 									   const char *file, struct ast_config *cfg,
 									   struct ast_flags flags, const char *suggested_incl, const char *who_asked)
 {
-        // pre-check
-	ast_mutex_lock(&redis_lock);
-	// do load config
-	ast_mutex_unlock(&redis_lock);
+	struct redis_static_rows result = { NULL, 0, 0 };
+	realtime_filter_t filter;
+	struct ast_category *cur_cat = NULL;
+	struct ast_variable *new_v;
+	const char *last_category = "";
+	redisContext *ctx;
+	int i, res;
+
+	if (ast_strlen_zero(file) || !strcmp(file, RES_CONFIG_REDIS_CONF)) {
+		ast_log(LOG_WARNING, "Cannot configure myself.\n");
+		return NULL;
+	}
+	realtime_filter_parse(&filter, "filename", file);
+	if (!(ctx = redis_acquire())) {
+		return NULL;
+	}
+	res = redis_find_rows(ctx, database, table, &filter, 1, redis_static_row_cb, &result);
+	redis_release(ctx);
+	if (res < 0) {
+		cfg = NULL;
+		goto done;
+	}
+	qsort(result.rows, result.count, sizeof(*result.rows), redis_static_row_cmp);
+
+	for (i = 0; i < result.count; i++) {
+		struct redis_static_row *row = &result.rows[i];
+
+		if (!row->category || !row->var_name || !row->var_val) {
+			continue;
+		}
+		if (!strcmp(row->var_name, "#include")) {
+			if (!ast_config_internal_load(row->var_val, cfg, flags, "", who_asked)) {
+				cfg = NULL;
+				goto done;
+			}
+			continue;
+		}
+		if (!cur_cat || strcmp(last_category, row->category)) {
+			if (!(cur_cat = ast_category_new(row->category, "", 99999))) {
+				break;
+			}
+			last_category = row->category;
+			ast_category_append(cfg, cur_cat);
+		}
+		if ((new_v = ast_variable_new(row->var_name, row->var_val, ""))) {
+			ast_variable_append(cur_cat, new_v);
+		}
+	}
+done:
+	for (i = 0; i < result.count; i++) {
+		ast_free(result.rows[i].category);
+		ast_free(result.rows[i].var_name);
+		ast_free(result.rows[i].var_val);
+	}
+	ast_free(result.rows);
 	return cfg;
 }
 
+/* hashes are schemaless, any column is there */
 static int require_redis(const char *database, const char *tablename, va_list ap)
 {
-	return -1;
+	return 0;
 }
 
+/* nothing is cached per table layout; drop the cached rows so the next lookup reads redis */
 static int unload_redis(const char *database, const char *tablename)
 {
-	return -1;
+	if (!cache) {
+		return -1;
+	}
+	realtime_cache_flush(cache);
+	return 0;
 }
 
 static struct ast_config_engine redis_engine = {
@@ -152,14 +1883,237 @@ static struct ast_config_engine redis_engine = {
 	.unload_func = unload_redis,
 };
 
-static int load_module(void)
+/*
+ * keyspace notifications
+ */
+static int redis_notify_usable(redisContext *ctx)
+{
+	redisReply *reply = redisCommand(ctx, "CONFIG GET notify-keyspace-events");
+	const char *flags;
+	int res = 1;
+
+	if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+		/* CONFIG may be disabled on managed servers, trust the operator */
+		ast_log(LOG_WARNING, "Cannot verify notify-keyspace-events, assuming keyspace notifications are enabled\n");
+	} else {
+		flags = reply->element[1]->str;
+		if (!strchr(flags, 'K') || (!strchr(flags, 'A') && (!strchr(flags, 'g') || !strchr(flags, 'h') || !strchr(flags, 's')))) {
+			ast_log(LOG_WARNING, "Realtime cache disabled: redis needs notify-keyspace-events to include K and A (or g, h and s), it is '%s'\n", flags);
+			res = 0;
+		}
+	}
+	redis_reply_free(reply);
+	return res;
+}
+
+static int redis_notify_subscribe(redisContext *ctx)
+{
+	redisReply *reply;
+	unsigned int i, num;
+	int db;
+
+	ast_mutex_lock(&redis_lock);
+	db = dbnum;
+	num = num_cache_tables;
+	if (!num) {
+		redisAppendCommand(ctx, "PSUBSCRIBE __keyspace@%d__:*", db);
+	}
+	for (i = 0; i < num; i++) {
+		/* <database>:<table>, <database>:<table>:<id> and the indexes <database>:<table>#..., for any database */
+		redisAppendCommand(ctx, "PSUBSCRIBE __keyspace@%d__:*:%s __keyspace@%d__:*:%s:* __keyspace@%d__:*:%s#*", db, cache_tables[i], db, cache_tables[i], db, cache_tables[i]);
+	}
+	ast_mutex_unlock(&redis_lock);
+
+	for (i = 0; i < (num ? num * 3 : 1); i++) {
+		if (redisGetReply(ctx, (void **) &reply) != REDIS_OK) {
+			return -1;
+		}
+		redis_reply_free(reply);
+	}
+	return 0;
+}
+
+/* a redis key changed: drop the row and the table-wide entries it may affect, lookups answered from an index are cached under the table */
+static void redis_notify_invalidate(const char *key)
+{
+	char table_key[MAX_DB_OPTION_SIZE * 2 + 2];
+
+	if (cache) {
+		realtime_cache_invalidate_key(cache, key);
+	}
+	if (negative) {
+		realtime_cache_invalidate_key(negative, key);
+	}
+	if (realtime_key_table(key, table_key, sizeof(table_key)) == RT_KEY_ROW) {
+		/* written or deleted, either way an id the filter may hold */
+		redis_bloom_note(key);
+	}
+}
+
+static int redis_tracking_subscribe(redisContext *ctx)
+{
+	redisReply *reply;
+	long long id;
+
+	/* refused before redis 6 */
+	reply = redisCommand(ctx, "CLIENT TRACKING off");
+	if (redis_reply_failed(ctx, reply, "CLIENT TRACKING")) {
+		ast_log(LOG_WARNING, "Realtime cache disabled: cache_invalidation = tracking needs redis 6 or later\n");
+		redis_reply_free(reply);
+		return -1;
+	}
+	redis_reply_free(reply);
+	reply = redisCommand(ctx, "CLIENT ID");
+	if (redis_reply_failed(ctx, reply, "CLIENT ID") || reply->type != REDIS_REPLY_INTEGER) {
+		redis_reply_free(reply);
+		return -1;
+	}
+	id = reply->integer;
+	redis_reply_free(reply);
+	reply = redisCommand(ctx, "SUBSCRIBE __redis__:invalidate");
+	if (redis_reply_failed(ctx, reply, "SUBSCRIBE")) {
+		redis_reply_free(reply);
+		return -1;
+	}
+	redis_reply_free(reply);
+
+	/* every request connection has to be reopened to redirect to this one */
+	ast_mutex_lock(&redis_lock);
+	tracking_redirect = id;
+	ast_mutex_unlock(&redis_lock);
+	if (pool) {
+		conn_pool_invalidate(pool);
+	}
+	ast_atomic_fetchadd_int(&conn_generation, 1);
+	return 0;
+}
+
+static void redis_notify_message(redisReply *reply)
+{
+	const char *key;
+	size_t i;
+
+	if (reply->type != REDIS_REPLY_ARRAY) {
+		return;
+	}
+	if (reply->elements == 4 && reply->element[2]->str && (key = strstr(reply->element[2]->str, "__:"))) {
+		/* pmessage, __keyspace@<db>__:<key> */
+		redis_notify_invalidate(key + 3);
+	} else if (reply->elements == 3 && reply->element[2]->type == REDIS_REPLY_ARRAY) {
+		/* message on __redis__:invalidate, the keys */
+		for (i = 0; i < reply->element[2]->elements; i++) {
+			if (reply->element[2]->element[i]->str) {
+				redis_notify_invalidate(reply->element[2]->element[i]->str);
+			}
+		}
+	} else if (reply->elements == 3 && reply->element[2]->type == REDIS_REPLY_NIL) {
+		/* FLUSHALL / FLUSHDB: rows created afterwards must not be answered as known absent */
+		realtime_cache_flush(cache);
+		if (negative) {
+			realtime_cache_flush(negative);
+		}
+		redis_blooms_stale();
+	}
+}
+
+static void *redis_notify_thread_handler(void *data)
+{
+	struct timeval forever = { 0, 0 };
+	redisContext *ctx;
+	redisReply *reply;
+	int retry;
+
+	while (!notify_stop) {
+		if ((ctx = redis_open(0))) {
+			redisSetTimeout(ctx, forever);
+			ast_mutex_lock(&notify_lock);
+			notify_ctx = notify_stop ? NULL : ctx;
+			ast_mutex_unlock(&notify_lock);
+
+			if (notify_ctx && (cache_tracking ? !redis_tracking_subscribe(ctx) : (redis_notify_usable(ctx) && !redis_notify_subscribe(ctx)))) {
+				ast_log(LOG_NOTICE, "Realtime cache enabled, following %s\n", cache_tracking ? "tracking invalidations" : "keyspace notifications");
+				redis_blooms_stale();
+				cache_ready = 1;
+				while (redisGetReply(ctx, (void **) &reply) == REDIS_OK) {
+					redis_notify_message(reply);
+					redis_reply_free(reply);
+				}
+				/* whatever changed since is unknown */
+				cache_ready = 0;
+				realtime_cache_flush(cache);
+				redis_blooms_stale();
+				ast_mutex_lock(&redis_lock);
+				tracking_redirect = 0;
+				ast_mutex_unlock(&redis_lock);
+				if (!notify_stop) {
+					ast_log(LOG_WARNING, "Lost invalidation connection (%s), realtime cache disabled until resubscribed\n", ctx->errstr);
+				}
+			}
+			ast_mutex_lock(&notify_lock);
+			notify_ctx = NULL;
+			ast_mutex_unlock(&notify_lock);
+			redisFree(ctx);
+		}
+		for (retry = 0; retry < 5 && !notify_stop; retry++) {
+			sleep(1);
+		}
+	}
+	return NULL;
+}
+
+static void redis_notify_shutdown(void)
 {
-	ast_log(LOG_NOTICE, "Loading res_config_redis...\n");
+	if (notify_thread == AST_PTHREADT_NULL) {
+		return;
+	}
+	ast_mutex_lock(&notify_lock);
+	notify_stop = 1;
+	if (notify_ctx) {
+		/* wakes the blocking read */
+		shutdown(notify_ctx->fd, SHUT_RDWR);
+	}
+	ast_mutex_unlock(&notify_lock);
+	pthread_join(notify_thread, NULL);
+	notify_thread = AST_PTHREADT_NULL;
+}
 
+static int load_module(void)
+{
 	ast_debug(1, "Loading res_config_redis...\n");
-//	if(!parse_config(0)) {
-//		return AST_MODULE_LOAD_DECLINE;
-//	}
+	if (!parse_config(0)) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	if (!thread_mode && !(pool = conn_pool_new(max_connections, pool_wait, redis_connect, redis_disconnect, NULL))) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	if (cache_enabled) {
+		notify_stop = 0;
+		if (!(cache = realtime_cache_new(cache_shards, cache_size, cache_ttl * 1000)) ||
+			ast_pthread_create_background(&notify_thread, NULL, redis_notify_thread_handler, NULL)) {
+			ast_log(LOG_ERROR, "Unable to start the realtime cache\n");
+			realtime_cache_destroy(cache);
+			cache = NULL;
+			notify_thread = AST_PTHREADT_NULL;
+		}
+	}
+	if (cache && !cache_tracking) {
+		/* also when bloom_tables is empty, a reload may add some */
+		bloom_stop = 0;
+		ast_cond_init(&bloom_cond, NULL);
+		if (ast_pthread_create_background(&bloom_thread, NULL, redis_bloom_thread_handler, NULL)) {
+			ast_log(LOG_ERROR, "Unable to start the bloom filter thread, bloom_tables ignored\n");
+			ast_cond_destroy(&bloom_cond);
+			bloom_thread = AST_PTHREADT_NULL;
+		}
+	}
+	if (negative_cache_enabled && !(negative = realtime_cache_new(cache_shards, negative_cache_size, negative_cache_ttl * 1000))) {
+		ast_log(LOG_ERROR, "Unable to start the negative cache\n");
+	}
+	if (num_bloom_tables && !cache) {
+		ast_log(LOG_NOTICE, "bloom_tables needs cache = yes, ignored\n");
+	} else if (num_bloom_tables && cache_tracking) {
+		ast_log(LOG_NOTICE, "bloom_tables needs cache_invalidation = keyspace, ignored\n");
+	}
 	ast_config_engine_register(&redis_engine);
 
 	ast_cli_register_multiple(cli_realtime, ARRAY_LEN(cli_realtime));
@@ -171,15 +2125,32 @@ static int load_module(void)
 static int unload_module(void)
 {
 	ast_debug(1, "Unloading res_config_redis...\n");
-	ast_mutex_lock(&redis_lock);
-	if (redisConn) {
-	        // disconnect
-		redisConn = NULL;
+	ast_config_engine_deregister(&redis_engine);
+	/* realtime calls already inside the driver hold their connection until they return */
+	if (pool && conn_pool_drain(pool, UNLOAD_DRAIN_MS)) {
+		ast_log(LOG_WARNING, "Realtime requests still running after %u ms, not unloading\n", UNLOAD_DRAIN_MS);
+		ast_config_engine_register(&redis_engine);
+		return -1;
 	}
 	ast_cli_unregister_multiple(cli_realtime, ARRAY_LEN(cli_realtime));
-	ast_config_engine_deregister(&redis_engine);
-	/* Unlock so something else can destroy the lock. */
-	ast_mutex_unlock(&redis_lock);
+	redis_notify_shutdown();
+	redis_bloom_thread_shutdown();
+	cache_ready = 0;
+	realtime_cache_destroy(cache);
+	cache = NULL;
+	realtime_cache_destroy(negative);
+	negative = NULL;
+	ast_mutex_lock(&blooms_lock);
+	while (num_blooms) {
+		num_blooms--;
+		bloom_filter_destroy(blooms[num_blooms].filter);
+		blooms[num_blooms].filter = NULL;
+		ast_mutex_destroy(&blooms[num_blooms].lock);
+	}
+	ast_mutex_unlock(&blooms_lock);
+	conn_pool_destroy(pool);
+	pool = NULL;
+	redis_thread_conns_free();
 
 	ast_debug(1, "Done Unloading res_config_redis...\n");
 	return 0;
@@ -188,50 +2159,261 @@ static int unload_module(void)
 static int reload(void)
 {
 	ast_debug(1, "Reloading res_config_redis...\n");
-	parse_config(1);
+	if (parse_config(1)) {
+		/* every connection reconnects with the new settings */
+		if (pool) {
+			conn_pool_invalidate(pool);
+		}
+		ast_atomic_fetchadd_int(&conn_generation, 1);
+	}
 	ast_debug(1, "Done Reloading res_config_redis...\n");
 	return 0;
 }
 
+/* comma separated table names */
+static unsigned int redis_table_list(const char *value, char tables[MAX_KEYFIELDS][MAX_DB_OPTION_SIZE])
+{
+	char *list = ast_strdupa(value), *table;
+	unsigned int num = 0;
+
+	while ((table = strsep(&list, ",")) && num < MAX_KEYFIELDS) {
+		table = ast_strip(table);
+		if (!ast_strlen_zero(table)) {
+			ast_copy_string(tables[num++], table, MAX_DB_OPTION_SIZE);
+		}
+	}
+	return num;
+}
+
 static int parse_config(int is_reload)
 {
+	struct ast_config *cfg;
+	struct ast_flags config_flags = { 0 };
+	struct ast_variable *v;
+	const char *cat = NULL;
+
 	ast_debug(1, "Parsing Config '%s'...\n", RES_CONFIG_REDIS_CONF);
+	cfg = ast_config_load(RES_CONFIG_REDIS_CONF, config_flags);
+	if (cfg == CONFIG_STATUS_FILEINVALID) {
+		ast_log(LOG_WARNING, "Unable to load config %s\n", RES_CONFIG_REDIS_CONF);
+		return 0;
+	}
+	if (cfg == CONFIG_STATUS_FILEMISSING) {
+		ast_log(LOG_NOTICE, "No %s, using redis at %s:%d\n", RES_CONFIG_REDIS_CONF, hostname, port);
+		return 1;
+	}
+
 	ast_mutex_lock(&redis_lock);
-	
+	num_keyfields = 0;
+	num_indexes = 0;
+	while ((cat = ast_category_browse(cfg, cat))) {
+		if (!strcasecmp(cat, "general")) {
+			for (v = ast_variable_browse(cfg, cat); v; v = v->next) {
+				if (!strcasecmp(v->name, "hostname")) {
+					ast_copy_string(hostname, v->value, sizeof(hostname));
+				} else if (!strcasecmp(v->name, "port")) {
+					port = atoi(v->value);
+				} else if (!strcasecmp(v->name, "socket")) {
+					ast_copy_string(dbsock, v->value, sizeof(dbsock));
+				} else if (!strcasecmp(v->name, "password")) {
+					ast_copy_string(dbpass, v->value, sizeof(dbpass));
+				} else if (!strcasecmp(v->name, "dbnum")) {
+					dbnum = atoi(v->value);
+				} else if (!strcasecmp(v->name, "timeout")) {
+					int ms = atoi(v->value);
+					if (ms > 0) {
+						timeout.tv_sec = ms / 1000;
+						timeout.tv_usec = (ms % 1000) * 1000;
+					}
+				} else if (!strcasecmp(v->name, "max_connections")) {
+					if (is_reload) {
+						if (atoi(v->value) != (int) max_connections) {
+							ast_log(LOG_NOTICE, "max_connections takes effect on module load\n");
+						}
+					} else if (atoi(v->value) > 0) {
+						max_connections = atoi(v->value);
+					}
+				} else if (!strcasecmp(v->name, "connection_mode")) {
+					if (strcasecmp(v->value, "pool") && strcasecmp(v->value, "thread")) {
+						ast_log(LOG_WARNING, "connection_mode must be pool or thread, not '%s'\n", v->value);
+					} else if (is_reload) {
+						if ((strcasecmp(v->value, "thread") == 0) != thread_mode) {
+							ast_log(LOG_NOTICE, "connection_mode takes effect on module load\n");
+						}
+					} else {
+						thread_mode = !strcasecmp(v->value, "thread");
+					}
+				} else if (!strcasecmp(v->name, "thread_idle_timeout")) {
+					thread_idle_timeout = atoi(v->value) > 0 ? atoi(v->value) : 0;
+				} else if (!strcasecmp(v->name, "cache")) {
+					if (!is_reload) {
+						cache_enabled = ast_true(v->value);
+					}
+				} else if (!strcasecmp(v->name, "cache_invalidation")) {
+					if (strcasecmp(v->value, "keyspace") && strcasecmp(v->value, "tracking")) {
+						ast_log(LOG_WARNING, "cache_invalidation must be keyspace or tracking, not '%s'\n", v->value);
+					} else if (!is_reload) {
+						cache_tracking = !strcasecmp(v->value, "tracking");
+					}
+				} else if (!strcasecmp(v->name, "cache_size")) {
+					if (!is_reload && atoi(v->value) > 0) {
+						cache_size = atoi(v->value);
+					}
+				} else if (!strcasecmp(v->name, "cache_shards")) {
+					if (!is_reload && atoi(v->value) > 0) {
+						cache_shards = atoi(v->value);
+					}
+				} else if (!strcasecmp(v->name, "cache_ttl")) {
+					if (!is_reload) {
+						cache_ttl = atoi(v->value) > 0 ? atoi(v->value) : 0;
+					}
+				} else if (!strcasecmp(v->name, "cache_tables")) {
+					if (!is_reload) {
+						num_cache_tables = redis_table_list(v->value, cache_tables);
+					}
+				} else if (!strcasecmp(v->name, "negative_cache")) {
+					if (!is_reload) {
+						negative_cache_enabled = ast_true(v->value);
+					}
+				} else if (!strcasecmp(v->name, "negative_cache_size")) {
+					if (!is_reload && atoi(v->value) > 0) {
+						negative_cache_size = atoi(v->value);
+					}
+				} else if (!strcasecmp(v->name, "negative_cache_ttl")) {
+					if (!is_reload && atoi(v->value) > 0) {
+						negative_cache_ttl = atoi(v->value);
+					}
+				} else if (!strcasecmp(v->name, "bloom_tables")) {
+					if (!is_reload) {
+						num_bloom_tables = redis_table_list(v->value, bloom_tables);
+					}
+				} else if (!strcasecmp(v->name, "bloom_entries")) {
+					if (!is_reload && atoi(v->value) > 0) {
+						bloom_entries = atoi(v->value);
+					}
+				} else if (!strcasecmp(v->name, "bloom_rebuild")) {
+					bloom_rebuild = atoi(v->value) > 0 ? atoi(v->value) : 0;
+				} else if (!strcasecmp(v->name, "pool_wait")) {
+					pool_wait = atoi(v->value) > 0 ? atoi(v->value) : 0;
+				} else if (!strcasecmp(v->name, "keyfield")) {
+					ast_copy_string(default_keyfield, v->value, sizeof(default_keyfield));
+				} else {
+					ast_log(LOG_WARNING, "Unknown option '%s' in [general]\n", v->name);
+				}
+			}
+		} else if (!strcasecmp(cat, "indexes")) {
+			for (v = ast_variable_browse(cfg, cat); v; v = v->next) {
+				char *list = ast_strdupa(v->value), *field;
+
+				while ((field = strsep(&list, ","))) {
+					field = ast_strip(field);
+					if (ast_strlen_zero(field)) {
+						continue;
+					}
+					if (num_indexes == MAX_KEYFIELDS) {
+						ast_log(LOG_WARNING, "Too many [indexes], ignoring '%s' of '%s'\n", field, v->name);
+						continue;
+					}
+					ast_copy_string(indexes[num_indexes].table, v->name, sizeof(indexes[num_indexes].table));
+					ast_copy_string(indexes[num_indexes].field, field, sizeof(indexes[num_indexes].field));
+					num_indexes++;
+				}
+			}
+		} else if (!strcasecmp(cat, "keyfields")) {
+			for (v = ast_variable_browse(cfg, cat); v; v = v->next) {
+				if (num_keyfields == MAX_KEYFIELDS) {
+					ast_log(LOG_WARNING, "Too many [keyfields], ignoring '%s'\n", v->name);
+					break;
+				}
+				ast_copy_string(keyfields[num_keyfields].table, v->name, sizeof(keyfields[num_keyfields].table));
+				ast_copy_string(keyfields[num_keyfields].field, v->value, sizeof(keyfields[num_keyfields].field));
+				num_keyfields++;
+			}
+		} else {
+			ast_log(LOG_WARNING, "Unknown configuration section '%s'\n", cat);
+		}
+	}
 	ast_mutex_unlock(&redis_lock);
+
+	ast_config_destroy(cfg);
 	return 1;
 }
 
-static int redis_reconnect(const char *database)
+/* with tracking, reads on this connection are tracked for the invalidation connection */
+static redisContext *redis_open(int tracking)
 {
-	redisContext *conn = NULL;
-	if (redisConn) {
-		if (!redisConn->err) {
-			// everything is still ok
-			return -1;
-		} else {
-			// reconnect
-			redisFree(redisConn);
-		}
-	}
+	char host[MAX_DB_OPTION_SIZE], sock[MAX_DB_OPTION_SIZE], pass[MAX_DB_OPTION_SIZE];
+	struct timeval tv;
+	redisContext *conn;
+	redisReply *reply;
+	long long redirect;
+	int p, db;
+
+	ast_mutex_lock(&redis_lock);
+	ast_copy_string(host, hostname, sizeof(host));
+	ast_copy_string(sock, dbsock, sizeof(sock));
+	ast_copy_string(pass, dbpass, sizeof(pass));
+	p = port;
+	db = dbnum;
+	tv = timeout;
+	redirect = tracking ? tracking_redirect : 0;
+	ast_mutex_unlock(&redis_lock);
 
-	conn = redisConnectWithTimeout(hostname, port, timeout);
-	
+	conn = ast_strlen_zero(sock) ? redisConnectWithTimeout(host, p, tv) : redisConnectUnixWithTimeout(sock, tv);
 	if (conn == NULL || conn->err) {
 		if (conn) {
 	 		ast_log(LOG_ERROR, "Connection error: %s\n", conn->errstr);
+			redisFree(conn);
 		} else {
 	 		ast_log(LOG_ERROR, "Connection error: Can't allocated redis context\n");
 		}
-		return 0;
+		return NULL;
 	}
-	redisConn = conn;
-	return -1;
+	/* blocking calls give up after the same timeout */
+	redisSetTimeout(conn, tv);
+	if (!ast_strlen_zero(pass)) {
+		reply = redisCommand(conn, "AUTH %s", pass);
+		if (redis_reply_failed(conn, reply, "AUTH")) {
+			redis_reply_free(reply);
+			redisFree(conn);
+			return NULL;
+		}
+		redis_reply_free(reply);
+	}
+	if (db) {
+		reply = redisCommand(conn, "SELECT %d", db);
+		if (redis_reply_failed(conn, reply, "SELECT")) {
+			redis_reply_free(reply);
+			redisFree(conn);
+			return NULL;
+		}
+		redis_reply_free(reply);
+	}
+	if (redirect) {
+		reply = redisCommand(conn, "CLIENT TRACKING on REDIRECT %lld", redirect);
+		if (redis_reply_failed(conn, reply, "CLIENT TRACKING")) {
+			redis_reply_free(reply);
+			redisFree(conn);
+			return NULL;
+		}
+		redis_reply_free(reply);
+	}
+	return conn;
+}
+
+static void *redis_connect(void *data)
+{
+	return redis_open(1);
+}
+
+static void redis_disconnect(void *conn, void *data)
+{
+	redisFree(conn);
 }
 
 static char *handle_cli_realtime_redis_status(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
-	//char status[256];
+	conn_pool_stats_t stats;
 
 	switch (cmd) {
 		case CLI_INIT:
@@ -246,12 +2428,137 @@ static char *handle_cli_realtime_redis_status(struct ast_cli_entry *e, int cmd,
 
 	if (a->argc != 4) {
 		return CLI_SHOWUSAGE;
-        }
-        if (redisConn) {
-		return CLI_SUCCESS;
+	}
+	if (!thread_mode && !pool) {
+		return CLI_FAILURE;
+	}
+	ast_mutex_lock(&redis_lock);
+	if (ast_strlen_zero(dbsock)) {
+		ast_cli(a->fd, "Connected to %s:%d, db %d\n", hostname, port, dbnum);
 	} else {
+		ast_cli(a->fd, "Connected to %s, db %d\n", dbsock, dbnum);
+	}
+	ast_mutex_unlock(&redis_lock);
+	if (cache) {
+		realtime_cache_stats_t cstats;
+
+		realtime_cache_stats(cache, &cstats);
+		ast_cli(a->fd, "Cache: %s, %u entries, %lu hits, %lu misses, %lu evicted, %lu invalidated\n", cache_ready ? (cache_tracking ? "active (tracking)" : "active (keyspace)") : "waiting for invalidations",
+			cstats.entries, cstats.hits, cstats.misses, cstats.evictions, cstats.invalidations);
+	}
+	if (negative) {
+		realtime_cache_stats_t nstats;
+
+		realtime_cache_stats(negative, &nstats);
+		ast_cli(a->fd, "Negative cache: %u entries, %d hits, %lu invalidated\n", nstats.entries, negative_hits, nstats.invalidations);
+	}
+	if (num_blooms) {
+		unsigned int i;
+
+		ast_mutex_lock(&blooms_lock);
+		for (i = 0; i < num_blooms; i++) {
+			ast_mutex_lock(&blooms[i].lock);
+			ast_cli(a->fd, "Bloom filter %s: %s%s, %u ids\n", blooms[i].table_key, blooms[i].state == BLOOM_READY ? "ready" : "stale",
+				blooms[i].rebuild ? ", rebuilding" : "", bloom_filter_count(blooms[i].filter));
+			ast_mutex_unlock(&blooms[i].lock);
+		}
+		ast_mutex_unlock(&blooms_lock);
+		ast_cli(a->fd, "Bloom filter rejects: %d\n", bloom_rejects);
+	}
+	if (thread_mode) {
+		ast_cli(a->fd, "Per-thread connections: %d open, %d connects, %d reaped (idle timeout %us)\n",
+			thread_conns_open, thread_conns_connects, thread_conns_reaps, thread_idle_timeout);
+		return thread_conns_open ? CLI_SUCCESS : CLI_FAILURE;
+	}
+	conn_pool_stats(pool, &stats);
+	ast_cli(a->fd, "Connections: %u open, %u idle, %u max\n", stats.open, stats.idle, stats.max);
+	ast_cli(a->fd, "Requests: %lu, waited %lu, timed out %lu, connect failures %lu\n", stats.acquired, stats.waited, stats.timeouts, stats.failed);
+	return stats.open ? CLI_SUCCESS : CLI_FAILURE;
+}
+
+static char *handle_cli_realtime_redis_reindex(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	char fields[MAX_KEYFIELDS][MAX_DB_OPTION_SIZE];
+	const char *names[MAX_KEYFIELDS];
+	const char *database, *table, *table_key;
+	redisContext *ctx;
+	redisReply *reply, **olds;
+	char **ids = NULL;
+	size_t num_ids = 0, start, count, i;
+	int num_fields, j, k, queued, res = 0;
+
+	switch (cmd) {
+		case CLI_INIT:
+			e->command = "realtime redis reindex";
+			e->usage =
+				"Usage: realtime redis reindex <database> <table>\n"
+				"       Adds every row of a table to its [indexes] and marks them complete,\n"
+				"       needed once after an index is added to res_config_redis.conf\n";
+			return NULL;
+		case CLI_GENERATE:
+			return NULL;
+	}
+
+	if (a->argc != 5) {
+		return CLI_SHOWUSAGE;
+	}
+	database = a->argv[3];
+	table = a->argv[4];
+	if (!(num_fields = redis_index_fields(table, fields))) {
+		ast_cli(a->fd, "No [indexes] configured for table '%s'\n", table);
+		return CLI_FAILURE;
+	}
+	for (j = 0; j < num_fields; j++) {
+		names[j] = fields[j];
+	}
+	if (!(table_key = redis_table_key(database, table)) || !(ctx = redis_acquire())) {
+		return CLI_FAILURE;
+	}
+	reply = redisCommand(ctx, "SMEMBERS %s", table_key);
+	if (redis_reply_failed(ctx, reply, "SMEMBERS") || !(ids = redis_reply_ids(reply, 0, &num_ids))) {
+		res = -1;
+	}
+	for (start = 0; start < num_ids && !res; start += count) {
+		count = num_ids - start < SCAN_CHUNK ? num_ids - start : SCAN_CHUNK;
+		if (!(olds = redis_index_read(ctx, database, table, ids + start, count, names, num_fields))) {
+			res = -1;
+			break;
+		}
+		for (i = 0, queued = 0; i < count && !res; i++) {
+			for (j = 0; j < num_fields; j++) {
+				if ((k = redis_index_append(ctx, database, table, names[j], ids[start + i], NULL, redis_index_old(olds[i], j))) < 0) {
+					redis_pipeline_abort(ctx);
+					res = -1;
+					break;
+				}
+				queued += k;
+			}
+		}
+		redis_index_olds_free(olds, count);
+		if (redis_pipeline_read(ctx, queued, "index") < 0) {
+			res = -1;
+		}
+	}
+	ast_free(ids);
+	redis_reply_free(reply);
+	for (j = 0, queued = 0; j < num_fields && !res; j++) {
+		if (redisAppendCommand(ctx, "SADD %s:%s# %s", database, table, names[j]) != REDIS_OK) {
+			redis_pipeline_abort(ctx);
+			res = -1;
+			break;
+		}
+		queued++;
+	}
+	if (redis_pipeline_read(ctx, queued, "SADD") < 0) {
+		res = -1;
+	}
+	redis_release(ctx);
+	if (res) {
+		ast_cli(a->fd, "Reindexing '%s' failed, see the log\n", table);
 		return CLI_FAILURE;
 	}
+	ast_cli(a->fd, "Indexed %zu rows of '%s' on %d fields\n", num_ids, table, num_fields);
+	return CLI_SUCCESS;
 }
 
 /* needs usecount semantics defined */
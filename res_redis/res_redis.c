@@ -29,9 +29,11 @@
 #define AST_MODULE "res_redis"
 
 ASTERISK_FILE_VERSION(__FILE__, "$Revision: 419592 $")
+#include <limits.h>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 #include <hiredis/adapters/libevent.h>
+#include <event2/thread.h>
 
 #include <asterisk/module.h>
 #include <asterisk/logger.h>
@@ -40,6 +42,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 419592 $")
 #include <asterisk/cli.h>
 #include <asterisk/netsock2.h>
 #include <asterisk/devicestate.h>
+#include <asterisk/utils.h>
 #ifdef HAVE_PBX_STASIS_H
 #include <asterisk/stasis.h>
 #endif
@@ -47,6 +50,17 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 419592 $")
 #define AST_LOG_NOTICE_DEBUG(...) {ast_log(LOG_NOTICE, __VA_ARGS__);ast_debug(1, __VA_ARGS__);}
 
 #include "../include/pbx_event_message_serializer.h"
+#include "../include/intern_table.h"
+#include "../include/event_batch.h"
+#include "../include/seq_tracker.h"
+#include "../include/member_table.h"
+#include "../include/device_lru.h"
+#include "../include/dump_queue.h"
+#include "../include/state_file.h"
+#include "../include/stale_filter.h"
+#include "../include/devstate_aggregate.h"
+#include "../include/json_string.h"
+#include "../include/scratch_arena.h"
 #include "../include/shared.h"
 
 /* globals */
@@ -60,10 +74,87 @@ struct event_base *eventbase = NULL;
 unsigned int stoprunning = 0;
 static redisAsyncContext *redisSubConn = NULL;
 static redisAsyncContext *redisPubConn = NULL;
+static redisAsyncContext *redisBulkConn = NULL;
 char default_servers[] = "127.0.0.1:6379";
 char *servers = NULL;
 char *curserver = NULL;
 static char default_eid_str[32];
+static char default_intern_channel[] = "asterisk:intern";
+static char *intern_channel = NULL;
+static intern_table_t *local_intern_table = NULL;
+static unsigned int intern_devices = 0;
+static char default_batch_channel[] = "asterisk:batch";
+static char *batch_channel = NULL;
+static unsigned int batch_events = 0;
+static unsigned int batch_max_events = 64;
+static unsigned int batch_max_delay = 5;		/* ms */
+static event_batch_t publish_batch;
+static struct event *batch_timer = NULL;	/* one-shot, armed by the first event of a batch */
+static struct timeval batch_delay;
+AST_MUTEX_DEFINE_STATIC(batch_lock);
+static char default_state_prefix[] = "asterisk:state";
+static char *state_prefix = NULL;
+static unsigned int state_snapshot = 0;
+static int snapshot_marker;			/* userdata of the cache dump: store in the state hash, don't publish */
+static unsigned int snapshot_count = 0;
+static unsigned int state_fetch_jitter = 250;	/* ms */
+static struct event *state_fetch_timer = NULL;	/* one-shot, armed by the first member queued for a fetch */
+#define STATE_FETCH_PENDING_MAX 64
+static char state_fetch_pending[STATE_FETCH_PENDING_MAX][32];	/* dispatch thread only */
+static unsigned int state_fetch_pending_count = 0;
+static char default_resync_channel[] = "asterisk:resync";
+static char *resync_channel = NULL;
+static unsigned int sequence_events = 0;
+static uint32_t publish_epoch = 0;
+static seq_tracker_t *seq_tracker = NULL;
+static unsigned int dump_jitter = 0;		/* ms */
+static unsigned int dump_digest = 0;
+static unsigned int dump_digest_timeout = 500;	/* ms */
+static unsigned int dump_max_rate = 0;		/* events/s, 0 = unlimited */
+static unsigned int anti_entropy_interval = 0;	/* s, 0 = off */
+static unsigned int anti_entropy_buckets = 16;
+static struct event *anti_entropy_timer = NULL;
+static char default_digest_channel[] = "asterisk:digest";
+static char *digest_channel = NULL;
+static struct event *dump_timer = NULL;
+static int dump_marker;				/* userdata of a paced cache dump: queue, redis_dump_timer_cb publishes */
+static unsigned int heartbeat_interval = 0;	/* s, 0 = off */
+static unsigned int heartbeat_misses = 3;
+static struct event *heartbeat_timer = NULL;
+static member_table_t *members = NULL;
+static char default_devstate_prefix[] = "devstate";
+static char *devstate_prefix = NULL;
+static unsigned int devstate_ttl = 0;		/* ms, 0 = off */
+static struct event *devstate_timer = NULL;
+static unsigned int aggregate_devstate = 0;
+static char default_aggregate_prefix[] = "asterisk:aggregate";
+static char *aggregate_prefix = NULL;
+static char default_aggregate_eid[] = "ff:ff:ff:ff:ff:ff";
+static char *aggregate_eid = NULL;
+static unsigned int pull_mode = 0;
+static unsigned int pull_cache_size = 1024;
+static device_lru_t *pull_cache = NULL;
+static char default_pull_prefix[] = "asterisk:pull";
+static char *pull_prefix = NULL;
+static char *state_file = NULL;
+static unsigned int state_file_interval = 60;	/* s */
+static unsigned int state_file_reconcile = 60;	/* s */
+static unsigned int state_file_max_age = 3600;	/* s, 0 = any age */
+static struct event *state_file_timer = NULL;
+static boolean_t state_file_loaded = FALSE;	/* only write once the old file was read */
+static unsigned int timestamp_events = 0;
+static unsigned int max_clock_skew = 500;	/* ms, added to every max_age */
+static stale_filter_t *stale_filter = NULL;
+static unsigned int publish_suppress = 0;
+static unsigned int suppress_probe_interval = 30;	/* s */
+static struct event *suppress_timer = NULL;
+static int batch_receivers = -1;		/* like loc_event_type.receivers, for batch_channel */
+static unsigned char batch_active = 0;		/* like loc_event_type.active, for batch_channel */
+static unsigned int priority_lanes = 0;
+static unsigned int bulk_share = 20;		/* % of the realtime traffic, while there is any */
+static unsigned int bulk_connection = 0;
+static int lane_realtime_bytes = 0;		/* atomic, published on the realtime lane since the last tick */
+static int events_published = 0;		/* atomic */
 
 /* predeclarations */
 #ifdef HAVE_PBX_STASIS_H
@@ -72,10 +163,31 @@ static void ast_event_cb(void *userdata, struct stasis_subscription *sub, struct
 static void ast_event_cb(const struct ast_event *event, void *data);
 #endif
 static void redis_dump_ast_event_cache();
+static void redis_publish_cache(boolean_t to_state);
 static void redis_subscription_cb(redisAsyncContext *c, void *r, void *privdata);
 static void redis_unsubscribe_cb(redisAsyncContext *c, void *r, void *privdata);
 static void redis_subscribe_to_channels(void);
 static void redis_unsubscribe_from_channels(void);
+static void redis_intern_reset(void);
+static void redis_batch_subscription_cb(redisAsyncContext *c, void *r, void *privdata);
+static void redis_batch_flush(void);
+static void redis_state_subscription_cb(redisAsyncContext *c, void *r, void *privdata);
+static void redis_sequence_check(enum ast_event_type event_type, const char *msg);
+static void redis_resync_subscription_cb(redisAsyncContext *c, void *r, void *privdata);
+static void redis_digest_subscription_cb(redisAsyncContext *c, void *r, void *privdata);
+static boolean_t redis_heartbeat_handle(const char *msg);
+static void redis_devstate_set(const char *field, const char *msg, size_t len);
+static void redis_aggregate_update(const char *msg);
+static void redis_pull_publish(const char *msg);
+static void redis_pull_resubscribe_cb(const char *device, void *data);
+static void redis_bulk_attach(void);
+static enum ast_device_state redis_pull_devstate(const char *device);
+static int redis_pull_aggregate(const int *states, unsigned int count);
+static void redis_state_file_seen(const char *msg);
+static boolean_t redis_stale_check(enum ast_event_type event_type, const char *msg);
+static int redis_state_field(const char *msg, char *field, size_t field_len);
+static void redis_publish_count_cb(redisAsyncContext *c, void *r, void *privdata);
+static void redis_suppress_probe(void);
 
 static struct loc_event_type {
 	const char *name;
@@ -90,13 +202,22 @@ static struct loc_event_type {
 	unsigned char subscribe_default;
 	char *channelstr;
 	char *prefix;
+	unsigned int max_age;				/* ms, 0 = no staleness filter */
+	int receivers;					/* subscribers of channelstr (us included) at the last PUBLISH / NUMSUB, -1 = unknown */
+	unsigned char active;				/* redis confirmed our SUBSCRIBE to channelstr */
+	unsigned char bulk;				/* priority_lanes: queued behind the realtime lane */
+	uint32_t seq;					/* sequence_events: last "Seq" stamped on this type */
 } event_types[] = {
-	[AST_EVENT_MWI] = { .name = "mwi"},
+	[AST_EVENT_MWI] = { .name = "mwi", .bulk = 1 },
 	[AST_EVENT_DEVICE_STATE_CHANGE] = { .name = "device_state_change"},
 	[AST_EVENT_DEVICE_STATE] = { .name = "device_state"},
 	[AST_EVENT_PING] = { .name = "ping", .publish_default = 1, .subscribe_default = 1 },
 };
 
+static void redis_dump_queue(struct loc_event_type *etype, boolean_t dump, const char *msg, size_t len);
+static void redis_dump_supersede(struct loc_event_type *etype, const char *msg);
+static boolean_t redis_publish_suppressed(struct loc_event_type *etype);
+
 enum {
 	PUBLISH,
 	SUBSCRIBE,
@@ -122,6 +243,12 @@ static int redis_connect_nextserver()
 		//redisAsyncDisconnect(redisSubConn);
 		//redisAsyncFree(redisSubConn);
 	}
+	if (redisBulkConn) {
+		/* the next server gets its own, redis_bulk_disconnect_cb() leaves that one alone */
+		redisAsyncContext *old = redisBulkConn;
+		redisBulkConn = NULL;
+		redisAsyncDisconnect(old);
+	}
 	if (!remaining) {
 		strcat(servers, delims);
 		curserver = strtok_r(servers, delims, &remaining);
@@ -135,6 +262,9 @@ static int redis_connect_nextserver()
 			AST_LOG_NOTICE_DEBUG("Use Socket: %s\n", server);
 			redisPubConn = redisAsyncConnectUnix(server);
 			redisSubConn = redisAsyncConnectUnix(server);
+			if (bulk_connection) {
+				redisBulkConn = redisAsyncConnectUnix(server);
+			}
 		} else {
 			ast_sockaddr_split_hostport(server, &host, &portstr, 0);
 			if (!ast_strlen_zero(portstr)) {
@@ -144,6 +274,9 @@ static int redis_connect_nextserver()
 			if (!ast_strlen_zero(server)) {
 				redisPubConn = redisAsyncConnect(server, port);
 				redisSubConn = redisAsyncConnect(server, port);
+				if (bulk_connection) {
+					redisBulkConn = redisAsyncConnect(server, port);
+				}
 			}
 		}
 		if (redisPubConn == NULL || redisPubConn->err || redisSubConn == NULL || redisSubConn->err) {
@@ -159,7 +292,17 @@ static int redis_connect_nextserver()
 				return 0;
 			}
 		}
+		if (redisBulkConn && redisBulkConn->err) {
+			/* the bulk lane falls back to the publish connection */
+			ast_log(LOG_WARNING, "Bulk connection error: %s\n", redisBulkConn->errstr);
+			redisAsyncFree(redisBulkConn);
+			redisBulkConn = NULL;
+		} else if (redisBulkConn && dispatch_thread_id != AST_PTHREADT_NULL) {
+			/* reconnecting: the dispatch thread runs already and will not attach it */
+			redis_bulk_attach();
+		}
 		AST_LOG_NOTICE_DEBUG("Async Connection Started %s\n", curserver);
+		redis_intern_reset();
 		redis_dump_ast_event_cache();
 		break;
 	}
@@ -209,9 +352,98 @@ void redis_publish_cb(redisAsyncContext *c, void *r, void *privdata) {
 }
 */
 
-static void redis_subscription_cb(redisAsyncContext *c, void *r, void *privdata) 
+#ifndef HAVE_PBX_STASIS_H
+/* inbound filters, run on the lazy view so rejected messages never become an ast_event; the serializer emits EntityID first, so the own-eid check only touches the head of the message */
+static exception_t redis_filter_event(enum ast_event_type event_type, pbx_event_view_t *view)
+{
+	const char *prefix = event_types[event_type].prefix;
+	const char *name = NULL;
+	exception_t res;
+
+	if ((res = pbx_event_view_get_eid(view, NULL, NULL, 0)) && res != EXISTS_EXCEPTION) {
+		return res;
+	}
+	if (!ast_strlen_zero(prefix)) {
+		res = pbx_event_view_get_str(view, event_type == AST_EVENT_MWI ? AST_EVENT_IE_MAILBOX : AST_EVENT_IE_DEVICE, &name);
+		if (res && res != EXISTS_EXCEPTION) {
+			return res;
+		}
+		if (name && strncmp(name, prefix, strlen(prefix))) {
+			return FILTERED_EXCEPTION;
+		}
+	}
+	return NO_EXCEPTION;
+}
+#endif
+
+/* decode one message and hand it to asterisk, shared by the single event and the batch path */
+static exception_t redis_decode_event(enum ast_event_type event_type, char *msg)
 {
 #ifndef HAVE_PBX_STASIS_H
+	struct ast_event *event = NULL;
+	pbx_event_view_t view;
+	boolean_t cacheable = FALSE;
+#endif
+	exception_t res;
+
+	if (!event_types[event_type].publish) {
+		ast_debug(1, "event_type should not be published\n");
+		return FILTERED_EXCEPTION;
+	}
+	if (strlen(msg) < ast_event_minimum_length()) {
+		ast_log(LOG_ERROR, "Ignoring event that's too small. %u < %u\n", (unsigned int) strlen(msg), (unsigned int) ast_event_minimum_length());
+		return DECODING_EXCEPTION;
+	}
+	redis_state_file_seen(msg);
+#ifdef HAVE_PBX_STASIS_H
+	res = json2stasis(event_type, msg, event_types[event_type].prefix);
+#else
+	if (!(res = pbx_event_view_init(&view, event_type, msg)) && !(res = redis_filter_event(event_type, &view))) {
+		res = pbx_event_view_materialize(&view, &event, &cacheable);
+	}
+#endif
+	switch (res) {
+		case NO_EXCEPTION:
+#ifndef HAVE_PBX_STASIS_H
+			if (!cacheable) {
+				ast_event_queue(event);
+			} else {
+				ast_event_queue_and_cache(event);
+			}
+#endif
+			ast_debug(1, "ast_event sent'\n");
+			break;
+		case EID_SELF_EXCEPTION:
+			// skip feeding back to self
+		case FILTERED_EXCEPTION:
+			ast_debug(1, "Skipping event (Exception: %s)'\n", exception2str[res].str);
+			break;
+		case INTERN_MISS_EXCEPTION:
+			ast_debug(1, "Dropped event using an unknown interned string, fetching table\n");
+			break;
+		default:
+			ast_log(LOG_ERROR, "error decoding '%s' exception: %d\n", msg, res);
+			break;
+	}
+	scratch_reset(scratch_arena_get());
+	return res;
+}
+
+/* follow the subscribe / unsubscribe confirmations of a channel, dispatch thread only */
+static void redis_subscription_track(redisReply *reply, unsigned char *active)
+{
+	if (reply->type != REDIS_REPLY_ARRAY || reply->elements < 2 || reply->element[0]->type != REDIS_REPLY_STRING) {
+		return;
+	}
+	if (!strcasecmp(reply->element[0]->str, "subscribe")) {
+		*active = 1;
+	} else if (!strcasecmp(reply->element[0]->str, "unsubscribe")) {
+		*active = 0;
+	}
+}
+
+static void redis_subscription_cb(redisAsyncContext *c, void *r, void *privdata) 
+{
 	enum ast_event_type event_type;
 	redisReply *reply = r;
 	if (reply == NULL) {
@@ -240,51 +472,17 @@ static void redis_subscription_cb(redisAsyncContext *c, void *r, void *privdata)
 					if (!ast_strlen_zero(reply->element[2]->str)) {
 						ast_debug(1, "start decoding'\n");
 					
-						if (etype->publish) {
-							if (!strcasecmp(reply->element[1]->str, etype->channelstr)) {
-#ifdef HAVE_PBX_STASIS_H
-									
-#else
-								struct ast_event *event = NULL;
-								char *msg = ast_strdupa(reply->element[2]->str);
-								unsigned int res = 0;
-								
-								if (strlen(reply->element[2]->str) < ast_event_minimum_length()) {
-									ast_log(LOG_ERROR, "Ignoring event that's too small. %u < %u\n", (unsigned int) strlen(reply->element[2]->str), (unsigned int) ast_event_minimum_length());
-									return;
-								}
-								boolean_t cacheable = FALSE;
-								if ((res = json2message(&event, event_type, msg, &cacheable)) < 100) {
-									if (res == EID_SELF_EXCEPTION) {
-										// skip feeding back to self
-										ast_debug(1, "Originated Here. skip (Exception: %s)'\n", exception2str[res].str);
-										return;
-									} else {
-										if (!cacheable) {
-#ifdef HAVE_PBX_STASIS_H
-											//ast_publish_device_state();
-#else
-											ast_event_queue(event);
-#endif
-										} else {
-#ifdef HAVE_PBX_STASIS_H
-											//ast_publish_device_state();
-#else
-											ast_event_queue_and_cache(event);
-#endif
-										}
-										ast_debug(1, "ast_event sent'\n");
-										res = NO_EXCEPTION;
-									}
-								} else {
-									ast_log(LOG_ERROR, "error decoding '%s' exception: %d\n", msg, res);
-								}
-#endif
-							} else {
-								ast_debug(1, "has different channelstr '%s'\n", etype->channelstr);
+						if (!strcasecmp(reply->element[1]->str, etype->channelstr)) {
+							if (event_type == AST_EVENT_PING && redis_heartbeat_handle(reply->element[2]->str)) {
+								return;
 							}
+							redis_sequence_check(event_type, reply->element[2]->str);
+							if (redis_stale_check(event_type, reply->element[2]->str)) {
+								return;
+							}
+							redis_decode_event(event_type, reply->element[2]->str);
 						} else {
-							ast_debug(1, "event_type should not be published\n");
+							ast_debug(1, "has different channelstr '%s'\n", etype->channelstr);
 						}
 					} else {
 						ast_debug(1, "message content is zero\n");
@@ -298,72 +496,2484 @@ static void redis_subscription_cb(redisAsyncContext *c, void *r, void *privdata)
 			for (j = 0; j < reply->elements; j++) {
 				ast_debug(1, "REDIS_SUBSCRIPTION_CB: [%u]: %s\n", j, reply->element[j]->str);
 			}
+			for (event_type = 0; reply->elements > 1 && event_type < ARRAY_LEN(event_types); event_type++) {
+				if (event_types[event_type].channelstr && reply->element[1]->str && !strcmp(event_types[event_type].channelstr, reply->element[1]->str)) {
+					redis_subscription_track(reply, &event_types[event_type].active);
+				}
+			}
 		}		
 	}
-#endif
-//exit:
-	//redisAsyncFree(c);
+//exit:
+	//redisAsyncFree(c);
+}
+
+/*
+ * Device name interning
+ *
+ * Every new local mapping is stored in the hash '<intern_channel>:<eid>' and
+ * announced on intern_channel, both on the publish connection and before the
+ * event using it, so subscribers always see the mapping first. Subscribers that
+ * missed an announcement fetch the whole hash of that origin. Ids carry the
+ * epoch of the origin's table: a receiver seeing a new epoch, in an
+ * announcement or in the hash, drops what it had for the old one.
+ */
+/* receiver side: a mapping of origin table, moving the table to the id's epoch first */
+static void redis_intern_learn(intern_table_t *table, unsigned int id, const char *str)
+{
+	if (INTERN_EPOCH(id) != intern_table_epoch(table)) {
+		intern_table_reset(table, INTERN_EPOCH(id));
+	}
+	intern_table_set(table, id, str);
+}
+
+static void redis_intern_announce_cb(unsigned int id, const char *str)
+{
+	char escaped[INTERN_MAX_STRLEN * 6];
+	char msg[sizeof(escaped) + 128];
+
+	if (json_escape(escaped, sizeof(escaped), str, strlen(str), NULL)) {
+		return;
+	}
+	snprintf(msg, sizeof(msg), "{\"EntityID\":\"%s\",\"id\":%u,\"str\":\"%s\"}", default_eid_str, id, escaped);
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "HSET %s:%s %u %s", intern_channel, default_eid_str, id, str);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "PUBLISH %s %s", intern_channel, msg);
+	if (redisPubConn->err) {
+		ast_log(LOG_ERROR, "redisAsyncCommand Send error: %s\n", redisPubConn->errstr);
+	}
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+static void redis_intern_fetch_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	char *eid_str = privdata;
+	intern_table_t *table;
+	unsigned int j;
+
+	if (reply && reply->type == REDIS_REPLY_ARRAY && (table = intern_registry_get(eid_str, TRUE))) {
+		for (j = 0; j + 1 < reply->elements; j += 2) {
+			redis_intern_learn(table, strtoul(reply->element[j]->str, NULL, 10), reply->element[j + 1]->str);
+		}
+		ast_debug(1, "Fetched %u interned strings from %s\n", (unsigned int) reply->elements / 2, eid_str);
+	}
+	ast_free(eid_str);
+}
+
+static void redis_intern_miss_cb(const char *eid_str)
+{
+	static char last_eid_str[32];
+	static time_t last_fetch;
+	char *privdata;
+
+	/* the dispatch thread is the only caller, one fetch per origin per second is plenty */
+	if (last_fetch == time(NULL) && !strcmp(last_eid_str, eid_str)) {
+		return;
+	}
+	last_fetch = time(NULL);
+	ast_copy_string(last_eid_str, eid_str, sizeof(last_eid_str));
+	if (!(privdata = ast_strdup(eid_str))) {
+		return;
+	}
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, redis_intern_fetch_cb, privdata, "HGETALL %s:%s", intern_channel, eid_str);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+static void redis_intern_subscription_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	char *cursor, *key, *value;
+	char *eid_str = NULL, *str = NULL;
+	unsigned int id = 0, epoch = 0;
+	boolean_t is_string, reset = FALSE;
+	intern_table_t *table;
+
+	if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements < 3 || strcasecmp(reply->element[0]->str, "MESSAGE")) {
+		return;
+	}
+	if (!(cursor = scratch_strdup(scratch_arena_get(), reply->element[2]->str))) {
+		return;
+	}
+	while (!json_next_member(&cursor, &key, &value, &is_string) && key) {
+		if (!strcasecmp(key, "EntityID")) {
+			eid_str = value;
+		} else if (!strcasecmp(key, "id")) {
+			id = strtoul(value, NULL, 10);
+		} else if (!strcasecmp(key, "epoch")) {
+			epoch = strtoul(value, NULL, 10);
+		} else if (!strcasecmp(key, "str")) {
+			str = value;
+		} else if (!strcasecmp(key, "reset")) {
+			reset = ast_true(value) || atoi(value);
+		}
+	}
+	if (eid_str && strcasecmp(eid_str, default_eid_str) && (table = intern_registry_get(eid_str, TRUE))) {
+		if (reset) {
+			ast_debug(1, "Interned strings of %s reset to epoch %u\n", eid_str, epoch);
+			intern_table_reset(table, epoch);
+		} else if (id && str) {
+			redis_intern_learn(table, id, str);
+		}
+	}
+	scratch_reset(scratch_arena_get());
+}
+
+/* (re)start our id space in a new epoch: runs on every (re)connect, the new server may not have our hash */
+static void redis_intern_reset(void)
+{
+	char msg[128];
+	unsigned int epoch;
+
+	if (!local_intern_table) {
+		return;
+	}
+	epoch = (intern_table_epoch(local_intern_table) + 1) & 0xffff;
+	intern_table_reset(local_intern_table, epoch ? epoch : 1);
+	snprintf(msg, sizeof(msg), "{\"EntityID\":\"%s\",\"reset\":1,\"epoch\":%u}", default_eid_str, epoch ? epoch : 1);
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "DEL %s:%s", intern_channel, default_eid_str);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "PUBLISH %s %s", intern_channel, msg);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+/*
+ * Sequencing
+ *
+ * With sequence_events every published event carries "Epoch" (our start time)
+ * and "Seq", numbered per event type in the order the events go out on the
+ * publish connection: every type has its own channel, so only within a type
+ * does the order on the wire survive to the receiver. Receivers track the last
+ * sequence per origin and type, and on a gap resync just that origin: from its
+ * state hashes when state snapshots are kept, otherwise by asking it on
+ * resync_channel to republish its cache.
+ */
+/* called with the lock that orders the wire (redis_write_lock or batch_lock) held */
+static const char *redis_sequence_stamp(struct loc_event_type *etype, const char *msg, size_t *len)
+{
+	char *stamped;
+	int n;
+
+	if (!sequence_events || !*len || msg[*len - 1] != '}' || !(stamped = scratch_alloc(scratch_arena_get(), *len + 40))) {
+		return msg;
+	}
+	memcpy(stamped, msg, *len - 1);
+	n = snprintf(stamped + *len - 1, 41, ",\"Epoch\":%u,\"Seq\":%u}", publish_epoch, ++etype->seq);
+	*len += n - 1;
+	return stamped;
+}
+
+/*
+ * Origin timestamps
+ *
+ * With timestamp_events every published event carries "Ts", the time in ms
+ * it left the origin. For the event types with a max_age receivers drop live
+ * events older than that, and events older than the last one they saw from
+ * the same origin for the same device / mailbox: a subscriber catching up
+ * after a stall, or a backlog draining, would otherwise replay every old
+ * transition into the cache. Fetched state (snapshots, state file, pull
+ * hashes read on subscribe) is current by definition and not filtered.
+ * max_age compares an origin's clock with ours, so max_clock_skew is added
+ * to it: an origin whose clock runs behind by less than that does not get
+ * its fresh events dropped. Superseded events only compare timestamps of the
+ * same origin and do not depend on the skew.
+ */
+static inline uint64_t redis_now_ms(void)
+{
+	struct timeval now = ast_tvnow();
+
+	return (uint64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+static const char *redis_timestamp_stamp(const char *msg, size_t *len)
+{
+	char *stamped;
+	int n;
+
+	if (!timestamp_events || !*len || msg[*len - 1] != '}' || !(stamped = scratch_alloc(scratch_arena_get(), *len + 32))) {
+		return msg;
+	}
+	memcpy(stamped, msg, *len - 1);
+	n = snprintf(stamped + *len - 1, 33, ",\"Ts\":%llu}", (unsigned long long) redis_now_ms());
+	*len += n - 1;
+	return stamped;
+}
+
+/* TRUE when the event is stale and must not reach asterisk, dispatch thread only */
+static boolean_t redis_stale_check(enum ast_event_type event_type, const char *msg)
+{
+	static uint64_t last_expire;
+	char field[INTERN_MAX_STRLEN * 2] = "";
+	char key[sizeof(field) + 64];
+	char *cursor, *name, *value;
+	char *eid_str = NULL, *ts = NULL;
+	boolean_t is_string;
+	scratch_arena_t *arena = scratch_arena_get();
+	size_t mark = scratch_used(arena);
+	uint64_t now, max_age;
+	stale_status_t status;
+
+	if (!stale_filter || event_type >= ARRAY_LEN(event_types) || !(max_age = event_types[event_type].max_age)) {
+		return FALSE;
+	}
+	if (!(cursor = scratch_strdup(arena, msg))) {
+		/* fail closed, accepting it could overwrite newer state */
+		ast_log(LOG_WARNING, "Dropping %s event, no scratch space to check its age\n", event_types[event_type].name);
+		return TRUE;
+	}
+	while ((!eid_str || !ts) && !json_next_member(&cursor, &name, &value, &is_string) && name) {
+		if (!strcasecmp(name, "EntityID")) {
+			eid_str = value;
+		} else if (!strcasecmp(name, "Ts")) {
+			ts = value;
+		}
+	}
+	if (!eid_str || !ts) {
+		scratch_rewind(arena, mark);
+		return FALSE;
+	}
+	redis_state_field(msg, field, sizeof(field));
+	snprintf(key, sizeof(key), "%s/%s/%s", eid_str, event_types[event_type].name, field);
+	now = redis_now_ms();
+	status = stale_filter_check(stale_filter, key, strtoull(ts, NULL, 10), now, max_age + max_clock_skew);
+	scratch_rewind(arena, mark);
+
+	/* a key older than every max_age can only be followed by events that are too old anyway */
+	if (now - last_expire > 60000) {
+		unsigned int i;
+		for (i = 0, max_age = 0; i < ARRAY_LEN(event_types); i++) {
+			max_age = MAX(max_age, event_types[i].max_age);
+		}
+		stale_filter_expire(stale_filter, now - max_age - max_clock_skew);
+		last_expire = now;
+	}
+	if (status == STALE_FRESH) {
+		return FALSE;
+	}
+	ast_debug(1, "Dropping %s %s event for '%s'\n", status == STALE_TOO_OLD ? "too old" : "superseded", event_types[event_type].name, key);
+	return TRUE;
+}
+
+/*
+ * Multi-event batches
+ *
+ * Published events are collected in publish_batch and sent as one PUBLISH on
+ * batch_channel once batch_max_events are queued, the buffer is full, or the
+ * batch timer fires on the dispatch thread. The timer is one-shot, armed for
+ * batch_max_delay ms by the first event of a batch, so an idle node does not
+ * wake up.
+ * Subscribers split the envelope and decode each event as if it had arrived
+ * on its own channel.
+ */
+static void redis_batch_flush_locked(void)
+{
+	const char *payload;
+	size_t len;
+
+	if (!publish_batch.count) {
+		return;
+	}
+	payload = event_batch_finish(&publish_batch, &len);
+	AST_LOG_NOTICE_DEBUG("sending batch of %u events to '%s'\n", publish_batch.count, batch_channel);
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, publish_suppress ? redis_publish_count_cb : NULL, &batch_receivers, "PUBLISH %s %b", batch_channel, payload, len);
+	if (redisPubConn->err) {
+		ast_log(LOG_ERROR, "redisAsyncCommand Send error: %s\n", redisPubConn->errstr);
+	}
+	ast_mutex_unlock(&redis_write_lock);
+	event_batch_reset(&publish_batch);
+}
+
+static void redis_batch_flush(void)
+{
+	ast_mutex_lock(&batch_lock);
+	redis_batch_flush_locked();
+	ast_mutex_unlock(&batch_lock);
+}
+
+static void redis_batch_publish(struct loc_event_type *etype, const char *msg, size_t len)
+{
+	const char *type_name = etype->name;
+	exception_t res;
+
+	ast_mutex_lock(&batch_lock);
+	msg = redis_sequence_stamp(etype, msg, &len);
+	if ((res = event_batch_append(&publish_batch, type_name, msg, len)) == BUFFERSIZE_EXCEPTION) {
+		redis_batch_flush_locked();
+		res = event_batch_append(&publish_batch, type_name, msg, len);
+	}
+	if (res) {
+		ast_log(LOG_ERROR, "Could not add %s event to batch (Exception: %s)\n", type_name, exception2str[res].str);
+	} else if (publish_batch.count >= batch_max_events) {
+		redis_batch_flush_locked();
+	} else if (publish_batch.count == 1 && batch_timer) {
+		event_add(batch_timer, &batch_delay);
+	}
+	ast_mutex_unlock(&batch_lock);
+}
+
+static void redis_batch_timer_cb(evutil_socket_t fd, short what, void *data)
+{
+	redis_batch_flush();
+}
+
+static void redis_batch_subscription_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	enum ast_event_type event_type;
+	char *cursor, *type_name, *msg;
+	unsigned int events = 0;
+	exception_t res;
+
+	if (reply) {
+		redis_subscription_track(reply, &batch_active);
+	}
+	if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements < 3 || strcasecmp(reply->element[0]->str, "MESSAGE")) {
+		return;
+	}
+	if (ast_strlen_zero(reply->element[2]->str)) {
+		ast_debug(1, "message content is zero\n");
+		return;
+	}
+	/* split in place, hiredis releases the reply once we return */
+	if (!(cursor = event_batch_open(reply->element[2]->str))) {
+		ast_log(LOG_ERROR, "Ignoring message on '%s' that is not a batch\n", reply->element[1]->str);
+		return;
+	}
+	while (!(res = event_batch_next(&cursor, &type_name, &msg)) && type_name) {
+		for (event_type = 0; event_type < ARRAY_LEN(event_types); event_type++) {
+			if (event_types[event_type].name && !strcmp(event_types[event_type].name, type_name)) {
+				break;
+			}
+		}
+		if (event_type == ARRAY_LEN(event_types)) {
+			ast_debug(1, "Skipping batched event of unknown type '%s'\n", type_name);
+			continue;
+		}
+		redis_sequence_check(event_type, msg);
+		if (redis_stale_check(event_type, msg)) {
+			continue;
+		}
+		redis_decode_event(event_type, msg);
+		events++;
+	}
+	if (res) {
+		ast_log(LOG_ERROR, "error splitting batch after %u events, exception: %d\n", events, res);
+	}
+	ast_debug(1, "Dispatched %u events from batch\n", events);
+}
+
+void redis_connect_cb(const redisAsyncContext *c, int status) {
+	if (status != REDIS_OK) {
+		printf("Error: %s\n", c->errstr);
+		return;
+	}
+	AST_LOG_NOTICE_DEBUG("Connected\n");
+}
+
+void redis_disconnect_cb(const redisAsyncContext *c, int status) {
+	if (status != REDIS_OK) {
+		printf("Error: %s\n", c->errstr);
+		return;
+	}
+	AST_LOG_NOTICE_DEBUG("Disconnected\n");
+	if (c == redisSubConn) {
+		unsigned int i;
+		for (i = 0; i < ARRAY_LEN(event_types); i++) {
+			event_types[i].active = 0;
+		}
+		batch_active = 0;
+	}
+	ast_mutex_lock(&redis_lock);
+	if (!stoprunning) {
+		redis_connect_nextserver();
+	}
+	ast_mutex_unlock(&redis_lock);
+}
+
+
+/*
+ * Cluster state snapshot
+ *
+ * Every node keeps its own state in the hashes '<state_prefix>:<type>:<eid>'
+ * (field: device or mailbox@context, value: the encoded message), updated in
+ * the same MULTI/EXEC as the PUBLISH. On (re)connect a node rewrites its own
+ * hashes from the local cache without publishing anything, announces itself
+ * once on state_prefix, and pulls everybody else's state with one pipelined
+ * HGETALL per member and event type.
+ */
+/* hash field identifying the state carried by msg: the device, or mailbox@context */
+static int redis_state_field(const char *msg, char *field, size_t field_len)
+{
+	char *cursor, *key, *value;
+	const char *device = NULL, *mailbox = NULL, *context = NULL;
+	boolean_t is_string;
+	size_t keylen;
+	int interned, res = 0;
+	scratch_arena_t *arena = scratch_arena_get();
+	size_t mark = scratch_used(arena);
+
+	if (!(cursor = scratch_strdup(arena, msg))) {
+		return -1;
+	}
+	while (!json_next_member(&cursor, &key, &value, &is_string) && key) {
+		keylen = strlen(key);
+		interned = (keylen > 1 && key[keylen - 1] == '#');
+		if (interned) {
+			key[keylen - 1] = '\0';
+			*--value = '#';		/* keep interned ids apart from literal names, the ':' before the value is free */
+		}
+		if (!strcasecmp(key, "Device")) {
+			device = value;
+		} else if (!strcasecmp(key, "Mailbox")) {
+			mailbox = value;
+		} else if (!strcasecmp(key, "Context")) {
+			context = value;
+		}
+	}
+	if (device) {
+		ast_copy_string(field, device, field_len);
+	} else if (mailbox) {
+		snprintf(field, field_len, "%s@%s", mailbox, S_OR(context, "default"));
+	} else {
+		res = -1;
+	}
+	scratch_rewind(arena, mark);
+	return res;
+}
+
+/* publish one encoded event on conn, through the batch when batching is enabled */
+static void redis_publish_event_on(redisAsyncContext *conn, struct loc_event_type *etype, const char *msg, size_t len)
+{
+	char field[INTERN_MAX_STRLEN * 2];
+	boolean_t ttl_key = (devstate_ttl && etype == &event_types[AST_EVENT_DEVICE_STATE_CHANGE]) ? TRUE : FALSE;
+	boolean_t has_field = ((state_snapshot || ttl_key) && !redis_state_field(msg, field, sizeof(field))) ? TRUE : FALSE;
+	boolean_t store = (state_snapshot && has_field) ? TRUE : FALSE;
+	const char *stamped;
+	size_t stamped_len = len;
+	scratch_arena_t *arena = scratch_arena_get();
+	size_t mark = scratch_used(arena);
+
+	redis_dump_supersede(etype, msg);
+	ast_atomic_fetchadd_int(&events_published, 1);
+	msg = redis_timestamp_stamp(msg, &len);
+	stamped_len = len;
+	if (pull_cache && etype == &event_types[AST_EVENT_DEVICE_STATE_CHANGE]) {
+		redis_pull_publish(msg);
+	}
+	if (aggregate_devstate && etype == &event_types[AST_EVENT_DEVICE_STATE_CHANGE]) {
+		if (store || (ttl_key && has_field)) {
+			ast_mutex_lock(&redis_write_lock);
+			if (store) {
+				redisAsyncCommand(redisPubConn, NULL, NULL, "HSET %s:%s:%s %s %b", state_prefix, etype->name, default_eid_str, field, msg, len);
+			}
+			if (ttl_key && has_field) {
+				redis_devstate_set(field, msg, len);
+			}
+			ast_mutex_unlock(&redis_write_lock);
+		}
+		redis_aggregate_update(msg);
+		scratch_rewind(arena, mark);
+		return;
+	}
+	if (batch_events) {
+		if (store || (ttl_key && has_field)) {
+			/* pipelined ahead of the batch, the hash is never older than what was published */
+			ast_mutex_lock(&redis_write_lock);
+			if (store) {
+				redisAsyncCommand(redisPubConn, NULL, NULL, "HSET %s:%s:%s %s %b", state_prefix, etype->name, default_eid_str, field, msg, len);
+			}
+			if (ttl_key && has_field) {
+				redis_devstate_set(field, msg, len);
+			}
+			ast_mutex_unlock(&redis_write_lock);
+		}
+		redis_batch_publish(etype, msg, len);
+		scratch_rewind(arena, mark);
+		return;
+	}
+	AST_LOG_NOTICE_DEBUG("sending 'PUBLISH %s \"%s\"'\n", etype->channelstr, msg);
+	ast_mutex_lock(&redis_write_lock);
+	if (ttl_key && has_field) {
+		redis_devstate_set(field, msg, len);
+	}
+	if (store) {
+		redisAsyncCommand(conn, NULL, NULL, "MULTI");
+		redisAsyncCommand(conn, NULL, NULL, "HSET %s:%s:%s %s %b", state_prefix, etype->name, default_eid_str, field, msg, len);
+	}
+	stamped = redis_sequence_stamp(etype, msg, &stamped_len);
+	redisAsyncCommand(conn, publish_suppress ? redis_publish_count_cb : NULL, &etype->receivers, "PUBLISH %s %b", etype->channelstr, stamped, stamped_len);
+	if (store) {
+		redisAsyncCommand(conn, NULL, NULL, "EXEC");
+	}
+	if (conn->err) {
+		ast_log(LOG_ERROR, "redisAsyncCommand Send error: %s\n", conn->errstr);
+	}
+	ast_mutex_unlock(&redis_write_lock);
+	scratch_rewind(arena, mark);
+}
+
+static void redis_publish_event(struct loc_event_type *etype, const char *msg, size_t len)
+{
+	redis_publish_event_on(redisPubConn, etype, msg, len);
+}
+
+/* cache dump: write into a temporary hash, swapped in by redis_state_commit() */
+static void redis_state_store_snapshot(struct loc_event_type *etype, const char *msg, size_t len)
+{
+	char field[INTERN_MAX_STRLEN * 2];
+
+	if (redis_state_field(msg, field, sizeof(field))) {
+		return;
+	}
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "HSET %s:%s:%s:tmp %s %b", state_prefix, etype->name, default_eid_str, field, msg, len);
+	ast_mutex_unlock(&redis_write_lock);
+	snapshot_count++;
+}
+
+static void redis_state_commit(struct loc_event_type *etype, unsigned int count)
+{
+	ast_mutex_lock(&redis_write_lock);
+	if (count) {
+		redisAsyncCommand(redisPubConn, NULL, NULL, "RENAME %s:%s:%s:tmp %s:%s:%s", state_prefix, etype->name, default_eid_str, state_prefix, etype->name, default_eid_str);
+	} else {
+		redisAsyncCommand(redisPubConn, NULL, NULL, "DEL %s:%s:%s", state_prefix, etype->name, default_eid_str);
+	}
+	ast_mutex_unlock(&redis_write_lock);
+	ast_debug(1, "Stored %u %s states in %s:%s:%s\n", count, etype->name, state_prefix, etype->name, default_eid_str);
+}
+
+/* one HGETALL of a member's state hash */
+struct state_fetch {
+	enum ast_event_type event_type;
+	boolean_t retry;			/* sent after refetching the member's intern table */
+	char eid_str[32];
+};
+
+static void redis_state_fetch_send(enum ast_event_type event_type, const char *eid_str, boolean_t retry);
+
+/*
+ * With intern_devices the hashes hold interned ids. A node starting cold has
+ * not seen the member's table yet and drops those entries; fetch the table and
+ * the hash once more, replies come in order so the table is known by then
+ */
+static void redis_state_fetch_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	struct state_fetch *fetch = privdata;
+	unsigned int j, misses = 0;
+	char *eid_str;
+
+	if (!reply || reply->type != REDIS_REPLY_ARRAY) {
+		ast_free(fetch);
+		return;
+	}
+	for (j = 0; j + 1 < reply->elements; j += 2) {
+		if (redis_decode_event(fetch->event_type, reply->element[j + 1]->str) == INTERN_MISS_EXCEPTION) {
+			misses++;
+		}
+	}
+	ast_debug(1, "Loaded %u %s states from snapshot\n", (unsigned int) reply->elements / 2 - misses, event_types[fetch->event_type].name);
+	if (misses && !fetch->retry && (eid_str = ast_strdup(fetch->eid_str))) {
+		ast_debug(1, "%u %s states of %s use unknown interned ids, fetching its table and the states again\n", misses, event_types[fetch->event_type].name, fetch->eid_str);
+		ast_mutex_lock(&redis_write_lock);
+		redisAsyncCommand(redisPubConn, redis_intern_fetch_cb, eid_str, "HGETALL %s:%s", intern_channel, fetch->eid_str);
+		ast_mutex_unlock(&redis_write_lock);
+		redis_state_fetch_send(fetch->event_type, fetch->eid_str, TRUE);
+	} else if (misses) {
+		ast_log(LOG_WARNING, "Dropped %u %s states of %s using interned ids missing from its table\n", misses, event_types[fetch->event_type].name, fetch->eid_str);
+	}
+	ast_free(fetch);
+}
+
+static void redis_state_fetch_send(enum ast_event_type event_type, const char *eid_str, boolean_t retry)
+{
+	struct state_fetch *fetch;
+
+	if (!(fetch = ast_calloc(1, sizeof(*fetch)))) {
+		return;
+	}
+	fetch->event_type = event_type;
+	fetch->retry = retry;
+	ast_copy_string(fetch->eid_str, eid_str, sizeof(fetch->eid_str));
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, redis_state_fetch_cb, fetch, "HGETALL %s:%s:%s", state_prefix, event_types[event_type].name, eid_str);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+/* pull the state of one member, one pipelined HGETALL per event type */
+static void redis_state_fetch_now(const char *eid_str)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LEN(event_types); i++) {
+		if (!event_types[i].publish) {
+			continue;
+		}
+		redis_state_fetch_send(i, eid_str, FALSE);
+	}
+}
+
+static void redis_state_fetch_timer_cb(evutil_socket_t fd, short what, void *data)
+{
+	unsigned int i;
+
+	for (i = 0; i < state_fetch_pending_count; i++) {
+		redis_state_fetch_now(state_fetch_pending[i]);
+	}
+	ast_debug(1, "Fetched the state of %u members\n", state_fetch_pending_count);
+	state_fetch_pending_count = 0;
+}
+
+/*
+ * queue a member for a fetch after a random 0..state_fetch_jitter ms: after a
+ * redis restart every node announces its snapshot at once, the delay spreads
+ * the HGETALLs and collapses the announcement and the SMEMBERS listing of the
+ * same member into one fetch
+ */
+static void redis_state_fetch(const char *eid_str)
+{
+	unsigned int i;
+	struct timeval tv = { 0, 0 };
+
+	if (!strcasecmp(eid_str, default_eid_str)) {
+		return;
+	}
+	if (!state_fetch_timer) {
+		redis_state_fetch_now(eid_str);
+		return;
+	}
+	for (i = 0; i < state_fetch_pending_count; i++) {
+		if (!strcasecmp(state_fetch_pending[i], eid_str)) {
+			return;
+		}
+	}
+	if (state_fetch_pending_count == STATE_FETCH_PENDING_MAX) {
+		redis_state_fetch_now(eid_str);
+		return;
+	}
+	ast_copy_string(state_fetch_pending[state_fetch_pending_count++], eid_str, sizeof(state_fetch_pending[0]));
+	if (state_fetch_pending_count == 1) {
+		if (state_fetch_jitter) {
+			tv.tv_usec = (ast_random() % state_fetch_jitter) * 1000;
+			tv.tv_sec = tv.tv_usec / 1000000;
+			tv.tv_usec %= 1000000;
+		}
+		event_add(state_fetch_timer, &tv);
+	}
+}
+
+static void redis_state_members_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	unsigned int j;
+
+	if (!reply || reply->type != REDIS_REPLY_ARRAY) {
+		return;
+	}
+	for (j = 0; j < reply->elements; j++) {
+		redis_state_fetch(reply->element[j]->str);
+	}
+}
+
+/* a member (re)wrote its snapshot, pull it */
+static void redis_state_subscription_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	char *cursor, *key, *value;
+	char *eid_str = NULL;
+	boolean_t is_string, snapshot = FALSE;
+
+	if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements < 3 || strcasecmp(reply->element[0]->str, "MESSAGE")) {
+		return;
+	}
+	if (!(cursor = scratch_strdup(scratch_arena_get(), reply->element[2]->str))) {
+		return;
+	}
+	while (!json_next_member(&cursor, &key, &value, &is_string) && key) {
+		if (!strcasecmp(key, "EntityID")) {
+			eid_str = value;
+		} else if (!strcasecmp(key, "snapshot")) {
+			snapshot = atoi(value) ? TRUE : FALSE;
+		}
+	}
+	if (eid_str && snapshot) {
+		ast_debug(1, "%s stored a new snapshot, fetching\n", eid_str);
+		redis_state_fetch(eid_str);
+	}
+	scratch_reset(scratch_arena_get());
+}
+
+static void redis_state_announce_and_pull(void)
+{
+	char msg[128];
+
+	snprintf(msg, sizeof(msg), "{\"EntityID\":\"%s\",\"snapshot\":1}", default_eid_str);
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "SADD %s:members %s", state_prefix, default_eid_str);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "PUBLISH %s %s", state_prefix, msg);
+	redisAsyncCommand(redisPubConn, redis_state_members_cb, NULL, "SMEMBERS %s:members", state_prefix);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+/*
+ * Device state keys with a TTL
+ *
+ * With devstate_ttl every published device state is also written to
+ * '<devstate_prefix>:<eid>:<device>' (value: the encoded message) with a PX
+ * of devstate_ttl ms. The owner rewrites all of its keys from the local cache
+ * every devstate_ttl / 3, pipelined in one go, so the keys of a node that died
+ * expire on their own. A joining node pulls the live set with SCAN / MGET.
+ */
+/* called with redis_write_lock held */
+static void redis_devstate_set(const char *field, const char *msg, size_t len)
+{
+	redisAsyncCommand(redisPubConn, NULL, NULL, "SET %s:%s:%s %b PX %u", devstate_prefix, default_eid_str, field, msg, len, devstate_ttl);
+}
+
+static void redis_devstate_refresh_cb(enum ast_event_type event_type, const char *msg, size_t msg_len, void *data)
+{
+	char field[INTERN_MAX_STRLEN * 2];
+	unsigned int *count = data;
+
+	if (redis_state_field(msg, field, sizeof(field))) {
+		return;
+	}
+	ast_mutex_lock(&redis_write_lock);
+	redis_devstate_set(field, msg, msg_len);
+	ast_mutex_unlock(&redis_write_lock);
+	(*count)++;
+}
+
+static void redis_devstate_timer_cb(evutil_socket_t fd, short what, void *data)
+{
+	unsigned int count = 0;
+
+	pbx_cache_republish(AST_EVENT_DEVICE_STATE_CHANGE, 1, 1, redis_devstate_refresh_cb, &count);
+	ast_debug(1, "Refreshed %u device state keys\n", count);
+}
+
+static void redis_devstate_mget_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	unsigned int j, count = 0;
+
+	if (!reply || reply->type != REDIS_REPLY_ARRAY) {
+		return;
+	}
+	for (j = 0; j < reply->elements; j++) {
+		/* expired between SCAN and MGET */
+		if (reply->element[j]->type == REDIS_REPLY_STRING) {
+			redis_decode_event(AST_EVENT_DEVICE_STATE_CHANGE, reply->element[j]->str);
+			count++;
+		}
+	}
+	ast_debug(1, "Loaded %u device states from %s keys\n", count, devstate_prefix);
+}
+
+static void redis_devstate_scan_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	redisReply *keys;
+	const char **argv;
+	char own[64];
+	size_t own_len;
+	unsigned int j;
+	int argc = 1;
+
+	if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 || reply->element[1]->type != REDIS_REPLY_ARRAY) {
+		return;
+	}
+	keys = reply->element[1];
+	own_len = snprintf(own, sizeof(own), "%s:%s:", devstate_prefix, default_eid_str);
+	if (keys->elements && (argv = ast_malloc((keys->elements + 1) * sizeof(char *)))) {
+		argv[0] = "MGET";
+		for (j = 0; j < keys->elements; j++) {
+			if (strncasecmp(keys->element[j]->str, own, own_len)) {
+				argv[argc++] = keys->element[j]->str;
+			}
+		}
+		if (argc > 1) {
+			ast_mutex_lock(&redis_write_lock);
+			redisAsyncCommandArgv(redisPubConn, redis_devstate_mget_cb, NULL, argc, argv, NULL);
+			ast_mutex_unlock(&redis_write_lock);
+		}
+		ast_free(argv);
+	}
+	if (strcmp(reply->element[0]->str, "0")) {
+		ast_mutex_lock(&redis_write_lock);
+		redisAsyncCommand(redisPubConn, redis_devstate_scan_cb, NULL, "SCAN %s MATCH %s:* COUNT 500", reply->element[0]->str, devstate_prefix);
+		ast_mutex_unlock(&redis_write_lock);
+	}
+}
+
+static void redis_devstate_pull(void)
+{
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, redis_devstate_scan_cb, NULL, "SCAN 0 MATCH %s:* COUNT 500", devstate_prefix);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+/* literal device name and state of a device state message, -1 when it has none (or an interned name) */
+static int redis_device_state_parse(const char *msg, char *device, size_t device_len, unsigned int *state)
+{
+	char *cursor, *key, *value;
+	char *dev = NULL, *state_str = NULL;
+	boolean_t is_string;
+	int res = -1;
+	scratch_arena_t *arena = scratch_arena_get();
+	size_t mark = scratch_used(arena);
+
+	if (!(cursor = scratch_strdup(arena, msg))) {
+		return -1;
+	}
+	while (!json_next_member(&cursor, &key, &value, &is_string) && key) {
+		if (!strcasecmp(key, "Device")) {
+			dev = value;
+		} else if (!strcasecmp(key, "State")) {
+			state_str = value;
+		}
+	}
+	if (dev && state_str && strlen(dev) < device_len) {
+		strcpy(device, dev);
+		*state = strtoul(state_str, NULL, 10);
+		res = 0;
+	}
+	scratch_rewind(arena, mark);
+	return res;
+}
+
+/*
+ * Server side device state aggregation
+ *
+ * With aggregate_devstate the device_state_change events are not published
+ * as they are. Instead a script, loaded once per connection, stores the state
+ * of each node in the hash '<aggregate_prefix>:eid:<device>', recomputes the
+ * aggregate the way ast_devstate_aggregate_add() does and, only when it
+ * changed, stores it in '<aggregate_prefix>:agg:<device>' and publishes it
+ * on the device_state_change channel under aggregate_eid. Every node caches
+ * that one pseudo origin per device; a joining node reads the agg keys. The
+ * set '<aggregate_prefix>:dev:<eid>' lists the devices a node contributed to,
+ * so the fields of a node that stops sending heartbeats can be removed and
+ * the aggregates recomputed without it. See devstate_aggregate.h.
+ */
+static char aggregate_sha[41] = "";
+
+/* called with redis_write_lock held, commands queued after it find the script loaded */
+static void redis_aggregate_load(void)
+{
+	if (!aggregate_sha[0]) {
+		ast_sha1_hash(aggregate_sha, devstate_aggregate_script);
+	}
+	redisAsyncCommand(redisPubConn, NULL, NULL, "SCRIPT LOAD %s", devstate_aggregate_script);
+}
+
+static void redis_aggregate_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+
+	if (reply && reply->type == REDIS_REPLY_ERROR) {
+		ast_log(LOG_ERROR, "Aggregating device state failed: %s\n", reply->str);
+		if (!strncmp(reply->str, "NOSCRIPT", 8)) {
+			ast_mutex_lock(&redis_write_lock);
+			redis_aggregate_load();
+			ast_mutex_unlock(&redis_write_lock);
+		}
+	}
+}
+
+/* set (state: "0".."8") or remove (state: "") the state eid_str contributes to device, called with redis_write_lock held */
+static void redis_aggregate_eval(const char *device, const char *eid_str, const char *state)
+{
+	char escaped[INTERN_MAX_STRLEN * 6];
+	char head[sizeof(escaped) + 32];
+	char tail[128];
+
+	if (json_escape(escaped, sizeof(escaped), device, strlen(device), NULL)) {
+		return;
+	}
+	snprintf(head, sizeof(head), "{\"Device\":\"%s\",\"State\":", escaped);
+	snprintf(tail, sizeof(tail), ",\"EntityID\":\"%s\",\"Cachable\":1}", aggregate_eid);
+	redisAsyncCommand(redisPubConn, redis_aggregate_cb, NULL, "EVALSHA %s 3 %s:eid:%s %s:agg:%s %s:dev:%s %s %s %s %s %s %s",
+		aggregate_sha, aggregate_prefix, device, aggregate_prefix, device, aggregate_prefix, eid_str, eid_str, state,
+		event_types[AST_EVENT_DEVICE_STATE_CHANGE].channelstr, head, tail, device);
+	if (redisPubConn->err) {
+		ast_log(LOG_ERROR, "redisAsyncCommand Send error: %s\n", redisPubConn->errstr);
+	}
+}
+
+static void redis_aggregate_update(const char *msg)
+{
+	char device[INTERN_MAX_STRLEN];
+	char state_str[12];
+	unsigned int state;
+
+	if (redis_device_state_parse(msg, device, sizeof(device), &state)) {
+		ast_debug(1, "No device / state in '%s', not aggregated\n", msg);
+		return;
+	}
+	snprintf(state_str, sizeof(state_str), "%u", state);
+	ast_mutex_lock(&redis_write_lock);
+	redis_aggregate_eval(device, default_eid_str, state_str);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+/* a dead member's devices: drop its state from each of them */
+static void redis_aggregate_purge_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	char *eid_str = privdata;
+	unsigned int j;
+
+	if (reply && reply->type == REDIS_REPLY_ARRAY) {
+		ast_mutex_lock(&redis_write_lock);
+		for (j = 0; j < reply->elements; j++) {
+			if (reply->element[j]->type == REDIS_REPLY_STRING) {
+				redis_aggregate_eval(reply->element[j]->str, eid_str, "");
+			}
+		}
+		ast_mutex_unlock(&redis_write_lock);
+		ast_debug(1, "Removed %s from %u aggregated device states\n", eid_str, (unsigned int) reply->elements);
+	}
+	ast_free(eid_str);
+}
+
+/* called with redis_write_lock held */
+static void redis_aggregate_purge(const char *eid_str)
+{
+	char *privdata = ast_strdup(eid_str);
+
+	if (privdata) {
+		redisAsyncCommand(redisPubConn, redis_aggregate_purge_cb, privdata, "SMEMBERS %s:dev:%s", aggregate_prefix, eid_str);
+	}
+}
+
+struct aggregate_keys {
+	unsigned int count;
+	char *devices[];
+};
+
+static void redis_aggregate_mget_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	struct aggregate_keys *keys = privdata;
+	char escaped[INTERN_MAX_STRLEN * 6];
+	char msg[sizeof(escaped) + 128];
+	unsigned int j, count = 0;
+
+	if (reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == keys->count) {
+		for (j = 0; j < reply->elements; j++) {
+			if (reply->element[j]->type != REDIS_REPLY_STRING || !keys->devices[j]
+				|| json_escape(escaped, sizeof(escaped), keys->devices[j], strlen(keys->devices[j]), NULL)) {
+				continue;
+			}
+			snprintf(msg, sizeof(msg), "{\"Device\":\"%s\",\"State\":%s,\"EntityID\":\"%s\",\"Cachable\":1}", escaped, reply->element[j]->str, aggregate_eid);
+			redis_decode_event(AST_EVENT_DEVICE_STATE_CHANGE, msg);
+			count++;
+		}
+	}
+	ast_debug(1, "Loaded %u aggregated device states\n", count);
+	for (j = 0; j < keys->count; j++) {
+		ast_free(keys->devices[j]);
+	}
+	ast_free(keys);
+}
+
+static void redis_aggregate_scan_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	struct aggregate_keys *keys;
+	const char **argv;
+	size_t skip = strlen(aggregate_prefix) + 5;	/* ":agg:" */
+	unsigned int j;
+
+	if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 || reply->element[1]->type != REDIS_REPLY_ARRAY) {
+		return;
+	}
+	if (reply->element[1]->elements && (argv = ast_malloc((reply->element[1]->elements + 1) * sizeof(char *)))) {
+		/* the device names are needed again to rebuild the messages */
+		if ((keys = ast_calloc(1, sizeof(*keys) + reply->element[1]->elements * sizeof(char *)))) {
+			argv[0] = "MGET";
+			for (j = 0; j < reply->element[1]->elements; j++) {
+				if (strlen(reply->element[1]->element[j]->str) > skip) {
+					argv[keys->count + 1] = reply->element[1]->element[j]->str;
+					keys->devices[keys->count++] = ast_strdup(reply->element[1]->element[j]->str + skip);
+				}
+			}
+			if (keys->count) {
+				ast_mutex_lock(&redis_write_lock);
+				redisAsyncCommandArgv(redisPubConn, redis_aggregate_mget_cb, keys, keys->count + 1, argv, NULL);
+				ast_mutex_unlock(&redis_write_lock);
+			} else {
+				ast_free(keys);
+			}
+		}
+		ast_free(argv);
+	}
+	if (strcmp(reply->element[0]->str, "0")) {
+		ast_mutex_lock(&redis_write_lock);
+		redisAsyncCommand(redisPubConn, redis_aggregate_scan_cb, NULL, "SCAN %s MATCH %s:agg:* COUNT 500", reply->element[0]->str, aggregate_prefix);
+		ast_mutex_unlock(&redis_write_lock);
+	}
+}
+
+/* on (re)connect: load the script before our cache goes through it, then read the aggregates */
+static void redis_aggregate_start(void)
+{
+	ast_mutex_lock(&redis_write_lock);
+	redis_aggregate_load();
+	redisAsyncCommand(redisPubConn, redis_aggregate_scan_cb, NULL, "SCAN 0 MATCH %s:agg:* COUNT 500", aggregate_prefix);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+/*
+ * Pull mode
+ *
+ * With pull_mode the device_state_change firehose is not subscribed to. Every
+ * node still writes its device states into '<pull_prefix>:<device>' (field:
+ * EntityID) and publishes them on that per-device channel. Hints reference
+ * remote devices as 'Redis:<device>': the first query for one subscribes to
+ * its channel and reads the hash, the result is kept in a bounded LRU
+ * (pull_cache_size). States are reported not cachable, so every query comes
+ * back to the LRU. Devices asked for again (hints) stay cached, only one-off
+ * lookups are evicted and simply pulled again. Each node also lists the
+ * devices it wrote in '<pull_prefix>:devices:<eid>', so its fields can be
+ * removed when it stops sending heartbeats.
+ */
+static int redis_pull_aggregate(const int *states, unsigned int count)
+{
+	struct ast_devstate_aggregate agg;
+	unsigned int i;
+
+	if (!count) {
+		return AST_DEVICE_UNKNOWN;
+	}
+	ast_devstate_aggregate_init(&agg);
+	for (i = 0; i < count; i++) {
+		ast_devstate_aggregate_add(&agg, states[i]);
+	}
+	return ast_devstate_aggregate_result(&agg);
+}
+
+static void redis_pull_update(const char *device, const char *eid_str, unsigned int state)
+{
+	int aggregate;
+
+	if (device_lru_update(pull_cache, device, eid_str, state, &aggregate)) {
+		ast_devstate_changed(aggregate, AST_DEVSTATE_NOT_CACHABLE, "Redis:%s", device);
+	}
+}
+
+/* publisher side, every node in the cluster keeps the per-device hash and channel up to date */
+static void redis_pull_publish(const char *msg)
+{
+	char device[INTERN_MAX_STRLEN];
+	char update[128];
+	unsigned int state;
+
+	if (redis_device_state_parse(msg, device, sizeof(device), &state)) {
+		return;
+	}
+	if (timestamp_events) {
+		snprintf(update, sizeof(update), "{\"EntityID\":\"%s\",\"State\":%u,\"Ts\":%llu}", default_eid_str, state, (unsigned long long) redis_now_ms());
+	} else {
+		snprintf(update, sizeof(update), "{\"EntityID\":\"%s\",\"State\":%u}", default_eid_str, state);
+	}
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "HSET %s:%s %s %u", pull_prefix, device, default_eid_str, state);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "SADD %s:devices:%s %s", pull_prefix, default_eid_str, device);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "PUBLISH %s:%s %s", pull_prefix, device, update);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+static void redis_pull_fetch_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	char *device = privdata;
+	unsigned int j;
+
+	if (reply && reply->type == REDIS_REPLY_ARRAY) {
+		for (j = 0; j + 1 < reply->elements; j += 2) {
+			redis_pull_update(device, reply->element[j]->str, strtoul(reply->element[j + 1]->str, NULL, 10));
+		}
+	}
+	ast_free(device);
+}
+
+static void redis_pull_subscription_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	char *cursor, *key, *value;
+	char *eid_str = NULL, *state_str = NULL;
+	boolean_t is_string;
+	size_t skip = strlen(pull_prefix) + 1;
+
+	if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements < 3 || strcasecmp(reply->element[0]->str, "MESSAGE")
+		|| strlen(reply->element[1]->str) <= skip) {
+		return;
+	}
+	if (!(cursor = scratch_strdup(scratch_arena_get(), reply->element[2]->str))) {
+		return;
+	}
+	while (!json_next_member(&cursor, &key, &value, &is_string) && key) {
+		if (!strcasecmp(key, "EntityID")) {
+			eid_str = value;
+		} else if (!strcasecmp(key, "State")) {
+			state_str = value;
+		}
+	}
+	if (eid_str && state_str && !redis_stale_check(AST_EVENT_DEVICE_STATE_CHANGE, reply->element[2]->str)) {
+		redis_pull_update(reply->element[1]->str + skip, eid_str, strtoul(state_str, NULL, 10));
+	}
+	scratch_reset(scratch_arena_get());
+}
+
+/* a dead member's devices: drop its field from each of them */
+static void redis_pull_purge_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	char *eid_str = privdata;
+	unsigned int j;
+
+	if (reply && reply->type == REDIS_REPLY_ARRAY) {
+		ast_mutex_lock(&redis_write_lock);
+		for (j = 0; j < reply->elements; j++) {
+			if (reply->element[j]->type == REDIS_REPLY_STRING) {
+				redisAsyncCommand(redisPubConn, NULL, NULL, "HDEL %s:%s %s", pull_prefix, reply->element[j]->str, eid_str);
+			}
+		}
+		redisAsyncCommand(redisPubConn, NULL, NULL, "DEL %s:devices:%s", pull_prefix, eid_str);
+		ast_mutex_unlock(&redis_write_lock);
+		ast_debug(1, "Removed %s from %u pulled device states\n", eid_str, (unsigned int) reply->elements);
+	}
+	ast_free(eid_str);
+}
+
+/* runs with the LRU locked, collects the devices to report once it is released */
+static void redis_pull_forget_cb(const char *device, int state, void *data)
+{
+	ast_str_append((struct ast_str **) data, 0, "%d %s\n", state, device);
+}
+
+static void redis_pull_purge(const char *eid_str)
+{
+	struct ast_str *changed = ast_str_create(128);
+	char *privdata = ast_strdup(eid_str);
+	char *cursor, *line, *device;
+
+	if (privdata) {
+		ast_mutex_lock(&redis_write_lock);
+		redisAsyncCommand(redisPubConn, redis_pull_purge_cb, privdata, "SMEMBERS %s:devices:%s", pull_prefix, eid_str);
+		ast_mutex_unlock(&redis_write_lock);
+	}
+	if (!changed) {
+		return;
+	}
+	device_lru_forget_origin(pull_cache, eid_str, redis_pull_forget_cb, &changed);
+	cursor = ast_str_buffer(changed);
+	while ((line = strsep(&cursor, "\n")) && *line) {
+		device = strchr(line, ' ') + 1;
+		ast_devstate_changed(atoi(line), AST_DEVSTATE_NOT_CACHABLE, "Redis:%s", device);
+	}
+	ast_free(changed);
+}
+
+/* called with redis_write_lock held: subscribe before reading, an update in between is not lost */
+static void redis_pull_watch(const char *device)
+{
+	redisAsyncCommand(redisSubConn, redis_pull_subscription_cb, NULL, "SUBSCRIBE %s:%s", pull_prefix, device);
+	redisAsyncCommand(redisPubConn, redis_pull_fetch_cb, ast_strdup(device), "HGETALL %s:%s", pull_prefix, device);
+}
+
+/* device state provider for 'Redis:<device>' */
+static enum ast_device_state redis_pull_devstate(const char *device)
+{
+	char evicted[DEVICE_LRU_MAX_NAME];
+	int state;
+
+	if (!device_lru_get(pull_cache, device, &state)) {
+		return state;
+	}
+	if (device_lru_add(pull_cache, device, evicted, sizeof(evicted))) {
+		return AST_DEVICE_UNKNOWN;
+	}
+	ast_debug(1, "Pulling device state of %s%s%s\n", device, evicted[0] ? ", evicted " : "", evicted);
+	ast_mutex_lock(&redis_write_lock);
+	if (evicted[0]) {
+		redisAsyncCommand(redisSubConn, redis_unsubscribe_cb, NULL, "UNSUBSCRIBE %s:%s", pull_prefix, evicted);
+	}
+	redis_pull_watch(device);
+	ast_mutex_unlock(&redis_write_lock);
+	return AST_DEVICE_UNKNOWN;
+}
+
+/* runs with the LRU locked */
+static void redis_pull_resubscribe_cb(const char *device, void *data)
+{
+	ast_mutex_lock(&redis_write_lock);
+	if (data) {
+		redisAsyncCommand(redisSubConn, redis_unsubscribe_cb, NULL, "UNSUBSCRIBE %s:%s", pull_prefix, device);
+	} else {
+		redis_pull_watch(device);
+	}
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+/*
+ * Local state file
+ *
+ * The remote device state / mwi cache is written to state_file every
+ * state_file_interval seconds and on unload, and read back in load_module()
+ * before the first connection, so BLF is right from the start. A file older
+ * than state_file_max_age is ignored. Live data overwrites the restored
+ * entries. The first message from a restored origin asks it on digest_channel
+ * to republish all anti-entropy buckets, followed by the identities it holds,
+ * so entries it dropped while we were down are removed one by one (see
+ * redis_anti_entropy_remove()); origins from the file that stay silent for
+ * state_file_reconcile seconds after the connection are purged as a whole.
+ */
+#define STATE_FILE_MAX_ORIGINS 64
+
+static struct {
+	char eid_str[32];
+	boolean_t seen;
+} restored_origins[STATE_FILE_MAX_ORIGINS];
+static unsigned int restored_count = 0;
+static boolean_t reconciling = FALSE;		/* set once the file is loaded, reset by the reconcile timer */
+
+/* restored origin of msg, -1 when there is none or it was not in the file */
+static int redis_state_file_origin(const char *msg)
+{
+	const char *eid_str = strstr(msg, "\"EntityID\":\"");
+	unsigned int i;
+
+	if (!eid_str) {
+		return -1;
+	}
+	eid_str += 12;
+	for (i = 0; i < restored_count; i++) {
+		if (!strncasecmp(restored_origins[i].eid_str, eid_str, strlen(restored_origins[i].eid_str))) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* dispatch thread only, like the reconcile timer */
+static void redis_state_file_seen(const char *msg)
+{
+	uint64_t mask = anti_entropy_buckets < 64 ? (1ULL << anti_entropy_buckets) - 1 : ~0ULL;
+	char request[128];
+	int origin;
+
+	if (!reconciling || (origin = redis_state_file_origin(msg)) < 0 || restored_origins[origin].seen) {
+		return;
+	}
+	restored_origins[origin].seen = TRUE;
+	snprintf(request, sizeof(request), "{\"EntityID\":\"%s\",\"origin\":\"%s\",\"fetch\":\"%llx\"}", default_eid_str,
+		restored_origins[origin].eid_str, (unsigned long long) mask);
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "PUBLISH %s %s", digest_channel, request);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+static void redis_state_file_add_cb(enum ast_event_type event_type, const char *msg, size_t msg_len, void *data)
+{
+	state_file_writer_add(data, event_type, msg, msg_len);
+}
+
+static void redis_state_file_write(void)
+{
+	state_file_writer_t *writer;
+	unsigned int i, count = 0;
+
+	if (!(writer = state_file_writer_new(state_file))) {
+		ast_log(LOG_WARNING, "Could not write state file '%s': %s\n", state_file, strerror(errno));
+		return;
+	}
+	for (i = 0; i < ARRAY_LEN(event_types); i++) {
+		if (event_types[i].subscribe) {
+			count += pbx_cache_dump_remote(i, redis_state_file_add_cb, writer);
+		}
+	}
+	if (state_file_writer_commit(writer, time(NULL))) {
+		ast_log(LOG_WARNING, "Could not write state file '%s': %s\n", state_file, strerror(errno));
+		return;
+	}
+	ast_debug(1, "Wrote %u remote states to '%s'\n", count, state_file);
+}
+
+static void redis_state_file_timer_cb(evutil_socket_t fd, short what, void *data)
+{
+	redis_state_file_write();
+}
+
+static void redis_state_file_load(void)
+{
+	state_file_t *file;
+	exception_t res;
+	size_t cursor = 0, len;
+	unsigned int type, count = 0;
+	const char *msg;
+	char *copy;
+	const char *eid_str;
+	time_t age;
+
+	state_file_loaded = TRUE;
+	if (!(file = state_file_open(state_file, &res))) {
+		if (res != EXISTS_EXCEPTION) {
+			ast_log(LOG_WARNING, "Ignoring state file '%s': %s\n", state_file, exception2str[res].str);
+		}
+		return;
+	}
+	age = time(NULL) - (time_t) state_file_header(file)->created;
+	if (state_file_max_age && age > (time_t) state_file_max_age) {
+		ast_log(LOG_NOTICE, "Ignoring state file '%s', written %ld seconds ago\n", state_file, (long) age);
+		state_file_close(file);
+		return;
+	}
+	while (!state_file_next(file, &cursor, &type, &msg, &len) && msg) {
+		if (type >= ARRAY_LEN(event_types) || !event_types[type].subscribe) {
+			continue;
+		}
+		if (redis_state_file_origin(msg) < 0 && restored_count < STATE_FILE_MAX_ORIGINS && (eid_str = strstr(msg, "\"EntityID\":\""))) {
+			ast_copy_string(restored_origins[restored_count].eid_str, eid_str + 12, sizeof(restored_origins[0].eid_str));
+			*strchrnul(restored_origins[restored_count].eid_str, '"') = '\0';
+			restored_count++;
+		}
+		if ((copy = ast_strdup(msg))) {
+			redis_decode_event(type, copy);
+			ast_free(copy);
+			count++;
+		}
+	}
+	ast_log(LOG_NOTICE, "Restored %u states of %u servers from '%s', written %ld seconds ago\n", count, restored_count, state_file, (long) age);
+	state_file_close(file);
+	reconciling = restored_count ? TRUE : FALSE;
+}
+
+static void redis_state_file_reconcile_cb(evutil_socket_t fd, short what, void *data)
+{
+	struct ast_eid eid;
+	unsigned int i, j, count;
+
+	for (i = 0; i < restored_count; i++) {
+		if (restored_origins[i].seen || ast_str_to_eid(&eid, restored_origins[i].eid_str)) {
+			continue;
+		}
+		for (j = 0, count = 0; j < ARRAY_LEN(event_types); j++) {
+			if (event_types[j].subscribe) {
+				count += pbx_cache_purge(j, &eid);
+			}
+		}
+		ast_log(LOG_NOTICE, "No live data from %s, purged %u restored states\n", restored_origins[i].eid_str, count);
+	}
+	reconciling = FALSE;
+	restored_count = 0;
+}
+
+static void redis_sequence_resync(const char *eid_str)
+{
+	char msg[128];
+
+	/* a burst of gaps, even interleaved across origins, needs one resync per origin */
+	if (!seq_tracker_resync_due(seq_tracker, eid_str, time(NULL), 1)) {
+		return;
+	}
+	if (state_snapshot) {
+		redis_state_fetch(eid_str);
+		return;
+	}
+	snprintf(msg, sizeof(msg), "{\"EntityID\":\"%s\",\"resync\":\"%s\"}", default_eid_str, eid_str);
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "PUBLISH %s %s", resync_channel, msg);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+static void redis_sequence_check(enum ast_event_type event_type, const char *msg)
+{
+	char *cursor, *key, *value;
+	char *eid_str = NULL, *epoch = NULL, *seq = NULL;
+	boolean_t is_string;
+	uint32_t missed;
+	scratch_arena_t *arena = scratch_arena_get();
+	size_t mark = scratch_used(arena);
+
+	if (!seq_tracker) {
+		return;
+	}
+	if (!(cursor = scratch_strdup(arena, msg))) {
+		ast_log(LOG_WARNING, "Skipping sequence check of %s event, no scratch space\n", event_types[event_type].name);
+		return;
+	}
+	while ((!eid_str || !epoch || !seq) && !json_next_member(&cursor, &key, &value, &is_string) && key) {
+		if (!strcasecmp(key, "EntityID")) {
+			eid_str = value;
+		} else if (!strcasecmp(key, "Epoch")) {
+			epoch = value;
+		} else if (!strcasecmp(key, "Seq")) {
+			seq = value;
+		}
+	}
+	if (eid_str && epoch && seq && strcasecmp(eid_str, default_eid_str)
+		&& seq_tracker_check(seq_tracker, eid_str, event_types[event_type].name, strtoul(epoch, NULL, 10), strtoul(seq, NULL, 10), &missed) == SEQ_GAP) {
+		ast_log(LOG_NOTICE, "Missed %u events from %s, resyncing its state\n", missed, eid_str);
+		redis_sequence_resync(eid_str);
+	}
+	scratch_rewind(arena, mark);
+}
+
+/* somebody lost our events: republish the cache, rate limited against a burst of requests */
+static void redis_resync_subscription_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	static time_t last_republish;
+	redisReply *reply = r;
+	char *cursor, *key, *value;
+	char *eid_str = NULL, *target = NULL;
+	boolean_t is_string;
+
+	if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements < 3 || strcasecmp(reply->element[0]->str, "MESSAGE")) {
+		return;
+	}
+	if (!(cursor = scratch_strdup(scratch_arena_get(), reply->element[2]->str))) {
+		return;
+	}
+	while (!json_next_member(&cursor, &key, &value, &is_string) && key) {
+		if (!strcasecmp(key, "EntityID")) {
+			eid_str = value;
+		} else if (!strcasecmp(key, "resync")) {
+			target = value;
+		}
+	}
+	if (eid_str && target && !strcasecmp(target, default_eid_str) && last_republish != time(NULL)) {
+		last_republish = time(NULL);
+		ast_debug(1, "%s requested a resync, republishing our cache\n", eid_str);
+		redis_publish_cache(FALSE);
+	}
+	scratch_reset(scratch_arena_get());
+}
+
+/*
+ * Priority lanes
+ *
+ * With priority_lanes, events of the bulk types (mwi unless configured
+ * otherwise) and every cache dump go through the dump queue, where a newer
+ * event replaces the queued one for the same mailbox / device. Realtime events
+ * (device state always) are published right away. redis_dump_pace() drains
+ * the queue every LANE_TICK_MS: freely while the realtime lane is idle,
+ * otherwise bulk_share percent of what the realtime lane sent in the last
+ * tick. With bulk_connection the bulk lane has its own redis connection, so
+ * its bytes do not sit in front of device state in the publish socket.
+ */
+#define LANE_TICK_MS 10
+#define LANE_IDLE_BURST 65536				/* bytes per tick while the realtime lane is idle */
+
+static void redis_lane_publish(struct loc_event_type *etype, const char *msg, size_t len)
+{
+	if (!priority_lanes) {
+		redis_publish_event(etype, msg, len);
+	} else if (etype->bulk) {
+		redis_dump_supersede(etype, msg);
+		redis_dump_queue(etype, FALSE, msg, len);
+	} else {
+		ast_atomic_fetchadd_int(&lane_realtime_bytes, (int) len);
+		redis_publish_event(etype, msg, len);
+	}
+}
+
+static void redis_bulk_disconnect_cb(const redisAsyncContext *c, int status)
+{
+	/* hiredis frees the context, the bulk lane goes back to the publish connection */
+	if (c == redisBulkConn) {
+		redisBulkConn = NULL;
+	}
+}
+
+static void redis_bulk_attach(void)
+{
+	redisLibeventAttach(redisBulkConn, eventbase);
+	redisAsyncSetConnectCallback(redisBulkConn, redis_connect_cb);
+	redisAsyncSetDisconnectCallback(redisBulkConn, redis_bulk_disconnect_cb);
+}
+
+static void redis_snapshot_cb(enum ast_event_type event_type, const char *msg, size_t msg_len, void *data)
+{
+	if (!event_types[event_type].publish) {
+		return;
+	}
+	if (data == &snapshot_marker) {
+		redis_state_store_snapshot(&event_types[event_type], msg, msg_len);
+	} else if (data == &dump_marker) {
+		redis_dump_queue(&event_types[event_type], TRUE, msg, msg_len);
+	} else {
+		redis_lane_publish(&event_types[event_type], msg, msg_len);
+	}
+}
+
+/*
+ * Cache dump scheduling
+ *
+ * After a redis restart every node reconnects at the same moment. With
+ * dump_jitter the dump starts after a random delay instead; with dump_digest a
+ * node first asks on digest_channel, every peer answers with the (count,
+ * hash) digests of what it holds from that node, per event type it subscribes
+ * to and with the prefix it filters on, and the node compares them with the
+ * same slice of its own state. The dump is skipped only when every peer that
+ * received the question answered and all answers match. dump_max_rate queues the dump
+ * and lets redis_dump_timer_cb publish it at that many events per second; a
+ * live event supersedes the queued state of the same device or mailbox.
+ *
+ * All of it is driven from dump_timer on the dispatch thread.
+ */
+#define DUMP_TICK_MS 100
+
+AST_MUTEX_DEFINE_STATIC(dump_lock);
+static dump_queue_t *dump_queue = NULL;
+static struct timeval dump_due = { 0, 0 };			/* zero: no dump pending */
+static struct timeval digest_deadline = { 0, 0 };		/* zero: not collecting digest answers */
+static unsigned int digest_answers = 0;
+static unsigned int digest_mismatches = 0;
+static int digest_expected = -1;				/* peers that received our question, -1 = not known yet */
+
+static void redis_dump_queue(struct loc_event_type *etype, boolean_t dump, const char *msg, size_t len)
+{
+	char field[INTERN_MAX_STRLEN * 2] = "";
+
+	redis_state_field(msg, field, sizeof(field));
+	dump_queue_push(dump_queue, etype - event_types, dump, field, msg, len);
+}
+
+/* a newer event is going out, drop the queued state it replaces */
+static void redis_dump_supersede(struct loc_event_type *etype, const char *msg)
+{
+	char field[INTERN_MAX_STRLEN * 2];
+
+	if (!dump_queue_len(dump_queue) || redis_state_field(msg, field, sizeof(field))) {
+		return;
+	}
+	dump_queue_supersede(dump_queue, etype - event_types, field);
+}
+
+static void redis_dump_pace(void)
+{
+	unsigned int tick = priority_lanes ? LANE_TICK_MS : DUMP_TICK_MS;
+	unsigned int budget = (priority_lanes && !dump_max_rate) ? UINT_MAX : MAX(1, dump_max_rate * tick / 1000);
+	unsigned int sent = 0;
+	size_t bytes = 0, byte_budget = SIZE_MAX;
+	redisAsyncContext *conn = redisBulkConn ? redisBulkConn : redisPubConn;
+	dump_entry_t *entry;
+	int realtime;
+
+	if (priority_lanes) {
+		realtime = ast_atomic_fetchadd_int(&lane_realtime_bytes, 0);
+		ast_atomic_fetchadd_int(&lane_realtime_bytes, -realtime);
+		byte_budget = dump_queue_lane_budget((size_t) realtime, bulk_share, LANE_IDLE_BURST);
+	}
+	/* at least one event per tick, so the bulk lane never starves */
+	while (sent < budget && (!sent || bytes < byte_budget) && (entry = dump_queue_pop(dump_queue))) {
+		redis_publish_event_on(conn, &event_types[entry->type], entry->msg, entry->len);
+		bytes += entry->len;
+		dump_queue_entry_free(entry);
+		sent++;
+	}
+	if (sent) {
+		if (batch_events && !dump_queue_len(dump_queue)) {
+			redis_batch_flush();
+		}
+		scratch_reset(scratch_arena_get());
+	}
+}
+
+/*
+ * peer side: per subscribed event type '"<type>":"count:hash:prefix"', the
+ * digest of what we hold from eid; the origin cannot know our filters, so
+ * they travel with the answer
+ */
+static void redis_dump_digest_answer(const char *eid_str, const struct ast_eid *eid)
+{
+	char msg[1024];
+	size_t len, escaped_len;
+	pbx_digest_t digest;
+	const char *prefix;
+	unsigned int i;
+
+	len = snprintf(msg, sizeof(msg), "{\"EntityID\":\"%s\",\"origin\":\"%s\",\"answer\":1", default_eid_str, eid_str);
+	for (i = 0; i < ARRAY_LEN(event_types); i++) {
+		if (!event_types[i].subscribe || i == AST_EVENT_PING || pbx_cache_digest(i, eid, event_types[i].prefix, 1, &digest)) {
+			continue;
+		}
+		prefix = S_OR(event_types[i].prefix, "");
+		len += snprintf(msg + len, sizeof(msg) - len, ",\"%s\":\"%u:%u:", event_types[i].name, digest.count, digest.hash);
+		if (len >= sizeof(msg) || json_escape(msg + len, sizeof(msg) - len, prefix, strlen(prefix), &escaped_len)) {
+			/* no answer makes the origin dump, which is always safe */
+			return;
+		}
+		len += escaped_len;
+		len += snprintf(msg + len, sizeof(msg) - len, "\"");
+	}
+	len += snprintf(msg + len, sizeof(msg) - len, "}");
+	if (len >= sizeof(msg)) {
+		return;
+	}
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "PUBLISH %s %s", digest_channel, msg);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+/* origin side: does the state the peer holds match ours, seen through its filters */
+static boolean_t redis_dump_digest_matches(const char *answer)
+{
+	char *cursor, *key, *value, *end;
+	boolean_t is_string;
+	pbx_digest_t digest;
+	unsigned int i, count;
+	uint32_t hash;
+
+	if (!(cursor = scratch_strdup(scratch_arena_get(), answer))) {
+		return FALSE;
+	}
+	while (!json_next_member(&cursor, &key, &value, &is_string) && key) {
+		for (i = 0; i < ARRAY_LEN(event_types); i++) {
+			if (event_types[i].name && !strcasecmp(key, event_types[i].name)) {
+				break;
+			}
+		}
+		if (i == ARRAY_LEN(event_types) || !event_types[i].publish) {
+			continue;
+		}
+		count = strtoul(value, &end, 10);
+		if (*end != ':') {
+			return FALSE;
+		}
+		hash = strtoul(end + 1, &end, 10);
+		if (*end != ':' || pbx_cache_digest(i, &ast_eid_default, end + 1, 1, &digest)) {
+			return FALSE;
+		}
+		if (digest.count != count || digest.hash != hash) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* PUBLISH answers with the number of receivers, ourselves included */
+static void redis_dump_digest_published_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+
+	if (!reply || reply->type != REDIS_REPLY_INTEGER) {
+		return;
+	}
+	ast_mutex_lock(&dump_lock);
+	if (!ast_tvzero(digest_deadline)) {
+		digest_expected = reply->integer > 0 ? (int) reply->integer - 1 : 0;
+	}
+	ast_mutex_unlock(&dump_lock);
+}
+
+static void redis_dump_run(void)
+{
+	redis_publish_cache(state_snapshot);
+	AST_LOG_NOTICE_DEBUG("Ast Event Cache Dumped to %s\n", curserver);
+	if (state_snapshot) {
+		redis_state_announce_and_pull();
+	}
+}
+
+static void redis_dump_start(void)
+{
+	char msg[128];
+
+	/* state snapshots are written to our own hashes, there is no fan-out to save */
+	if (!dump_digest || state_snapshot) {
+		redis_dump_run();
+		return;
+	}
+	ast_mutex_lock(&dump_lock);
+	digest_answers = 0;
+	digest_mismatches = 0;
+	digest_expected = -1;
+	digest_deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(dump_digest_timeout, 1000));
+	ast_mutex_unlock(&dump_lock);
+	snprintf(msg, sizeof(msg), "{\"EntityID\":\"%s\",\"digest\":1}", default_eid_str);
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, redis_dump_digest_published_cb, NULL, "PUBLISH %s %s", digest_channel, msg);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+static void redis_dump_digest_done(void)
+{
+	unsigned int answers, mismatches;
+	int expected;
+
+	ast_mutex_lock(&dump_lock);
+	answers = digest_answers;
+	mismatches = digest_mismatches;
+	expected = digest_expected;
+	ast_mutex_unlock(&dump_lock);
+	/* a peer that did not answer in time may hold anything */
+	if (expected > 0 && answers >= (unsigned int) expected && !mismatches) {
+		AST_LOG_NOTICE_DEBUG("All %u peers hold our current state, skipping the cache dump\n", answers);
+		return;
+	}
+	ast_debug(1, "%u of %u peers hold a different state, %d received the digest, dumping the cache\n", mismatches, answers, expected);
+	redis_dump_run();
+}
+
+static void redis_dump_timer_cb(evutil_socket_t fd, short what, void *data)
+{
+	struct timeval now = ast_tvnow();
+	boolean_t start = FALSE, digest_done = FALSE;
+
+	ast_mutex_lock(&dump_lock);
+	if (!ast_tvzero(dump_due) && ast_tvcmp(now, dump_due) >= 0) {
+		dump_due = ast_tv(0, 0);
+		start = TRUE;
+	}
+	if (!ast_tvzero(digest_deadline) && ast_tvcmp(now, digest_deadline) >= 0) {
+		digest_deadline = ast_tv(0, 0);
+		digest_done = TRUE;
+	}
+	ast_mutex_unlock(&dump_lock);
+	if (start) {
+		redis_dump_start();
+	}
+	if (digest_done) {
+		redis_dump_digest_done();
+	}
+	redis_dump_pace();
+}
+
+/*
+ * Anti-entropy
+ *
+ * Every anti_entropy_interval seconds each node publishes the digests of its
+ * own state, split into anti_entropy_buckets buckets, on digest_channel. Peers
+ * compare them with what they hold from that node and ask for the buckets that
+ * differ, the node republishes just those, followed per event type by the
+ * list of identities it holds in them; peers drop what they hold from it in
+ * those buckets that is not on the list. Peers that filter hold only part of
+ * the node's state; they answer with their digest and their filters and the
+ * node compares through those. In steady state that is one short message per
+ * node per interval, plus one per filtering peer. Runs on the dispatch thread
+ * only.
+ */
+static uint64_t anti_entropy_fetch_mask = 0;
+static unsigned int anti_entropy_fetch_pending = 0;
+
+/*
+ * per bucket, over the event types that have an entry in prefixes; NULL leaves
+ * the type out, "" takes every entry. The count is folded in
+ */
+static void redis_anti_entropy_digest(const struct ast_eid *eid, const char **prefixes, uint32_t *buckets)
+{
+	pbx_digest_t digests[PBX_DIGEST_MAX_BUCKETS];
+	unsigned int i, b;
+
+	memset(buckets, 0, anti_entropy_buckets * sizeof(*buckets));
+	for (i = 0; i < ARRAY_LEN(event_types); i++) {
+		if (!prefixes[i] || pbx_cache_digest(i, eid, prefixes[i], anti_entropy_buckets, digests)) {
+			continue;
+		}
+		for (b = 0; b < anti_entropy_buckets; b++) {
+			buckets[b] = buckets[b] * 31 + digests[b].hash + digests[b].count * 2654435761u;
+		}
+	}
+}
+
+static size_t redis_anti_entropy_hex(char *buf, size_t buf_len, const uint32_t *buckets)
+{
+	size_t len = 0;
+	unsigned int b;
+
+	for (b = 0; b < anti_entropy_buckets && len < buf_len; b++) {
+		len += snprintf(buf + len, buf_len - len, "%08x", buckets[b]);
+	}
+	return len;
+}
+
+static uint64_t redis_anti_entropy_diff(const char *remote, const uint32_t *buckets)
+{
+	uint64_t mask = 0;
+	char hex[9] = "";
+	unsigned int b;
+
+	for (b = 0; b < anti_entropy_buckets; b++) {
+		memcpy(hex, remote + b * 8, 8);
+		if (strtoul(hex, NULL, 16) != buckets[b]) {
+			mask |= 1ULL << b;
+		}
+	}
+	return mask;
+}
+
+/* the digest covers our published event types, listed so peers can tell whether their filters let them compare */
+static void redis_anti_entropy_timer_cb(evutil_socket_t fd, short what, void *data)
+{
+	const char *prefixes[ARRAY_LEN(event_types)];
+	uint32_t buckets[PBX_DIGEST_MAX_BUCKETS];
+	char msg[256 + PBX_DIGEST_MAX_BUCKETS * 8];
+	const char *sep = "";
+	size_t len;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LEN(event_types); i++) {
+		prefixes[i] = event_types[i].publish ? "" : NULL;
+	}
+	redis_anti_entropy_digest(&ast_eid_default, prefixes, buckets);
+	len = snprintf(msg, sizeof(msg), "{\"EntityID\":\"%s\",\"buckets\":\"", default_eid_str);
+	len += redis_anti_entropy_hex(msg + len, sizeof(msg) - len, buckets);
+	len += snprintf(msg + len, sizeof(msg) - len, "\",\"types\":\"");
+	for (i = 0; i < ARRAY_LEN(event_types) && len < sizeof(msg); i++) {
+		if (prefixes[i]) {
+			len += snprintf(msg + len, sizeof(msg) - len, "%s%s", sep, event_types[i].name);
+			sep = ",";
+		}
+	}
+	if (len < sizeof(msg)) {
+		len += snprintf(msg + len, sizeof(msg) - len, "\"}");
+	}
+	if (len >= sizeof(msg)) {
+		ast_log(LOG_WARNING, "Anti-entropy digest does not fit, not sending it\n");
+		return;
+	}
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "PUBLISH %s %s", digest_channel, msg);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+/*
+ * peer side: ask origin for the buckets where our copy of its state differs.
+ * When we do not take every published type unfiltered we only hold a subset
+ * of its state, which cannot match its digest; then we send our digest with
+ * our filters and let the origin compare through them
+ */
+static void redis_anti_entropy_compare(const char *eid_str, const struct ast_eid *eid, const char *remote, const char *types)
+{
+	const char *prefixes[ARRAY_LEN(event_types)] = { NULL };
+	uint32_t buckets[PBX_DIGEST_MAX_BUCKETS];
+	boolean_t filtered = FALSE;
+	uint64_t mask;
+	char *list, *name;
+	char msg[1024];
+	size_t len, escaped_len;
+	unsigned int i;
+
+	if (strlen(remote) != anti_entropy_buckets * 8) {
+		ast_debug(1, "%s uses a different anti_entropy_buckets setting, ignoring its digest\n", eid_str);
+		return;
+	}
+	if (!(list = scratch_strdup(scratch_arena_get(), types))) {
+		return;
+	}
+	while ((name = strsep(&list, ","))) {
+		for (i = 0; i < ARRAY_LEN(event_types); i++) {
+			if (event_types[i].name && !strcasecmp(event_types[i].name, name)) {
+				break;
+			}
+		}
+		if (i == ARRAY_LEN(event_types) || !event_types[i].subscribe) {
+			filtered = TRUE;
+			continue;
+		}
+		prefixes[i] = S_OR(event_types[i].prefix, "");
+		filtered |= *prefixes[i] ? TRUE : FALSE;
+	}
+	redis_anti_entropy_digest(eid, prefixes, buckets);
+	if (filtered) {
+		len = snprintf(msg, sizeof(msg), "{\"EntityID\":\"%s\",\"origin\":\"%s\",\"compare\":\"", default_eid_str, eid_str);
+		len += redis_anti_entropy_hex(msg + len, sizeof(msg) - len, buckets);
+		len += snprintf(msg + len, sizeof(msg) - len, "\"");
+		for (i = 0; i < ARRAY_LEN(event_types) && len < sizeof(msg); i++) {
+			if (!prefixes[i]) {
+				continue;
+			}
+			len += snprintf(msg + len, sizeof(msg) - len, ",\"%s\":\"", event_types[i].name);
+			if (len >= sizeof(msg) || json_escape(msg + len, sizeof(msg) - len, prefixes[i], strlen(prefixes[i]), &escaped_len)) {
+				len = sizeof(msg);
+				break;
+			}
+			len += escaped_len;
+			len += snprintf(msg + len, sizeof(msg) - len, "\"");
+		}
+		if (len < sizeof(msg)) {
+			len += snprintf(msg + len, sizeof(msg) - len, "}");
+		}
+		if (len >= sizeof(msg)) {
+			ast_log(LOG_WARNING, "Filtered anti-entropy digest for %s does not fit, not sending it\n", eid_str);
+			return;
+		}
+	} else {
+		if (!(mask = redis_anti_entropy_diff(remote, buckets))) {
+			return;
+		}
+		ast_debug(1, "State from %s differs in buckets %llx, fetching\n", eid_str, (unsigned long long) mask);
+		snprintf(msg, sizeof(msg), "{\"EntityID\":\"%s\",\"origin\":\"%s\",\"fetch\":\"%llx\"}", default_eid_str, eid_str, (unsigned long long) mask);
+	}
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "PUBLISH %s %s", digest_channel, msg);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+/* the identities of one repaired event type, as a json escaped, '\n' separated list */
+struct anti_entropy_keys {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static boolean_t redis_anti_entropy_key_cb(enum ast_event_type event_type, const char *identity, void *data)
+{
+	struct anti_entropy_keys *keys = data;
+	size_t escaped_len, need = strlen(identity) * 6 + 3;
+	char *buf;
+
+	if (!keys->buf) {
+		return FALSE;
+	}
+	if (keys->len + need >= keys->size) {
+		if (!(buf = ast_realloc(keys->buf, keys->size + need + 4096))) {
+			ast_free(keys->buf);
+			keys->buf = NULL;
+			return FALSE;
+		}
+		keys->buf = buf;
+		keys->size += need + 4096;
+	}
+	if (!json_escape(keys->buf + keys->len, keys->size - keys->len, identity, strlen(identity), &escaped_len)) {
+		keys->len += escaped_len;
+		keys->len += snprintf(keys->buf + keys->len, keys->size - keys->len, "\\n");
+	}
+	return TRUE;
+}
+
+/* after a repair, tell the peers what is left in those buckets, so they can drop what is not */
+static void redis_anti_entropy_send_keys(unsigned int event_type, uint64_t mask)
+{
+	struct anti_entropy_keys keys = { NULL, 0, 4096 };
+	size_t header;
+
+	if (!(keys.buf = ast_malloc(keys.size))) {
+		return;
+	}
+	header = snprintf(keys.buf, keys.size, "{\"EntityID\":\"%s\",\"repaired\":\"%llx\",\"buckets\":%u,\"type\":\"%s\",\"keys\":\"",
+		default_eid_str, (unsigned long long) mask, anti_entropy_buckets, event_types[event_type].name);
+	keys.len = header;
+	pbx_cache_identities(event_type, anti_entropy_buckets, mask, redis_anti_entropy_key_cb, &keys);
+	if (!keys.buf || keys.len + 3 > keys.size) {
+		ast_log(LOG_WARNING, "Could not send the %s keys of the repaired buckets\n", event_types[event_type].name);
+		ast_free(keys.buf);
+		return;
+	}
+	keys.len += snprintf(keys.buf + keys.len, keys.size - keys.len, "\"}");
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "PUBLISH %s %b", digest_channel, keys.buf, keys.len);
+	ast_mutex_unlock(&redis_write_lock);
+	ast_free(keys.buf);
+}
+
+/* keys is the origin's list wrapped in '\n', so every identity on it is found as "\n<identity>\n" */
+static boolean_t redis_anti_entropy_keep_cb(enum ast_event_type event_type, const char *identity, void *data)
+{
+	const char *keys = data;
+	char needle[258];
+
+	if (ast_strlen_zero(identity)) {
+		return FALSE;
+	}
+	if (snprintf(needle, sizeof(needle), "\n%s\n", identity) >= (int) sizeof(needle)) {
+		/* cannot tell, keep it */
+		return TRUE;
+	}
+	return strstr(keys, needle) ? TRUE : FALSE;
+}
+
+/* peer side: drop what we hold from the origin in the repaired buckets that it no longer has */
+static void redis_anti_entropy_remove(const char *eid_str, const char *repaired, const char *buckets, const char *type_name, const char *keys)
+{
+	struct ast_eid eid;
+	unsigned int i, count;
+	char *wrapped;
+
+	if (strtoul(buckets, NULL, 10) != anti_entropy_buckets || ast_str_to_eid(&eid, eid_str)) {
+		return;
+	}
+	for (i = 0; i < ARRAY_LEN(event_types); i++) {
+		if (event_types[i].name && !strcasecmp(event_types[i].name, type_name)) {
+			break;
+		}
+	}
+	if (i == ARRAY_LEN(event_types) || !event_types[i].subscribe) {
+		return;
+	}
+	if (!(wrapped = scratch_alloc(scratch_arena_get(), strlen(keys) + 3))) {
+		return;
+	}
+	sprintf(wrapped, "\n%s\n", keys);
+	if ((count = pbx_cache_purge_missing(i, &eid, anti_entropy_buckets, strtoull(repaired, NULL, 16), redis_anti_entropy_keep_cb, wrapped))) {
+		ast_log(LOG_NOTICE, "Removed %u %s states %s no longer has\n", count, type_name, eid_str);
+	}
+}
+
+static void redis_anti_entropy_republish_cb(evutil_socket_t fd, short what, void *data)
+{
+	uint64_t mask = anti_entropy_fetch_mask;
+	unsigned int i, count = 0;
+
+	anti_entropy_fetch_mask = 0;
+	anti_entropy_fetch_pending = 0;
+	for (i = 0; i < ARRAY_LEN(event_types); i++) {
+		if (event_types[i].publish) {
+			count += pbx_cache_republish(i, anti_entropy_buckets, mask, redis_snapshot_cb, NULL);
+			if (i != AST_EVENT_PING) {
+				redis_anti_entropy_send_keys(i, mask);
+			}
+		}
+	}
+	if (batch_events) {
+		redis_batch_flush();
+	}
+	ast_debug(1, "Republished %u events from buckets %llx\n", count, (unsigned long long) mask);
+}
+
+/* origin side: collect the requests of all peers for a moment, then republish once */
+static void redis_anti_entropy_fetch(uint64_t mask)
+{
+	struct timeval tv = { 0, 200000 };
+
+	anti_entropy_fetch_mask |= mask;
+	if (!anti_entropy_fetch_pending) {
+		anti_entropy_fetch_pending = 1;
+		event_base_once(eventbase, -1, EV_TIMEOUT, redis_anti_entropy_republish_cb, NULL, &tv);
+	}
+}
+
+/* origin side: a filtered peer's digest, its per type prefixes travel as members of the message */
+static void redis_anti_entropy_compare_filtered(const char *peer, const char *request)
+{
+	const char *prefixes[ARRAY_LEN(event_types)] = { NULL };
+	uint32_t buckets[PBX_DIGEST_MAX_BUCKETS];
+	char *cursor, *key, *value, *remote = NULL;
+	boolean_t is_string;
+	uint64_t mask;
+	unsigned int i;
+
+	if (!(cursor = scratch_strdup(scratch_arena_get(), request))) {
+		return;
+	}
+	while (!json_next_member(&cursor, &key, &value, &is_string) && key) {
+		if (!strcasecmp(key, "compare")) {
+			remote = value;
+			continue;
+		}
+		for (i = 0; i < ARRAY_LEN(event_types); i++) {
+			if (event_types[i].name && !strcasecmp(key, event_types[i].name)) {
+				break;
+			}
+		}
+		if (i < ARRAY_LEN(event_types) && event_types[i].publish) {
+			prefixes[i] = value;
+		}
+	}
+	if (!remote || strlen(remote) != anti_entropy_buckets * 8) {
+		return;
+	}
+	redis_anti_entropy_digest(&ast_eid_default, prefixes, buckets);
+	if ((mask = redis_anti_entropy_diff(remote, buckets))) {
+		ast_debug(1, "State of %s differs in buckets %llx, republishing\n", peer, (unsigned long long) mask);
+		redis_anti_entropy_fetch(mask);
+	}
+}
+
+/* digest_channel: a reconnecting peer's digest, anti-entropy buckets, or the answers to ours */
+static void redis_digest_subscription_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	char *cursor, *key, *value;
+	char *eid_str = NULL, *origin = NULL, *digest_str = NULL, *answer_str = NULL;
+	char *buckets_str = NULL, *fetch_str = NULL;
+	char *repaired_str = NULL, *type_str = NULL, *keys_str = NULL;
+	char *types_str = NULL, *compare_str = NULL;
+	boolean_t is_string;
+	struct ast_eid eid;
+
+	if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements < 3 || strcasecmp(reply->element[0]->str, "MESSAGE")) {
+		return;
+	}
+	if (!(cursor = scratch_strdup(scratch_arena_get(), reply->element[2]->str))) {
+		return;
+	}
+	while (!json_next_member(&cursor, &key, &value, &is_string) && key) {
+		if (!strcasecmp(key, "EntityID")) {
+			eid_str = value;
+		} else if (!strcasecmp(key, "origin")) {
+			origin = value;
+		} else if (!strcasecmp(key, "digest")) {
+			digest_str = value;
+		} else if (!strcasecmp(key, "answer")) {
+			answer_str = value;
+		} else if (!strcasecmp(key, "buckets")) {
+			buckets_str = value;
+		} else if (!strcasecmp(key, "fetch")) {
+			fetch_str = value;
+		} else if (!strcasecmp(key, "repaired")) {
+			repaired_str = value;
+		} else if (!strcasecmp(key, "type")) {
+			type_str = value;
+		} else if (!strcasecmp(key, "keys")) {
+			keys_str = value;
+		} else if (!strcasecmp(key, "types")) {
+			types_str = value;
+		} else if (!strcasecmp(key, "compare")) {
+			compare_str = value;
+		}
+	}
+	if (!eid_str || !strcasecmp(eid_str, default_eid_str)) {
+		goto exit;
+	}
+	if (origin) {
+		if (strcasecmp(origin, default_eid_str)) {
+			goto exit;
+		}
+		if (fetch_str) {
+			redis_anti_entropy_fetch(strtoull(fetch_str, NULL, 16));
+		} else if (compare_str) {
+			/* the per type prefixes are read from a fresh copy */
+			redis_anti_entropy_compare_filtered(eid_str, reply->element[2]->str);
+		} else if (answer_str) {
+			/* the per type members of the answer are compared on a fresh copy */
+			boolean_t match = redis_dump_digest_matches(reply->element[2]->str);
+			ast_mutex_lock(&dump_lock);
+			if (!ast_tvzero(digest_deadline)) {
+				digest_answers++;
+				digest_mismatches += match ? 0 : 1;
+			}
+			ast_mutex_unlock(&dump_lock);
+		}
+	} else if (repaired_str && buckets_str && type_str && keys_str) {
+		if (anti_entropy_interval || reconciling) {
+			redis_anti_entropy_remove(eid_str, repaired_str, buckets_str, type_str, keys_str);
+		}
+	} else if (buckets_str && types_str && anti_entropy_interval && !ast_str_to_eid(&eid, eid_str)) {
+		redis_anti_entropy_compare(eid_str, &eid, buckets_str, types_str);
+	} else if (digest_str && !ast_str_to_eid(&eid, eid_str)) {
+		redis_dump_digest_answer(eid_str, &eid);
+	}
+exit:
+	scratch_reset(scratch_arena_get());
+}
+
+/*
+ * Heartbeats
+ *
+ * Every heartbeat_interval seconds each node publishes a heartbeat on the ping
+ * channel. All nodes keep a member table from them; a member that stays silent
+ * for heartbeat_misses intervals is removed and the state it contributed to
+ * our cache (and its state hashes) is purged, instead of lingering until the
+ * node comes back. Members are only expired while our own heartbeats make the
+ * round trip, a broken link to redis must not purge the whole cluster.
+ */
+static unsigned int heartbeat_rtt = 0;		/* ms, our own heartbeat's round trip */
+static uint32_t heartbeat_seq = 0;
+
+static int64_t redis_heartbeat_now(void)
+{
+	struct timeval now = ast_tvnow();
+	return (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+/* runs with the member table locked */
+static void redis_heartbeat_purge_cb(const member_info_t *member, void *data)
+{
+	struct ast_eid eid;
+	unsigned int i, count = 0;
+
+	if (!strcasecmp(member->eid_str, default_eid_str) || ast_str_to_eid(&eid, member->eid_str)) {
+		return;
+	}
+	for (i = 0; i < ARRAY_LEN(event_types); i++) {
+		if (event_types[i].subscribe) {
+			count += pbx_cache_purge(i, &eid);
+		}
+	}
+	if (aggregate_devstate) {
+		ast_mutex_lock(&redis_write_lock);
+		redis_aggregate_purge(member->eid_str);
+		ast_mutex_unlock(&redis_write_lock);
+	}
+	if (pull_cache) {
+		redis_pull_purge(member->eid_str);
+	}
+	if (state_snapshot) {
+		ast_mutex_lock(&redis_write_lock);
+		redisAsyncCommand(redisPubConn, NULL, NULL, "SREM %s:members %s", state_prefix, member->eid_str);
+		for (i = 0; i < ARRAY_LEN(event_types); i++) {
+			if (event_types[i].name) {
+				redisAsyncCommand(redisPubConn, NULL, NULL, "DEL %s:%s:%s", state_prefix, event_types[i].name, member->eid_str);
+			}
+		}
+		ast_mutex_unlock(&redis_write_lock);
+	}
+	ast_log(LOG_NOTICE, "Cluster member %s missed %u heartbeats, purged %u cached states\n", member->eid_str, heartbeat_misses, count);
+}
+
+static void redis_heartbeat_timer_cb(evutil_socket_t fd, short what, void *data)
+{
+	int64_t now = redis_heartbeat_now();
+	int64_t timeout = (int64_t) heartbeat_misses * heartbeat_interval * 1000;
+	member_info_t self;
+	double load[1] = { 0 };
+	char msg[256];
+
+	if (!member_table_get(members, default_eid_str, &self) && now - self.last_seen <= timeout) {
+		member_table_expire(members, now, timeout, redis_heartbeat_purge_cb, NULL);
+	}
+	if (!event_types[AST_EVENT_PING].channelstr) {
+		return;
+	}
+	getloadavg(load, 1);
+	snprintf(msg, sizeof(msg), "{\"EntityID\":\"%s\",\"heartbeat\":%u,\"ts\":%lld,\"rtt\":%u,\"load\":%u,\"events\":%u}",
+		default_eid_str, ++heartbeat_seq, (long long) now, heartbeat_rtt, (unsigned int) (load[0] * 100), (unsigned int) events_published);
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisPubConn, NULL, NULL, "PUBLISH %s %s", event_types[AST_EVENT_PING].channelstr, msg);
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+/* ping channel: returns TRUE when msg was a heartbeat, anything else is decoded as a ping event */
+static boolean_t redis_heartbeat_handle(const char *msg)
+{
+	char *cursor, *key, *value;
+	char *eid_str = NULL, *seq_str = NULL, *ts_str = NULL, *rtt_str = NULL, *load_str = NULL, *events_str = NULL;
+	boolean_t is_string;
+	member_info_t beat = { "" };
+	int64_t now = redis_heartbeat_now();
+
+	if (!strstr(msg, "\"heartbeat\"")) {
+		return FALSE;
+	}
+	if (!members || !(cursor = scratch_strdup(scratch_arena_get(), msg))) {
+		return TRUE;
+	}
+	while (!json_next_member(&cursor, &key, &value, &is_string) && key) {
+		if (!strcasecmp(key, "EntityID")) {
+			eid_str = value;
+		} else if (!strcasecmp(key, "heartbeat")) {
+			seq_str = value;
+		} else if (!strcasecmp(key, "ts")) {
+			ts_str = value;
+		} else if (!strcasecmp(key, "rtt")) {
+			rtt_str = value;
+		} else if (!strcasecmp(key, "load")) {
+			load_str = value;
+		} else if (!strcasecmp(key, "events")) {
+			events_str = value;
+		}
+	}
+	if (!eid_str || !seq_str) {
+		goto exit;
+	}
+	ast_copy_string(beat.eid_str, eid_str, sizeof(beat.eid_str));
+	beat.seq = strtoul(seq_str, NULL, 10);
+	beat.rtt = rtt_str ? strtoul(rtt_str, NULL, 10) : 0;
+	beat.load = load_str ? strtoul(load_str, NULL, 10) : 0;
+	beat.events = events_str ? strtoul(events_str, NULL, 10) : 0;
+	if (!strcasecmp(eid_str, default_eid_str) && ts_str) {
+		/* our own heartbeat made it through redis and back */
+		heartbeat_rtt = beat.rtt = (unsigned int) (now - strtoll(ts_str, NULL, 10));
+	}
+	redis_state_file_seen(msg);
+	if (member_table_heartbeat(members, &beat, now)) {
+		ast_log(LOG_NOTICE, "Cluster member %s joined\n", eid_str);
+		if (publish_suppress) {
+			redis_suppress_probe();
+		}
+	}
+exit:
+	scratch_reset(scratch_arena_get());
+	return TRUE;
+}
+
+/*
+ * Publish suppression
+ *
+ * With publish_suppress the receiver count PUBLISH replies with is kept per
+ * channel. When nobody else subscribes (we count ourselves only while we
+ * subscribe to the type and redis confirmed it, like msq_publish_suppressed()
+ * does), events of that type are neither encoded nor sent.
+ * PUBSUB NUMSUB probes every suppress_probe_interval seconds, and whenever a
+ * cluster member joins, find new subscribers; on the way back the cache is
+ * republished so they start out with our current state. Not available with
+ * the features that keep state in redis next to the channel (state_snapshot,
+ * devstate_ttl, aggregate_devstate), nor for device state in pull mode.
+ */
+static boolean_t redis_publish_suppressed(struct loc_event_type *etype)
+{
+	int receivers = batch_events ? batch_receivers : etype->receivers;
+	int own = (etype->subscribe && (batch_events ? batch_active : etype->active)) ? 1 : 0;
+
+	if (!publish_suppress || etype == &event_types[AST_EVENT_PING] || (pull_mode && etype == &event_types[AST_EVENT_DEVICE_STATE_CHANGE])) {
+		return FALSE;
+	}
+	return (receivers >= 0 && receivers <= own) ? TRUE : FALSE;
 }
 
-void redis_connect_cb(const redisAsyncContext *c, int status) {
-	if (status != REDIS_OK) {
-		printf("Error: %s\n", c->errstr);
-		return;
+/* whether receivers (a loc_event_type's or batch_receivers) counts ourselves */
+static int redis_receivers_own(const int *receivers)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LEN(event_types); i++) {
+		if (receivers == &event_types[i].receivers) {
+			return (event_types[i].subscribe && event_types[i].active) ? 1 : 0;
+		}
+		if (receivers == &batch_receivers && event_types[i].subscribe && batch_active) {
+			return 1;
+		}
 	}
-	AST_LOG_NOTICE_DEBUG("Connected\n");
+	return 0;
 }
 
-void redis_disconnect_cb(const redisAsyncContext *c, int status) {
-	if (status != REDIS_OK) {
-		printf("Error: %s\n", c->errstr);
+/* dispatch thread only, readers tolerate a stale value for one event */
+static void redis_receivers_set(int *receivers, int count, const char *channel)
+{
+	int previous = *receivers;
+	int own = redis_receivers_own(receivers);
+
+	*receivers = count;
+	if (count <= own && (previous < 0 || previous > own)) {
+		ast_log(LOG_NOTICE, "Nobody else subscribes to '%s', pausing publish\n", channel);
+	} else if (count > own && previous >= 0 && previous <= own) {
+		ast_log(LOG_NOTICE, "'%s' has %d other subscribers, resuming publish\n", channel, count - own);
+		redis_publish_cache(FALSE);
+	}
+}
+
+static void redis_publish_count_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
+	int *receivers = privdata;
+	const char *channel = batch_channel;
+	unsigned int i;
+
+	/* the reply is QUEUED inside MULTI, only a direct PUBLISH counts */
+	if (!reply || reply->type != REDIS_REPLY_INTEGER) {
 		return;
 	}
-	AST_LOG_NOTICE_DEBUG("Disconnected\n");
-	ast_mutex_lock(&redis_lock);
-	if (!stoprunning) {
-		redis_connect_nextserver();
+	for (i = 0; i < ARRAY_LEN(event_types); i++) {
+		if (receivers == &event_types[i].receivers) {
+			channel = event_types[i].channelstr;
+		}
 	}
-	ast_mutex_unlock(&redis_lock);
+	redis_receivers_set(receivers, (int) reply->integer, channel);
 }
 
+static void redis_numsub_cb(redisAsyncContext *c, void *r, void *privdata)
+{
+	redisReply *reply = r;
 
-static void redis_dump_ast_event_cache()
+	if (reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 && reply->element[1]->type == REDIS_REPLY_INTEGER) {
+		redis_receivers_set(privdata, (int) reply->element[1]->integer, reply->element[0]->str);
+	}
+}
+
+static void redis_suppress_probe(void)
 {
-	if (dispatch_thread_id != AST_PTHREADT_NULL) {
-		ast_debug(1, "Dumping Ast Event Cache to %s\n", curserver);
-		unsigned int i = 0;
-		// flush all changes
+	unsigned int i;
+
+	ast_mutex_lock(&redis_write_lock);
+	if (batch_events) {
+		redisAsyncCommand(redisPubConn, redis_numsub_cb, &batch_receivers, "PUBSUB NUMSUB %s", batch_channel);
+	} else {
 		for (i = 0; i < ARRAY_LEN(event_types); i++) {
-			ast_rwlock_rdlock(&event_types_lock);
-			if (!event_types[i].publish) {
-				ast_rwlock_unlock(&event_types_lock);
-				ast_debug(1, "%s skipping not published\n", event_types[i].name);
-				continue;
+			if (event_types[i].publish && event_types[i].channelstr) {
+				redisAsyncCommand(redisPubConn, redis_numsub_cb, &event_types[i].receivers, "PUBSUB NUMSUB %s", event_types[i].channelstr);
 			}
+		}
+	}
+	ast_mutex_unlock(&redis_write_lock);
+}
+
+static void redis_suppress_timer_cb(evutil_socket_t fd, short what, void *data)
+{
+	redis_suppress_probe();
+}
+
+/* send our cache out: published, or (to_state) only written into our state hashes */
+static void redis_publish_cache(boolean_t to_state)
+{
+	unsigned int i = 0;
+	void *marker = to_state ? &snapshot_marker : ((dump_max_rate || priority_lanes) ? &dump_marker : NULL);
+
+	if (marker == &dump_marker) {
+		/* this dump carries the current state of everything an older dump still has queued */
+		dump_queue_clear(dump_queue, TRUE);
+	}
+	// flush all changes
+	for (i = 0; i < ARRAY_LEN(event_types); i++) {
+		ast_rwlock_rdlock(&event_types_lock);
+		if (!event_types[i].publish) {
 			ast_rwlock_unlock(&event_types_lock);
+			ast_debug(1, "%s skipping not published\n", event_types[i].name);
+			continue;
+		}
+		ast_rwlock_unlock(&event_types_lock);
+		if (!to_state && redis_publish_suppressed(&event_types[i])) {
+			ast_debug(1, "%s skipping, nobody listens\n", event_types[i].name);
+			continue;
+		}
 
-			ast_debug(1, "subscribe %s\n", event_types[i].name);
+		ast_debug(1, "subscribe %s\n", event_types[i].name);
+		snapshot_count = 0;
 #ifdef HAVE_PBX_STASIS_H
-			struct stasis_subscription *event_sub;
-			event_sub = stasis_subscribe(ast_device_state_topic_all(), ast_event_cb, NULL);
-			usleep(500);
-			ast_debug(1, "Dumping Past %s Events\n", event_types[i].name);
-			stasis_cache_dump(ast_device_state_cache(), NULL);
-//			stasis_cache_dump_by_eid();
-			stasis_unsubscribe(event_sub)
-			//destroy ? 
+		ast_debug(1, "Streaming %s cache snapshot\n", event_types[i].name);
+		pbx_stream_cache_snapshot(i, redis_snapshot_cb, marker);
 #else
-			struct ast_event_sub *event_sub;
-			event_sub = ast_event_subscribe_new(i, ast_event_cb, NULL);
-			ast_event_sub_append_ie_raw(event_sub, AST_EVENT_IE_EID, &ast_eid_default, sizeof(ast_eid_default));
-			usleep(500);
-			ast_debug(1, "Dumping Past %s Events\n", event_types[i].name);
-			ast_event_dump_cache(event_sub);
-			ast_event_sub_destroy(event_sub);
+		struct ast_event_sub *event_sub;
+		event_sub = ast_event_subscribe_new(i, ast_event_cb, marker);
+		ast_event_sub_append_ie_raw(event_sub, AST_EVENT_IE_EID, &ast_eid_default, sizeof(ast_eid_default));
+		ast_debug(1, "Dumping Past %s Events\n", event_types[i].name);
+		ast_event_dump_cache(event_sub);
+		ast_event_sub_destroy(event_sub);
 #endif
+		if (to_state) {
+			redis_state_commit(&event_types[i], snapshot_count);
+		}
+	}
+	if (batch_events) {
+		redis_batch_flush();
+	}
+}
+
+static void redis_dump_ast_event_cache()
+{
+	if (dispatch_thread_id != AST_PTHREADT_NULL) {
+		if (aggregate_devstate) {
+			redis_aggregate_start();
+		}
+		if (dump_jitter || dump_digest || dump_max_rate) {
+			/* subscribe right away, dump_timer starts the dump once the jitter has passed */
+			redis_subscribe_to_channels();
+			ast_mutex_lock(&dump_lock);
+			dump_due = ast_tvadd(ast_tvnow(), ast_samp2tv(dump_jitter ? ast_random() % dump_jitter : 0, 1000));
+			ast_mutex_unlock(&dump_lock);
+			ast_debug(1, "Dumping Ast Event Cache to %s in %ld ms\n", curserver, (long) ast_tvdiff_ms(dump_due, ast_tvnow()));
+			if (devstate_ttl) {
+				redis_devstate_pull();
+			}
+			return;
 		}
+		ast_debug(1, "Dumping Ast Event Cache to %s\n", curserver);
+		/* with state snapshots the cache goes into our hash, nothing is published */
+		redis_publish_cache(state_snapshot);
 		AST_LOG_NOTICE_DEBUG("Ast Event Cache Dumped to %s\n", curserver);
 		redis_subscribe_to_channels();
+		if (state_snapshot) {
+			redis_state_announce_and_pull();
+		}
+		if (devstate_ttl) {
+			redis_devstate_pull();
+		}
 	}
 }
 
@@ -424,44 +3034,69 @@ static void ast_event_cb(const struct ast_event *event, void *data)
 	// decode event2msg
 	ast_debug(1, "(ast_event_cb) decode incoming message\n");
 	struct loc_event_type *etype;
-	char *msg = ast_alloca(MAX_EVENT_LENGTH + 1);
+	scratch_arena_t *arena = scratch_arena_get();
+	char *msg = scratch_alloc(arena, MAX_EVENT_LENGTH + 1);
+	exception_t res;
 	if (!msg) {
 		return /* MALLOC_ERROR */;
 	}
 	
+#ifdef HAVE_PBX_STASIS_H
+	enum ast_event_type event_type;
+	if (stasis_subscription_final_message(sub, smsg)) {
+		scratch_reset(arena);
+		return;
+	}
+	if (userdata && redis_publish_suppressed(userdata)) {
+		scratch_reset(arena);
+		return;
+	}
+	/* only locally originated device state / mwi messages are encoded */
+	if ((res = stasis2json(msg, MAX_EVENT_LENGTH, smsg, &event_type))) {
+		scratch_reset(arena);
+		return;
+	}
+#else
+	enum ast_event_type event_type = ast_event_get_type(event);
+#endif
 	ast_rwlock_rdlock(&event_types_lock);
-	etype = &event_types[ast_event_get_type(event)];
+	etype = &event_types[event_type];
 	ast_rwlock_unlock(&event_types_lock);
 	
-	if (etype) {
-		if (etype->publish) {
-
-#ifdef HAVE_PBX_STASIS_H
-			const struct ast_eid *eid;
-			char eid_str[32] = "";
-
-			struct ast_json *
-			if ((msg = stasis_message_to_json(smsg, NULL))) {
-#else
-			if (!message2json(msg, MAX_EVENT_LENGTH, event)) {
+#ifndef HAVE_PBX_STASIS_H
+	if (data != &snapshot_marker && redis_publish_suppressed(etype)) {
+		scratch_reset(arena);
+		return;
+	}
+#endif
+	if (etype->publish) {
+#ifndef HAVE_PBX_STASIS_H
+		res = message2json(msg, MAX_EVENT_LENGTH, event);
+#endif
+		if (res) {
+			ast_log(LOG_ERROR, "error encoding %s'\n", msg);
+#ifndef HAVE_PBX_STASIS_H
+		} else if (data == &snapshot_marker) {
+			redis_state_store_snapshot(etype, msg, strlen(msg));
+		} else if (data == &dump_marker) {
+			redis_dump_queue(etype, TRUE, msg, strlen(msg));
 #endif
-				AST_LOG_NOTICE_DEBUG("sending 'PUBLISH %s \"%s\"'\n", etype->channelstr, msg);
-				ast_mutex_lock(&redis_write_lock);
-//				redisAsyncCommand(redisPubConn, redis_publish_cb, NULL, "PUBLISH %s %b", etype->channelstr, msg, (size_t)strlen(msg));
-				redisAsyncCommand(redisPubConn, NULL, NULL, "PUBLISH %s %b", etype->channelstr, msg, (size_t)strlen(msg));
-				if (redisPubConn->err) {
-					ast_log(LOG_ERROR, "redisAsyncCommand Send error: %s\n", redisPubConn->errstr);
-				}
-				ast_mutex_unlock(&redis_write_lock);
-			} else {
-				ast_log(LOG_ERROR, "error encoding %s'\n", msg);
-			}
 		} else {
-			ast_debug(1, "event_type should not be published'\n");
+			redis_lane_publish(etype, msg, strlen(msg));
 		}
 	} else {
-		ast_log(LOG_ERROR, "event_type does not exist'\n");
+		ast_debug(1, "event_type should not be published'\n");
+	}
+	scratch_reset(arena);
+}
+
+static int set_max_age(enum ast_event_type event_type, const char *value)
+{
+	if (sscanf(value, "%u", &event_types[event_type].max_age) != 1) {
+		ast_log(LOG_WARNING, "Invalid %s max_age '%s', filter disabled\n", event_types[event_type].name, value);
+		event_types[event_type].max_age = 0;
 	}
+	return 0;
 }
 
 static int set_event(const char *event_type, int pubsub, char *str)
@@ -505,11 +3140,14 @@ static void redis_unsubscribe_from_channels(void)
 		}
 		if (event_types[i].sub) {
 #ifdef HAVE_PBX_STASIS_H
-			statis_unsubscribe(event_types[i].sub);
+			event_types[i].sub = stasis_unsubscribe(event_types[i].sub);
 #else
-			ast_event_unsubscribe(event_types[i].sub);
+			event_types[i].sub = ast_event_unsubscribe(event_types[i].sub);
 #endif
 		}
+		if (pull_mode && i == AST_EVENT_DEVICE_STATE_CHANGE) {
+			continue;
+		}
 		AST_LOG_NOTICE_DEBUG("Unsubscribing from redis channel '%s'\n", event_types[i].channelstr);
 		ast_mutex_lock(&redis_write_lock);
  		redisAsyncCommand(redisSubConn, redis_unsubscribe_cb, NULL, "UNSUBSCRIBE %s", event_types[i].channelstr);
@@ -519,6 +3157,32 @@ static void redis_unsubscribe_from_channels(void)
 		ast_mutex_unlock(&redis_write_lock);
 	}
 	ast_rwlock_unlock(&event_types_lock);
+	if (local_intern_table) {
+		ast_mutex_lock(&redis_write_lock);
+		redisAsyncCommand(redisSubConn, redis_unsubscribe_cb, NULL, "UNSUBSCRIBE %s", intern_channel);
+		ast_mutex_unlock(&redis_write_lock);
+	}
+	if (batch_events) {
+		ast_mutex_lock(&redis_write_lock);
+		redisAsyncCommand(redisSubConn, redis_unsubscribe_cb, NULL, "UNSUBSCRIBE %s", batch_channel);
+		ast_mutex_unlock(&redis_write_lock);
+	}
+	if (state_snapshot) {
+		ast_mutex_lock(&redis_write_lock);
+		redisAsyncCommand(redisSubConn, redis_unsubscribe_cb, NULL, "UNSUBSCRIBE %s", state_prefix);
+		ast_mutex_unlock(&redis_write_lock);
+	}
+	if (sequence_events) {
+		ast_mutex_lock(&redis_write_lock);
+		redisAsyncCommand(redisSubConn, redis_unsubscribe_cb, NULL, "UNSUBSCRIBE %s", resync_channel);
+		ast_mutex_unlock(&redis_write_lock);
+	}
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisSubConn, redis_unsubscribe_cb, NULL, "UNSUBSCRIBE %s", digest_channel);
+	ast_mutex_unlock(&redis_write_lock);
+	if (pull_cache) {
+		device_lru_list(pull_cache, redis_pull_resubscribe_cb, (void *) 1);
+	}
 }
 
 static void redis_subscribe_to_channels(void) 
@@ -532,11 +3196,17 @@ static void redis_subscribe_to_channels(void)
 		}
 		if (event_types[i].publish && !event_types[i].sub) {
 #ifdef HAVE_PBX_STASIS_H
-			event_types[i].sub = stasis_subscribe(ast_device_state_topic_all(), ast_event_cb, NULL);
+			if (!(event_types[i].sub = pbx_stasis_subscribe(i, ast_event_cb, &event_types[i]))) {
+				ast_log(LOG_ERROR, "Cannot subscribe to stasis '%s' events, not publishing them\n", event_types[i].name);
+			}
 #else
 			event_types[i].sub = ast_event_subscribe(i, ast_event_cb, "res_redis", NULL, AST_EVENT_IE_END);
 #endif
 		}
+		if (pull_mode && i == AST_EVENT_DEVICE_STATE_CHANGE) {
+			/* pull mode: only the devices asked for, see redis_pull_devstate() */
+			continue;
+		}
 		AST_LOG_NOTICE_DEBUG("Subscribing to redis channel '%s'\n", event_types[i].channelstr);
 		ast_mutex_lock(&redis_write_lock);
  		redisAsyncCommand(redisSubConn, redis_subscription_cb, NULL, "SUBSCRIBE %s", event_types[i].channelstr);
@@ -546,6 +3216,48 @@ static void redis_subscribe_to_channels(void)
 		ast_mutex_unlock(&redis_write_lock);
 	}
 	ast_rwlock_unlock(&event_types_lock);
+	if (local_intern_table) {
+		AST_LOG_NOTICE_DEBUG("Subscribing to redis channel '%s'\n", intern_channel);
+		ast_mutex_lock(&redis_write_lock);
+		redisAsyncCommand(redisSubConn, redis_intern_subscription_cb, NULL, "SUBSCRIBE %s", intern_channel);
+		ast_mutex_unlock(&redis_write_lock);
+	}
+	if (batch_events) {
+		AST_LOG_NOTICE_DEBUG("Subscribing to redis channel '%s'\n", batch_channel);
+		ast_mutex_lock(&redis_write_lock);
+		redisAsyncCommand(redisSubConn, redis_batch_subscription_cb, NULL, "SUBSCRIBE %s", batch_channel);
+		ast_mutex_unlock(&redis_write_lock);
+	}
+	if (state_snapshot) {
+		AST_LOG_NOTICE_DEBUG("Subscribing to redis channel '%s'\n", state_prefix);
+		ast_mutex_lock(&redis_write_lock);
+		redisAsyncCommand(redisSubConn, redis_state_subscription_cb, NULL, "SUBSCRIBE %s", state_prefix);
+		ast_mutex_unlock(&redis_write_lock);
+	}
+	if (sequence_events) {
+		AST_LOG_NOTICE_DEBUG("Subscribing to redis channel '%s'\n", resync_channel);
+		ast_mutex_lock(&redis_write_lock);
+		redisAsyncCommand(redisSubConn, redis_resync_subscription_cb, NULL, "SUBSCRIBE %s", resync_channel);
+		ast_mutex_unlock(&redis_write_lock);
+	}
+	/* always: peers ask us on it after a dump, a repair, or a warm start */
+	AST_LOG_NOTICE_DEBUG("Subscribing to redis channel '%s'\n", digest_channel);
+	ast_mutex_lock(&redis_write_lock);
+	redisAsyncCommand(redisSubConn, redis_digest_subscription_cb, NULL, "SUBSCRIBE %s", digest_channel);
+	ast_mutex_unlock(&redis_write_lock);
+	if (pull_cache) {
+		/* after a reconnect: watch the cached devices again */
+		device_lru_list(pull_cache, redis_pull_resubscribe_cb, NULL);
+	}
+}
+
+static void redis_show_member_cb(const member_info_t *member, void *data)
+{
+	struct ast_cli_args *a = data;
+	int64_t now = redis_heartbeat_now();
+
+	ast_cli(a->fd, "%-20s %10u %8u %10lld %8u %6u.%02u %12lu\n", member->eid_str, member->seq, member->missed,
+		(long long) (now - member->last_seen) / 1000, member->rtt, member->load / 100, member->load % 100, member->events);
 }
 
 static char *redis_show_members(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
@@ -565,9 +3277,12 @@ static char *redis_show_members(struct ast_cli_entry *e, int cmd, struct ast_cli
 		return CLI_SHOWUSAGE;
 	}
 
-	//if (!event) {
-	//	return CLI_FAILURE;
-	//}
+	if (!members) {
+		ast_cli(a->fd, "Heartbeats are disabled (heartbeat_interval = 0)\n");
+		return CLI_SUCCESS;
+	}
+	ast_cli(a->fd, "%-20s %10s %8s %10s %8s %9s %12s\n", "EntityID", "Seq", "Missed", "Last seen", "RTT (ms)", "Load", "Events");
+	ast_cli(a->fd, "%d members\n", (int) member_table_list(members, redis_show_member_cb, a));
 	return CLI_SUCCESS;
 }
 
@@ -663,10 +3378,16 @@ static int load_general_config(struct ast_config *cfg)
 			
 		} else if (!strcasecmp(v->name, "devicestate_prefix")) {
 			res = set_event("device_state", PREFIX, strdup(v->value)); 
+#ifdef HAVE_PBX_STASIS_H
+		} else if (!strcasecmp(v->name, "publish_devicestate_event") || !strcasecmp(v->name, "subscribe_devicestate_event")) {
+			/* stasis only carries per server device states, see pbx_stasis_subscribe() */
+			ast_log(LOG_ERROR, "'%s' is not supported on this asterisk version, ignoring it; use the devicestate_change events instead\n", v->name);
+#else
 		} else if (!strcasecmp(v->name, "publish_devicestate_event")) {
 			res = set_event("device_state", PUBLISH, strdup(v->value)); 
 		} else if (!strcasecmp(v->name, "subscribe_devicestate_event")) {
 			res = set_event("device_state", SUBSCRIBE, strdup(v->value)); 
+#endif
 			
 		} else if (!strcasecmp(v->name, "devicestate_change_prefix")) {
 			res = set_event("device_state_change", PREFIX, strdup(v->value)); 
@@ -674,6 +3395,179 @@ static int load_general_config(struct ast_config *cfg)
 			res = set_event("device_state_change", PUBLISH, strdup(v->value)); 
 		} else if (!strcasecmp(v->name, "subscribe_devicestate_change_event")) {
 			res = set_event("device_state_change", SUBSCRIBE, strdup(v->value));
+
+		} else if (!strcasecmp(v->name, "intern_devices")) {
+			intern_devices = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "intern_channel")) {
+			if (intern_channel) {
+				ast_free(intern_channel);
+			}
+			intern_channel = strdup(v->value);
+		} else if (!strcasecmp(v->name, "batch_events")) {
+			batch_events = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "batch_channel")) {
+			if (batch_channel) {
+				ast_free(batch_channel);
+			}
+			batch_channel = strdup(v->value);
+		} else if (!strcasecmp(v->name, "batch_max_events")) {
+			if (sscanf(v->value, "%u", &batch_max_events) != 1 || !batch_max_events || batch_max_events > 1024) {
+				ast_log(LOG_WARNING, "Invalid batch_max_events '%s', using 64\n", v->value);
+				batch_max_events = 64;
+			}
+		} else if (!strcasecmp(v->name, "batch_max_delay")) {
+			if (sscanf(v->value, "%u", &batch_max_delay) != 1 || !batch_max_delay) {
+				ast_log(LOG_WARNING, "Invalid batch_max_delay '%s', using 5\n", v->value);
+				batch_max_delay = 5;
+			}
+		} else if (!strcasecmp(v->name, "state_snapshot")) {
+			state_snapshot = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "state_fetch_jitter")) {
+			if (sscanf(v->value, "%u", &state_fetch_jitter) != 1 || state_fetch_jitter > 10000) {
+				ast_log(LOG_WARNING, "Invalid state_fetch_jitter '%s', using 250\n", v->value);
+				state_fetch_jitter = 250;
+			}
+		} else if (!strcasecmp(v->name, "state_prefix")) {
+			if (state_prefix) {
+				ast_free(state_prefix);
+			}
+			state_prefix = strdup(v->value);
+		} else if (!strcasecmp(v->name, "timestamp_events")) {
+			timestamp_events = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "max_clock_skew")) {
+			if (sscanf(v->value, "%u", &max_clock_skew) != 1) {
+				ast_log(LOG_WARNING, "Invalid max_clock_skew '%s', using 500\n", v->value);
+				max_clock_skew = 500;
+			}
+		} else if (!strcasecmp(v->name, "mwi_max_age")) {
+			res = set_max_age(AST_EVENT_MWI, v->value);
+		} else if (!strcasecmp(v->name, "devicestate_max_age")) {
+			res = set_max_age(AST_EVENT_DEVICE_STATE, v->value);
+		} else if (!strcasecmp(v->name, "devicestate_change_max_age")) {
+			res = set_max_age(AST_EVENT_DEVICE_STATE_CHANGE, v->value);
+		} else if (!strcasecmp(v->name, "publish_suppress")) {
+			publish_suppress = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "suppress_probe_interval")) {
+			if (sscanf(v->value, "%u", &suppress_probe_interval) != 1 || !suppress_probe_interval) {
+				ast_log(LOG_WARNING, "Invalid suppress_probe_interval '%s', using 30\n", v->value);
+				suppress_probe_interval = 30;
+			}
+		} else if (!strcasecmp(v->name, "priority_lanes")) {
+			priority_lanes = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "bulk_share")) {
+			if (sscanf(v->value, "%u", &bulk_share) != 1 || !bulk_share || bulk_share > 99) {
+				ast_log(LOG_WARNING, "Invalid bulk_share '%s', using 20\n", v->value);
+				bulk_share = 20;
+			}
+		} else if (!strcasecmp(v->name, "bulk_connection")) {
+			bulk_connection = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "mwi_lane")) {
+			event_types[AST_EVENT_MWI].bulk = strcasecmp(v->value, "realtime") ? 1 : 0;
+		} else if (!strcasecmp(v->name, "devicestate_lane")) {
+			event_types[AST_EVENT_DEVICE_STATE].bulk = strcasecmp(v->value, "realtime") ? 1 : 0;
+		} else if (!strcasecmp(v->name, "sequence_events")) {
+			sequence_events = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "resync_channel")) {
+			if (resync_channel) {
+				ast_free(resync_channel);
+			}
+			resync_channel = strdup(v->value);
+		} else if (!strcasecmp(v->name, "dump_jitter")) {
+			if (sscanf(v->value, "%u", &dump_jitter) != 1) {
+				ast_log(LOG_WARNING, "Invalid dump_jitter '%s', using 0\n", v->value);
+				dump_jitter = 0;
+			}
+		} else if (!strcasecmp(v->name, "dump_digest")) {
+			dump_digest = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "dump_digest_timeout")) {
+			if (sscanf(v->value, "%u", &dump_digest_timeout) != 1 || !dump_digest_timeout) {
+				ast_log(LOG_WARNING, "Invalid dump_digest_timeout '%s', using 500\n", v->value);
+				dump_digest_timeout = 500;
+			}
+		} else if (!strcasecmp(v->name, "dump_max_rate")) {
+			if (sscanf(v->value, "%u", &dump_max_rate) != 1) {
+				ast_log(LOG_WARNING, "Invalid dump_max_rate '%s', using 0 (unlimited)\n", v->value);
+				dump_max_rate = 0;
+			}
+		} else if (!strcasecmp(v->name, "digest_channel")) {
+			if (digest_channel) {
+				ast_free(digest_channel);
+			}
+			digest_channel = strdup(v->value);
+		} else if (!strcasecmp(v->name, "anti_entropy_interval")) {
+			if (sscanf(v->value, "%u", &anti_entropy_interval) != 1) {
+				ast_log(LOG_WARNING, "Invalid anti_entropy_interval '%s', using 0 (off)\n", v->value);
+				anti_entropy_interval = 0;
+			}
+		} else if (!strcasecmp(v->name, "anti_entropy_buckets")) {
+			if (sscanf(v->value, "%u", &anti_entropy_buckets) != 1 || !anti_entropy_buckets || anti_entropy_buckets > PBX_DIGEST_MAX_BUCKETS) {
+				ast_log(LOG_WARNING, "Invalid anti_entropy_buckets '%s', using 16\n", v->value);
+				anti_entropy_buckets = 16;
+			}
+		} else if (!strcasecmp(v->name, "heartbeat_interval")) {
+			if (sscanf(v->value, "%u", &heartbeat_interval) != 1) {
+				ast_log(LOG_WARNING, "Invalid heartbeat_interval '%s', using 0 (off)\n", v->value);
+				heartbeat_interval = 0;
+			}
+		} else if (!strcasecmp(v->name, "heartbeat_misses")) {
+			if (sscanf(v->value, "%u", &heartbeat_misses) != 1 || heartbeat_misses < 2) {
+				ast_log(LOG_WARNING, "Invalid heartbeat_misses '%s', using 3\n", v->value);
+				heartbeat_misses = 3;
+			}
+		} else if (!strcasecmp(v->name, "devstate_ttl")) {
+			if (sscanf(v->value, "%u", &devstate_ttl) != 1 || (devstate_ttl && devstate_ttl < 300)) {
+				ast_log(LOG_WARNING, "Invalid devstate_ttl '%s', using 0 (off)\n", v->value);
+				devstate_ttl = 0;
+			}
+		} else if (!strcasecmp(v->name, "devstate_prefix")) {
+			if (devstate_prefix) {
+				ast_free(devstate_prefix);
+			}
+			devstate_prefix = strdup(v->value);
+		} else if (!strcasecmp(v->name, "aggregate_devstate")) {
+			aggregate_devstate = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "aggregate_prefix")) {
+			if (aggregate_prefix) {
+				ast_free(aggregate_prefix);
+			}
+			aggregate_prefix = strdup(v->value);
+		} else if (!strcasecmp(v->name, "aggregate_eid")) {
+			if (aggregate_eid) {
+				ast_free(aggregate_eid);
+			}
+			aggregate_eid = strdup(v->value);
+		} else if (!strcasecmp(v->name, "pull_mode")) {
+			pull_mode = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "pull_prefix")) {
+			if (pull_prefix) {
+				ast_free(pull_prefix);
+			}
+			pull_prefix = strdup(v->value);
+		} else if (!strcasecmp(v->name, "pull_cache_size")) {
+			if (sscanf(v->value, "%u", &pull_cache_size) != 1 || !pull_cache_size) {
+				ast_log(LOG_WARNING, "Invalid pull_cache_size '%s', using 1024\n", v->value);
+				pull_cache_size = 1024;
+			}
+		} else if (!strcasecmp(v->name, "state_file")) {
+			if (state_file) {
+				ast_free(state_file);
+			}
+			state_file = ast_strlen_zero(v->value) ? NULL : strdup(v->value);
+		} else if (!strcasecmp(v->name, "state_file_interval")) {
+			if (sscanf(v->value, "%u", &state_file_interval) != 1 || !state_file_interval) {
+				ast_log(LOG_WARNING, "Invalid state_file_interval '%s', using 60\n", v->value);
+				state_file_interval = 60;
+			}
+		} else if (!strcasecmp(v->name, "state_file_max_age")) {
+			if (sscanf(v->value, "%u", &state_file_max_age) != 1) {
+				ast_log(LOG_WARNING, "Invalid state_file_max_age '%s', using 3600\n", v->value);
+				state_file_max_age = 3600;
+			}
+		} else if (!strcasecmp(v->name, "state_file_reconcile")) {
+			if (sscanf(v->value, "%u", &state_file_reconcile) != 1 || !state_file_reconcile) {
+				ast_log(LOG_WARNING, "Invalid state_file_reconcile '%s', using 60\n", v->value);
+				state_file_reconcile = 60;
+			}
 		} else {
 			ast_log(LOG_WARNING, "Unknown option '%s'\n", v->name);
 		}
@@ -682,6 +3576,38 @@ static int load_general_config(struct ast_config *cfg)
 	if (!servers) {
 		servers = strdup(default_servers);
 	}
+	if (!intern_channel) {
+		intern_channel = strdup(default_intern_channel);
+	}
+	if (!batch_channel) {
+		batch_channel = strdup(default_batch_channel);
+	}
+	if (!state_prefix) {
+		state_prefix = strdup(default_state_prefix);
+	}
+	if (!resync_channel) {
+		resync_channel = strdup(default_resync_channel);
+	}
+	if (!digest_channel) {
+		digest_channel = strdup(default_digest_channel);
+	}
+	if (!devstate_prefix) {
+		devstate_prefix = strdup(default_devstate_prefix);
+	}
+	if (!aggregate_prefix) {
+		aggregate_prefix = strdup(default_aggregate_prefix);
+	}
+	if (!aggregate_eid) {
+		aggregate_eid = strdup(default_aggregate_eid);
+	}
+	if (!pull_prefix) {
+		pull_prefix = strdup(default_pull_prefix);
+	}
+	/* state_snapshot keeps interned ids, redis_state_fetch_cb refetches the intern table when it meets unknown ones */
+	if ((aggregate_devstate || pull_mode) && intern_devices) {
+		ast_log(LOG_WARNING, "%s needs literal device names, disabling intern_devices\n", aggregate_devstate ? "aggregate_devstate" : "pull_mode");
+		intern_devices = 0;
+	}
 	AST_LOG_NOTICE_DEBUG("Done loading config\n");
 
 	return res;
@@ -726,6 +3652,52 @@ static void *dispatch_thread_handler(void *data)
 	
 	redisAsyncSetConnectCallback(redisSubConn, redis_connect_cb);
 	redisAsyncSetDisconnectCallback(redisSubConn, redis_disconnect_cb);
+
+	if (batch_events) {
+		batch_delay.tv_sec = batch_max_delay / 1000;
+		batch_delay.tv_usec = (batch_max_delay % 1000) * 1000;
+		batch_timer = event_new(eventbase, -1, 0, redis_batch_timer_cb, NULL);
+	}
+	if (state_snapshot) {
+		state_fetch_timer = event_new(eventbase, -1, 0, redis_state_fetch_timer_cb, NULL);
+	}
+	if (redisBulkConn) {
+		redis_bulk_attach();
+	}
+	if (dump_jitter || dump_digest || dump_max_rate || priority_lanes) {
+		struct timeval tv = { 0, (priority_lanes ? LANE_TICK_MS : DUMP_TICK_MS) * 1000 };
+		dump_timer = event_new(eventbase, -1, EV_PERSIST, redis_dump_timer_cb, NULL);
+		event_add(dump_timer, &tv);
+	}
+	if (anti_entropy_interval) {
+		struct timeval tv = { anti_entropy_interval, 0 };
+		anti_entropy_timer = event_new(eventbase, -1, EV_PERSIST, redis_anti_entropy_timer_cb, NULL);
+		event_add(anti_entropy_timer, &tv);
+	}
+	if (heartbeat_interval) {
+		struct timeval tv = { heartbeat_interval, 0 };
+		heartbeat_timer = event_new(eventbase, -1, EV_PERSIST, redis_heartbeat_timer_cb, NULL);
+		event_add(heartbeat_timer, &tv);
+	}
+	if (state_file) {
+		struct timeval tv = { state_file_interval, 0 };
+		state_file_timer = event_new(eventbase, -1, EV_PERSIST, redis_state_file_timer_cb, NULL);
+		event_add(state_file_timer, &tv);
+		if (reconciling) {
+			tv.tv_sec = state_file_reconcile;
+			event_base_once(eventbase, -1, EV_TIMEOUT, redis_state_file_reconcile_cb, NULL, &tv);
+		}
+	}
+	if (publish_suppress) {
+		struct timeval tv = { suppress_probe_interval, 0 };
+		suppress_timer = event_new(eventbase, -1, EV_PERSIST, redis_suppress_timer_cb, NULL);
+		event_add(suppress_timer, &tv);
+	}
+	if (devstate_ttl) {
+		struct timeval tv = { devstate_ttl / 3000, (devstate_ttl / 3 % 1000) * 1000 };
+		devstate_timer = event_new(eventbase, -1, EV_PERSIST, redis_devstate_timer_cb, NULL);
+		event_add(devstate_timer, &tv);
+	}
 	
 	event_base_dispatch(eventbase);
 	return NULL;
@@ -735,6 +3707,9 @@ static void *dispatch_thread_handler(void *data)
 static void cleanup_module(void)
 {
 	unsigned int i = 0;
+	if (state_file && state_file_loaded) {
+		redis_state_file_write();
+	}
 	redis_unsubscribe_from_channels();
 	for (i = 0; i < ARRAY_LEN(event_types); i++) {
 		event_types[i].publish = 0;
@@ -747,6 +3722,7 @@ static void cleanup_module(void)
 			ast_free(event_types[i].prefix);
 			event_types[i].prefix = NULL;
 		}
+		event_types[i].max_age = 0;
 	}
 
 	ast_mutex_lock(&redis_lock);
@@ -763,11 +3739,121 @@ static void cleanup_module(void)
 		ast_free(servers);
 		servers = NULL;
 	}
+
+	pbx_set_interning(NULL, NULL, NULL);
+	if (local_intern_table) {
+		intern_table_destroy(local_intern_table);
+		local_intern_table = NULL;
+	}
+	intern_registry_destroy_all();
+	if (intern_channel) {
+		ast_free(intern_channel);
+		intern_channel = NULL;
+	}
+
+	if (batch_timer) {
+		event_free(batch_timer);
+		batch_timer = NULL;
+	}
+	if (state_fetch_timer) {
+		event_free(state_fetch_timer);
+		state_fetch_timer = NULL;
+	}
+	state_fetch_pending_count = 0;
+	if (publish_batch.buf) {
+		event_batch_free(&publish_batch);
+	}
+	if (batch_channel) {
+		ast_free(batch_channel);
+		batch_channel = NULL;
+	}
+	if (state_prefix) {
+		ast_free(state_prefix);
+		state_prefix = NULL;
+	}
+	seq_tracker_destroy(seq_tracker);
+	seq_tracker = NULL;
+	stale_filter_destroy(stale_filter);
+	stale_filter = NULL;
+	if (suppress_timer) {
+		event_free(suppress_timer);
+		suppress_timer = NULL;
+	}
+	publish_suppress = 0;
+	if (redisBulkConn) {
+		redisAsyncDisconnect(redisBulkConn);
+		redisBulkConn = NULL;
+	}
+	priority_lanes = 0;
+	bulk_connection = 0;
+	event_types[AST_EVENT_MWI].bulk = 1;
+	event_types[AST_EVENT_DEVICE_STATE].bulk = 0;
+	if (resync_channel) {
+		ast_free(resync_channel);
+		resync_channel = NULL;
+	}
+	if (dump_timer) {
+		event_free(dump_timer);
+		dump_timer = NULL;
+	}
+	if (anti_entropy_timer) {
+		event_free(anti_entropy_timer);
+		anti_entropy_timer = NULL;
+	}
+	if (heartbeat_timer) {
+		event_free(heartbeat_timer);
+		heartbeat_timer = NULL;
+	}
+	member_table_destroy(members);
+	members = NULL;
+	if (devstate_timer) {
+		event_free(devstate_timer);
+		devstate_timer = NULL;
+	}
+	if (devstate_prefix) {
+		ast_free(devstate_prefix);
+		devstate_prefix = NULL;
+	}
+	if (aggregate_prefix) {
+		ast_free(aggregate_prefix);
+		aggregate_prefix = NULL;
+	}
+	if (aggregate_eid) {
+		ast_free(aggregate_eid);
+		aggregate_eid = NULL;
+	}
+	if (pull_cache) {
+		ast_devstate_prov_del("Redis");
+		device_lru_destroy(pull_cache);
+		pull_cache = NULL;
+	}
+	if (pull_prefix) {
+		ast_free(pull_prefix);
+		pull_prefix = NULL;
+	}
+	if (state_file_timer) {
+		event_free(state_file_timer);
+		state_file_timer = NULL;
+	}
+	if (state_file) {
+		ast_free(state_file);
+		state_file = NULL;
+	}
+	state_file_loaded = FALSE;
+	reconciling = FALSE;
+	restored_count = 0;
+	dump_queue_destroy(dump_queue);
+	dump_queue = NULL;
+	if (digest_channel) {
+		ast_free(digest_channel);
+		digest_channel = NULL;
+	}
 }
 
 static int load_module(void)
 {
 	enum ast_module_load_result res = AST_MODULE_LOAD_FAILURE;
+	unsigned int i;
 
 	AST_LOG_NOTICE_DEBUG("Loading res_config_redis...\n");
 	ast_debug(1, "Loading res_config_redis...\n");
@@ -783,7 +3869,74 @@ static int load_module(void)
 
 	ast_cli_register_multiple(redis_cli, ARRAY_LEN(redis_cli));
 
-	/* create libevent base */
+	if (intern_devices) {
+		if (!(local_intern_table = intern_table_new(INTERN_MAX_ENTRIES, TRUE))) {
+			ast_log(LOG_ERROR, "Could not allocate the device intern table\n");
+			goto failed;
+		}
+		/* a restarted module must not continue an epoch its previous run used */
+		intern_table_reset(local_intern_table, ast_random());
+		pbx_set_interning(local_intern_table, redis_intern_announce_cb, redis_intern_miss_cb);
+	}
+
+	if (batch_events && event_batch_init(&publish_batch, batch_max_events * (MAX_EVENT_LENGTH + EVENT_BATCH_MAX_TYPE_NAME + 8) + 2)) {
+		ast_log(LOG_ERROR, "Could not allocate the event batch buffer\n");
+		goto failed;
+	}
+
+	if (sequence_events) {
+		if (!(seq_tracker = seq_tracker_new())) {
+			ast_log(LOG_ERROR, "Could not allocate the sequence tracker\n");
+			goto failed;
+		}
+		publish_epoch = (uint32_t) time(NULL);
+		for (i = 0; i < ARRAY_LEN(event_types); i++) {
+			event_types[i].seq = 0;
+		}
+	}
+
+	if (bulk_connection && (!priority_lanes || sequence_events || batch_events)) {
+		/* sequence numbers follow the order on one connection, batches are sent whole */
+		ast_log(LOG_NOTICE, "bulk_connection needs priority_lanes and does not work with sequence_events or batch_events, disabled\n");
+		bulk_connection = 0;
+	}
+	if (publish_suppress && (state_snapshot || devstate_ttl || aggregate_devstate)) {
+		ast_log(LOG_NOTICE, "publish_suppress does not work together with state_snapshot, devstate_ttl or aggregate_devstate, disabled\n");
+		publish_suppress = 0;
+	}
+	for (i = 0; i < ARRAY_LEN(event_types); i++) {
+		event_types[i].receivers = -1;
+		if (event_types[i].max_age && !stale_filter && !(stale_filter = stale_filter_new())) {
+			ast_log(LOG_ERROR, "Could not allocate the staleness filter\n");
+			goto failed;
+		}
+	}
+
+	if (!(dump_queue = dump_queue_new())) {
+		ast_log(LOG_ERROR, "Could not allocate the dump queue\n");
+		goto failed;
+	}
+
+	if (pull_mode) {
+		if (!(pull_cache = device_lru_new(pull_cache_size, redis_pull_aggregate))) {
+			ast_log(LOG_ERROR, "Could not allocate the pull mode device cache\n");
+			goto failed;
+		}
+		ast_devstate_prov_add("Redis", redis_pull_devstate);
+	}
+
+	if (heartbeat_interval && !(members = member_table_new())) {
+		ast_log(LOG_ERROR, "Could not allocate the member table\n");
+		goto failed;
+	}
+
+	if (state_file) {
+		/* before the first connection: BLF / MWI are right while redis and the peers catch up */
+		redis_state_file_load();
+	}
+
+	/* create libevent base, locked: publishing threads arm timers and queue writes on it */
+	evthread_use_pthreads();
 	eventbase = event_base_new();
 
 	/* connect to the first available redis server */
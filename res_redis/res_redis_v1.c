@@ -56,9 +56,11 @@ pthread_rwlock_t msq_event_channel_map_rwlock = PTHREAD_RWLOCK_INITIALIZER;
  */
 static char *redis_show_config(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
 static char *redis_ping(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+static char *redis_show_limits(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
 static struct ast_cli_entry redis_cli[] = {
 	AST_CLI_DEFINE(redis_show_config, "Show configuration"),
 	AST_CLI_DEFINE(redis_ping, "Send a test ping to the cluster"),
+	AST_CLI_DEFINE(redis_show_limits, "Show the rate limiter counters"),
 };
  
 /*
@@ -107,6 +109,12 @@ static void cleanup_module(void)
 	exception_t res = NO_EXCEPTION;
 
 	// cleanup first;
+	event_type_t chan;
+	for (chan = 0; chan < ARRAY_LEN(event_map); chan++) {
+		if (event_map[chan].name) {
+			msq_set_rate_limit(chan, 0, 0);
+		}
+	}
 	msq_list_servers();
 	msq_remove_all_servers();
 	msq_list_servers();
@@ -155,6 +163,7 @@ static int load_channel_config(struct ast_config *cfg, const char *cat)
 {
 	struct ast_variable *v;
 	int res = 0;
+	unsigned int rate_limit = 0, rate_burst = 0;
 	ast_debug(2,"Loading loading category [%s]\n", cat);
 
 	//lookup by channelname
@@ -178,11 +187,25 @@ static int load_channel_config(struct ast_config *cfg, const char *cat)
 			res |= 0;
 		} else if (!strcasecmp(v->name, "dump_state_table_on_connection")) {
 			res |= 0;
+		} else if (!strcasecmp(v->name, "rate_limit")) {
+			if (sscanf(v->value, "%u", &rate_limit) != 1) {
+				ast_log(LOG_WARNING, "Invalid rate_limit '%s' in [%s], not limiting\n", v->value, cat);
+				rate_limit = 0;
+			}
+		} else if (!strcasecmp(v->name, "rate_burst")) {
+			if (sscanf(v->value, "%u", &rate_burst) != 1) {
+				ast_log(LOG_WARNING, "Invalid rate_burst '%s' in [%s], using rate_limit\n", v->value, cat);
+				rate_burst = 0;
+			}
 		} else {
 			ast_log(LOG_WARNING, "Unknown option '%s'\n", v->name);
 			//res = 1;
 		}
 	}
+	if (!res && rate_limit) {
+		ast_debug(2, "Limiting [%s] to %u events/s, burst %u\n", cat, rate_limit, rate_burst ? rate_burst : rate_limit);
+		res |= msq_set_rate_limit(channel, rate_limit, rate_burst);
+	}
 	ast_debug(2,"Done loading category [%s]\n", cat);
 	return res;
 }
@@ -312,6 +335,36 @@ static char *redis_show_config(struct ast_cli_entry *e, int cmd, struct ast_cli_
 	return CLI_SUCCESS;
 }
 
+static char *redis_show_limits(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	rate_limiter_stats_t stats;
+	event_type_t chan;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "res_redis show limits";
+		e->usage =
+			"Usage: res_redis show limits\n"
+			"       Show how often the per channel rate limits were hit.\n";
+		return NULL;
+
+	case CLI_GENERATE:
+		return NULL;	/* no completion */
+	}
+
+	if (a->argc != e->args) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "%-20s %10s %10s %10s %10s %8s\n", "Channel", "Passed", "Deferred", "Coalesced", "Dropped", "Pending");
+	for (chan = 0; chan < ARRAY_LEN(event_map); chan++) {
+		if (event_map[chan].name && !msq_get_rate_limit_stats(chan, &stats)) {
+			ast_cli(a->fd, "%-20s %10lu %10lu %10lu %10lu %8u\n", event_map[chan].name, stats.passed, stats.deferred, stats.coalesced, stats.dropped, stats.pending);
+		}
+	}
+	return CLI_SUCCESS;
+}
+
 static char *redis_ping(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
 	struct ast_event *event;
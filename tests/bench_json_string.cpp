@@ -0,0 +1,90 @@
+/*
+ * Benchmark the json string kernels on realistic CEL / devstate payloads.
+ * usage: ./bench_json_string [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+extern "C" {
+#include "../include/json_string.h"
+}
+
+static const char *payloads[] = {
+	/* device state */
+	"SIP/site12-ext4711",
+	/* CEL caller id name with quotes */
+	"\"Reception\" Main Office \\ Building 3",
+	/* CEL channel name */
+	"SIP/trunk-provider-eu-west-0000a3f2",
+	/* CEL appdata */
+	"SIP/site12-ext4711&SIP/site12-ext4712&SIP/site12-ext4713,30,tTkKr(ringing)U(sub-record^${UNIQUEID})",
+	/* CEL extra (embedded json) */
+	"{\"hangupcause\":16,\"hangupsource\":\"SIP/site12-ext4711-0000001a\",\"dialstatus\":\"ANSWER\"}",
+	/* CEL linkedid / uniqueid */
+	"1444922390.118342",
+	/* utf-8 caller id name */
+	"J\xc3\xbcrgen M\xc3\xbcller-Schmidt (Vertrieb)",
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	const json_kernel_t kernels[] = {JSON_KERNEL_SCALAR, JSON_KERNEL_SSE2, JSON_KERNEL_AVX2};
+	long iterations = argc > 1 ? atol(argv[1]) : 200000;
+	size_t total_bytes = 0;
+	char escaped[1024], unescaped[1024];
+	size_t i, len;
+	volatile size_t sink = 0;
+
+	for (i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+		total_bytes += strlen(payloads[i]);
+	}
+	printf("payloads: %zu strings, %zu bytes per round, %ld rounds\n", sizeof(payloads) / sizeof(payloads[0]), total_bytes, iterations);
+	printf("%-8s %14s %14s %14s\n", "kernel", "scan ns/B", "escape ns/B", "unescape ns/B");
+
+	for (json_kernel_t requested : kernels) {
+		json_kernel_t kernel = json_string_set_kernel(requested);
+		if (kernel != requested) {
+			printf("%-8s (not supported on this cpu)\n", json_kernel2str(requested));
+			continue;
+		}
+		double start = now_ns();
+		for (long n = 0; n < iterations; n++) {
+			for (i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+				sink += json_string_find_special(payloads[i], strlen(payloads[i]));
+			}
+		}
+		double scan = (now_ns() - start) / ((double)iterations * total_bytes);
+
+		start = now_ns();
+		for (long n = 0; n < iterations; n++) {
+			for (i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+				json_escape(escaped, sizeof(escaped), payloads[i], strlen(payloads[i]), &len);
+				sink += len;
+			}
+		}
+		double escape = (now_ns() - start) / ((double)iterations * total_bytes);
+
+		start = now_ns();
+		for (long n = 0; n < iterations; n++) {
+			for (i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+				size_t escaped_len;
+				json_escape(escaped, sizeof(escaped), payloads[i], strlen(payloads[i]), &escaped_len);
+				json_unescape(unescaped, sizeof(unescaped), escaped, escaped_len, &len);
+				sink += len;
+			}
+		}
+		double unescape = (now_ns() - start) / ((double)iterations * total_bytes) - escape;
+
+		printf("%-8s %14.3f %14.3f %14.3f\n", json_kernel2str(kernel), scan, escape, unescape);
+	}
+	return sink == 0;
+}
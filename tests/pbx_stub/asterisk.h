@@ -0,0 +1,151 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*
+ * Stub of the asterisk 11 api used by lib/ast_event_message_serializer.c, so
+ * the serializer can be linked into the unit tests. Declarations follow the
+ * asterisk headers, the implementation is in pbx_stub.c and keeps events in
+ * the same packed wire layout as asterisk/event.c.
+ */
+#ifndef _PBX_STUB_ASTERISK_H_
+#define _PBX_STUB_ASTERISK_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define ASTERISK_FILE_VERSION(file, version)
+
+/* logger */
+#define _A_ __FILE__, __LINE__, __PRETTY_FUNCTION__
+#define __LOG_DEBUG	0
+#define __LOG_ERROR	4
+#define LOG_DEBUG	__LOG_DEBUG, _A_
+#define LOG_ERROR	__LOG_ERROR, _A_
+extern int option_debug;
+void ast_log(int level, const char *file, int line, const char *function, const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+#define ast_debug(level, ...) do { if (option_debug >= (level)) { ast_log(LOG_DEBUG, __VA_ARGS__); } } while (0)
+
+/* lock */
+typedef pthread_rwlock_t ast_rwlock_t;
+#define AST_RWLOCK_DEFINE_STATIC(rwlock) static ast_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER
+#define ast_rwlock_rdlock pthread_rwlock_rdlock
+#define ast_rwlock_wrlock pthread_rwlock_wrlock
+#define ast_rwlock_unlock pthread_rwlock_unlock
+
+/* utils / strings */
+#define ast_malloc malloc
+#define ast_calloc calloc
+#define ast_realloc realloc
+#define ast_strdup strdup
+#define ast_free free
+#define ARRAY_LEN(a) (size_t) (sizeof(a) / sizeof(0[a]))
+#define S_OR(a, b) ({typeof(&((a)[0])) __x = (a); ast_strlen_zero(__x) ? (b) : __x;})
+static inline int ast_strlen_zero(const char *s) { return (!s || (*s == '\0')); }
+void ast_copy_string(char *dst, const char *src, size_t size);
+int ast_str_hash(const char *str);
+
+/* entity id */
+struct ast_eid {
+	unsigned char eid[6];
+} __attribute__((__packed__));
+extern struct ast_eid ast_eid_default;
+char *ast_eid_to_str(char *s, int maxlen, struct ast_eid *eid);
+int ast_str_to_eid(struct ast_eid *eid, const char *s);
+int ast_eid_cmp(const struct ast_eid *eid1, const struct ast_eid *eid2);
+
+/* event */
+enum ast_event_type {
+	AST_EVENT_ALL = 0x00, AST_EVENT_CUSTOM = 0x01, AST_EVENT_MWI = 0x02, AST_EVENT_SUB = 0x03,
+	AST_EVENT_UNSUB = 0x04, AST_EVENT_DEVICE_STATE = 0x05, AST_EVENT_DEVICE_STATE_CHANGE = 0x06,
+	AST_EVENT_CEL = 0x07, AST_EVENT_SECURITY = 0x08, AST_EVENT_NETWORK_CHANGE = 0x09,
+	AST_EVENT_PRESENCE_STATE = 0x0a, AST_EVENT_ACL_CHANGE = 0x0b, AST_EVENT_PING = 0x0c,
+	AST_EVENT_TOTAL = 0x0d,
+};
+enum ast_event_ie_type {
+	AST_EVENT_IE_END = -1,
+	AST_EVENT_IE_NEWMSGS = 0x0001, AST_EVENT_IE_OLDMSGS, AST_EVENT_IE_MAILBOX, AST_EVENT_IE_UNIQUEID,
+	AST_EVENT_IE_EVENTTYPE, AST_EVENT_IE_EXISTS, AST_EVENT_IE_DEVICE, AST_EVENT_IE_STATE,
+	AST_EVENT_IE_CONTEXT, AST_EVENT_IE_EID, AST_EVENT_IE_CEL_EVENT_TYPE, AST_EVENT_IE_CEL_EVENT_TIME,
+	AST_EVENT_IE_CEL_EVENT_TIME_USEC, AST_EVENT_IE_CEL_USEREVENT_NAME, AST_EVENT_IE_CEL_CIDNAME,
+	AST_EVENT_IE_CEL_CIDNUM, AST_EVENT_IE_CEL_EXTEN, AST_EVENT_IE_CEL_CONTEXT, AST_EVENT_IE_CEL_CHANNAME,
+	AST_EVENT_IE_CEL_APPNAME, AST_EVENT_IE_CEL_APPDATA, AST_EVENT_IE_CEL_AMAFLAGS, AST_EVENT_IE_CEL_ACCTCODE,
+	AST_EVENT_IE_CEL_UNIQUEID, AST_EVENT_IE_CEL_USERFIELD, AST_EVENT_IE_CEL_CIDANI, AST_EVENT_IE_CEL_CIDRDNIS,
+	AST_EVENT_IE_CEL_CIDDNID, AST_EVENT_IE_CEL_PEER, AST_EVENT_IE_CEL_LINKEDID, AST_EVENT_IE_CEL_PEERACCT,
+	AST_EVENT_IE_CEL_EXTRA, AST_EVENT_IE_SECURITY_EVENT, AST_EVENT_IE_EVENT_VERSION, AST_EVENT_IE_SERVICE,
+	AST_EVENT_IE_MODULE, AST_EVENT_IE_ACCOUNT_ID, AST_EVENT_IE_SESSION_ID, AST_EVENT_IE_SESSION_TV,
+	AST_EVENT_IE_ACL_NAME, AST_EVENT_IE_LOCAL_ADDR, AST_EVENT_IE_REMOTE_ADDR, AST_EVENT_IE_EVENT_TV,
+	AST_EVENT_IE_REQUEST_TYPE, AST_EVENT_IE_REQUEST_PARAMS, AST_EVENT_IE_AUTH_METHOD, AST_EVENT_IE_SEVERITY,
+	AST_EVENT_IE_EXPECTED_ADDR, AST_EVENT_IE_CHALLENGE, AST_EVENT_IE_RESPONSE, AST_EVENT_IE_EXPECTED_RESPONSE,
+	AST_EVENT_IE_RECEIVED_CHALLENGE, AST_EVENT_IE_RECEIVED_HASH, AST_EVENT_IE_USING_PASSWORD,
+	AST_EVENT_IE_ATTEMPTED_TRANSPORT, AST_EVENT_IE_PRESENCE_PROVIDER, AST_EVENT_IE_PRESENCE_STATE,
+	AST_EVENT_IE_PRESENCE_SUBTYPE, AST_EVENT_IE_PRESENCE_MESSAGE, AST_EVENT_IE_CACHABLE,
+	AST_EVENT_IE_TOTAL,
+};
+enum ast_event_ie_pltype {
+	AST_EVENT_IE_PLTYPE_UNKNOWN = -1,
+	AST_EVENT_IE_PLTYPE_EXISTS,
+	AST_EVENT_IE_PLTYPE_UINT,
+	AST_EVENT_IE_PLTYPE_STR,
+	AST_EVENT_IE_PLTYPE_RAW,
+	AST_EVENT_IE_PLTYPE_BITFLAGS,
+};
+
+struct ast_event;
+struct ast_event_ie;
+struct ast_event_sub;
+struct ast_event_iterator {
+	uint16_t event_len;
+	const struct ast_event *event;
+	struct ast_event_ie *ie;
+};
+typedef void (*ast_event_cb_t)(const struct ast_event *event, void *userdata);
+
+struct ast_event *ast_event_new(enum ast_event_type event_type, ...);
+void ast_event_destroy(struct ast_event *event);
+int ast_event_queue_and_cache(struct ast_event *event);
+enum ast_event_type ast_event_get_type(const struct ast_event *event);
+const char *ast_event_get_type_name(const struct ast_event *event);
+const char *ast_event_get_ie_type_name(enum ast_event_ie_type ie_type);
+enum ast_event_ie_pltype ast_event_get_ie_pltype(enum ast_event_ie_type ie_type);
+uint32_t ast_event_get_ie_uint(const struct ast_event *event, enum ast_event_ie_type ie_type);
+const char *ast_event_get_ie_str(const struct ast_event *event, enum ast_event_ie_type ie_type);
+const void *ast_event_get_ie_raw(const struct ast_event *event, enum ast_event_ie_type ie_type);
+size_t ast_event_get_size(const struct ast_event *event);
+
+int ast_event_iterator_init(struct ast_event_iterator *iterator, const struct ast_event *event);
+int ast_event_iterator_next(struct ast_event_iterator *iterator);
+enum ast_event_ie_type ast_event_iterator_get_ie_type(struct ast_event_iterator *iterator);
+uint32_t ast_event_iterator_get_ie_uint(struct ast_event_iterator *iterator);
+uint32_t ast_event_iterator_get_ie_bitflags(struct ast_event_iterator *iterator);
+const char *ast_event_iterator_get_ie_str(struct ast_event_iterator *iterator);
+void *ast_event_iterator_get_ie_raw(struct ast_event_iterator *iterator);
+
+/* there is no event cache in the stub: subscriptions fail and nothing gets dumped */
+struct ast_event_sub *ast_event_subscribe_new(enum ast_event_type type, ast_event_cb_t cb, void *userdata);
+struct ast_event_sub *ast_event_unsubscribe(struct ast_event_sub *event_sub);
+void ast_event_sub_destroy(struct ast_event_sub *sub);
+int ast_event_sub_append_ie_raw(struct ast_event_sub *sub, enum ast_event_ie_type ie_type, void *data, size_t raw_datalen);
+void ast_event_dump_cache(const struct ast_event_sub *event_sub);
+
+/* devicestate */
+enum ast_device_state {
+	AST_DEVICE_UNKNOWN, AST_DEVICE_NOT_INUSE, AST_DEVICE_INUSE, AST_DEVICE_BUSY, AST_DEVICE_INVALID,
+	AST_DEVICE_UNAVAILABLE, AST_DEVICE_RINGING, AST_DEVICE_RINGINUSE, AST_DEVICE_ONHOLD, AST_DEVICE_TOTAL,
+};
+const char *ast_devstate_str(enum ast_device_state devstate);
+
+#endif /* _PBX_STUB_ASTERISK_H_ */
@@ -0,0 +1,2 @@
+/* unit tests: everything the serializer needs lives in the stub asterisk.h */
+#include <asterisk.h>
@@ -0,0 +1,15 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+/* unit tests: the serializer is built against the stub asterisk api in this directory */
+#define HAVE_PBX_ASTERISK_H 1
+#define HAVE_PBX_EVENT_H 1
+#define HAVE_PBX_VERSION_11 1
@@ -0,0 +1,326 @@
+/*!
+ * res_redis -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, Diederik de Groot
+ *
+ * Diederik de Groot <ddegroot@users.sf.net>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+#include <stdarg.h>
+
+#include "asterisk.h"
+
+int option_debug = 0;
+struct ast_eid ast_eid_default = {{0x02, 0x00, 0x00, 0x00, 0x00, 0x01}};
+
+/* copied from asterisk/event.c */
+struct ast_event {
+	enum ast_event_type type:16;
+	uint16_t event_len:16;
+	unsigned char payload[0];
+} __attribute__((packed));
+
+struct ast_event_ie {
+	enum ast_event_ie_type ie_type:16;
+	uint16_t ie_payload_len;
+	unsigned char ie_payload[0];
+} __attribute__((packed));
+
+struct ast_event_ie_str_payload {
+	uint32_t hash;
+	char str[1];
+} __attribute__((packed));
+/* end copy */
+
+/* only the information elements of the mwi and device state events */
+static const struct ie_map {
+	enum ast_event_ie_pltype ie_pltype;
+	const char *name;
+} ie_maps[AST_EVENT_IE_TOTAL] = {
+	[AST_EVENT_IE_NEWMSGS]  = { AST_EVENT_IE_PLTYPE_UINT, "NewMessages" },
+	[AST_EVENT_IE_OLDMSGS]  = { AST_EVENT_IE_PLTYPE_UINT, "OldMessages" },
+	[AST_EVENT_IE_MAILBOX]  = { AST_EVENT_IE_PLTYPE_STR,  "Mailbox" },
+	[AST_EVENT_IE_UNIQUEID] = { AST_EVENT_IE_PLTYPE_UINT, "UniqueID" },
+	[AST_EVENT_IE_EXISTS]   = { AST_EVENT_IE_PLTYPE_UINT, "Exists" },
+	[AST_EVENT_IE_DEVICE]   = { AST_EVENT_IE_PLTYPE_STR,  "Device" },
+	[AST_EVENT_IE_STATE]    = { AST_EVENT_IE_PLTYPE_UINT, "State" },
+	[AST_EVENT_IE_CONTEXT]  = { AST_EVENT_IE_PLTYPE_STR,  "Context" },
+	[AST_EVENT_IE_EID]      = { AST_EVENT_IE_PLTYPE_RAW,  "EntityID" },
+	[AST_EVENT_IE_CACHABLE] = { AST_EVENT_IE_PLTYPE_UINT, "Cachable" },
+};
+
+static const char *devstate_names[AST_DEVICE_TOTAL] = {
+	"UNKNOWN", "NOT_INUSE", "INUSE", "BUSY", "INVALID", "UNAVAILABLE", "RINGING", "RINGINUSE", "ONHOLD",
+};
+
+void ast_log(int level, const char *file, int line, const char *function, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "[%d] %s:%d %s: ", level, file, line, function);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+/* res_redis logging, normally piped back to asterisk by res_redis.c */
+void _log_verbose(int level, const char *file, int line, const char *function, const char *fmt, ...)
+{
+}
+
+void ast_copy_string(char *dst, const char *src, size_t size)
+{
+	snprintf(dst, size, "%s", src);
+}
+
+int ast_str_hash(const char *str)
+{
+	int hash = 5381;
+
+	while (*str) {
+		hash = hash * 33 ^ *str++;
+	}
+	return abs(hash);
+}
+
+char *ast_eid_to_str(char *s, int maxlen, struct ast_eid *eid)
+{
+	snprintf(s, maxlen, "%02x:%02x:%02x:%02x:%02x:%02x", eid->eid[0], eid->eid[1], eid->eid[2], eid->eid[3], eid->eid[4], eid->eid[5]);
+	return s;
+}
+
+int ast_str_to_eid(struct ast_eid *eid, const char *s)
+{
+	unsigned int eid_int[6];
+	int i;
+
+	if (sscanf(s, "%2x:%2x:%2x:%2x:%2x:%2x", &eid_int[0], &eid_int[1], &eid_int[2], &eid_int[3], &eid_int[4], &eid_int[5]) != 6) {
+		return -1;
+	}
+	for (i = 0; i < 6; i++) {
+		eid->eid[i] = eid_int[i];
+	}
+	return 0;
+}
+
+int ast_eid_cmp(const struct ast_eid *eid1, const struct ast_eid *eid2)
+{
+	return memcmp(eid1, eid2, sizeof(*eid1));
+}
+
+const char *ast_devstate_str(enum ast_device_state devstate)
+{
+	return devstate < AST_DEVICE_TOTAL ? devstate_names[devstate] : "UNKNOWN";
+}
+
+/*
+ * event
+ */
+static int event_append_ie_raw(struct ast_event **eventref, enum ast_event_ie_type ie_type, const void *data, size_t data_len)
+{
+	struct ast_event *event;
+	struct ast_event_ie *ie;
+	uint16_t event_len = ntohs((*eventref)->event_len);
+	size_t extra_len = sizeof(*ie) + data_len;
+
+	if (!(event = realloc(*eventref, event_len + extra_len))) {
+		return -1;
+	}
+	ie = (struct ast_event_ie *) (((char *) event) + event_len);
+	ie->ie_type = htons(ie_type);
+	ie->ie_payload_len = htons(data_len);
+	memcpy(ie->ie_payload, data, data_len);
+	event->event_len = htons(event_len + extra_len);
+	*eventref = event;
+	return 0;
+}
+
+/* takes (ie_type, pltype, value) triplets up to AST_EVENT_IE_END, does not add the local eid */
+struct ast_event *ast_event_new(enum ast_event_type type, ...)
+{
+	struct ast_event *event;
+	enum ast_event_ie_type ie_type;
+	va_list ap;
+	int res = 0;
+
+	if (!(event = calloc(1, sizeof(*event)))) {
+		return NULL;
+	}
+	event->type = htons(type);
+	event->event_len = htons(sizeof(*event));
+
+	va_start(ap, type);
+	while (!res && (ie_type = va_arg(ap, enum ast_event_ie_type)) != AST_EVENT_IE_END) {
+		switch (va_arg(ap, enum ast_event_ie_pltype)) {
+			case AST_EVENT_IE_PLTYPE_UINT:
+			case AST_EVENT_IE_PLTYPE_BITFLAGS: {
+				uint32_t data = htonl(va_arg(ap, uint32_t));
+				res = event_append_ie_raw(&event, ie_type, &data, sizeof(data));
+				break;
+			}
+			case AST_EVENT_IE_PLTYPE_STR: {
+				const char *str = va_arg(ap, const char *);
+				size_t payload_len = sizeof(struct ast_event_ie_str_payload) + strlen(str);
+				struct ast_event_ie_str_payload *str_payload = alloca(payload_len);
+				strcpy(str_payload->str, str);
+				str_payload->hash = ast_str_hash(str);
+				res = event_append_ie_raw(&event, ie_type, str_payload, payload_len);
+				break;
+			}
+			case AST_EVENT_IE_PLTYPE_RAW: {
+				const void *data = va_arg(ap, const void *);
+				size_t data_len = va_arg(ap, size_t);
+				res = event_append_ie_raw(&event, ie_type, data, data_len);
+				break;
+			}
+			default:
+				res = -1;
+				break;
+		}
+	}
+	va_end(ap);
+	if (res) {
+		free(event);
+		return NULL;
+	}
+	return event;
+}
+
+void ast_event_destroy(struct ast_event *event)
+{
+	free(event);
+}
+
+int ast_event_queue_and_cache(struct ast_event *event)
+{
+	return -1;
+}
+
+enum ast_event_type ast_event_get_type(const struct ast_event *event)
+{
+	return ntohs(event->type);
+}
+
+const char *ast_event_get_type_name(const struct ast_event *event)
+{
+	return ast_event_get_type(event) == AST_EVENT_MWI ? "MWI" : "DeviceStateChange";
+}
+
+const char *ast_event_get_ie_type_name(enum ast_event_ie_type ie_type)
+{
+	return (ie_type > 0 && ie_type < AST_EVENT_IE_TOTAL && ie_maps[ie_type].name) ? ie_maps[ie_type].name : "";
+}
+
+enum ast_event_ie_pltype ast_event_get_ie_pltype(enum ast_event_ie_type ie_type)
+{
+	return (ie_type > 0 && ie_type < AST_EVENT_IE_TOTAL && ie_maps[ie_type].name) ? ie_maps[ie_type].ie_pltype : AST_EVENT_IE_PLTYPE_UNKNOWN;
+}
+
+size_t ast_event_get_size(const struct ast_event *event)
+{
+	return ntohs(event->event_len);
+}
+
+int ast_event_iterator_init(struct ast_event_iterator *iterator, const struct ast_event *event)
+{
+	iterator->event_len = ntohs(event->event_len);
+	iterator->event = event;
+	if (iterator->event_len >= sizeof(*event) + sizeof(struct ast_event_ie)) {
+		iterator->ie = (struct ast_event_ie *) ((char *) event + sizeof(*event));
+		return 0;
+	}
+	iterator->ie = NULL;
+	return -1;
+}
+
+int ast_event_iterator_next(struct ast_event_iterator *iterator)
+{
+	iterator->ie = (struct ast_event_ie *) (((char *) iterator->ie) + sizeof(*iterator->ie) + ntohs(iterator->ie->ie_payload_len));
+	return ((iterator->event_len <= (((char *) iterator->ie) - ((char *) iterator->event))) ? -1 : 0);
+}
+
+enum ast_event_ie_type ast_event_iterator_get_ie_type(struct ast_event_iterator *iterator)
+{
+	return ntohs(iterator->ie->ie_type);
+}
+
+uint32_t ast_event_iterator_get_ie_uint(struct ast_event_iterator *iterator)
+{
+	uint32_t data;
+
+	memcpy(&data, iterator->ie->ie_payload, sizeof(data));
+	return ntohl(data);
+}
+
+uint32_t ast_event_iterator_get_ie_bitflags(struct ast_event_iterator *iterator)
+{
+	return ast_event_iterator_get_ie_uint(iterator);
+}
+
+const char *ast_event_iterator_get_ie_str(struct ast_event_iterator *iterator)
+{
+	return ((const struct ast_event_ie_str_payload *) iterator->ie->ie_payload)->str;
+}
+
+void *ast_event_iterator_get_ie_raw(struct ast_event_iterator *iterator)
+{
+	return iterator->ie->ie_payload;
+}
+
+const void *ast_event_get_ie_raw(const struct ast_event *event, enum ast_event_ie_type ie_type)
+{
+	struct ast_event_iterator iterator;
+	int res;
+
+	for (res = ast_event_iterator_init(&iterator, event); !res; res = ast_event_iterator_next(&iterator)) {
+		if (ast_event_iterator_get_ie_type(&iterator) == ie_type) {
+			return ast_event_iterator_get_ie_raw(&iterator);
+		}
+	}
+	return NULL;
+}
+
+uint32_t ast_event_get_ie_uint(const struct ast_event *event, enum ast_event_ie_type ie_type)
+{
+	const uint32_t *ie_val = ast_event_get_ie_raw(event, ie_type);
+	uint32_t data;
+
+	if (!ie_val) {
+		return 0;
+	}
+	memcpy(&data, ie_val, sizeof(data));
+	return ntohl(data);
+}
+
+const char *ast_event_get_ie_str(const struct ast_event *event, enum ast_event_ie_type ie_type)
+{
+	const struct ast_event_ie_str_payload *str_payload = ast_event_get_ie_raw(event, ie_type);
+
+	return str_payload ? str_payload->str : NULL;
+}
+
+struct ast_event_sub *ast_event_subscribe_new(enum ast_event_type type, ast_event_cb_t cb, void *userdata)
+{
+	return NULL;
+}
+
+struct ast_event_sub *ast_event_unsubscribe(struct ast_event_sub *event_sub)
+{
+	return NULL;
+}
+
+void ast_event_sub_destroy(struct ast_event_sub *sub)
+{
+}
+
+int ast_event_sub_append_ie_raw(struct ast_event_sub *sub, enum ast_event_ie_type ie_type, void *data, size_t raw_datalen)
+{
+	return -1;
+}
+
+void ast_event_dump_cache(const struct ast_event_sub *event_sub)
+{
+}
@@ -0,0 +1,57 @@
+#include <gtest/gtest.h>
+#include <stdio.h>
+
+extern "C" {
+#include "../include/bloom_filter.h"
+}
+
+TEST(BloomFilter, NoFalseNegatives)
+{
+	bloom_filter_t *filter = bloom_filter_new(1000, 10);
+	char key[32];
+	int i;
+
+	ASSERT_TRUE(filter != NULL);
+	for (i = 0; i < 1000; i++) {
+		snprintf(key, sizeof(key), "peer%d", i);
+		bloom_filter_add(filter, key);
+	}
+	EXPECT_EQ(1000u, bloom_filter_count(filter));
+	for (i = 0; i < 1000; i++) {
+		snprintf(key, sizeof(key), "peer%d", i);
+		EXPECT_TRUE(bloom_filter_check(filter, key));
+	}
+	bloom_filter_destroy(filter);
+}
+
+TEST(BloomFilter, FalsePositiveRate)
+{
+	bloom_filter_t *filter = bloom_filter_new(10000, 10);
+	char key[32];
+	int i, passed = 0;
+
+	for (i = 0; i < 10000; i++) {
+		snprintf(key, sizeof(key), "%d", 100000 + i);
+		bloom_filter_add(filter, key);
+	}
+	for (i = 0; i < 10000; i++) {
+		snprintf(key, sizeof(key), "scanner%d", i);
+		passed += bloom_filter_check(filter, key);
+	}
+	/* about 1% expected */
+	EXPECT_LT(passed, 300);
+	bloom_filter_destroy(filter);
+}
+
+TEST(BloomFilter, Clear)
+{
+	bloom_filter_t *filter = bloom_filter_new(100, 10);
+
+	bloom_filter_add(filter, "1000");
+	EXPECT_TRUE(bloom_filter_check(filter, "1000"));
+	bloom_filter_clear(filter);
+	EXPECT_FALSE(bloom_filter_check(filter, "1000"));
+	EXPECT_EQ(0u, bloom_filter_count(filter));
+	EXPECT_TRUE(bloom_filter_new(0, 10) == NULL);
+	bloom_filter_destroy(filter);
+}
@@ -0,0 +1,184 @@
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <unistd.h>
+
+extern "C" {
+#include "../include/conn_pool.h"
+}
+
+struct fake_backend {
+	int created;
+	int destroyed;
+	int fail;
+};
+
+static void *fake_create(void *data)
+{
+	struct fake_backend *backend = (struct fake_backend *) data;
+	if (backend->fail) {
+		return NULL;
+	}
+	__sync_fetch_and_add(&backend->created, 1);
+	return malloc(1);
+}
+
+static void fake_destroy(void *conn, void *data)
+{
+	struct fake_backend *backend = (struct fake_backend *) data;
+	__sync_fetch_and_add(&backend->destroyed, 1);
+	free(conn);
+}
+
+TEST(ConnPool, ReuseAndBroken)
+{
+	struct fake_backend backend = {0, 0, 0};
+	conn_pool_t *pool = conn_pool_new(2, 10, fake_create, fake_destroy, &backend);
+	conn_pool_stats_t stats;
+	void *a, *b;
+
+	ASSERT_TRUE(pool != NULL);
+	a = conn_pool_acquire(pool);
+	ASSERT_TRUE(a != NULL);
+	conn_pool_release(pool, a, 0);
+	b = conn_pool_acquire(pool);
+	EXPECT_EQ(a, b);
+	EXPECT_EQ(1, backend.created);
+	conn_pool_release(pool, b, 1);
+	EXPECT_EQ(1, backend.destroyed);
+	conn_pool_stats(pool, &stats);
+	EXPECT_EQ(0u, stats.open);
+	EXPECT_EQ(2ul, stats.acquired);
+
+	backend.fail = 1;
+	EXPECT_TRUE(conn_pool_acquire(pool) == NULL);
+	conn_pool_stats(pool, &stats);
+	EXPECT_EQ(1ul, stats.failed);
+	EXPECT_EQ(0u, stats.open);
+	conn_pool_destroy(pool);
+}
+
+TEST(ConnPool, LimitAndTimeout)
+{
+	struct fake_backend backend = {0, 0, 0};
+	conn_pool_t *pool = conn_pool_new(2, 20, fake_create, fake_destroy, &backend);
+	conn_pool_stats_t stats;
+	void *a, *b;
+
+	a = conn_pool_acquire(pool);
+	b = conn_pool_acquire(pool);
+	ASSERT_TRUE(a && b && a != b);
+	EXPECT_TRUE(conn_pool_acquire(pool) == NULL);
+	conn_pool_stats(pool, &stats);
+	EXPECT_EQ(1ul, stats.timeouts);
+	EXPECT_EQ(2u, stats.open);
+	conn_pool_release(pool, a, 0);
+	conn_pool_release(pool, b, 0);
+	conn_pool_flush(pool);
+	EXPECT_EQ(2, backend.destroyed);
+	conn_pool_destroy(pool);
+}
+
+struct worker_arg {
+	conn_pool_t *pool;
+	int ok;
+};
+
+static void *worker(void *data)
+{
+	struct worker_arg *arg = (struct worker_arg *) data;
+	int i;
+
+	for (i = 0; i < 200; i++) {
+		void *conn = conn_pool_acquire(arg->pool);
+		if (conn) {
+			arg->ok++;
+			conn_pool_release(arg->pool, conn, (i % 50) == 0);
+		}
+	}
+	return NULL;
+}
+
+TEST(ConnPool, Concurrent)
+{
+	struct fake_backend backend = {0, 0, 0};
+	conn_pool_t *pool = conn_pool_new(3, 1000, fake_create, fake_destroy, &backend);
+	struct worker_arg args[8];
+	pthread_t threads[8];
+	conn_pool_stats_t stats;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		args[i].pool = pool;
+		args[i].ok = 0;
+		pthread_create(&threads[i], NULL, worker, &args[i]);
+	}
+	for (i = 0; i < 8; i++) {
+		pthread_join(threads[i], NULL);
+		EXPECT_EQ(200, args[i].ok);
+	}
+	conn_pool_stats(pool, &stats);
+	EXPECT_LE(stats.open, 3u);
+	conn_pool_destroy(pool);
+	EXPECT_EQ(backend.created, backend.destroyed);
+}
+
+TEST(ConnPool, InvalidateClosesBusyOnRelease)
+{
+	struct fake_backend backend = {0, 0, 0};
+	conn_pool_t *pool = conn_pool_new(2, 10, fake_create, fake_destroy, &backend);
+	void *busy, *idle, *fresh;
+
+	busy = conn_pool_acquire(pool);
+	idle = conn_pool_acquire(pool);
+	conn_pool_release(pool, idle, 0);
+	conn_pool_invalidate(pool);
+	EXPECT_EQ(1, backend.destroyed);
+	conn_pool_release(pool, busy, 0);
+	EXPECT_EQ(2, backend.destroyed);
+	fresh = conn_pool_acquire(pool);
+	EXPECT_EQ(3, backend.created);
+	conn_pool_release(pool, fresh, 0);
+	EXPECT_EQ(2, backend.destroyed);
+	conn_pool_destroy(pool);
+	EXPECT_EQ(3, backend.destroyed);
+}
+
+struct drain_arg {
+	conn_pool_t *pool;
+	void *conn;
+};
+
+static void *late_release(void *data)
+{
+	struct drain_arg *arg = (struct drain_arg *) data;
+
+	usleep(20000);
+	conn_pool_release(arg->pool, arg->conn, 0);
+	return NULL;
+}
+
+TEST(ConnPool, DrainWaitsForRelease)
+{
+	struct fake_backend backend = {0, 0, 0};
+	conn_pool_t *pool = conn_pool_new(2, 10, fake_create, fake_destroy, &backend);
+	struct drain_arg arg;
+	pthread_t thread;
+	void *busy, *extra;
+
+	busy = conn_pool_acquire(pool);
+	ASSERT_TRUE(busy != NULL);
+	EXPECT_EQ(-1, conn_pool_drain(pool, 10));
+	/* a timed out drain leaves the pool usable */
+	extra = conn_pool_acquire(pool);
+	EXPECT_TRUE(extra != NULL);
+	conn_pool_release(pool, extra, 0);
+
+	arg.pool = pool;
+	arg.conn = busy;
+	pthread_create(&thread, NULL, late_release, &arg);
+	EXPECT_EQ(0, conn_pool_drain(pool, 1000));
+	EXPECT_TRUE(conn_pool_acquire(pool) == NULL);
+	pthread_join(thread, NULL);
+	EXPECT_EQ(backend.created, backend.destroyed);
+	conn_pool_destroy(pool);
+}
@@ -0,0 +1,139 @@
+#include <gtest/gtest.h>
+#include <string.h>
+#include <string>
+
+extern "C" {
+#include "../include/device_lru.h"
+}
+
+/* highest state wins, -1 without reports */
+static int max_aggregate(const int *states, unsigned int count)
+{
+	int state = -1;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (states[i] > state) {
+			state = states[i];
+		}
+	}
+	return state;
+}
+
+static void collect_cb(const char *device, void *data)
+{
+	std::string *names = (std::string *) data;
+	*names += device;
+	*names += ";";
+}
+
+TEST(DeviceLru, AggregatesOrigins)
+{
+	device_lru_t *lru = device_lru_new(4, max_aggregate);
+	int state;
+
+	ASSERT_TRUE(lru != NULL);
+	EXPECT_EQ(-1, device_lru_get(lru, "SIP/1000", &state));
+	EXPECT_FALSE(device_lru_update(lru, "SIP/1000", "00:11:22:33:44:55", 2, &state));
+	ASSERT_EQ(NO_EXCEPTION, device_lru_add(lru, "SIP/1000", NULL, 0));
+	EXPECT_EQ(EXISTS_EXCEPTION, device_lru_add(lru, "sip/1000", NULL, 0));
+	ASSERT_EQ(0, device_lru_get(lru, "SIP/1000", &state));
+	EXPECT_EQ(-1, state);
+
+	EXPECT_TRUE(device_lru_update(lru, "SIP/1000", "00:11:22:33:44:55", 1, &state));
+	EXPECT_EQ(1, state);
+	EXPECT_TRUE(device_lru_update(lru, "SIP/1000", "66:77:88:99:aa:bb", 2, &state));
+	EXPECT_EQ(2, state);
+	EXPECT_FALSE(device_lru_update(lru, "SIP/1000", "00:11:22:33:44:55", 2, &state));
+	EXPECT_FALSE(device_lru_update(lru, "SIP/1000", "66:77:88:99:aa:bb", 1, &state));
+	EXPECT_EQ(2, state);
+	EXPECT_TRUE(device_lru_update(lru, "SIP/1000", "00:11:22:33:44:55", 0, &state));
+	EXPECT_EQ(1, state);
+	device_lru_remove(lru, "SIP/1000");
+	EXPECT_EQ(0u, device_lru_count(lru));
+	device_lru_destroy(lru);
+}
+
+TEST(DeviceLru, EvictsLeastRecent)
+{
+	device_lru_t *lru = device_lru_new(3, max_aggregate);
+	char evicted[DEVICE_LRU_MAX_NAME];
+	std::string names;
+	int state;
+
+	ASSERT_EQ(NO_EXCEPTION, device_lru_add(lru, "SIP/1", evicted, sizeof(evicted)));
+	ASSERT_EQ(NO_EXCEPTION, device_lru_add(lru, "SIP/2", evicted, sizeof(evicted)));
+	ASSERT_EQ(NO_EXCEPTION, device_lru_add(lru, "SIP/3", evicted, sizeof(evicted)));
+	EXPECT_STREQ("", evicted);
+	EXPECT_EQ(0, device_lru_get(lru, "SIP/1", &state));
+
+	ASSERT_EQ(NO_EXCEPTION, device_lru_add(lru, "SIP/4", evicted, sizeof(evicted)));
+	EXPECT_STREQ("SIP/2", evicted);
+	EXPECT_EQ(-1, device_lru_get(lru, "SIP/2", &state));
+	EXPECT_EQ(3u, device_lru_count(lru));
+
+	EXPECT_EQ(3u, device_lru_list(lru, collect_cb, &names));
+	EXPECT_EQ("SIP/4;SIP/1;SIP/3;", names);
+	names.clear();
+	device_lru_clear(lru, collect_cb, &names);
+	EXPECT_EQ("SIP/4;SIP/1;SIP/3;", names);
+	EXPECT_EQ(0u, device_lru_count(lru));
+	EXPECT_EQ(NO_EXCEPTION, device_lru_add(lru, "SIP/5", evicted, sizeof(evicted)));
+	device_lru_destroy(lru);
+}
+
+TEST(DeviceLru, KeepsPinnedEntries)
+{
+	device_lru_t *lru = device_lru_new(2, max_aggregate);
+	char evicted[DEVICE_LRU_MAX_NAME];
+	int state;
+
+	ASSERT_EQ(NO_EXCEPTION, device_lru_add(lru, "SIP/1", evicted, sizeof(evicted)));
+	ASSERT_EQ(NO_EXCEPTION, device_lru_add(lru, "SIP/2", evicted, sizeof(evicted)));
+	EXPECT_EQ(0, device_lru_get(lru, "SIP/1", &state));
+	EXPECT_EQ(0, device_lru_get(lru, "SIP/2", &state));
+
+	/* SIP/1 is least recent but pinned, like SIP/2: grow instead */
+	ASSERT_EQ(NO_EXCEPTION, device_lru_add(lru, "SIP/3", evicted, sizeof(evicted)));
+	EXPECT_STREQ("", evicted);
+	EXPECT_EQ(3u, device_lru_count(lru));
+
+	/* only the unpinned entry makes room */
+	ASSERT_EQ(NO_EXCEPTION, device_lru_add(lru, "SIP/4", evicted, sizeof(evicted)));
+	EXPECT_STREQ("SIP/3", evicted);
+	EXPECT_EQ(0, device_lru_get(lru, "SIP/1", &state));
+	EXPECT_EQ(3u, device_lru_count(lru));
+	device_lru_destroy(lru);
+}
+
+static void changed_cb(const char *device, int state, void *data)
+{
+	std::string *names = (std::string *) data;
+	*names += device;
+	*names += "=" + std::to_string(state) + ";";
+}
+
+TEST(DeviceLru, ForgetsOrigin)
+{
+	device_lru_t *lru = device_lru_new(4, max_aggregate);
+	std::string names;
+	int state;
+
+	ASSERT_EQ(NO_EXCEPTION, device_lru_add(lru, "SIP/1", NULL, 0));
+	ASSERT_EQ(NO_EXCEPTION, device_lru_add(lru, "SIP/2", NULL, 0));
+	device_lru_update(lru, "SIP/1", "00:11:22:33:44:55", 2, NULL);
+	device_lru_update(lru, "SIP/1", "66:77:88:99:aa:bb", 1, NULL);
+	device_lru_update(lru, "SIP/2", "00:11:22:33:44:55", 1, NULL);
+	device_lru_update(lru, "SIP/2", "66:77:88:99:aa:bb", 1, NULL);
+
+	EXPECT_EQ(2u, device_lru_forget_origin(lru, "00:11:22:33:44:55", changed_cb, &names));
+	EXPECT_EQ("SIP/1=1;", names);
+	EXPECT_EQ(0u, device_lru_forget_origin(lru, "00:11:22:33:44:55", changed_cb, &names));
+
+	names.clear();
+	EXPECT_EQ(2u, device_lru_forget_origin(lru, "66:77:88:99:aa:bb", changed_cb, &names));
+	EXPECT_EQ("SIP/2=-1;SIP/1=-1;", names);
+	ASSERT_EQ(0, device_lru_get(lru, "SIP/1", &state));
+	EXPECT_EQ(-1, state);
+	device_lru_destroy(lru);
+}
@@ -0,0 +1,44 @@
+#include <gtest/gtest.h>
+#include <string.h>
+
+extern "C" {
+#include "../include/devstate_aggregate.h"
+}
+
+/* enum ast_device_state */
+enum { UNKNOWN = 0, NOT_INUSE, INUSE, BUSY, INVALID, UNAVAILABLE, RINGING, RINGINUSE, ONHOLD };
+
+static int aggregate(std::initializer_list<int> states)
+{
+	return devstate_aggregate(states.begin(), states.size());
+}
+
+TEST(DevstateAggregate, RanksLikeAsterisk)
+{
+	EXPECT_EQ(INVALID, devstate_aggregate(NULL, 0));
+	EXPECT_EQ(UNKNOWN, aggregate({ INVALID, UNKNOWN }));
+	EXPECT_EQ(NOT_INUSE, aggregate({ UNKNOWN, NOT_INUSE }));
+	EXPECT_EQ(NOT_INUSE, aggregate({ UNAVAILABLE, NOT_INUSE }));
+	EXPECT_EQ(ONHOLD, aggregate({ NOT_INUSE, ONHOLD }));
+	EXPECT_EQ(RINGING, aggregate({ NOT_INUSE, RINGING, UNAVAILABLE }));
+	EXPECT_EQ(INUSE, aggregate({ ONHOLD, INUSE, NOT_INUSE }));
+	EXPECT_EQ(BUSY, aggregate({ INUSE, BUSY }));
+	/* the order the servers are walked in does not matter */
+	EXPECT_EQ(BUSY, aggregate({ BUSY, INUSE }));
+}
+
+TEST(DevstateAggregate, RingingWhileInUse)
+{
+	EXPECT_EQ(RINGINUSE, aggregate({ RINGING, INUSE }));
+	EXPECT_EQ(RINGINUSE, aggregate({ BUSY, RINGING }));
+	EXPECT_EQ(RINGINUSE, aggregate({ ONHOLD, NOT_INUSE, RINGING }));
+	EXPECT_EQ(RINGINUSE, aggregate({ RINGING, INUSE, NOT_INUSE, UNAVAILABLE }));
+}
+
+TEST(DevstateAggregate, ScriptUsesTheSameRanks)
+{
+	/* the lua table is 0 based: [0] = rank of unknown, then not in use .. on hold */
+	EXPECT_TRUE(strstr(devstate_aggregate_script, "local order = {[0] = 1, 3, 6, 7, 0, 2, 5, 8, 4} ") != NULL);
+	EXPECT_TRUE(strstr(devstate_aggregate_script, "local agg, ringing, inuse = 4, false, false ") != NULL);
+	EXPECT_TRUE(strstr(devstate_aggregate_script, "if s == 6 then ringing = true elseif s == 2 or s == 3 or s == 8 then inuse = true end ") != NULL);
+}
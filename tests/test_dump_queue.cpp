@@ -0,0 +1,69 @@
+#include <gtest/gtest.h>
+#include <string>
+
+extern "C" {
+#include "../include/dump_queue.h"
+}
+
+static std::string drain(dump_queue_t *queue)
+{
+	std::string out;
+	dump_entry_t *entry;
+
+	while ((entry = dump_queue_pop(queue))) {
+		out += entry->msg;
+		out += ";";
+		dump_queue_entry_free(entry);
+	}
+	return out;
+}
+
+TEST(DumpQueue, SupersedesByTypeAndField)
+{
+	dump_queue_t *queue = dump_queue_new();
+
+	ASSERT_TRUE(queue != NULL);
+	ASSERT_EQ(NO_EXCEPTION, dump_queue_push(queue, 1, TRUE, "SIP/100", "a1", 2));
+	ASSERT_EQ(NO_EXCEPTION, dump_queue_push(queue, 1, TRUE, "SIP/101", "b1", 2));
+	ASSERT_EQ(NO_EXCEPTION, dump_queue_push(queue, 2, TRUE, "SIP/100", "c1", 2));
+	ASSERT_EQ(NO_EXCEPTION, dump_queue_push(queue, 1, FALSE, "", "ping", 4));
+	EXPECT_EQ(4u, dump_queue_len(queue));
+
+	EXPECT_TRUE(dump_queue_supersede(queue, 1, "SIP/100"));
+	EXPECT_FALSE(dump_queue_supersede(queue, 1, "SIP/100"));
+	EXPECT_FALSE(dump_queue_supersede(queue, 1, ""));
+	ASSERT_EQ(NO_EXCEPTION, dump_queue_push(queue, 1, FALSE, "SIP/100", "a2", 2));
+	EXPECT_EQ("b1;c1;ping;a2;", drain(queue));
+	EXPECT_EQ(0u, dump_queue_len(queue));
+	dump_queue_destroy(queue);
+}
+
+TEST(DumpQueue, NewDumpKeepsLiveEvents)
+{
+	dump_queue_t *queue = dump_queue_new();
+
+	ASSERT_EQ(NO_EXCEPTION, dump_queue_push(queue, 1, TRUE, "1000@default", "dump1", 5));
+	ASSERT_EQ(NO_EXCEPTION, dump_queue_push(queue, 1, FALSE, "1001@default", "live1", 5));
+	ASSERT_EQ(NO_EXCEPTION, dump_queue_push(queue, 1, TRUE, "1002@default", "dump2", 5));
+	ASSERT_EQ(NO_EXCEPTION, dump_queue_push(queue, 1, FALSE, "1003@default", "live2", 5));
+
+	EXPECT_EQ(2u, dump_queue_clear(queue, TRUE));
+	EXPECT_EQ(2u, dump_queue_len(queue));
+	ASSERT_EQ(NO_EXCEPTION, dump_queue_push(queue, 1, TRUE, "1000@default", "dump3", 5));
+	EXPECT_EQ("live1;live2;dump3;", drain(queue));
+
+	ASSERT_EQ(NO_EXCEPTION, dump_queue_push(queue, 1, FALSE, "1001@default", "live3", 5));
+	EXPECT_EQ(1u, dump_queue_clear(queue, FALSE));
+	EXPECT_TRUE(dump_queue_pop(queue) == NULL);
+	dump_queue_destroy(queue);
+}
+
+TEST(DumpQueue, LaneBudget)
+{
+	/* idle realtime lane: the burst */
+	EXPECT_EQ(65536u, dump_queue_lane_budget(0, 20, 65536));
+	/* 20%: a quarter of what the realtime lane sent */
+	EXPECT_EQ(250u, dump_queue_lane_budget(1000, 20, 65536));
+	EXPECT_EQ(1000u, dump_queue_lane_budget(1000, 50, 65536));
+	EXPECT_EQ(99000u, dump_queue_lane_budget(1000, 99, 65536));
+}
@@ -0,0 +1,77 @@
+#include <gtest/gtest.h>
+#include <string.h>
+
+extern "C" {
+#include "../include/event_batch.h"
+}
+
+TEST(EventBatch, PackAndSplit)
+{
+	const char *ds = "{\"Device\":\"SIP/\\\"}],[x\\\"\",\"State\":2}";
+	const char *mwi = "{\"Mailbox\":\"4711\",\"NewMsgs\":1,\"Nested\":{\"a\":[1,2]}}";
+	event_batch_t batch;
+	char payload[512];
+	size_t len;
+	char *cursor, *type_name, *msg;
+
+	ASSERT_EQ(NO_EXCEPTION, event_batch_init(&batch, 256));
+	ASSERT_EQ(NO_EXCEPTION, event_batch_append(&batch, "device_state", ds, strlen(ds)));
+	ASSERT_EQ(NO_EXCEPTION, event_batch_append(&batch, "mwi", mwi, strlen(mwi)));
+	EXPECT_EQ(2u, batch.count);
+	strcpy(payload, event_batch_finish(&batch, &len));
+	EXPECT_EQ(strlen(payload), len);
+
+	ASSERT_TRUE((cursor = event_batch_open(payload)) != NULL);
+	ASSERT_EQ(NO_EXCEPTION, event_batch_next(&cursor, &type_name, &msg));
+	EXPECT_STREQ("device_state", type_name);
+	EXPECT_STREQ(ds, msg);
+	ASSERT_EQ(NO_EXCEPTION, event_batch_next(&cursor, &type_name, &msg));
+	EXPECT_STREQ("mwi", type_name);
+	EXPECT_STREQ(mwi, msg);
+	ASSERT_EQ(NO_EXCEPTION, event_batch_next(&cursor, &type_name, &msg));
+	EXPECT_TRUE(type_name == NULL);
+	event_batch_free(&batch);
+}
+
+TEST(EventBatch, SingleEventIsNotABatch)
+{
+	char single[] = "{\"Device\":\"SIP/1000\",\"State\":2}";
+	char empty[] = "[]";
+	char *cursor, *type_name, *msg;
+
+	EXPECT_TRUE(event_batch_open(single) == NULL);
+	ASSERT_TRUE((cursor = event_batch_open(empty)) != NULL);
+	ASSERT_EQ(NO_EXCEPTION, event_batch_next(&cursor, &type_name, &msg));
+	EXPECT_TRUE(type_name == NULL);
+}
+
+TEST(EventBatch, FullBatchRejectsAppend)
+{
+	const char *msg = "{\"Device\":\"SIP/site12-ext4711\",\"State\":2}";
+	event_batch_t batch;
+	unsigned int appended = 0;
+
+	ASSERT_EQ(NO_EXCEPTION, event_batch_init(&batch, 200));
+	while (event_batch_append(&batch, "device_state", msg, strlen(msg)) == NO_EXCEPTION) {
+		appended++;
+	}
+	EXPECT_EQ(3u, appended);
+	EXPECT_EQ(BUFFERSIZE_EXCEPTION, event_batch_append(&batch, "device_state", msg, strlen(msg)));
+	EXPECT_LT(strlen(event_batch_finish(&batch, NULL)), 200u);
+	event_batch_reset(&batch);
+	EXPECT_EQ(0u, batch.count);
+	EXPECT_EQ(NO_EXCEPTION, event_batch_append(&batch, "device_state", msg, strlen(msg)));
+	event_batch_free(&batch);
+}
+
+TEST(EventBatch, MalformedBatch)
+{
+	char truncated[] = "[[\"device_state\",{\"Device\":\"SIP/1000\"";
+	char notype[] = "[[{\"Device\":\"SIP/1000\"}]]";
+	char *cursor, *type_name, *msg;
+
+	ASSERT_TRUE((cursor = event_batch_open(truncated)) != NULL);
+	EXPECT_EQ(DECODING_EXCEPTION, event_batch_next(&cursor, &type_name, &msg));
+	ASSERT_TRUE((cursor = event_batch_open(notype)) != NULL);
+	EXPECT_EQ(DECODING_EXCEPTION, event_batch_next(&cursor, &type_name, &msg));
+}
@@ -0,0 +1,192 @@
+#include <gtest/gtest.h>
+#include <string.h>
+
+extern "C" {
+#include <asterisk.h>
+#include "../include/pbx_event_message_serializer.h"
+#include "../include/scratch_arena.h"
+}
+
+/*
+ * Count the heap allocations of the calling thread by interposing the
+ * allocator entry points in front of glibc. This binary only holds the
+ * serializer tests, and the count is only armed inside the measured loops.
+ */
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+}
+
+static __thread int allocs_armed = 0;
+static __thread unsigned long heap_allocs = 0;
+
+extern "C" void *malloc(size_t size)
+{
+	if (allocs_armed) {
+		heap_allocs++;
+	}
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size)
+{
+	if (allocs_armed) {
+		heap_allocs++;
+	}
+	return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+	if (allocs_armed) {
+		heap_allocs++;
+	}
+	return __libc_realloc(ptr, size);
+}
+
+static void arm_alloc_count(void)
+{
+	heap_allocs = 0;
+	allocs_armed = 1;
+}
+
+static unsigned long disarm_alloc_count(void)
+{
+	allocs_armed = 0;
+	return heap_allocs;
+}
+
+static struct ast_eid remote_eid = {{0x00, 0x0c, 0x29, 0x4a, 0x3e, 0x01}};
+
+static struct ast_event *new_device_state_change(const char *device, enum ast_device_state state)
+{
+	return ast_event_new(AST_EVENT_DEVICE_STATE_CHANGE,
+		AST_EVENT_IE_DEVICE, AST_EVENT_IE_PLTYPE_STR, device,
+		AST_EVENT_IE_STATE, AST_EVENT_IE_PLTYPE_UINT, state,
+		AST_EVENT_IE_CACHABLE, AST_EVENT_IE_PLTYPE_UINT, 1,
+		AST_EVENT_IE_EID, AST_EVENT_IE_PLTYPE_RAW, &remote_eid, sizeof(remote_eid),
+		AST_EVENT_IE_END);
+}
+
+/* one publish and one receive: message2json() into the arena, then the decode view builds the event in a pooled buffer */
+static exception_t round_trip(const struct ast_event *event, struct ast_event **decoded, boolean_t *cacheable)
+{
+	scratch_arena_t *arena = scratch_arena_get();
+	pbx_event_view_t view;
+	char *msg;
+	exception_t res;
+
+	if (!(msg = (char *)scratch_alloc(arena, MAX_JSON_BUFFERLEN))) {
+		return MALLOC_EXCEPTION;
+	}
+	if ((res = message2json(msg, MAX_JSON_BUFFERLEN, event))) {
+		return res;
+	}
+	if ((res = pbx_event_view_init(&view, AST_EVENT_DEVICE_STATE_CHANGE, msg))) {
+		return res;
+	}
+	return pbx_event_view_build(&view, decoded, cacheable);
+}
+
+TEST(EventSerializer, Message2Json)
+{
+	struct ast_event *event = new_device_state_change("SIP/site12-ext4711", AST_DEVICE_INUSE);
+	char msg[MAX_JSON_BUFFERLEN];
+	ASSERT_TRUE(event != NULL);
+
+	EXPECT_EQ(NO_EXCEPTION, message2json(msg, sizeof(msg), event));
+	EXPECT_STREQ("{\"EntityID\":\"00:0c:29:4a:3e:01\",\"Device\":\"SIP/site12-ext4711\",\"State\":2,\"statestr\":\"INUSE\",\"Cachable\":1}", msg);
+	ast_event_destroy(event);
+}
+
+TEST(EventSerializer, Json2MessageRoundTrip)
+{
+	struct ast_event *event = new_device_state_change("SIP/site12-\"ext4711\"", AST_DEVICE_RINGING);
+	struct ast_event *decoded = NULL;
+	boolean_t cacheable = FALSE;
+	char msg[MAX_JSON_BUFFERLEN];
+	ASSERT_TRUE(event != NULL);
+
+	ASSERT_EQ(NO_EXCEPTION, message2json(msg, sizeof(msg), event));
+	ASSERT_EQ(NO_EXCEPTION, json2message(&decoded, AST_EVENT_DEVICE_STATE_CHANGE, msg, &cacheable));
+	ASSERT_TRUE(decoded != NULL);
+	EXPECT_EQ(AST_EVENT_DEVICE_STATE_CHANGE, ast_event_get_type(decoded));
+	EXPECT_STREQ("SIP/site12-\"ext4711\"", ast_event_get_ie_str(decoded, AST_EVENT_IE_DEVICE));
+	EXPECT_EQ((uint32_t) AST_DEVICE_RINGING, ast_event_get_ie_uint(decoded, AST_EVENT_IE_STATE));
+	EXPECT_EQ(0, memcmp(&remote_eid, ast_event_get_ie_raw(decoded, AST_EVENT_IE_EID), sizeof(remote_eid)));
+	EXPECT_EQ(TRUE, cacheable);
+	/* same information elements, only the EntityID moved to the front */
+	EXPECT_EQ(ast_event_get_size(event), ast_event_get_size(decoded));
+
+	ast_event_destroy(decoded);
+	ast_event_destroy(event);
+	scratch_reset(scratch_arena_get());
+}
+
+TEST(EventSerializer, SteadyStateRoundTripDoesNotAllocate)
+{
+	struct ast_event *event = new_device_state_change("SIP/site12-ext4711", AST_DEVICE_INUSE);
+	struct ast_event *decoded = NULL;
+	boolean_t cacheable = FALSE;
+	unsigned int failures = 0;
+	ASSERT_TRUE(event != NULL);
+
+	/* warm up: creates the thread's arena and fills the pool freelists */
+	for (int i = 0; i < 4; i++) {
+		ASSERT_EQ(NO_EXCEPTION, round_trip(event, &decoded, &cacheable));
+		scratch_pool_put(decoded);
+		scratch_reset(scratch_arena_get());
+	}
+
+	scratch_reset_stats();
+	arm_alloc_count();
+	for (int i = 0; i < 10000; i++) {
+		if (round_trip(event, &decoded, &cacheable) || ast_event_get_ie_uint(decoded, AST_EVENT_IE_STATE) != AST_DEVICE_INUSE) {
+			failures++;
+		}
+		scratch_pool_put(decoded);
+		scratch_reset(scratch_arena_get());
+	}
+	unsigned long allocs = disarm_alloc_count();
+
+	scratch_stats_t stats;
+	scratch_get_stats(&stats);
+	EXPECT_EQ(0u, failures);
+	EXPECT_EQ(0u, allocs);
+	EXPECT_EQ(0u, stats.backing_allocs);
+	EXPECT_EQ(0u, stats.pool_misses);
+	EXPECT_EQ(0u, stats.arena_exhausted);
+	EXPECT_GT(stats.pool_hits, 0u);
+	ast_event_destroy(event);
+}
+
+TEST(EventSerializer, MaterializeOnlyAllocatesTheHandOff)
+{
+	struct ast_event *event = new_device_state_change("SIP/site12-ext4711", AST_DEVICE_INUSE);
+	struct ast_event *decoded = NULL;
+	boolean_t cacheable = FALSE;
+	pbx_event_view_t view;
+	char msg[MAX_JSON_BUFFERLEN];
+	ASSERT_TRUE(event != NULL);
+	ASSERT_EQ(NO_EXCEPTION, message2json(msg, sizeof(msg), event));
+
+	/* warm up the pool */
+	ASSERT_EQ(NO_EXCEPTION, json2message(&decoded, AST_EVENT_DEVICE_STATE_CHANGE, msg, &cacheable));
+	ast_event_destroy(decoded);
+	scratch_reset(scratch_arena_get());
+
+	arm_alloc_count();
+	exception_t res = pbx_event_view_init(&view, AST_EVENT_DEVICE_STATE_CHANGE, msg);
+	if (!res) {
+		res = pbx_event_view_materialize(&view, &decoded, &cacheable);
+	}
+	unsigned long allocs = disarm_alloc_count();
+
+	ASSERT_EQ(NO_EXCEPTION, res);
+	EXPECT_EQ(1u, allocs);		/* the exact-size copy asterisk takes ownership of */
+	EXPECT_EQ(ast_event_get_size(event), ast_event_get_size(decoded));
+	ast_event_destroy(decoded);
+	ast_event_destroy(event);
+	scratch_reset(scratch_arena_get());
+}
@@ -0,0 +1,95 @@
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "../include/intern_table.h"
+}
+
+TEST(InternTable, AssignsStableIds)
+{
+	intern_table_t *table = intern_table_new(16, TRUE);
+	unsigned int id1, id2, again;
+	boolean_t added;
+
+	ASSERT_TRUE(table != NULL);
+	ASSERT_EQ(NO_EXCEPTION, intern_table_get_id(table, "SIP/site12-ext4711", &id1, &added));
+	EXPECT_TRUE(added);
+	ASSERT_EQ(NO_EXCEPTION, intern_table_get_id(table, "SIP/site12-ext4712", &id2, &added));
+	EXPECT_TRUE(added);
+	EXPECT_NE(id1, id2);
+	ASSERT_EQ(NO_EXCEPTION, intern_table_get_id(table, "SIP/site12-ext4711", &again, &added));
+	EXPECT_FALSE(added);
+	EXPECT_EQ(id1, again);
+	EXPECT_EQ(2u, intern_table_count(table));
+
+	char buf[64];
+	ASSERT_EQ(NO_EXCEPTION, intern_table_copy(table, id2, buf, sizeof(buf)));
+	EXPECT_STREQ("SIP/site12-ext4712", buf);
+	intern_table_destroy(table);
+}
+
+TEST(InternTable, FullTableFallsBack)
+{
+	intern_table_t *table = intern_table_new(2, TRUE);
+	unsigned int id;
+	boolean_t added;
+
+	EXPECT_EQ(NO_EXCEPTION, intern_table_get_id(table, "a", &id, &added));
+	EXPECT_EQ(NO_EXCEPTION, intern_table_get_id(table, "b", &id, &added));
+	EXPECT_EQ(BUFFERSIZE_EXCEPTION, intern_table_get_id(table, "c", &id, &added));
+	intern_table_clear(table);
+	EXPECT_EQ(NO_EXCEPTION, intern_table_get_id(table, "c", &id, &added));
+	EXPECT_EQ(1u, id);
+	intern_table_destroy(table);
+}
+
+TEST(InternTable, RemoteRegistry)
+{
+	char buf[64];
+	intern_table_t *remote = intern_registry_get("00:0c:29:4a:3e:01", TRUE);
+
+	ASSERT_TRUE(remote != NULL);
+	EXPECT_EQ(remote, intern_registry_get("00:0C:29:4A:3E:01", FALSE));
+	EXPECT_TRUE(intern_registry_get("00:0c:29:4a:3e:02", FALSE) == NULL);
+
+	EXPECT_EQ(EXISTS_EXCEPTION, intern_table_copy(remote, 7, buf, sizeof(buf)));
+	EXPECT_EQ(NO_EXCEPTION, intern_table_set(remote, 7, "1234@default"));
+	EXPECT_EQ(NO_EXCEPTION, intern_table_copy(remote, 7, buf, sizeof(buf)));
+	EXPECT_STREQ("1234@default", buf);
+	EXPECT_EQ(NO_EXCEPTION, intern_table_set(remote, 7, "1235@default"));
+	EXPECT_EQ(NO_EXCEPTION, intern_table_copy(remote, 7, buf, sizeof(buf)));
+	EXPECT_STREQ("1235@default", buf);
+	EXPECT_EQ(BUFFERSIZE_EXCEPTION, intern_table_copy(remote, 7, buf, 4));
+	intern_registry_destroy_all();
+}
+
+TEST(InternTable, EpochSeparatesReusedIds)
+{
+	intern_table_t *local = intern_table_new(16, TRUE);
+	intern_table_t *remote = intern_table_new(16, FALSE);
+	unsigned int id, reused;
+	boolean_t added;
+	char buf[64];
+
+	intern_table_reset(local, 7);
+	ASSERT_EQ(NO_EXCEPTION, intern_table_get_id(local, "SIP/site12-ext4711", &id, &added));
+	EXPECT_EQ(7u, INTERN_EPOCH(id));
+	EXPECT_EQ(1u, INTERN_INDEX(id));
+	intern_table_reset(remote, INTERN_EPOCH(id));
+	ASSERT_EQ(NO_EXCEPTION, intern_table_set(remote, id, "SIP/site12-ext4711"));
+
+	/* the origin restarts its ids, the receiver misses the reset */
+	intern_table_reset(local, 8);
+	ASSERT_EQ(NO_EXCEPTION, intern_table_get_id(local, "SIP/site12-ext4712", &reused, &added));
+	EXPECT_EQ(INTERN_INDEX(id), INTERN_INDEX(reused));
+	EXPECT_NE(id, reused);
+	EXPECT_EQ(EXISTS_EXCEPTION, intern_table_copy(remote, reused, buf, sizeof(buf)));
+	EXPECT_EQ(EXISTS_EXCEPTION, intern_table_set(remote, reused, "SIP/site12-ext4712"));
+
+	intern_table_reset(remote, INTERN_EPOCH(reused));
+	EXPECT_EQ(EXISTS_EXCEPTION, intern_table_copy(remote, id, buf, sizeof(buf)));
+	ASSERT_EQ(NO_EXCEPTION, intern_table_set(remote, reused, "SIP/site12-ext4712"));
+	ASSERT_EQ(NO_EXCEPTION, intern_table_copy(remote, reused, buf, sizeof(buf)));
+	EXPECT_STREQ("SIP/site12-ext4712", buf);
+	intern_table_destroy(local);
+	intern_table_destroy(remote);
+}
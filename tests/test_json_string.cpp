@@ -0,0 +1,142 @@
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+extern "C" {
+#include "../include/json_string.h"
+}
+
+static const json_kernel_t kernels[] = {JSON_KERNEL_SCALAR, JSON_KERNEL_SSE2, JSON_KERNEL_AVX2};
+
+static std::string escape(const std::string &in)
+{
+	char buf[1024];
+	size_t len = 0;
+	EXPECT_EQ(NO_EXCEPTION, json_escape(buf, sizeof(buf), in.data(), in.size(), &len));
+	return std::string(buf, len);
+}
+
+static std::string unescape(const std::string &in)
+{
+	char buf[1024];
+	size_t len = 0;
+	EXPECT_EQ(NO_EXCEPTION, json_unescape(buf, sizeof(buf), in.data(), in.size(), &len));
+	return std::string(buf, len);
+}
+
+TEST(JsonString, KernelsAgreeOnFindSpecial)
+{
+	char buf[300];
+	srand(4711);
+	for (int round = 0; round < 2000; round++) {
+		size_t len = rand() % sizeof(buf);
+		for (size_t i = 0; i < len; i++) {
+			buf[i] = 0x20 + rand() % 0x5f;
+			if (buf[i] == '"' || buf[i] == '\\') {
+				buf[i] = 'x';
+			}
+		}
+		if (len && rand() % 2) {
+			const char specials[] = {'"', '\\', '\n', 0x01, 0x1f};
+			buf[rand() % len] = specials[rand() % sizeof(specials)];
+		}
+		json_string_set_kernel(JSON_KERNEL_SCALAR);
+		size_t expected = json_string_find_special(buf, len);
+		for (json_kernel_t kernel : kernels) {
+			json_string_set_kernel(kernel);
+			EXPECT_EQ(expected, json_string_find_special(buf, len)) << json_kernel2str(kernel);
+		}
+	}
+	json_string_set_kernel(JSON_KERNEL_AUTO);
+}
+
+TEST(JsonString, HighBytesAreNotSpecial)
+{
+	const char utf8[] = "J\xc3\xbcrgen M\xc3\xbcller \xe2\x82\xac caller with a long utf8 name";
+	for (json_kernel_t kernel : kernels) {
+		json_string_set_kernel(kernel);
+		EXPECT_EQ(strlen(utf8), json_string_find_special(utf8, strlen(utf8)));
+	}
+	json_string_set_kernel(JSON_KERNEL_AUTO);
+}
+
+TEST(JsonString, EscapeRoundTrip)
+{
+	EXPECT_EQ("SIP/site12-ext4711", escape("SIP/site12-ext4711"));
+	EXPECT_EQ("\\\"Boss\\\" \\\\ Office", escape("\"Boss\" \\ Office"));
+	EXPECT_EQ("a\\nb\\tc\\u0001", escape("a\nb\tc\x01"));
+
+	const std::string nasty = "\"quoted\" back\\slash\r\n\x02 ctl \xc3\xa9";
+	EXPECT_EQ(nasty, unescape(escape(nasty)));
+}
+
+TEST(JsonString, UnescapeUnicode)
+{
+	EXPECT_EQ("\xc3\xa9", unescape("\\u00e9"));
+	EXPECT_EQ("\xe2\x82\xac", unescape("\\u20AC"));
+	EXPECT_EQ("\xf0\x9f\x93\x9e", unescape("\\ud83d\\udcde"));
+	EXPECT_EQ("/", unescape("\\/"));
+}
+
+TEST(JsonString, ValidateRejectsMalformed)
+{
+	EXPECT_TRUE(json_validate_string("plain", 5));
+	EXPECT_TRUE(json_validate_string("esc \\\" ok", 9));
+	EXPECT_FALSE(json_validate_string("bare \" quote", 12));
+	EXPECT_FALSE(json_validate_string("ctl \x01", 5));
+	EXPECT_FALSE(json_validate_string("bad \\x", 6));
+	EXPECT_FALSE(json_validate_string("trailing \\", 10));
+	EXPECT_FALSE(json_validate_string("\\udc00", 6));
+}
+
+TEST(JsonString, EscapeBufferTooSmall)
+{
+	char buf[8];
+	size_t len;
+	EXPECT_EQ(BUFFERSIZE_EXCEPTION, json_escape(buf, sizeof(buf), "0123456789", 10, &len));
+	EXPECT_EQ(BUFFERSIZE_EXCEPTION, json_escape(buf, sizeof(buf), "\"\"\"\"", 4, &len));
+	EXPECT_EQ(NO_EXCEPTION, json_escape(buf, sizeof(buf), "\"\"\"", 3, &len));
+	EXPECT_EQ(6u, len);
+}
+
+TEST(JsonString, NextMember)
+{
+	char msg[] = "{\"Device\":\"SIP/\\\"x,y\\\"\", \"State\":2,\"EntityID\":\"00:0c:29:4a:3e:01\",\"Cachable\":1}";
+	char *cursor = msg, *key, *value;
+	boolean_t is_string;
+
+	ASSERT_EQ(NO_EXCEPTION, json_next_member(&cursor, &key, &value, &is_string));
+	EXPECT_STREQ("Device", key);
+	EXPECT_STREQ("SIP/\"x,y\"", value);
+	EXPECT_TRUE(is_string);
+
+	ASSERT_EQ(NO_EXCEPTION, json_next_member(&cursor, &key, &value, &is_string));
+	EXPECT_STREQ("State", key);
+	EXPECT_STREQ("2", value);
+	EXPECT_FALSE(is_string);
+
+	ASSERT_EQ(NO_EXCEPTION, json_next_member(&cursor, &key, &value, &is_string));
+	EXPECT_STREQ("EntityID", key);
+	EXPECT_STREQ("00:0c:29:4a:3e:01", value);
+
+	ASSERT_EQ(NO_EXCEPTION, json_next_member(&cursor, &key, &value, &is_string));
+	EXPECT_STREQ("Cachable", key);
+	EXPECT_STREQ("1", value);
+
+	ASSERT_EQ(NO_EXCEPTION, json_next_member(&cursor, &key, &value, &is_string));
+	EXPECT_TRUE(key == NULL);
+}
+
+TEST(JsonString, NextMemberMalformed)
+{
+	char unterminated[] = "{\"Device\":\"SIP/1000}";
+	char nocolon[] = "{\"Device\" \"SIP/1000\"}";
+	char *cursor, *key, *value;
+	boolean_t is_string;
+
+	cursor = unterminated;
+	EXPECT_EQ(DECODING_EXCEPTION, json_next_member(&cursor, &key, &value, &is_string));
+	cursor = nocolon;
+	EXPECT_EQ(DECODING_EXCEPTION, json_next_member(&cursor, &key, &value, &is_string));
+}
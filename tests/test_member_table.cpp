@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+#include <string.h>
+#include <string>
+
+extern "C" {
+#include "../include/member_table.h"
+}
+
+static member_info_t beat(const char *eid_str, uint32_t seq)
+{
+	member_info_t info;
+	memset(&info, 0, sizeof(info));
+	strcpy(info.eid_str, eid_str);
+	info.seq = seq;
+	info.rtt = 3;
+	info.load = 125;
+	return info;
+}
+
+static void collect_cb(const member_info_t *member, void *data)
+{
+	std::string *names = (std::string *) data;
+	*names += member->eid_str;
+	*names += ";";
+}
+
+TEST(MemberTable, HeartbeatsAndMissed)
+{
+	member_table_t *table = member_table_new();
+	member_info_t b, info;
+
+	ASSERT_TRUE(table != NULL);
+	b = beat("00:11:22:33:44:55", 1);
+	EXPECT_TRUE(member_table_heartbeat(table, &b, 1000));
+	b.seq = 2;
+	EXPECT_FALSE(member_table_heartbeat(table, &b, 2000));
+	b.seq = 5;
+	EXPECT_FALSE(member_table_heartbeat(table, &b, 5000));
+	ASSERT_EQ(0, member_table_get(table, "00:11:22:33:44:55", &info));
+	EXPECT_EQ(2u, info.missed);
+	EXPECT_EQ(1000, info.first_seen);
+	EXPECT_EQ(5000, info.last_seen);
+	EXPECT_EQ(125u, info.load);
+
+	/* restart: sequence goes back, no missed heartbeats counted */
+	b.seq = 1;
+	member_table_heartbeat(table, &b, 6000);
+	member_table_get(table, "00:11:22:33:44:55", &info);
+	EXPECT_EQ(2u, info.missed);
+	EXPECT_EQ(-1, member_table_get(table, "66:77:88:99:aa:bb", &info));
+	member_table_destroy(table);
+}
+
+TEST(MemberTable, ExpireAfterTimeout)
+{
+	member_table_t *table = member_table_new();
+	member_info_t a = beat("00:11:22:33:44:55", 1), b = beat("66:77:88:99:aa:bb", 1);
+	std::string expired, listed;
+
+	ASSERT_TRUE(table != NULL);
+	member_table_heartbeat(table, &a, 1000);
+	member_table_heartbeat(table, &b, 1000);
+	a.seq = 2;
+	member_table_heartbeat(table, &a, 4000);
+
+	EXPECT_EQ(0u, member_table_expire(table, 3999, 3000, collect_cb, &expired));
+	EXPECT_EQ(1u, member_table_expire(table, 4000, 3000, collect_cb, &expired));
+	EXPECT_EQ("66:77:88:99:aa:bb;", expired);
+	EXPECT_EQ(1u, member_table_list(table, collect_cb, &listed));
+	EXPECT_EQ("00:11:22:33:44:55;", listed);
+
+	/* an expired member that comes back is new again */
+	EXPECT_TRUE(member_table_heartbeat(table, &b, 9000));
+	member_table_destroy(table);
+}
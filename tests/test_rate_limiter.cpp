@@ -0,0 +1,63 @@
+#include <gtest/gtest.h>
+#include <string>
+
+extern "C" {
+#include "../include/rate_limiter.h"
+}
+
+static void collect_cb(const char * /* key */, const char *msg, void *data)
+{
+	std::string *out = (std::string *) data;
+	*out += msg;
+	*out += ";";
+}
+
+TEST(RateLimiter, BurstThenCoalesce)
+{
+	rate_limiter_t *limiter = rate_limiter_new(10, 2, 100);
+	rate_limiter_stats_t stats;
+	std::string out;
+
+	ASSERT_TRUE(limiter != NULL);
+	EXPECT_EQ(RATE_PASS, rate_limiter_submit(limiter, "SIP/100", "a1", 0));
+	EXPECT_EQ(RATE_PASS, rate_limiter_submit(limiter, "SIP/101", "b1", 0));
+	EXPECT_EQ(RATE_DEFERRED, rate_limiter_submit(limiter, "SIP/100", "a2", 0));
+	EXPECT_EQ(RATE_DEFERRED, rate_limiter_submit(limiter, "SIP/101", "b2", 0));
+	EXPECT_EQ(RATE_COALESCED, rate_limiter_submit(limiter, "SIP/100", "a3", 10));
+
+	/* 10/s: one token after 100ms, the pending messages keep their order */
+	EXPECT_EQ(0u, rate_limiter_drain(limiter, 50, collect_cb, &out));
+	EXPECT_EQ(1u, rate_limiter_drain(limiter, 100, collect_cb, &out));
+	EXPECT_EQ("a3;", out);
+	/* a new message waits behind the pending one even with a token */
+	EXPECT_EQ(RATE_DEFERRED, rate_limiter_submit(limiter, "SIP/102", "c1", 200));
+	EXPECT_EQ(2u, rate_limiter_drain(limiter, 300, collect_cb, &out));
+	EXPECT_EQ("a3;b2;c1;", out);
+
+	rate_limiter_stats(limiter, &stats);
+	EXPECT_EQ(2u, stats.passed);
+	EXPECT_EQ(3u, stats.deferred);
+	EXPECT_EQ(1u, stats.coalesced);
+	EXPECT_EQ(0u, stats.pending);
+	rate_limiter_destroy(limiter);
+}
+
+TEST(RateLimiter, DropsWhenFull)
+{
+	rate_limiter_t *limiter = rate_limiter_new(1, 1, 2);
+	rate_limiter_stats_t stats;
+	std::string out;
+
+	ASSERT_TRUE(limiter != NULL);
+	EXPECT_EQ(RATE_PASS, rate_limiter_submit(limiter, "", "x", 0));
+	/* without a key nothing is coalesced */
+	EXPECT_EQ(RATE_DEFERRED, rate_limiter_submit(limiter, NULL, "y", 0));
+	EXPECT_EQ(RATE_DEFERRED, rate_limiter_submit(limiter, NULL, "y", 0));
+	EXPECT_EQ(RATE_DROPPED, rate_limiter_submit(limiter, "SIP/100", "z", 0));
+	/* the bucket never holds more than burst */
+	EXPECT_EQ(1u, rate_limiter_drain(limiter, 60000, collect_cb, &out));
+	rate_limiter_stats(limiter, &stats);
+	EXPECT_EQ(1u, stats.dropped);
+	EXPECT_EQ(1u, stats.pending);
+	rate_limiter_destroy(limiter);
+}
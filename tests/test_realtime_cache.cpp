@@ -0,0 +1,120 @@
+#include <gtest/gtest.h>
+#include <string>
+
+extern "C" {
+#include "../include/realtime_cache.h"
+}
+
+static void collect(const char *name, const char *value, void *data)
+{
+	std::string *out = (std::string *) data;
+	*out += name;
+	*out += "=";
+	*out += value;
+	*out += ";";
+}
+
+static const char *names[] = { "name", "host", "secret" };
+static const char *values[] = { "1000", "dynamic", NULL };
+
+TEST(RealtimeCache, HitMissAndTtl)
+{
+	realtime_cache_t *cache = realtime_cache_new(4, 64, 1000);
+	realtime_cache_stats_t stats;
+	std::string out;
+
+	ASSERT_TRUE(cache != NULL);
+	EXPECT_EQ(0, realtime_cache_get(cache, "ast:sippeers|name|1000", 0, collect, &out));
+	ASSERT_EQ(NO_EXCEPTION, realtime_cache_put(cache, "ast:sippeers|name|1000", "ast:sippeers:1000", names, values, 3, realtime_cache_epoch(cache), 0));
+	EXPECT_EQ(1, realtime_cache_get(cache, "ast:sippeers|name|1000", 999, collect, &out));
+	EXPECT_EQ("name=1000;host=dynamic;secret=;", out);
+	EXPECT_EQ(0, realtime_cache_get(cache, "ast:sippeers|name|1000", 1000, collect, &out));
+	realtime_cache_stats(cache, &stats);
+	EXPECT_EQ(1ul, stats.hits);
+	EXPECT_EQ(2ul, stats.misses);
+	EXPECT_EQ(0u, stats.entries);
+	realtime_cache_destroy(cache);
+}
+
+TEST(RealtimeCache, InvalidateByTag)
+{
+	realtime_cache_t *cache = realtime_cache_new(4, 64, 0);
+	std::string out;
+	unsigned long epoch = realtime_cache_epoch(cache);
+
+	realtime_cache_put(cache, "k1", "ast:sippeers:1000", names, values, 2, epoch, 0);
+	realtime_cache_put(cache, "k2", "ast:sippeers:1000", names, values, 2, epoch, 0);
+	realtime_cache_put(cache, "k3", "ast:sippeers", names, values, 2, epoch, 0);
+	realtime_cache_put(cache, "k4", "ast:sippeers:1001", names, values, 2, epoch, 0);
+	EXPECT_EQ(2u, realtime_cache_invalidate(cache, "ast:sippeers:1000"));
+	EXPECT_EQ(0, realtime_cache_get(cache, "k1", 0, collect, &out));
+	EXPECT_EQ(0, realtime_cache_get(cache, "k2", 0, collect, &out));
+	EXPECT_EQ(1, realtime_cache_get(cache, "k3", 0, collect, &out));
+	EXPECT_EQ(1u, realtime_cache_invalidate(cache, "ast:sippeers"));
+	EXPECT_EQ(1, realtime_cache_get(cache, "k4", 0, collect, &out));
+
+	/* a put that started before the invalidation is dropped */
+	EXPECT_EQ(GENERAL_EXCEPTION, realtime_cache_put(cache, "k1", "ast:sippeers:1000", names, values, 2, epoch, 0));
+	EXPECT_EQ(0, realtime_cache_get(cache, "k1", 0, collect, &out));
+
+	realtime_cache_flush(cache);
+	EXPECT_EQ(0, realtime_cache_get(cache, "k4", 0, collect, &out));
+	realtime_cache_destroy(cache);
+}
+
+TEST(RealtimeCache, LruEviction)
+{
+	realtime_cache_t *cache = realtime_cache_new(1, 3, 0);
+	realtime_cache_stats_t stats;
+	std::string out;
+	unsigned long epoch = realtime_cache_epoch(cache);
+
+	realtime_cache_put(cache, "a", "t:a", names, values, 1, epoch, 0);
+	realtime_cache_put(cache, "b", "t:b", names, values, 1, epoch, 0);
+	realtime_cache_put(cache, "c", "t:c", names, values, 1, epoch, 0);
+	EXPECT_EQ(1, realtime_cache_get(cache, "a", 0, collect, &out));
+	realtime_cache_put(cache, "d", "t:d", names, values, 1, epoch, 0);
+	EXPECT_EQ(0, realtime_cache_get(cache, "b", 0, collect, &out));
+	EXPECT_EQ(1, realtime_cache_get(cache, "a", 0, collect, &out));
+	EXPECT_EQ(1, realtime_cache_get(cache, "d", 0, collect, &out));
+	/* replacing a key does not evict */
+	realtime_cache_put(cache, "d", "t:d", names, values, 2, epoch, 0);
+	realtime_cache_stats(cache, &stats);
+	EXPECT_EQ(1ul, stats.evictions);
+	EXPECT_EQ(3u, stats.entries);
+	realtime_cache_destroy(cache);
+}
+
+/* what a node sees of a store on another node: the MULTI writes the row, the id set and the index keys */
+TEST(RealtimeCache, StoreInvalidatesIndexLookups)
+{
+	realtime_cache_t *cache = realtime_cache_new(4, 64, 0);
+	static const char *new_values[] = { "1001", "dynamic", NULL };
+	unsigned long epoch = realtime_cache_epoch(cache);
+	std::string out;
+
+	/* a lookup by host, answered from the index, cached under the table */
+	realtime_cache_put(cache, "ast:sippeers|host|dynamic", "ast:sippeers", names, values, 2, epoch, 0);
+	realtime_cache_put(cache, "ast:sippeers|name|1000", "ast:sippeers:1000", names, values, 2, epoch, 0);
+	EXPECT_EQ(1, realtime_cache_get(cache, "ast:sippeers|host|dynamic", 0, collect, &out));
+
+	/* client tracking only reports the keys this node read: the index, not the new row */
+	EXPECT_EQ(1u, realtime_cache_invalidate_key(cache, "ast:sippeers#host=dynamic"));
+	EXPECT_EQ(0, realtime_cache_get(cache, "ast:sippeers|host|dynamic", 0, collect, &out));
+	EXPECT_EQ(1, realtime_cache_get(cache, "ast:sippeers|name|1000", 0, collect, &out));
+
+	/* the next lookup reads the new row from redis and caches it */
+	epoch = realtime_cache_epoch(cache);
+	ASSERT_EQ(NO_EXCEPTION, realtime_cache_put(cache, "ast:sippeers|host|dynamic", "ast:sippeers", names, new_values, 2, epoch, 0));
+	out.clear();
+	EXPECT_EQ(1, realtime_cache_get(cache, "ast:sippeers|host|dynamic", 0, collect, &out));
+	EXPECT_EQ("name=1001;host=dynamic;", out);
+
+	/* the sorted set index and a row key drop the table entries too, the id set only itself */
+	EXPECT_EQ(1u, realtime_cache_invalidate_key(cache, "ast:sippeers#host"));
+	realtime_cache_put(cache, "ast:sippeers|host|dynamic", "ast:sippeers", names, values, 2, realtime_cache_epoch(cache), 0);
+	EXPECT_EQ(2u, realtime_cache_invalidate_key(cache, "ast:sippeers:1000"));
+	realtime_cache_put(cache, "ast:sippeers|host|dynamic", "ast:sippeers", names, values, 2, realtime_cache_epoch(cache), 0);
+	EXPECT_EQ(1u, realtime_cache_invalidate_key(cache, "ast:sippeers"));
+	realtime_cache_destroy(cache);
+}
@@ -0,0 +1,110 @@
+#include <gtest/gtest.h>
+#include <string.h>
+
+extern "C" {
+#include "../include/realtime_match.h"
+}
+
+TEST(RealtimeMatch, ParseOperators)
+{
+	realtime_filter_t filter;
+
+	ASSERT_EQ(NO_EXCEPTION, realtime_filter_parse(&filter, "name", "1000"));
+	EXPECT_STREQ("name", filter.field);
+	EXPECT_EQ(RT_OP_EQ, filter.op);
+	EXPECT_STREQ("1000", filter.value);
+	ASSERT_EQ(NO_EXCEPTION, realtime_filter_parse(&filter, "name LIKE", "10%"));
+	EXPECT_STREQ("name", filter.field);
+	EXPECT_EQ(RT_OP_LIKE, filter.op);
+	ASSERT_EQ(NO_EXCEPTION, realtime_filter_parse(&filter, "regseconds <", "100"));
+	EXPECT_EQ(RT_OP_LT, filter.op);
+	ASSERT_EQ(NO_EXCEPTION, realtime_filter_parse(&filter, "host !=", "dynamic"));
+	EXPECT_EQ(RT_OP_NE, filter.op);
+	ASSERT_EQ(NO_EXCEPTION, realtime_filter_parse(&filter, "ipaddr is not null", NULL));
+	EXPECT_EQ(RT_OP_IS_NOT_NULL, filter.op);
+	EXPECT_STREQ("", filter.value);
+	EXPECT_EQ(GENERAL_EXCEPTION, realtime_filter_parse(&filter, "name ~", "x"));
+	EXPECT_EQ(GENERAL_EXCEPTION, realtime_filter_parse(&filter, "", "x"));
+}
+
+TEST(RealtimeMatch, Compare)
+{
+	realtime_filter_t filter;
+
+	realtime_filter_parse(&filter, "name", "0100");
+	EXPECT_TRUE(realtime_filter_match(&filter, "0100"));
+	EXPECT_FALSE(realtime_filter_match(&filter, "100"));
+	EXPECT_FALSE(realtime_filter_match(&filter, NULL));
+
+	realtime_filter_parse(&filter, "regseconds <", "100");
+	EXPECT_TRUE(realtime_filter_match(&filter, "99"));
+	EXPECT_FALSE(realtime_filter_match(&filter, "1000"));
+	realtime_filter_parse(&filter, "name >=", "b");
+	EXPECT_TRUE(realtime_filter_match(&filter, "b"));
+	EXPECT_FALSE(realtime_filter_match(&filter, "a"));
+
+	realtime_filter_parse(&filter, "ipaddr IS NULL", NULL);
+	EXPECT_TRUE(realtime_filter_match(&filter, NULL));
+	EXPECT_FALSE(realtime_filter_match(&filter, ""));
+	realtime_filter_parse(&filter, "host !=", "dynamic");
+	EXPECT_FALSE(realtime_filter_match(&filter, NULL));
+	EXPECT_TRUE(realtime_filter_match(&filter, "10.0.0.1"));
+}
+
+TEST(RealtimeMatch, Like)
+{
+	EXPECT_TRUE(realtime_like("%", ""));
+	EXPECT_TRUE(realtime_like("foo%", "foobar"));
+	EXPECT_FALSE(realtime_like("foo%", "barfoo"));
+	EXPECT_TRUE(realtime_like("%bar", "foobar"));
+	EXPECT_TRUE(realtime_like("f%o%r", "foobar"));
+	EXPECT_TRUE(realtime_like("f__bar", "foobar"));
+	EXPECT_FALSE(realtime_like("f_bar", "foobar"));
+	EXPECT_TRUE(realtime_like("100\\%", "100%"));
+	EXPECT_FALSE(realtime_like("100\\%", "1000"));
+	EXPECT_TRUE(realtime_like("a\\_b", "a_b"));
+	EXPECT_FALSE(realtime_like("a\\_b", "axb"));
+	EXPECT_FALSE(realtime_like("abc", "ab"));
+}
+
+TEST(RealtimeMatch, LikePrefix)
+{
+	char prefix[8];
+
+	EXPECT_EQ(0, realtime_like_prefix("100%", prefix, sizeof(prefix)));
+	EXPECT_STREQ("100", prefix);
+	EXPECT_EQ(1, realtime_like_prefix("1000", prefix, sizeof(prefix)));
+	EXPECT_STREQ("1000", prefix);
+	EXPECT_EQ(0, realtime_like_prefix("%00", prefix, sizeof(prefix)));
+	EXPECT_STREQ("", prefix);
+	EXPECT_EQ(0, realtime_like_prefix("a_c", prefix, sizeof(prefix)));
+	EXPECT_STREQ("a", prefix);
+	/* escaped wildcards are literal */
+	EXPECT_EQ(0, realtime_like_prefix("50\\%%", prefix, sizeof(prefix)));
+	EXPECT_STREQ("50%", prefix);
+	EXPECT_EQ(1, realtime_like_prefix("a\\_b", prefix, sizeof(prefix)));
+	EXPECT_STREQ("a_b", prefix);
+	/* a prefix that does not fit is cut, never reported as exact */
+	EXPECT_EQ(0, realtime_like_prefix("abcdefghij", prefix, sizeof(prefix)));
+	EXPECT_STREQ("abcdefg", prefix);
+}
+
+TEST(RealtimeMatch, KeyTable)
+{
+	char table_key[16];
+
+	EXPECT_EQ(RT_KEY_TABLE, realtime_key_table("db:sip", table_key, sizeof(table_key)));
+	EXPECT_STREQ("db:sip", table_key);
+	EXPECT_EQ(RT_KEY_ROW, realtime_key_table("db:sip:100", table_key, sizeof(table_key)));
+	EXPECT_STREQ("db:sip", table_key);
+	/* ids and index values may contain the separators */
+	EXPECT_EQ(RT_KEY_ROW, realtime_key_table("db:sip:a#b:c", table_key, sizeof(table_key)));
+	EXPECT_STREQ("db:sip", table_key);
+	EXPECT_EQ(RT_KEY_INDEX, realtime_key_table("db:sip#host=10.0.0.1:5060", table_key, sizeof(table_key)));
+	EXPECT_STREQ("db:sip", table_key);
+	EXPECT_EQ(RT_KEY_INDEX, realtime_key_table("db:sip#host", table_key, sizeof(table_key)));
+	EXPECT_STREQ("db:sip", table_key);
+	EXPECT_EQ(RT_KEY_NONE, realtime_key_table("nocolon", table_key, sizeof(table_key)));
+	EXPECT_EQ(RT_KEY_NONE, realtime_key_table("db:#host", table_key, sizeof(table_key)));
+	EXPECT_EQ(RT_KEY_NONE, realtime_key_table("database:verylongtable:1", table_key, sizeof(table_key)));
+}
@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <string.h>
+
+extern "C" {
+#include "../include/scratch_arena.h"
+}
+
+TEST(ScratchArena, BumpAllocAndReset)
+{
+	scratch_arena_t *arena = scratch_arena_get();
+	ASSERT_TRUE(arena != NULL);
+	scratch_reset(arena);
+
+	char *a = scratch_strdup(arena, "SIP/site12-ext4711");
+	char *b = scratch_strdup(arena, "1234@default");
+	EXPECT_STREQ("SIP/site12-ext4711", a);
+	EXPECT_STREQ("1234@default", b);
+	EXPECT_NE(a, b);
+	EXPECT_GT(scratch_used(arena), 0u);
+
+	scratch_reset(arena);
+	EXPECT_EQ(0u, scratch_used(arena));
+	EXPECT_EQ(a, scratch_strdup(arena, "x"));
+	scratch_reset(arena);
+}
+
+TEST(ScratchArena, RewindToMark)
+{
+	scratch_arena_t *arena = scratch_arena_get();
+	scratch_reset(arena);
+
+	char *a = scratch_strdup(arena, "SIP/site12-ext4711");
+	size_t mark = scratch_used(arena);
+	char *b = scratch_strdup(arena, "1234@default");
+	scratch_rewind(arena, mark);
+	EXPECT_EQ(mark, scratch_used(arena));
+	EXPECT_STREQ("SIP/site12-ext4711", a);
+	EXPECT_EQ(b, scratch_strdup(arena, "x"));
+	scratch_rewind(arena, SCRATCH_ARENA_SIZE);		/* never moves forward */
+	EXPECT_LT(scratch_used(arena), (size_t) SCRATCH_ARENA_SIZE);
+	scratch_reset(arena);
+}
+
+TEST(ScratchArena, ExhaustionReturnsNull)
+{
+	scratch_arena_t *arena = scratch_arena_get();
+	scratch_reset(arena);
+	EXPECT_TRUE(scratch_alloc(arena, SCRATCH_ARENA_SIZE + 1) == NULL);
+	EXPECT_TRUE(scratch_alloc(arena, SCRATCH_ARENA_SIZE) != NULL);
+	EXPECT_TRUE(scratch_alloc(arena, 1) == NULL);
+	scratch_reset(arena);
+}
+
+TEST(ScratchArena, PoolRecyclesBlocks)
+{
+	size_t capacity = 0;
+	void *first = scratch_pool_get(200, &capacity);
+	ASSERT_TRUE(first != NULL);
+	EXPECT_EQ(256u, capacity);
+	scratch_pool_put(first);
+
+	void *second = scratch_pool_get(130, &capacity);
+	EXPECT_EQ(first, second);
+	memset(second, 'x', capacity);
+
+	void *grown = scratch_pool_grow(second, 700, &capacity);
+	ASSERT_TRUE(grown != NULL);
+	EXPECT_EQ(1024u, capacity);
+	EXPECT_EQ('x', ((char *)grown)[255]);
+	scratch_pool_put(grown);
+}
+
+TEST(ScratchArena, PoolOversizeIsNotCached)
+{
+	size_t capacity = 0;
+	void *big = scratch_pool_get(64 * 1024, &capacity);
+	ASSERT_TRUE(big != NULL);
+	EXPECT_EQ(64u * 1024, capacity);
+	scratch_pool_put(big);
+}
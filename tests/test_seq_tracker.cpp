@@ -0,0 +1,77 @@
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "../include/seq_tracker.h"
+}
+
+TEST(SeqTracker, InOrderAndGap)
+{
+	seq_tracker_t *tracker = seq_tracker_new();
+	uint32_t missed;
+
+	ASSERT_TRUE(tracker != NULL);
+	EXPECT_EQ(SEQ_NEW_ORIGIN, seq_tracker_check(tracker, "00:11:22:33:44:55", "mwi", 100, 7, &missed));
+	EXPECT_EQ(SEQ_IN_ORDER, seq_tracker_check(tracker, "00:11:22:33:44:55", "mwi", 100, 8, &missed));
+	EXPECT_EQ(0u, missed);
+	EXPECT_EQ(SEQ_GAP, seq_tracker_check(tracker, "00:11:22:33:44:55", "mwi", 100, 12, &missed));
+	EXPECT_EQ(3u, missed);
+	EXPECT_EQ(SEQ_IN_ORDER, seq_tracker_check(tracker, "00:11:22:33:44:55", "mwi", 100, 13, &missed));
+
+	/* origins are tracked independently */
+	EXPECT_EQ(SEQ_NEW_ORIGIN, seq_tracker_check(tracker, "66:77:88:99:aa:bb", "mwi", 200, 1, &missed));
+	EXPECT_EQ(SEQ_IN_ORDER, seq_tracker_check(tracker, "00:11:22:33:44:55", "mwi", 100, 14, &missed));
+	seq_tracker_destroy(tracker);
+}
+
+TEST(SeqTracker, LateRestartAndWrap)
+{
+	seq_tracker_t *tracker = seq_tracker_new();
+	uint32_t missed;
+
+	ASSERT_TRUE(tracker != NULL);
+	seq_tracker_check(tracker, "00:11:22:33:44:55", "mwi", 100, 50, &missed);
+	EXPECT_EQ(SEQ_LATE, seq_tracker_check(tracker, "00:11:22:33:44:55", "mwi", 100, 50, &missed));
+	EXPECT_EQ(SEQ_LATE, seq_tracker_check(tracker, "00:11:22:33:44:55", "mwi", 100, 49, &missed));
+	EXPECT_EQ(SEQ_IN_ORDER, seq_tracker_check(tracker, "00:11:22:33:44:55", "mwi", 100, 51, &missed));
+
+	/* a new epoch restarts the count without reporting a gap */
+	EXPECT_EQ(SEQ_NEW_ORIGIN, seq_tracker_check(tracker, "00:11:22:33:44:55", "mwi", 101, 1, &missed));
+	EXPECT_EQ(SEQ_IN_ORDER, seq_tracker_check(tracker, "00:11:22:33:44:55", "mwi", 101, 2, &missed));
+
+	seq_tracker_check(tracker, "66:77:88:99:aa:bb", "mwi", 100, UINT32_MAX, &missed);
+	EXPECT_EQ(SEQ_IN_ORDER, seq_tracker_check(tracker, "66:77:88:99:aa:bb", "mwi", 100, 0, &missed));
+	EXPECT_EQ(SEQ_GAP, seq_tracker_check(tracker, "66:77:88:99:aa:bb", "mwi", 100, 2, &missed));
+	EXPECT_EQ(1u, missed);
+	seq_tracker_destroy(tracker);
+}
+
+TEST(SeqTracker, StreamsAreCountedSeparately)
+{
+	seq_tracker_t *tracker = seq_tracker_new();
+	uint32_t missed;
+
+	ASSERT_TRUE(tracker != NULL);
+	EXPECT_EQ(SEQ_NEW_ORIGIN, seq_tracker_check(tracker, "00:11:22:33:44:55", "mwi", 100, 1, &missed));
+	EXPECT_EQ(SEQ_NEW_ORIGIN, seq_tracker_check(tracker, "00:11:22:33:44:55", "device_state_change", 100, 1, &missed));
+	/* interleaved streams of one origin do not look like gaps to each other */
+	EXPECT_EQ(SEQ_IN_ORDER, seq_tracker_check(tracker, "00:11:22:33:44:55", "device_state_change", 100, 2, &missed));
+	EXPECT_EQ(SEQ_IN_ORDER, seq_tracker_check(tracker, "00:11:22:33:44:55", "mwi", 100, 2, &missed));
+	EXPECT_EQ(SEQ_GAP, seq_tracker_check(tracker, "00:11:22:33:44:55", "mwi", 100, 4, &missed));
+	EXPECT_EQ(1u, missed);
+	EXPECT_EQ(SEQ_IN_ORDER, seq_tracker_check(tracker, "00:11:22:33:44:55", "device_state_change", 100, 3, &missed));
+	seq_tracker_destroy(tracker);
+}
+
+TEST(SeqTracker, ResyncThrottledPerOrigin)
+{
+	seq_tracker_t *tracker = seq_tracker_new();
+
+	ASSERT_TRUE(tracker != NULL);
+	EXPECT_EQ(TRUE, seq_tracker_resync_due(tracker, "00:11:22:33:44:55", 1000, 1));
+	EXPECT_EQ(FALSE, seq_tracker_resync_due(tracker, "00:11:22:33:44:55", 1000, 1));
+	/* another origin in between does not reset the first one's throttle */
+	EXPECT_EQ(TRUE, seq_tracker_resync_due(tracker, "66:77:88:99:aa:bb", 1000, 1));
+	EXPECT_EQ(FALSE, seq_tracker_resync_due(tracker, "00:11:22:33:44:55", 1000, 1));
+	EXPECT_EQ(TRUE, seq_tracker_resync_due(tracker, "00:11:22:33:44:55", 1001, 1));
+	seq_tracker_destroy(tracker);
+}
@@ -0,0 +1,49 @@
+#include <gtest/gtest.h>
+#include <stdio.h>
+
+extern "C" {
+#include "../include/stale_filter.h"
+}
+
+TEST(StaleFilter, SupersededAndTooOld)
+{
+	stale_filter_t *filter = stale_filter_new();
+
+	ASSERT_TRUE(filter != NULL);
+	EXPECT_EQ(STALE_FRESH, stale_filter_check(filter, "00:11:22:33:44:55/SIP/100", 1000, 1000, 0));
+	EXPECT_EQ(STALE_FRESH, stale_filter_check(filter, "00:11:22:33:44:55/SIP/100", 1000, 1001, 0));
+	EXPECT_EQ(STALE_SUPERSEDED, stale_filter_check(filter, "00:11:22:33:44:55/SIP/100", 999, 1002, 0));
+	EXPECT_EQ(STALE_FRESH, stale_filter_check(filter, "00:11:22:33:44:55/SIP/100", 1500, 1500, 0));
+
+	/* keys are independent */
+	EXPECT_EQ(STALE_FRESH, stale_filter_check(filter, "66:77:88:99:aa:bb/SIP/100", 10, 1500, 0));
+	EXPECT_EQ(2u, stale_filter_count(filter));
+
+	/* too old is dropped without moving the key forward */
+	EXPECT_EQ(STALE_TOO_OLD, stale_filter_check(filter, "00:11:22:33:44:55/SIP/101", 1000, 5000, 3000));
+	EXPECT_EQ(STALE_FRESH, stale_filter_check(filter, "00:11:22:33:44:55/SIP/101", 2000, 5000, 3000));
+	EXPECT_EQ(STALE_FRESH, stale_filter_check(filter, "00:11:22:33:44:55/SIP/101", 2500, 5000, 3000));
+	stale_filter_destroy(filter);
+}
+
+TEST(StaleFilter, GrowAndExpire)
+{
+	stale_filter_t *filter = stale_filter_new();
+	char key[32];
+	unsigned int i;
+
+	ASSERT_TRUE(filter != NULL);
+	for (i = 0; i < 2000; i++) {
+		snprintf(key, sizeof(key), "SIP/%u", i);
+		EXPECT_EQ(STALE_FRESH, stale_filter_check(filter, key, i, i, 0));
+	}
+	EXPECT_EQ(2000u, stale_filter_count(filter));
+	EXPECT_EQ(STALE_SUPERSEDED, stale_filter_check(filter, "SIP/1234", 1000, 2000, 0));
+
+	EXPECT_EQ(1500u, stale_filter_expire(filter, 1500));
+	EXPECT_EQ(500u, stale_filter_count(filter));
+	/* forgotten keys start over */
+	EXPECT_EQ(STALE_FRESH, stale_filter_check(filter, "SIP/10", 0, 2000, 0));
+	EXPECT_EQ(STALE_SUPERSEDED, stale_filter_check(filter, "SIP/1999", 1000, 2000, 0));
+	stale_filter_destroy(filter);
+}
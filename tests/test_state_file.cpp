@@ -0,0 +1,86 @@
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+extern "C" {
+#include "../include/state_file.h"
+}
+
+static const char *path = "test_state_file.bin";
+
+static void write_two(void)
+{
+	state_file_writer_t *writer = state_file_writer_new(path);
+	const char *ds = "{\"Device\":\"SIP/1000\",\"State\":2,\"EntityID\":\"00:11:22:33:44:55\"}";
+	const char *mwi = "{\"Mailbox\":\"4711\",\"NewMessages\":1}";
+
+	ASSERT_TRUE(writer != NULL);
+	ASSERT_EQ(NO_EXCEPTION, state_file_writer_add(writer, 6, ds, strlen(ds)));
+	ASSERT_EQ(NO_EXCEPTION, state_file_writer_add(writer, 2, mwi, strlen(mwi)));
+	ASSERT_EQ(NO_EXCEPTION, state_file_writer_commit(writer, 1234));
+}
+
+TEST(StateFile, WriteAndMap)
+{
+	state_file_t *file;
+	exception_t res;
+	size_t cursor = 0, len;
+	unsigned int type;
+	const char *msg;
+
+	write_two();
+	ASSERT_TRUE((file = state_file_open(path, &res)) != NULL);
+	EXPECT_EQ(2u, state_file_header(file)->count);
+	EXPECT_EQ(1234u, state_file_header(file)->created);
+
+	ASSERT_EQ(NO_EXCEPTION, state_file_next(file, &cursor, &type, &msg, &len));
+	EXPECT_EQ(6u, type);
+	EXPECT_STREQ("{\"Device\":\"SIP/1000\",\"State\":2,\"EntityID\":\"00:11:22:33:44:55\"}", msg);
+	EXPECT_EQ(strlen(msg), len);
+	EXPECT_EQ(0u, cursor % 4);
+	ASSERT_EQ(NO_EXCEPTION, state_file_next(file, &cursor, &type, &msg, &len));
+	EXPECT_EQ(2u, type);
+	EXPECT_STREQ("{\"Mailbox\":\"4711\",\"NewMessages\":1}", msg);
+	ASSERT_EQ(NO_EXCEPTION, state_file_next(file, &cursor, &type, &msg, &len));
+	EXPECT_TRUE(msg == NULL);
+	state_file_close(file);
+	unlink(path);
+}
+
+TEST(StateFile, RejectsDamagedFiles)
+{
+	state_file_header_t header;
+	exception_t res;
+	FILE *fp;
+
+	unlink(path);
+	EXPECT_TRUE(state_file_open(path, &res) == NULL);
+	EXPECT_EQ(EXISTS_EXCEPTION, res);
+
+	/* flipped byte in a record */
+	write_two();
+	fp = fopen(path, "r+");
+	fseek(fp, sizeof(state_file_header_t) + 8, SEEK_SET);
+	fputc('X', fp);
+	fclose(fp);
+	EXPECT_TRUE(state_file_open(path, &res) == NULL);
+	EXPECT_EQ(DECODING_EXCEPTION, res);
+
+	/* other version */
+	write_two();
+	fp = fopen(path, "r+");
+	ASSERT_EQ(1u, fread(&header, sizeof(header), 1, fp));
+	header.version++;
+	fseek(fp, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, fp);
+	fclose(fp);
+	EXPECT_TRUE(state_file_open(path, &res) == NULL);
+	EXPECT_EQ(DECODING_EXCEPTION, res);
+
+	/* truncated */
+	write_two();
+	ASSERT_EQ(0, truncate(path, sizeof(state_file_header_t) + 10));
+	EXPECT_TRUE(state_file_open(path, &res) == NULL);
+	unlink(path);
+}